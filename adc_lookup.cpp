@@ -0,0 +1,84 @@
+/*
+ * ADC lookup table construction and conversion
+ */
+
+#include "adc_lookup.h"
+
+#include <cstdlib>
+#include <limits>
+
+#include "apply.h"
+
+using namespace std;
+
+namespace {
+
+template <typename T>
+void lookup_codes(const AdcLookupTable& table, const T* in, double* out, size_t n) {
+    const double* values = table.values.data();
+    const double nan = numeric_limits<double>::quiet_NaN();
+
+    for (size_t i = 0; i < n; i++) {
+        // One unsigned compare covers codes below and above the table; unsigned
+        // subtraction wraps instead of overflowing for int32 codes near the limits
+        uint32_t index = static_cast<uint32_t>(in[i]) - static_cast<uint32_t>(table.first_code);
+        out[i] = index < table.values.size() ? values[index] : nan;
+    }
+}
+
+}  // namespace
+
+bool build_adc_lookup(const CalibrationModel& model, int bits, bool is_signed, AdcLookupTable& table) {
+    if (bits < 1 || bits > MAX_ADC_BITS || !model.is_valid) {
+        return false;
+    }
+
+    size_t count = size_t(1) << bits;
+    int32_t first_code = is_signed ? -static_cast<int32_t>(count / 2) : 0;
+
+    vector<double> codes(count);
+    for (size_t i = 0; i < count; i++) {
+        codes[i] = static_cast<double>(first_code + static_cast<int32_t>(i));
+    }
+
+    AdcLookupTable built;
+    built.bits = bits;
+    built.is_signed = is_signed;
+    built.first_code = first_code;
+    built.values.resize(count);
+    apply_model(model, codes.data(), built.values.data(), count);
+
+    table.bits = built.bits;
+    table.is_signed = built.is_signed;
+    table.first_code = built.first_code;
+    table.values.swap(built.values);
+    return true;
+}
+
+bool parse_adc_format(const string& text, int& bits, bool& is_signed) {
+    if (text.size() < 2 || (text[0] != 'u' && text[0] != 's')) {
+        return false;
+    }
+
+    char* end;
+    long value = strtol(text.c_str() + 1, &end, 10);
+    if (*end != '\0' || value < 1 || value > MAX_ADC_BITS) {
+        return false;
+    }
+
+    bits = static_cast<int>(value);
+    is_signed = text[0] == 's';
+    return true;
+}
+
+void apply_lookup(const AdcLookupTable& table, const int32_t* in, double* out, size_t n) {
+    lookup_codes(table, in, out, n);
+}
+
+void apply_lookup(const AdcLookupTable& table, const int16_t* in, double* out, size_t n) {
+    lookup_codes(table, in, out, n);
+}
+
+void apply_lookup(const AdcLookupTable& table, const uint16_t* in, double* out, size_t n) {
+    lookup_codes(table, in, out, n);
+}
@@ -0,0 +1,55 @@
+/*
+ * Lookup tables for integer ADC codes
+ *
+ * A 12- or 16-bit ADC only ever produces 4096 or 65536 distinct codes, so
+ * any calibration model can be evaluated once per code up front. Converting
+ * a sample is then a single table load, whatever the model costs.
+ * Tables hold at most 65536 doubles (512 KB), which stays in L2 cache.
+ */
+
+#ifndef ADC_LOOKUP_H
+#define ADC_LOOKUP_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "model.h"
+
+const int MAX_ADC_BITS = 16;
+
+struct AdcLookupTable {
+    int bits;
+    bool is_signed;             // Codes -2^(bits-1)..2^(bits-1)-1 instead of 0..2^bits-1
+    int32_t first_code;
+    std::vector<double> values; // values[code - first_code]
+
+    AdcLookupTable() : bits(0), is_signed(false), first_code(0) {}
+
+    bool has_code(int32_t code) const {
+        return static_cast<uint32_t>(code) - static_cast<uint32_t>(first_code) < values.size();
+    }
+};
+
+/*
+ * Evaluate model at every code of a bits-wide ADC (1 to 16 bits)
+ * Uses apply_model(), so table entries match direct conversion exactly.
+ */
+bool build_adc_lookup(const CalibrationModel& model, int bits, bool is_signed, AdcLookupTable& table);
+
+/*
+ * Parse an ADC format such as "u12" (unsigned 12-bit) or "s16" (signed
+ * 16-bit two's complement)
+ */
+bool parse_adc_format(const std::string& text, int& bits, bool& is_signed);
+
+/*
+ * Convert n ADC codes by table lookup: out[i] = values[in[i] - first_code]
+ * Codes outside the table come out NaN.
+ */
+void apply_lookup(const AdcLookupTable& table, const int32_t* in, double* out, size_t n);
+void apply_lookup(const AdcLookupTable& table, const int16_t* in, double* out, size_t n);
+void apply_lookup(const AdcLookupTable& table, const uint16_t* in, double* out, size_t n);
+
+#endif
@@ -0,0 +1,97 @@
+/*
+ * Reusable cache-line-aligned buffers for the convert and fit loops
+ *
+ * The batch paths parse, apply and format a block of samples at a time.
+ * An AlignedBuffer holds one such block: it allocates once, on the first
+ * block (or up front with reserve()), and clear() only forgets the
+ * contents, so every later block reuses the same memory. After warm-up
+ * the loops make no heap allocations at all (bench.cpp checks this).
+ *
+ * The storage starts on a cache line, so the SIMD kernels' loads never
+ * split lines at the start of a block and two buffers used by different
+ * threads never share one.
+ *
+ * Only for trivially copyable element types: growing copies bytes and
+ * new elements from resize() are zeroed.
+ */
+
+#ifndef ALIGNED_BUFFER_H
+#define ALIGNED_BUFFER_H
+
+#include <cstddef>
+#include <cstring>
+#include <new>
+#include <type_traits>
+
+const size_t CACHE_LINE_SIZE = 64;
+
+template <typename T>
+class AlignedBuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "AlignedBuffer holds plain values only");
+
+public:
+    AlignedBuffer() : items(NULL), used(0), allocated(0) {}
+
+    explicit AlignedBuffer(size_t n) : items(NULL), used(0), allocated(0) { resize(n); }
+
+    ~AlignedBuffer() { release(); }
+
+    // Make room for n elements; never shrinks, keeps the contents
+    void reserve(size_t n) {
+        if (n <= allocated) {
+            return;
+        }
+        T* grown = static_cast<T*>(::operator new(n * sizeof(T), std::align_val_t(CACHE_LINE_SIZE)));
+        if (used > 0) {
+            memcpy(grown, items, used * sizeof(T));
+        }
+        release();
+        items = grown;
+        allocated = n;
+    }
+
+    void resize(size_t n) {
+        reserve(n);
+        if (n > used) {
+            memset(static_cast<void*>(items + used), 0, (n - used) * sizeof(T));
+        }
+        used = n;
+    }
+
+    void push_back(const T& value) {
+        if (used == allocated) {
+            reserve(allocated < 16 ? 16 : 2 * allocated);
+        }
+        items[used++] = value;
+    }
+
+    // Empty, but keeps the memory for the next block
+    void clear() { used = 0; }
+
+    T* data() { return items; }
+    const T* data() const { return items; }
+    size_t size() const { return used; }
+    size_t capacity() const { return allocated; }
+    bool empty() const { return used == 0; }
+
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+
+private:
+    AlignedBuffer(const AlignedBuffer&);             // Not copyable
+    AlignedBuffer& operator=(const AlignedBuffer&);
+
+    void release() {
+        if (items != NULL) {
+            ::operator delete(items, std::align_val_t(CACHE_LINE_SIZE));
+        }
+        items = NULL;
+        allocated = 0;
+    }
+
+    T* items;
+    size_t used;
+    size_t allocated;
+};
+
+#endif
@@ -0,0 +1,838 @@
+/*
+ * Batch apply kernels with runtime CPU dispatch
+ *
+ * Every kernel has the same shape: broadcast slope and offset, widen the
+ * raw readings to double a vector at a time, then one multiply-add per
+ * vector. Leftover elements at the end of the buffer go through the same
+ * instruction in scalar form so a kernel gives identical results for an
+ * element no matter where it sits in the buffer.
+ */
+
+#include "apply.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SENSORCAL_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__) && defined(__ARM_NEON)
+#define SENSORCAL_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+// One entry per input type
+struct KernelTable {
+    ApplyKernel kernel;
+    void (*apply_double)(double slope, double offset, const double* in, double* out, size_t n);
+    void (*apply_float)(double slope, double offset, const float* in, double* out, size_t n);
+    void (*apply_int16)(double slope, double offset, const int16_t* in, double* out, size_t n);
+    void (*apply_int32)(double slope, double offset, const int32_t* in, double* out, size_t n);
+    void (*apply_multi)(const CalibrationTableView& table, const uint32_t* channels,
+                        const double* in, double* out, size_t n);
+    void (*apply_polynomial)(const CalibrationModel& model, const double* in, double* out, size_t n);
+    void (*apply_temperature)(const CalibrationModel& model, const double* raw,
+                              const double* temperature, double* out, size_t n);
+};
+
+/*
+ * SCALAR KERNEL
+ * Plain loop; the compiler is free to auto-vectorize it for the base ISA
+ */
+template <typename T>
+void apply_scalar(double slope, double offset, const T* in, double* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = slope * static_cast<double>(in[i]) + offset;
+    }
+}
+
+// One lookup per sample; invalid channels give NaN
+void apply_multi_scalar(const CalibrationTableView& table, const uint32_t* channels,
+                        const double* in, double* out, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        uint32_t index = channels[i] - table.first_channel;
+
+        if (table.has_channel(channels[i])) {
+            out[i] = table.slopes[index] * in[i] + table.offsets[index];
+        } else {
+            out[i] = numeric_limits<double>::quiet_NaN();
+        }
+    }
+}
+
+/*
+ * Horner's rule in the scaled variable t, one sample at a time
+ * The degree is a template parameter so the inner loop unrolls completely
+ */
+template <int DEGREE>
+void polynomial_scalar(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    const double* c = model.coefficients;
+
+    for (size_t i = 0; i < n; i++) {
+        double t = (in[i] - model.center) * model.scale;
+        double value = c[DEGREE];
+        for (int k = DEGREE - 1; k >= 0; k--) {
+            value = value * t + c[k];
+        }
+        out[i] = value;
+    }
+}
+
+void apply_polynomial_scalar(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    switch (model.degree) {
+        case 1: polynomial_scalar<1>(model, in, out, n); break;
+        case 2: polynomial_scalar<2>(model, in, out, n); break;
+        case 3: polynomial_scalar<3>(model, in, out, n); break;
+        case 4: polynomial_scalar<4>(model, in, out, n); break;
+        default: polynomial_scalar<5>(model, in, out, n); break;
+    }
+}
+
+/*
+ * Temperature surface: Horner's rule in u along each row c[j][*], then in
+ * t across the rows. The rows are independent, so their multiply-adds
+ * overlap without interleaving samples.
+ */
+template <int RAW, int TEMP>
+void temperature_scalar(const CalibrationModel& model, const double* raw,
+                        const double* temperature, double* out, size_t n) {
+    const double* c = model.surface;
+
+    for (size_t i = 0; i < n; i++) {
+        double t = (raw[i] - model.center) * model.scale;
+        double u = (temperature[i] - model.temperature_center) * model.temperature_scale;
+        double value = 0.0;
+        for (int j = RAW; j >= 0; j--) {
+            double row = c[j * (TEMP + 1) + TEMP];
+            for (int k = TEMP - 1; k >= 0; k--) {
+                row = row * u + c[j * (TEMP + 1) + k];
+            }
+            value = j == RAW ? row : value * t + row;
+        }
+        out[i] = value;
+    }
+}
+
+template <int RAW>
+void temperature_scalar_rows(const CalibrationModel& model, const double* raw,
+                             const double* temperature, double* out, size_t n) {
+    switch (model.temperature_degree) {
+        case 1: temperature_scalar<RAW, 1>(model, raw, temperature, out, n); break;
+        case 2: temperature_scalar<RAW, 2>(model, raw, temperature, out, n); break;
+        default: temperature_scalar<RAW, 3>(model, raw, temperature, out, n); break;
+    }
+}
+
+void apply_temperature_scalar(const CalibrationModel& model, const double* raw,
+                              const double* temperature, double* out, size_t n) {
+    switch (model.degree) {
+        case 1: temperature_scalar_rows<1>(model, raw, temperature, out, n); break;
+        case 2: temperature_scalar_rows<2>(model, raw, temperature, out, n); break;
+        case 3: temperature_scalar_rows<3>(model, raw, temperature, out, n); break;
+        case 4: temperature_scalar_rows<4>(model, raw, temperature, out, n); break;
+        default: temperature_scalar_rows<5>(model, raw, temperature, out, n); break;
+    }
+}
+
+const KernelTable scalar_table = {
+    APPLY_SCALAR,
+    apply_scalar<double>, apply_scalar<float>, apply_scalar<int16_t>, apply_scalar<int32_t>,
+    apply_multi_scalar, apply_polynomial_scalar, apply_temperature_scalar
+};
+
+#ifdef SENSORCAL_X86_KERNELS
+
+/*
+ * AVX2 + FMA KERNEL
+ * 4 doubles per vector, two vectors per iteration
+ */
+#define AVX2_TARGET __attribute__((target("avx2,fma")))
+
+AVX2_TARGET inline __m256d avx2_load4(const double* p) {
+    return _mm256_loadu_pd(p);
+}
+
+AVX2_TARGET inline __m256d avx2_load4(const float* p) {
+    return _mm256_cvtps_pd(_mm_loadu_ps(p));
+}
+
+AVX2_TARGET inline __m256d avx2_load4(const int32_t* p) {
+    return _mm256_cvtepi32_pd(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+}
+
+AVX2_TARGET inline __m256d avx2_load4(const int16_t* p) {
+    __m128i raw = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+    return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(raw));
+}
+
+// Scalar fused multiply-add for buffer tails
+AVX2_TARGET inline double fma_scalar_x86(double slope, double x, double offset) {
+    return _mm_cvtsd_f64(_mm_fmadd_sd(_mm_set_sd(slope), _mm_set_sd(x), _mm_set_sd(offset)));
+}
+
+template <typename T>
+AVX2_TARGET void apply_avx2(double slope, double offset, const T* in, double* out, size_t n) {
+    const __m256d s = _mm256_set1_pd(slope);
+    const __m256d o = _mm256_set1_pd(offset);
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256d a = avx2_load4(in + i);
+        __m256d b = avx2_load4(in + i + 4);
+        _mm256_storeu_pd(out + i, _mm256_fmadd_pd(s, a, o));
+        _mm256_storeu_pd(out + i + 4, _mm256_fmadd_pd(s, b, o));
+    }
+    for (; i + 4 <= n; i += 4) {
+        _mm256_storeu_pd(out + i, _mm256_fmadd_pd(s, avx2_load4(in + i), o));
+    }
+    for (; i < n; i++) {
+        out[i] = fma_scalar_x86(slope, static_cast<double>(in[i]), offset);
+    }
+}
+
+/*
+ * Multi-channel gather: 4 samples per iteration
+ * Table indices are range checked and the valid bit of each one is
+ * gathered too; lanes that fail either check are replaced by NaN.
+ * Out-of-range lanes gather entry 0 so no load goes past the arrays.
+ */
+AVX2_TARGET void apply_multi_avx2(const CalibrationTableView& table, const uint32_t* channels,
+                                  const double* in, double* out, size_t n) {
+    if (table.channel_count == 0) {
+        apply_multi_scalar(table, channels, in, out, n);
+        return;
+    }
+
+    // Unsigned 32-bit compare done as signed after flipping the sign bits
+    const __m128i sign = _mm_set1_epi32(static_cast<int>(0x80000000u));
+    const __m128i first = _mm_set1_epi32(static_cast<int>(table.first_channel));
+    const __m128i count = _mm_xor_si128(_mm_set1_epi32(static_cast<int>(table.channel_count)), sign);
+    const __m256i low_bits = _mm256_set1_epi64x(63);
+    const __m256i one = _mm256_set1_epi64x(1);
+    const __m256d nan = _mm256_set1_pd(numeric_limits<double>::quiet_NaN());
+    const long long* valid = reinterpret_cast<const long long*>(table.valid);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m128i channel = _mm_loadu_si128(reinterpret_cast<const __m128i*>(channels + i));
+        __m128i index = _mm_sub_epi32(channel, first);
+        __m128i in_range = _mm_cmpgt_epi32(count, _mm_xor_si128(index, sign));
+
+        __m256i index64 = _mm256_cvtepu32_epi64(_mm_and_si128(index, in_range));
+        __m256i words = _mm256_i64gather_epi64(valid, _mm256_srli_epi64(index64, 6), 8);
+        __m256i bits = _mm256_and_si256(_mm256_srlv_epi64(words, _mm256_and_si256(index64, low_bits)), one);
+        __m256i usable = _mm256_and_si256(_mm256_cmpeq_epi64(bits, one), _mm256_cvtepi32_epi64(in_range));
+
+        __m256d slope = _mm256_i64gather_pd(table.slopes, index64, 8);
+        __m256d offset = _mm256_i64gather_pd(table.offsets, index64, 8);
+        __m256d value = _mm256_fmadd_pd(slope, _mm256_loadu_pd(in + i), offset);
+
+        _mm256_storeu_pd(out + i, _mm256_blendv_pd(nan, value, _mm256_castsi256_pd(usable)));
+    }
+    for (; i < n; i++) {
+        uint32_t index = channels[i] - table.first_channel;
+
+        if (table.has_channel(channels[i])) {
+            out[i] = fma_scalar_x86(table.slopes[index], in[i], table.offsets[index]);
+        } else {
+            out[i] = numeric_limits<double>::quiet_NaN();
+        }
+    }
+}
+
+/*
+ * Horner's rule on 4 samples per vector, two vectors per iteration to
+ * hide the latency of the dependent multiply-adds
+ */
+template <int DEGREE>
+AVX2_TARGET void polynomial_avx2(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    const __m256d center = _mm256_set1_pd(model.center);
+    const __m256d scale = _mm256_set1_pd(model.scale);
+    __m256d c[DEGREE + 1];
+    for (int k = 0; k <= DEGREE; k++) {
+        c[k] = _mm256_set1_pd(model.coefficients[k]);
+    }
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m256d ta = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(in + i), center), scale);
+        __m256d tb = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(in + i + 4), center), scale);
+        __m256d a = c[DEGREE];
+        __m256d b = c[DEGREE];
+        for (int k = DEGREE - 1; k >= 0; k--) {
+            a = _mm256_fmadd_pd(a, ta, c[k]);
+            b = _mm256_fmadd_pd(b, tb, c[k]);
+        }
+        _mm256_storeu_pd(out + i, a);
+        _mm256_storeu_pd(out + i + 4, b);
+    }
+    for (; i < n; i++) {
+        double t = (in[i] - model.center) * model.scale;
+        double value = model.coefficients[DEGREE];
+        for (int k = DEGREE - 1; k >= 0; k--) {
+            value = fma_scalar_x86(value, t, model.coefficients[k]);
+        }
+        out[i] = value;
+    }
+}
+
+AVX2_TARGET void apply_polynomial_avx2(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    switch (model.degree) {
+        case 1: polynomial_avx2<1>(model, in, out, n); break;
+        case 2: polynomial_avx2<2>(model, in, out, n); break;
+        case 3: polynomial_avx2<3>(model, in, out, n); break;
+        case 4: polynomial_avx2<4>(model, in, out, n); break;
+        default: polynomial_avx2<5>(model, in, out, n); break;
+    }
+}
+
+// 4 samples per vector; leftovers use the same multiply-adds in scalar form
+template <int RAW, int TEMP>
+AVX2_TARGET void temperature_avx2(const CalibrationModel& model, const double* raw,
+                                  const double* temperature, double* out, size_t n) {
+    const double* coefficients = model.surface;
+    const __m256d center = _mm256_set1_pd(model.center);
+    const __m256d scale = _mm256_set1_pd(model.scale);
+    const __m256d temperature_center = _mm256_set1_pd(model.temperature_center);
+    const __m256d temperature_scale = _mm256_set1_pd(model.temperature_scale);
+    __m256d c[(RAW + 1) * (TEMP + 1)];
+    for (int k = 0; k < (RAW + 1) * (TEMP + 1); k++) {
+        c[k] = _mm256_set1_pd(coefficients[k]);
+    }
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        __m256d t = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(raw + i), center), scale);
+        __m256d u = _mm256_mul_pd(_mm256_sub_pd(_mm256_loadu_pd(temperature + i),
+                                                temperature_center), temperature_scale);
+        __m256d value = _mm256_setzero_pd();
+        for (int j = RAW; j >= 0; j--) {
+            __m256d row = c[j * (TEMP + 1) + TEMP];
+            for (int k = TEMP - 1; k >= 0; k--) {
+                row = _mm256_fmadd_pd(row, u, c[j * (TEMP + 1) + k]);
+            }
+            value = j == RAW ? row : _mm256_fmadd_pd(value, t, row);
+        }
+        _mm256_storeu_pd(out + i, value);
+    }
+    for (; i < n; i++) {
+        double t = (raw[i] - model.center) * model.scale;
+        double u = (temperature[i] - model.temperature_center) * model.temperature_scale;
+        double value = 0.0;
+        for (int j = RAW; j >= 0; j--) {
+            double row = coefficients[j * (TEMP + 1) + TEMP];
+            for (int k = TEMP - 1; k >= 0; k--) {
+                row = fma_scalar_x86(row, u, coefficients[j * (TEMP + 1) + k]);
+            }
+            value = j == RAW ? row : fma_scalar_x86(value, t, row);
+        }
+        out[i] = value;
+    }
+}
+
+template <int RAW>
+AVX2_TARGET void temperature_avx2_rows(const CalibrationModel& model, const double* raw,
+                                       const double* temperature, double* out, size_t n) {
+    switch (model.temperature_degree) {
+        case 1: temperature_avx2<RAW, 1>(model, raw, temperature, out, n); break;
+        case 2: temperature_avx2<RAW, 2>(model, raw, temperature, out, n); break;
+        default: temperature_avx2<RAW, 3>(model, raw, temperature, out, n); break;
+    }
+}
+
+AVX2_TARGET void apply_temperature_avx2(const CalibrationModel& model, const double* raw,
+                                        const double* temperature, double* out, size_t n) {
+    switch (model.degree) {
+        case 1: temperature_avx2_rows<1>(model, raw, temperature, out, n); break;
+        case 2: temperature_avx2_rows<2>(model, raw, temperature, out, n); break;
+        case 3: temperature_avx2_rows<3>(model, raw, temperature, out, n); break;
+        case 4: temperature_avx2_rows<4>(model, raw, temperature, out, n); break;
+        default: temperature_avx2_rows<5>(model, raw, temperature, out, n); break;
+    }
+}
+
+const KernelTable avx2_table = {
+    APPLY_AVX2,
+    apply_avx2<double>, apply_avx2<float>, apply_avx2<int16_t>, apply_avx2<int32_t>,
+    apply_multi_avx2, apply_polynomial_avx2, apply_temperature_avx2
+};
+
+/*
+ * AVX-512 KERNEL
+ * 8 doubles per vector, two vectors per iteration
+ */
+#define AVX512_TARGET __attribute__((target("avx512f,avx2,fma")))
+
+// GCC's own _mm512_undefined_pd() trips -Wmaybe-uninitialized when inlined
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmaybe-uninitialized"
+
+AVX512_TARGET inline __m512d avx512_load8(const double* p) {
+    return _mm512_loadu_pd(p);
+}
+
+AVX512_TARGET inline __m512d avx512_load8(const float* p) {
+    return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+}
+
+AVX512_TARGET inline __m512d avx512_load8(const int32_t* p) {
+    return _mm512_cvtepi32_pd(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+}
+
+AVX512_TARGET inline __m512d avx512_load8(const int16_t* p) {
+    __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    return _mm512_cvtepi32_pd(_mm256_cvtepi16_epi32(raw));
+}
+
+template <typename T>
+AVX512_TARGET void apply_avx512(double slope, double offset, const T* in, double* out, size_t n) {
+    const __m512d s = _mm512_set1_pd(slope);
+    const __m512d o = _mm512_set1_pd(offset);
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512d a = avx512_load8(in + i);
+        __m512d b = avx512_load8(in + i + 8);
+        _mm512_storeu_pd(out + i, _mm512_fmadd_pd(s, a, o));
+        _mm512_storeu_pd(out + i + 8, _mm512_fmadd_pd(s, b, o));
+    }
+    for (; i + 8 <= n; i += 8) {
+        _mm512_storeu_pd(out + i, _mm512_fmadd_pd(s, avx512_load8(in + i), o));
+    }
+    for (; i < n; i++) {
+        out[i] = _mm_cvtsd_f64(_mm_fmadd_sd(_mm_set_sd(slope),
+                                            _mm_set_sd(static_cast<double>(in[i])),
+                                            _mm_set_sd(offset)));
+    }
+}
+
+template <int DEGREE>
+AVX512_TARGET void polynomial_avx512(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    const __m512d center = _mm512_set1_pd(model.center);
+    const __m512d scale = _mm512_set1_pd(model.scale);
+    __m512d c[DEGREE + 1];
+    for (int k = 0; k <= DEGREE; k++) {
+        c[k] = _mm512_set1_pd(model.coefficients[k]);
+    }
+    size_t i = 0;
+
+    for (; i + 16 <= n; i += 16) {
+        __m512d ta = _mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(in + i), center), scale);
+        __m512d tb = _mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(in + i + 8), center), scale);
+        __m512d a = c[DEGREE];
+        __m512d b = c[DEGREE];
+        for (int k = DEGREE - 1; k >= 0; k--) {
+            a = _mm512_fmadd_pd(a, ta, c[k]);
+            b = _mm512_fmadd_pd(b, tb, c[k]);
+        }
+        _mm512_storeu_pd(out + i, a);
+        _mm512_storeu_pd(out + i + 8, b);
+    }
+    for (; i < n; i++) {
+        double t = (in[i] - model.center) * model.scale;
+        double value = model.coefficients[DEGREE];
+        for (int k = DEGREE - 1; k >= 0; k--) {
+            value = _mm_cvtsd_f64(_mm_fmadd_sd(_mm_set_sd(value), _mm_set_sd(t),
+                                               _mm_set_sd(model.coefficients[k])));
+        }
+        out[i] = value;
+    }
+}
+
+AVX512_TARGET void apply_polynomial_avx512(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    switch (model.degree) {
+        case 1: polynomial_avx512<1>(model, in, out, n); break;
+        case 2: polynomial_avx512<2>(model, in, out, n); break;
+        case 3: polynomial_avx512<3>(model, in, out, n); break;
+        case 4: polynomial_avx512<4>(model, in, out, n); break;
+        default: polynomial_avx512<5>(model, in, out, n); break;
+    }
+}
+
+template <int RAW, int TEMP>
+AVX512_TARGET void temperature_avx512(const CalibrationModel& model, const double* raw,
+                                      const double* temperature, double* out, size_t n) {
+    const double* coefficients = model.surface;
+    const __m512d center = _mm512_set1_pd(model.center);
+    const __m512d scale = _mm512_set1_pd(model.scale);
+    const __m512d temperature_center = _mm512_set1_pd(model.temperature_center);
+    const __m512d temperature_scale = _mm512_set1_pd(model.temperature_scale);
+    __m512d c[(RAW + 1) * (TEMP + 1)];
+    for (int k = 0; k < (RAW + 1) * (TEMP + 1); k++) {
+        c[k] = _mm512_set1_pd(coefficients[k]);
+    }
+    size_t i = 0;
+
+    for (; i + 8 <= n; i += 8) {
+        __m512d t = _mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(raw + i), center), scale);
+        __m512d u = _mm512_mul_pd(_mm512_sub_pd(_mm512_loadu_pd(temperature + i),
+                                                temperature_center), temperature_scale);
+        __m512d value = _mm512_setzero_pd();
+        for (int j = RAW; j >= 0; j--) {
+            __m512d row = c[j * (TEMP + 1) + TEMP];
+            for (int k = TEMP - 1; k >= 0; k--) {
+                row = _mm512_fmadd_pd(row, u, c[j * (TEMP + 1) + k]);
+            }
+            value = j == RAW ? row : _mm512_fmadd_pd(value, t, row);
+        }
+        _mm512_storeu_pd(out + i, value);
+    }
+    for (; i < n; i++) {
+        double t = (raw[i] - model.center) * model.scale;
+        double u = (temperature[i] - model.temperature_center) * model.temperature_scale;
+        double value = 0.0;
+        for (int j = RAW; j >= 0; j--) {
+            double row = coefficients[j * (TEMP + 1) + TEMP];
+            for (int k = TEMP - 1; k >= 0; k--) {
+                row = _mm_cvtsd_f64(_mm_fmadd_sd(_mm_set_sd(row), _mm_set_sd(u),
+                                                 _mm_set_sd(coefficients[j * (TEMP + 1) + k])));
+            }
+            value = j == RAW ? row : _mm_cvtsd_f64(_mm_fmadd_sd(_mm_set_sd(value), _mm_set_sd(t),
+                                                                _mm_set_sd(row)));
+        }
+        out[i] = value;
+    }
+}
+
+template <int RAW>
+AVX512_TARGET void temperature_avx512_rows(const CalibrationModel& model, const double* raw,
+                                           const double* temperature, double* out, size_t n) {
+    switch (model.temperature_degree) {
+        case 1: temperature_avx512<RAW, 1>(model, raw, temperature, out, n); break;
+        case 2: temperature_avx512<RAW, 2>(model, raw, temperature, out, n); break;
+        default: temperature_avx512<RAW, 3>(model, raw, temperature, out, n); break;
+    }
+}
+
+AVX512_TARGET void apply_temperature_avx512(const CalibrationModel& model, const double* raw,
+                                            const double* temperature, double* out, size_t n) {
+    switch (model.degree) {
+        case 1: temperature_avx512_rows<1>(model, raw, temperature, out, n); break;
+        case 2: temperature_avx512_rows<2>(model, raw, temperature, out, n); break;
+        case 3: temperature_avx512_rows<3>(model, raw, temperature, out, n); break;
+        case 4: temperature_avx512_rows<4>(model, raw, temperature, out, n); break;
+        default: temperature_avx512_rows<5>(model, raw, temperature, out, n); break;
+    }
+}
+
+// Multi-channel samples reuse the AVX2 gather kernel
+const KernelTable avx512_table = {
+    APPLY_AVX512,
+    apply_avx512<double>, apply_avx512<float>, apply_avx512<int16_t>, apply_avx512<int32_t>,
+    apply_multi_avx2, apply_polynomial_avx512, apply_temperature_avx512
+};
+
+#pragma GCC diagnostic pop
+
+#endif  // SENSORCAL_X86_KERNELS
+
+#ifdef SENSORCAL_NEON_KERNELS
+
+/*
+ * NEON KERNEL (AArch64)
+ * 2 doubles per vector, 4 elements per iteration
+ */
+inline void neon_load4(const double* p, float64x2_t& lo, float64x2_t& hi) {
+    lo = vld1q_f64(p);
+    hi = vld1q_f64(p + 2);
+}
+
+inline void neon_load4(const float* p, float64x2_t& lo, float64x2_t& hi) {
+    float32x4_t raw = vld1q_f32(p);
+    lo = vcvt_f64_f32(vget_low_f32(raw));
+    hi = vcvt_high_f64_f32(raw);
+}
+
+inline void neon_load4(const int32_t* p, float64x2_t& lo, float64x2_t& hi) {
+    int32x4_t raw = vld1q_s32(p);
+    lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(raw)));
+    hi = vcvtq_f64_s64(vmovl_high_s32(raw));
+}
+
+inline void neon_load4(const int16_t* p, float64x2_t& lo, float64x2_t& hi) {
+    int32x4_t raw = vmovl_s16(vld1_s16(p));
+    lo = vcvtq_f64_s64(vmovl_s32(vget_low_s32(raw)));
+    hi = vcvtq_f64_s64(vmovl_high_s32(raw));
+}
+
+template <typename T>
+void apply_neon(double slope, double offset, const T* in, double* out, size_t n) {
+    const float64x2_t s = vdupq_n_f64(slope);
+    const float64x2_t o = vdupq_n_f64(offset);
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        float64x2_t lo, hi;
+        neon_load4(in + i, lo, hi);
+        vst1q_f64(out + i, vfmaq_f64(o, s, lo));
+        vst1q_f64(out + i + 2, vfmaq_f64(o, s, hi));
+    }
+    for (; i < n; i++) {
+        out[i] = fma(slope, static_cast<double>(in[i]), offset);
+    }
+}
+
+template <int DEGREE>
+void polynomial_neon(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    const float64x2_t center = vdupq_n_f64(model.center);
+    const float64x2_t scale = vdupq_n_f64(model.scale);
+    float64x2_t c[DEGREE + 1];
+    for (int k = 0; k <= DEGREE; k++) {
+        c[k] = vdupq_n_f64(model.coefficients[k]);
+    }
+    size_t i = 0;
+
+    for (; i + 4 <= n; i += 4) {
+        float64x2_t ta = vmulq_f64(vsubq_f64(vld1q_f64(in + i), center), scale);
+        float64x2_t tb = vmulq_f64(vsubq_f64(vld1q_f64(in + i + 2), center), scale);
+        float64x2_t a = c[DEGREE];
+        float64x2_t b = c[DEGREE];
+        for (int k = DEGREE - 1; k >= 0; k--) {
+            a = vfmaq_f64(c[k], a, ta);
+            b = vfmaq_f64(c[k], b, tb);
+        }
+        vst1q_f64(out + i, a);
+        vst1q_f64(out + i + 2, b);
+    }
+    for (; i < n; i++) {
+        double t = (in[i] - model.center) * model.scale;
+        double value = model.coefficients[DEGREE];
+        for (int k = DEGREE - 1; k >= 0; k--) {
+            value = fma(value, t, model.coefficients[k]);
+        }
+        out[i] = value;
+    }
+}
+
+void apply_polynomial_neon(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    switch (model.degree) {
+        case 1: polynomial_neon<1>(model, in, out, n); break;
+        case 2: polynomial_neon<2>(model, in, out, n); break;
+        case 3: polynomial_neon<3>(model, in, out, n); break;
+        case 4: polynomial_neon<4>(model, in, out, n); break;
+        default: polynomial_neon<5>(model, in, out, n); break;
+    }
+}
+
+template <int RAW, int TEMP>
+void temperature_neon(const CalibrationModel& model, const double* raw,
+                      const double* temperature, double* out, size_t n) {
+    const double* coefficients = model.surface;
+    const float64x2_t center = vdupq_n_f64(model.center);
+    const float64x2_t scale = vdupq_n_f64(model.scale);
+    const float64x2_t temperature_center = vdupq_n_f64(model.temperature_center);
+    const float64x2_t temperature_scale = vdupq_n_f64(model.temperature_scale);
+    float64x2_t c[(RAW + 1) * (TEMP + 1)];
+    for (int k = 0; k < (RAW + 1) * (TEMP + 1); k++) {
+        c[k] = vdupq_n_f64(coefficients[k]);
+    }
+    size_t i = 0;
+
+    for (; i + 2 <= n; i += 2) {
+        float64x2_t t = vmulq_f64(vsubq_f64(vld1q_f64(raw + i), center), scale);
+        float64x2_t u = vmulq_f64(vsubq_f64(vld1q_f64(temperature + i), temperature_center),
+                                  temperature_scale);
+        float64x2_t value = vdupq_n_f64(0.0);
+        for (int j = RAW; j >= 0; j--) {
+            float64x2_t row = c[j * (TEMP + 1) + TEMP];
+            for (int k = TEMP - 1; k >= 0; k--) {
+                row = vfmaq_f64(c[j * (TEMP + 1) + k], row, u);
+            }
+            value = j == RAW ? row : vfmaq_f64(row, value, t);
+        }
+        vst1q_f64(out + i, value);
+    }
+    for (; i < n; i++) {
+        double t = (raw[i] - model.center) * model.scale;
+        double u = (temperature[i] - model.temperature_center) * model.temperature_scale;
+        double value = 0.0;
+        for (int j = RAW; j >= 0; j--) {
+            double row = coefficients[j * (TEMP + 1) + TEMP];
+            for (int k = TEMP - 1; k >= 0; k--) {
+                row = fma(row, u, coefficients[j * (TEMP + 1) + k]);
+            }
+            value = j == RAW ? row : fma(value, t, row);
+        }
+        out[i] = value;
+    }
+}
+
+template <int RAW>
+void temperature_neon_rows(const CalibrationModel& model, const double* raw,
+                           const double* temperature, double* out, size_t n) {
+    switch (model.temperature_degree) {
+        case 1: temperature_neon<RAW, 1>(model, raw, temperature, out, n); break;
+        case 2: temperature_neon<RAW, 2>(model, raw, temperature, out, n); break;
+        default: temperature_neon<RAW, 3>(model, raw, temperature, out, n); break;
+    }
+}
+
+void apply_temperature_neon(const CalibrationModel& model, const double* raw,
+                            const double* temperature, double* out, size_t n) {
+    switch (model.degree) {
+        case 1: temperature_neon_rows<1>(model, raw, temperature, out, n); break;
+        case 2: temperature_neon_rows<2>(model, raw, temperature, out, n); break;
+        case 3: temperature_neon_rows<3>(model, raw, temperature, out, n); break;
+        case 4: temperature_neon_rows<4>(model, raw, temperature, out, n); break;
+        default: temperature_neon_rows<5>(model, raw, temperature, out, n); break;
+    }
+}
+
+// NEON has no gather; multi-channel samples use the scalar lookup
+const KernelTable neon_table = {
+    APPLY_NEON,
+    apply_neon<double>, apply_neon<float>, apply_neon<int16_t>, apply_neon<int32_t>,
+    apply_multi_scalar, apply_polynomial_neon, apply_temperature_neon
+};
+
+#endif  // SENSORCAL_NEON_KERNELS
+
+const KernelTable* kernel_table(ApplyKernel kernel) {
+    switch (kernel) {
+#ifdef SENSORCAL_X86_KERNELS
+        case APPLY_AVX2:
+            return &avx2_table;
+        case APPLY_AVX512:
+            return &avx512_table;
+#endif
+#ifdef SENSORCAL_NEON_KERNELS
+        case APPLY_NEON:
+            return &neon_table;
+#endif
+        case APPLY_SCALAR:
+            return &scalar_table;
+        default:
+            return NULL;
+    }
+}
+
+// Fastest kernel this build and CPU support
+const KernelTable* best_kernel_table() {
+    const ApplyKernel preference[] = { APPLY_AVX512, APPLY_AVX2, APPLY_NEON };
+
+    for (ApplyKernel kernel : preference) {
+        if (apply_kernel_supported(kernel)) {
+            return kernel_table(kernel);
+        }
+    }
+    return &scalar_table;
+}
+
+// NULL until first use, then the table every call dispatches through
+atomic<const KernelTable*> active_table(NULL);
+
+const KernelTable& current_table() {
+    const KernelTable* table = active_table.load(memory_order_acquire);
+    if (table == NULL) {
+        table = best_kernel_table();
+        active_table.store(table, memory_order_release);
+    }
+    return *table;
+}
+
+}  // namespace
+
+void apply_calibration(const Calibration& cal, const double* in, double* out, size_t n) {
+    current_table().apply_double(cal.slope, cal.offset, in, out, n);
+}
+
+void apply_calibration(const Calibration& cal, const float* in, double* out, size_t n) {
+    current_table().apply_float(cal.slope, cal.offset, in, out, n);
+}
+
+void apply_calibration(const Calibration& cal, const int16_t* in, double* out, size_t n) {
+    current_table().apply_int16(cal.slope, cal.offset, in, out, n);
+}
+
+void apply_calibration(const Calibration& cal, const int32_t* in, double* out, size_t n) {
+    current_table().apply_int32(cal.slope, cal.offset, in, out, n);
+}
+
+void apply_calibration(const CalibrationTableView& table, const uint32_t* channels,
+                       const double* in, double* out, size_t n) {
+    current_table().apply_multi(table, channels, in, out, n);
+}
+
+void apply_model(const CalibrationModel& model, const double* in, double* out, size_t n) {
+    switch (model.kind) {
+        case MODEL_POLYNOMIAL:
+            current_table().apply_polynomial(model, in, out, n);
+            return;
+        case MODEL_PIECEWISE:
+            // Grid lookup then one multiply-add; the lookup does not vectorize
+            for (size_t i = 0; i < n; i++) {
+                size_t segment = piecewise_segment(model, in[i]);
+                out[i] = model.segment_slope[segment] * in[i] + model.segment_offset[segment];
+            }
+            return;
+        case MODEL_TEMPERATURE:
+            // Needs a temperature for every reading
+            fill(out, out + n, numeric_limits<double>::quiet_NaN());
+            return;
+        case MODEL_LINEAR:
+            break;
+    }
+    apply_calibration(model.linear, in, out, n);
+}
+
+void apply_model(const CalibrationModel& model, const double* raw, const double* temperature,
+                 double* out, size_t n) {
+    if (model.kind == MODEL_TEMPERATURE) {
+        current_table().apply_temperature(model, raw, temperature, out, n);
+    } else {
+        apply_model(model, raw, out, n);
+    }
+}
+
+ApplyKernel active_apply_kernel() {
+    return current_table().kernel;
+}
+
+bool select_apply_kernel(ApplyKernel kernel) {
+    if (!apply_kernel_supported(kernel)) {
+        return false;
+    }
+    active_table.store(kernel_table(kernel), memory_order_release);
+    return true;
+}
+
+bool apply_kernel_supported(ApplyKernel kernel) {
+    if (kernel_table(kernel) == NULL) {
+        return false;
+    }
+
+#ifdef SENSORCAL_X86_KERNELS
+    if (kernel == APPLY_AVX2) {
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    }
+    if (kernel == APPLY_AVX512) {
+        return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2")
+            && __builtin_cpu_supports("fma");
+    }
+#endif
+
+    // Scalar always works; NEON is part of the AArch64 baseline
+    return true;
+}
+
+const char* apply_kernel_name(ApplyKernel kernel) {
+    switch (kernel) {
+        case APPLY_SCALAR:
+            return "scalar";
+        case APPLY_AVX2:
+            return "avx2";
+        case APPLY_AVX512:
+            return "avx512";
+        case APPLY_NEON:
+            return "neon";
+    }
+    return "unknown";
+}
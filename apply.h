@@ -0,0 +1,73 @@
+/*
+ * Batch apply kernels: out[i] = Slope  in[i] + Offset
+ *
+ * The best kernel for the running CPU (AVX-512, AVX2+FMA, NEON or plain
+ * scalar code) is picked on first use. The SIMD kernels use fused
+ * multiply-add, so results may differ from the scalar formula in the last
+ * bit; each kernel is deterministic on its own.
+ *
+ * Calibrations whose coefficients are known at build time can be compiled
+ * into their own loop instead: see fixed_calibration.h.
+ */
+
+#ifndef APPLY_H
+#define APPLY_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "calibration.h"
+#include "calibration_table.h"
+#include "model.h"
+
+enum ApplyKernel {
+    APPLY_SCALAR,
+    APPLY_AVX2,
+    APPLY_AVX512,
+    APPLY_NEON
+};
+
+// Convert n raw readings from in[] into real values in out[]
+void apply_calibration(const Calibration& cal, const double* in, double* out, size_t n);
+void apply_calibration(const Calibration& cal, const float* in, double* out, size_t n);
+void apply_calibration(const Calibration& cal, const int16_t* in, double* out, size_t n);
+void apply_calibration(const Calibration& cal, const int32_t* in, double* out, size_t n);
+
+/*
+ * Convert n interleaved multi-channel samples:
+ * out[i] = slopes[channels[i]]  in[i] + offsets[channels[i]]
+ * Coefficients are gathered from the table's arrays by index (AVX2 gathers
+ * where available). Samples whose channel has no calibration come out NaN.
+ */
+void apply_calibration(const CalibrationTableView& table, const uint32_t* channels,
+                       const double* in, double* out, size_t n);
+
+/*
+ * Convert n raw readings with any calibration model
+ * Polynomials use a vectorized Horner kernel; piecewise models look up
+ * each sample's segment in the model's grid.
+ */
+void apply_model(const CalibrationModel& model, const double* in, double* out, size_t n);
+
+/*
+ * Convert n paired raw readings and temperatures in one pass
+ * Temperature models evaluate their surface with a vectorized nested
+ * Horner kernel; other models ignore the temperatures. (The single-input
+ * apply_model() gives NaN for a temperature model.)
+ */
+void apply_model(const CalibrationModel& model, const double* raw, const double* temperature,
+                 double* out, size_t n);
+
+// Kernel used by apply_calibration() and apply_model()
+ApplyKernel active_apply_kernel();
+
+// Force a kernel (e.g. for benchmarks). Returns false if this CPU lacks it.
+bool select_apply_kernel(ApplyKernel kernel);
+
+// True if this build and CPU can run the kernel
+bool apply_kernel_supported(ApplyKernel kernel);
+
+// Short name of a kernel ("scalar", "avx2", ...)
+const char* apply_kernel_name(ApplyKernel kernel);
+
+#endif
@@ -0,0 +1,857 @@
+/*
+ * io_uring and helper-thread backends for AsyncReader / AsyncWriter
+ */
+
+#include "async_io.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "aligned_buffer.h"
+#include "stats.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SENSORCAL_IO_URING 1
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+#endif
+
+using namespace std;
+
+// What AsyncReader and AsyncWriter forward to; one subclass per backend
+class ReadEngine {
+public:
+    virtual ~ReadEngine() {}
+    virtual bool next(const char*& data, size_t& size) = 0;
+    virtual bool failed() = 0;
+};
+
+class WriteEngine {
+public:
+    virtual ~WriteEngine() {}
+    virtual char* buffer() = 0;
+    virtual void submit(size_t used) = 0;
+    virtual bool finish() = 0;
+    virtual bool failed() = 0;
+};
+
+namespace {
+
+// read() / write() retried on EINTR; -1 on error
+long read_some(int fd, char* data, size_t size) {
+#ifdef _WIN32
+    return _read(fd, data, static_cast<unsigned>(min(size, size_t(1) << 30)));
+#else
+    ssize_t count;
+    do {
+        count = read(fd, data, size);
+    } while (count < 0 && errno == EINTR);
+    return static_cast<long>(count);
+#endif
+}
+
+long write_some(int fd, const char* data, size_t size) {
+#ifdef _WIN32
+    return _write(fd, data, static_cast<unsigned>(min(size, size_t(1) << 30)));
+#else
+    ssize_t count;
+    do {
+        count = write(fd, data, size);
+    } while (count < 0 && errno == EINTR);
+    return static_cast<long>(count);
+#endif
+}
+
+/*
+ * FIFO of buffer slot numbers with room for every slot
+ * A std::deque would allocate and free a node every few hundred chunks;
+ * this ring is sized once, so the steady state allocates nothing.
+ */
+class SlotQueue {
+public:
+    explicit SlotQueue(unsigned slots) : entries(slots), head(0), count(0) {}
+
+    bool empty() const { return count == 0; }
+    unsigned front() const { return entries[head]; }
+
+    void push_back(unsigned slot) {
+        entries[(head + count) % entries.size()] = slot;
+        count++;
+    }
+
+    void pop_front() {
+        head = (head + 1) % entries.size();
+        count--;
+    }
+
+private:
+    vector<unsigned> entries;
+    size_t head;
+    size_t count;
+};
+
+/*
+ * THREAD BACKEND
+ * A helper thread moves buffers between a free queue and a ready queue;
+ * the caller takes ready chunks (reader) or hands filled buffers over
+ * (writer) under one mutex.
+ */
+class ThreadReadEngine : public ReadEngine {
+public:
+    ThreadReadEngine(int fd, size_t chunk_size, unsigned depth)
+        : fd(fd), chunk_size(chunk_size), buffers(depth), sizes(depth, 0), free_slots(depth),
+          ready(depth), handed_out(-1), stop(false), finished(false), error(false) {
+        for (unsigned i = 0; i < depth; i++) {
+            buffers[i].reserve(chunk_size);
+            free_slots.push_back(i);
+        }
+        worker = thread(&ThreadReadEngine::run, this);
+    }
+
+    ~ThreadReadEngine() {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        worker.join();
+    }
+
+    bool next(const char*& data, size_t& size) {
+        StageTimer timer(STAT_READ);
+        unique_lock<mutex> lock(state_mutex);
+
+        if (handed_out >= 0) {
+            free_slots.push_back(handed_out);
+            handed_out = -1;
+            changed.notify_all();
+        }
+
+        changed.wait(lock, [this] { return !ready.empty() || finished; });
+        if (ready.empty()) {
+            return false;
+        }
+
+        handed_out = static_cast<int>(ready.front());
+        ready.pop_front();
+        data = buffers[handed_out].data();
+        size = sizes[handed_out];
+        timer.add_items(size);
+        return true;
+    }
+
+    bool failed() {
+        lock_guard<mutex> lock(state_mutex);
+        return error;
+    }
+
+private:
+    void run() {
+        while (true) {
+            unsigned slot;
+            {
+                unique_lock<mutex> lock(state_mutex);
+                changed.wait(lock, [this] { return stop || !free_slots.empty(); });
+                if (stop) {
+                    return;
+                }
+                slot = free_slots.front();
+                free_slots.pop_front();
+            }
+
+            // Fill the whole chunk; a short chunk means end of input
+            size_t filled = 0;
+            bool bad = false;
+            while (filled < chunk_size) {
+                long count = read_some(fd, buffers[slot].data() + filled, chunk_size - filled);
+                if (count <= 0) {
+                    bad = count < 0;
+                    break;
+                }
+                filled += static_cast<size_t>(count);
+            }
+
+            bool last = bad || filled < chunk_size;
+            {
+                lock_guard<mutex> lock(state_mutex);
+                if (filled > 0) {
+                    sizes[slot] = filled;
+                    ready.push_back(slot);
+                } else {
+                    free_slots.push_back(slot);
+                }
+                error = error || bad;
+                finished = last;
+            }
+            changed.notify_all();
+
+            if (last) {
+                return;
+            }
+        }
+    }
+
+    int fd;
+    size_t chunk_size;
+    vector<AlignedBuffer<char> > buffers;   // Reserved, not zeroed: pages are touched as they fill
+    vector<size_t> sizes;
+    SlotQueue free_slots;
+    SlotQueue ready;
+    int handed_out;         // Slot the caller is reading, or -1
+    bool stop;
+    bool finished;          // No chunks after those in ready
+    bool error;
+    mutex state_mutex;
+    condition_variable changed;
+    thread worker;
+};
+
+class ThreadWriteEngine : public WriteEngine {
+public:
+    ThreadWriteEngine(int fd, size_t buffer_size, unsigned depth)
+        : fd(fd), buffers(depth), sizes(depth, 0), free_slots(depth), ready(depth), current(0),
+          stop(false), error(false) {
+        for (unsigned i = 0; i < depth; i++) {
+            buffers[i].reserve(buffer_size);
+            if (i != current) {
+                free_slots.push_back(i);
+            }
+        }
+        worker = thread(&ThreadWriteEngine::run, this);
+    }
+
+    ~ThreadWriteEngine() { finish(); }
+
+    char* buffer() { return buffers[current].data(); }
+
+    void submit(size_t used) {
+        if (used == 0) {
+            return;
+        }
+        StageTimer timer(STAT_WRITE, used);
+        unique_lock<mutex> lock(state_mutex);
+
+        sizes[current] = used;
+        ready.push_back(current);
+        changed.notify_all();
+
+        changed.wait(lock, [this] { return !free_slots.empty(); });
+        current = free_slots.front();
+        free_slots.pop_front();
+    }
+
+    bool finish() {
+        {
+            lock_guard<mutex> lock(state_mutex);
+            stop = true;
+        }
+        changed.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+        return !error;
+    }
+
+    bool failed() {
+        lock_guard<mutex> lock(state_mutex);
+        return error;
+    }
+
+private:
+    void run() {
+        while (true) {
+            unsigned slot;
+            bool skip;
+            {
+                unique_lock<mutex> lock(state_mutex);
+                changed.wait(lock, [this] { return stop || !ready.empty(); });
+                if (ready.empty()) {
+                    return;
+                }
+                slot = ready.front();
+                ready.pop_front();
+                skip = error;   // After a failed write the rest is dropped
+            }
+
+            bool bad = false;
+            size_t written = 0;
+            while (!skip && written < sizes[slot]) {
+                long count = write_some(fd, buffers[slot].data() + written, sizes[slot] - written);
+                if (count <= 0) {
+                    bad = true;
+                    break;
+                }
+                written += static_cast<size_t>(count);
+            }
+
+            {
+                lock_guard<mutex> lock(state_mutex);
+                free_slots.push_back(slot);
+                error = error || bad;
+            }
+            changed.notify_all();
+        }
+    }
+
+    int fd;
+    vector<AlignedBuffer<char> > buffers;   // Reserved, not zeroed: pages are touched as they fill
+    vector<size_t> sizes;
+    SlotQueue free_slots;
+    SlotQueue ready;
+    unsigned current;       // Slot the caller is filling
+    bool stop;              // Exit once ready is empty
+    bool error;
+    mutex state_mutex;
+    condition_variable changed;
+    thread worker;
+};
+
+#ifdef SENSORCAL_IO_URING
+
+/*
+ * IO_URING BACKEND
+ * A minimal ring driven from the calling thread: one readv / writev per
+ * buffer is queued with its own file offset and completions are reaped
+ * while the caller waits for a particular buffer. Short transfers are
+ * queued again for the rest.
+ */
+class IoRing {
+public:
+    IoRing()
+        : ring_fd(-1), entries(0), sq_map(MAP_FAILED), cq_map(MAP_FAILED), sqes(NULL),
+          sq_map_size(0), cq_map_size(0), sqes_size(0) {}
+
+    ~IoRing() {
+        if (sqes != NULL) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_map != MAP_FAILED && cq_map != sq_map) {
+            munmap(cq_map, cq_map_size);
+        }
+        if (sq_map != MAP_FAILED) {
+            munmap(sq_map, sq_map_size);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
+
+    // Returns false if the kernel does not offer io_uring (or forbids it)
+    bool setup(unsigned depth) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+
+        long fd = syscall(__NR_io_uring_setup, depth, &params);
+        if (fd < 0) {
+            return false;
+        }
+        ring_fd = static_cast<int>(fd);
+        entries = params.sq_entries;
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single_map) {
+            sq_map_size = cq_map_size = max(sq_map_size, cq_map_size);
+        }
+
+        sq_map = mmap(NULL, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED) {
+            return false;
+        }
+        cq_map = single_map ? sq_map
+                            : mmap(NULL, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   ring_fd, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED) {
+            return false;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void* sqe_map = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring_fd, IORING_OFF_SQES);
+        if (sqe_map == MAP_FAILED) {
+            return false;
+        }
+        sqes = static_cast<io_uring_sqe*>(sqe_map);
+
+        char* sq = static_cast<char*>(sq_map);
+        sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+        sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+        sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+
+        char* cq = static_cast<char*>(cq_map);
+        cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+        cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+        cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+        cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Queue one readv / writev of iov at offset and submit it
+    bool submit(uint8_t opcode, int fd, const iovec* iov, uint64_t offset, uint64_t user_data) {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= entries) {
+            return false;
+        }
+
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<uintptr_t>(iov);
+        sqe->len = 1;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        long submitted;
+        do {
+            submitted = syscall(__NR_io_uring_enter, ring_fd, 1, 0, 0, NULL, 0);
+        } while (submitted < 0 && errno == EINTR);
+        return submitted == 1;
+    }
+
+    // Wait for the next completion
+    bool wait(uint64_t& user_data, int& result) {
+        while (true) {
+            unsigned head = *cq_head;
+            if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                const io_uring_cqe& cqe = cqes[head & *cq_mask];
+                user_data = cqe.user_data;
+                result = cqe.res;
+                __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+            long waited = syscall(__NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+            if (waited < 0 && errno != EINTR) {
+                return false;
+            }
+        }
+    }
+
+private:
+    IoRing(const IoRing&);             // Not copyable
+    IoRing& operator=(const IoRing&);
+
+    int ring_fd;
+    unsigned entries;
+    void* sq_map;
+    void* cq_map;
+    io_uring_sqe* sqes;
+    size_t sq_map_size;
+    size_t cq_map_size;
+    size_t sqes_size;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+};
+
+// One buffer and the transfer it is part of
+struct UringSlot {
+    AlignedBuffer<char> data;   // Reserved, not zeroed
+    iovec iov;
+    uint64_t offset;    // File offset of data[0]
+    size_t size;        // Bytes to transfer
+    size_t done;        // Bytes transferred so far
+    bool busy;          // Transfer queued and not yet complete
+};
+
+/*
+ * Chunk k of the file goes to slot k % depth, so chunks come back in
+ * order however the reads complete
+ */
+class UringReadEngine : public ReadEngine {
+public:
+    UringReadEngine(IoRing* ring, int fd, size_t chunk_size, unsigned depth, uint64_t start)
+        : ring(ring), fd(fd), chunk_size(chunk_size), slots(depth), next_slot(0), handed_out(-1),
+          next_offset(start), in_flight(0), at_end(false), error(false) {
+        for (unsigned i = 0; i < depth; i++) {
+            slots[i].data.reserve(chunk_size);
+            start_read(i);
+        }
+    }
+
+    ~UringReadEngine() {
+        // The kernel may still write into the buffers until every read completes
+        while (in_flight > 0 && reap()) {
+        }
+        delete ring;
+    }
+
+    bool next(const char*& data, size_t& size) {
+        if (handed_out >= 0 && !at_end && !error) {
+            start_read(handed_out);
+        }
+        handed_out = -1;
+        if (at_end || error) {
+            return false;
+        }
+
+        StageTimer timer(STAT_READ);
+        UringSlot& slot = slots[next_slot];
+        while (slot.busy && !error) {
+            if (!reap()) {
+                error = true;
+            }
+        }
+        if (error || slot.done == 0) {
+            at_end = true;
+            return false;
+        }
+
+        // A short chunk is the end of the file
+        at_end = slot.done < chunk_size;
+        data = slot.data.data();
+        size = slot.done;
+        handed_out = static_cast<int>(next_slot);
+        next_slot = (next_slot + 1) % slots.size();
+        timer.add_items(size);
+        return true;
+    }
+
+    bool failed() { return error; }
+
+private:
+    void start_read(unsigned index) {
+        UringSlot& slot = slots[index];
+        slot.offset = next_offset;
+        slot.size = chunk_size;
+        slot.done = 0;
+        next_offset += chunk_size;
+        queue(index);
+    }
+
+    void queue(unsigned index) {
+        UringSlot& slot = slots[index];
+        slot.iov.iov_base = slot.data.data() + slot.done;
+        slot.iov.iov_len = slot.size - slot.done;
+        slot.busy = ring->submit(IORING_OP_READV, fd, &slot.iov, slot.offset + slot.done, index);
+        if (slot.busy) {
+            in_flight++;
+        } else {
+            error = true;
+        }
+    }
+
+    // Handle one completion; false if the ring itself failed
+    bool reap() {
+        uint64_t index;
+        int result;
+        if (!ring->wait(index, result)) {
+            return false;
+        }
+        in_flight--;
+
+        UringSlot& slot = slots[index];
+        if (result == -EINTR || result == -EAGAIN) {
+            queue(static_cast<unsigned>(index));
+        } else if (result < 0) {
+            slot.busy = false;
+            error = true;
+        } else if (result == 0) {
+            slot.busy = false;
+        } else {
+            slot.done += static_cast<size_t>(result);
+            if (slot.done < slot.size) {
+                queue(static_cast<unsigned>(index));
+            } else {
+                slot.busy = false;
+            }
+        }
+        return true;
+    }
+
+    IoRing* ring;
+    int fd;
+    size_t chunk_size;
+    vector<UringSlot> slots;
+    size_t next_slot;       // Holds the next chunk to hand out
+    int handed_out;         // Slot the caller is reading, or -1
+    uint64_t next_offset;   // Of the next chunk to queue
+    unsigned in_flight;
+    bool at_end;
+    bool error;
+};
+
+class UringWriteEngine : public WriteEngine {
+public:
+    UringWriteEngine(IoRing* ring, int fd, size_t buffer_size, unsigned depth, uint64_t start)
+        : ring(ring), fd(fd), slots(depth), current(0), next_offset(start), in_flight(0),
+          finished(false), error(false) {
+        for (unsigned i = 0; i < depth; i++) {
+            slots[i].data.reserve(buffer_size);
+            slots[i].busy = false;
+        }
+    }
+
+    ~UringWriteEngine() {
+        finish();
+        delete ring;
+    }
+
+    char* buffer() { return slots[current].data.data(); }
+
+    void submit(size_t used) {
+        if (used == 0) {
+            return;
+        }
+        StageTimer timer(STAT_WRITE, used);
+
+        UringSlot& slot = slots[current];
+        slot.offset = next_offset;
+        slot.size = used;
+        slot.done = 0;
+        next_offset += used;
+        if (!error) {
+            queue(current);
+        }
+
+        current = (current + 1) % slots.size();
+        while (slots[current].busy) {
+            if (!reap()) {
+                error = true;
+                slots[current].busy = false;
+            }
+        }
+    }
+
+    bool finish() {
+        if (!finished) {
+            while (in_flight > 0) {
+                if (!reap()) {
+                    error = true;
+                    break;
+                }
+            }
+            // Leave the file position after the data, as write() would
+            if (!error) {
+                lseek(fd, static_cast<off_t>(next_offset), SEEK_SET);
+            }
+            finished = true;
+        }
+        return !error;
+    }
+
+    bool failed() { return error; }
+
+private:
+    void queue(unsigned index) {
+        UringSlot& slot = slots[index];
+        slot.iov.iov_base = slot.data.data() + slot.done;
+        slot.iov.iov_len = slot.size - slot.done;
+        slot.busy = ring->submit(IORING_OP_WRITEV, fd, &slot.iov, slot.offset + slot.done, index);
+        if (slot.busy) {
+            in_flight++;
+        } else {
+            error = true;
+        }
+    }
+
+    bool reap() {
+        uint64_t index;
+        int result;
+        if (!ring->wait(index, result)) {
+            return false;
+        }
+        in_flight--;
+
+        UringSlot& slot = slots[index];
+        if (result == -EINTR || result == -EAGAIN) {
+            queue(static_cast<unsigned>(index));
+        } else if (result <= 0) {
+            slot.busy = false;
+            error = true;
+        } else {
+            slot.done += static_cast<size_t>(result);
+            if (slot.done < slot.size) {
+                queue(static_cast<unsigned>(index));
+            } else {
+                slot.busy = false;
+            }
+        }
+        return true;
+    }
+
+    IoRing* ring;
+    int fd;
+    vector<UringSlot> slots;
+    unsigned current;       // Slot the caller is filling
+    uint64_t next_offset;   // Where the next submitted buffer goes
+    unsigned in_flight;
+    bool finished;
+    bool error;
+};
+
+/*
+ * io_uring transfers need explicit offsets: a regular file, not opened
+ * for appending (appends would land in completion order). Returns NULL
+ * with the current position, or why fd cannot be used.
+ */
+const char* uring_unusable(int fd, uint64_t& position) {
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+        return "not a regular file";
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || (flags & O_APPEND) != 0) {
+        return "opened for appending";
+    }
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+    if (offset < 0) {
+        return "not seekable";
+    }
+    position = static_cast<uint64_t>(offset);
+    return NULL;
+}
+
+// A ring for depth transfers, or NULL with why not in reason
+IoRing* open_ring(unsigned depth, string& reason) {
+    IoRing* ring = new IoRing;
+    if (ring->setup(depth)) {
+        return ring;
+    }
+    reason = string("the kernel refused an io_uring (") + strerror(errno) + ")";
+    delete ring;
+    return NULL;
+}
+
+#endif  // SENSORCAL_IO_URING
+
+}  // namespace
+
+bool parse_io_backend(const string& text, IoBackend& backend) {
+    if (text == "auto") {
+        backend = IO_AUTO;
+    } else if (text == "uring") {
+        backend = IO_URING;
+    } else if (text == "thread") {
+        backend = IO_THREAD;
+    } else if (text == "sync") {
+        backend = IO_SYNC;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* io_backend_name(IoBackend backend) {
+    switch (backend) {
+        case IO_AUTO: return "auto";
+        case IO_URING: return "uring";
+        case IO_THREAD: return "thread";
+        case IO_SYNC: return "sync";
+    }
+    return "unknown";
+}
+
+AsyncReader::AsyncReader(int fd, IoBackend backend, size_t chunk_size, unsigned depth)
+    : engine(NULL), chosen(IO_THREAD) {
+    depth = max(depth, 2u);
+
+#ifdef SENSORCAL_IO_URING
+    if (backend == IO_AUTO || backend == IO_URING) {
+        uint64_t position;
+        const char* unusable = uring_unusable(fd, position);
+        IoRing* ring = unusable == NULL ? open_ring(depth, fallback) : NULL;
+        if (ring != NULL) {
+            engine = new UringReadEngine(ring, fd, chunk_size, depth, position);
+            chosen = IO_URING;
+            return;
+        }
+        if (unusable != NULL) {
+            fallback = unusable;
+        }
+    }
+#else
+    if (backend == IO_AUTO || backend == IO_URING) {
+        fallback = "built without io_uring support";
+    }
+#endif
+
+    engine = new ThreadReadEngine(fd, chunk_size, depth);
+}
+
+AsyncReader::~AsyncReader() {
+    delete engine;
+}
+
+bool AsyncReader::next(const char*& data, size_t& size) {
+    return engine->next(data, size);
+}
+
+bool AsyncReader::failed() const {
+    return engine->failed();
+}
+
+AsyncWriter::AsyncWriter(int fd, IoBackend backend, size_t buffer_size, unsigned depth)
+    : engine(NULL), buffer_size(buffer_size), chosen(IO_THREAD) {
+    depth = max(depth, 2u);
+
+#ifdef SENSORCAL_IO_URING
+    if (backend == IO_AUTO || backend == IO_URING) {
+        uint64_t position;
+        const char* unusable = uring_unusable(fd, position);
+        IoRing* ring = unusable == NULL ? open_ring(depth, fallback) : NULL;
+        if (ring != NULL) {
+            engine = new UringWriteEngine(ring, fd, buffer_size, depth, position);
+            chosen = IO_URING;
+            return;
+        }
+        if (unusable != NULL) {
+            fallback = unusable;
+        }
+    }
+#else
+    if (backend == IO_AUTO || backend == IO_URING) {
+        fallback = "built without io_uring support";
+    }
+#endif
+
+    engine = new ThreadWriteEngine(fd, buffer_size, depth);
+}
+
+AsyncWriter::~AsyncWriter() {
+    delete engine;
+}
+
+char* AsyncWriter::buffer() {
+    return engine->buffer();
+}
+
+void AsyncWriter::submit(size_t used) {
+    engine->submit(used);
+}
+
+bool AsyncWriter::finish() {
+    return engine->finish();
+}
+
+bool AsyncWriter::failed() const {
+    return engine->failed();
+}
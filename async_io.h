@@ -0,0 +1,114 @@
+/*
+ * Overlapped file reads and writes for the batch pipeline
+ *
+ * A plain read-convert-write loop leaves the disk idle while it converts
+ * and the CPU idle while it waits for the disk. AsyncReader keeps several
+ * chunk reads in flight ahead of the consumer and AsyncWriter writes
+ * filled buffers behind the producer, so reading, converting and writing
+ * all overlap (triple buffering by default).
+ *
+ * BACKENDS:
+ *   IO_URING   Linux io_uring through the raw system calls (no liburing):
+ *              every buffer's read or write is queued at its own file
+ *              offset, so the device sees several requests at once.
+ *              Regular files only.
+ *   IO_THREAD  One helper thread per stream doing plain read() / write(),
+ *              for pipes, terminals and systems without io_uring.
+ * IO_AUTO picks io_uring when the kernel allows it and the file is a
+ * regular file, and the thread backend otherwise. IO_URING falls back to
+ * the thread backend the same way, but fallback_reason() says why, so
+ * the caller can tell the user. IO_SYNC means no overlap; the callers
+ * then use their stdio path.
+ *
+ * Neither class closes its file descriptor.
+ */
+
+#ifndef ASYNC_IO_H
+#define ASYNC_IO_H
+
+#include <cstddef>
+#include <string>
+
+enum IoBackend {
+    IO_AUTO,
+    IO_URING,
+    IO_THREAD,
+    IO_SYNC
+};
+
+// Parse "auto", "uring", "thread" or "sync"
+bool parse_io_backend(const std::string& text, IoBackend& backend);
+const char* io_backend_name(IoBackend backend);
+
+class ReadEngine;
+class WriteEngine;
+
+/*
+ * Reads a file descriptor from its current position in chunks of up to
+ * chunk_size bytes, with up to depth chunks read ahead
+ */
+class AsyncReader {
+public:
+    AsyncReader(int fd, IoBackend backend, size_t chunk_size = 1 << 20, unsigned depth = 3);
+    ~AsyncReader();
+
+    /*
+     * Point data at the next chunk of the file, in order. The chunk stays
+     * valid until the next call. Returns false at end of input or after a
+     * read error.
+     */
+    bool next(const char*& data, size_t& size);
+
+    bool failed() const;
+
+    // Backend in use once IO_AUTO has been resolved
+    IoBackend backend() const { return chosen; }
+
+    // Why io_uring was asked for (IO_AUTO or IO_URING) but not used; empty otherwise
+    const std::string& fallback_reason() const { return fallback; }
+
+private:
+    AsyncReader(const AsyncReader&);             // Not copyable
+    AsyncReader& operator=(const AsyncReader&);
+
+    ReadEngine* engine;
+    IoBackend chosen;
+    std::string fallback;
+};
+
+/*
+ * Writes buffers to a file descriptor in order, with up to depth buffers
+ * being written while the next one is filled
+ */
+class AsyncWriter {
+public:
+    AsyncWriter(int fd, IoBackend backend, size_t buffer_size = 1 << 20, unsigned depth = 3);
+    ~AsyncWriter();
+
+    // The buffer to fill next, buffer_size bytes long
+    char* buffer();
+    size_t capacity() const { return buffer_size; }
+
+    // Queue the first used bytes of buffer() and switch to a free buffer
+    // (waits while every buffer is being written)
+    void submit(size_t used);
+
+    // Wait until everything queued is written. Returns false if any write failed.
+    bool finish();
+
+    bool failed() const;
+
+    IoBackend backend() const { return chosen; }
+    const std::string& fallback_reason() const { return fallback; }
+
+private:
+    AsyncWriter(const AsyncWriter&);             // Not copyable
+    AsyncWriter& operator=(const AsyncWriter&);
+
+    WriteEngine* engine;
+    size_t buffer_size;
+    IoBackend chosen;
+    std::string fallback;
+};
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * The batch convert and fit loops shared by the commands and the benchmark
+ */
+
+#include "batch.h"
+
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+
+#include "aligned_buffer.h"
+#include "apply.h"
+#include "gpu_offload.h"
+#include "parallel_convert.h"
+#include "stats.h"
+
+using namespace std;
+
+string stream_error_message(const StreamResult& result, const string& in_filename,
+                            const string& out_filename) {
+    string line = "Line " + to_string(result.error_line);
+    switch (result.status) {
+        case STREAM_OK:
+            return "The stream was converted.";
+        case STREAM_BAD_SAMPLE:
+            return line + ": expected \"channel,raw\" but got '" + result.error_text + "'";
+        case STREAM_BAD_TEMPERATURE_SAMPLE:
+            return line + ": expected \"raw,temperature\" but got '" + result.error_text + "'";
+        case STREAM_BAD_READING:
+            return line + ": invalid raw reading '" + result.error_text + "'";
+        case STREAM_BAD_CODE:
+            return line + ": '" + result.error_text + "' is not an integer ADC code";
+        case STREAM_BAD_POINT:
+            return line + ": expected \"reference,raw\" but got '" + result.error_text + "'";
+        case STREAM_LINE_TOO_LONG:
+            return line + " is too long.";
+        case STREAM_READ_FAILED:
+            return "Reading '" + in_filename + "' failed.";
+        case STREAM_WRITE_FAILED:
+            return "Writing to '" + out_filename + "' failed.";
+    }
+    return "Unknown stream status.";
+}
+
+void convert_stream(ChunkedLineReader& reader, BufferedWriter& writer, const ConvertSetup& setup,
+                    StreamResult& result) {
+    bool multi_channel = setup.channel_table != NULL;
+    bool use_fixed_point = !multi_channel && setup.fixed_point != NULL;
+    bool use_lookup = !multi_channel && !use_fixed_point && setup.lookup != NULL;
+    bool with_temperature = !multi_channel && !use_fixed_point && !use_lookup
+        && model_needs_temperature(*setup.model);
+
+    // GPU transfers only pay off on large blocks
+    const size_t BLOCK_SIZE = setup.on_gpu ? 1 << 20 : 4096;
+    AlignedBuffer<double> block;
+    AlignedBuffer<uint32_t> block_channels;
+    AlignedBuffer<int32_t> block_codes;
+    AlignedBuffer<double> block_temperatures;
+    AlignedBuffer<double> real_values(BLOCK_SIZE);
+    AlignedBuffer<int32_t> fixed_values(use_fixed_point ? BLOCK_SIZE : 0);
+    block.reserve(BLOCK_SIZE);
+    block_channels.reserve(BLOCK_SIZE);
+    block_codes.reserve(BLOCK_SIZE);
+    block_temperatures.reserve(BLOCK_SIZE);
+
+    char* line;
+    size_t length;
+    unsigned long long line_number = 0;
+    result = StreamResult();
+
+    // The GPU converts large blocks on its own; the thread pool takes whole lines
+    unique_ptr<ParallelConverter> pool;
+    if (multi_channel && !setup.on_gpu && setup.threads != 1) {
+        pool.reset(new ParallelConverter(*setup.channel_table, setup.threads));
+        result.threads = pool->threads();
+        result.node_count = pool->node_count();
+    }
+
+    // When the block being filled was started, for the parse stage stats
+    uint64_t parse_start = stats_enabled() ? stats_clock_ns() : 0;
+
+    while (true) {
+        bool more = reader.next_line(line, length);
+
+        if (pool) {
+            unsigned long long written = pool->converted();
+            if (more ? !pool->add_line(line, length, writer) : !pool->finish(writer)) {
+                result.status = STREAM_BAD_SAMPLE;
+                result.error_line = pool->error_line();
+                result.error_text = pool->error_text();
+                break;
+            }
+            if (pool->converted() > written) {
+                record_startup(pool->converted());
+                if (setup.block_done) {
+                    setup.block_done();
+                }
+            }
+            if (more) {
+                line_number++;
+                continue;
+            }
+            result.converted = pool->converted();
+            break;
+        }
+
+        if (more) {
+            line_number++;
+
+            // Skip blank lines and comments
+            if (is_blank_or_comment(line, line + length)) {
+                continue;
+            }
+
+            double raw_reading;
+            StreamStatus bad = STREAM_OK;
+
+            if (multi_channel) {
+                uint32_t channel;
+                if (!parse_sample(line, line + length, channel, raw_reading)) {
+                    bad = STREAM_BAD_SAMPLE;
+                } else {
+                    block_channels.push_back(channel);
+                }
+            } else if (with_temperature) {
+                double temperature;
+                if (!parse_temperature_sample(line, line + length, raw_reading, temperature)) {
+                    bad = STREAM_BAD_TEMPERATURE_SAMPLE;
+                } else {
+                    block_temperatures.push_back(temperature);
+                }
+            } else if (!parse_reading(line, line + length, raw_reading)) {
+                bad = STREAM_BAD_READING;
+            } else if (use_lookup || use_fixed_point) {
+                // Anything out of range still maps to a code outside the table
+                double code = raw_reading < -1e9 ? -1e9 : (raw_reading > 1e9 ? 1e9 : raw_reading);
+                if (code != floor(code)) {
+                    bad = STREAM_BAD_CODE;
+                } else {
+                    block_codes.push_back(static_cast<int32_t>(code));
+                }
+            }
+
+            if (bad != STREAM_OK) {
+                result.status = bad;
+                result.error_line = line_number;
+                result.error_text.assign(line, length);
+                break;
+            }
+
+            block.push_back(raw_reading);
+            if (block.size() < BLOCK_SIZE) {
+                continue;
+            }
+        }
+
+        if (parse_start != 0) {
+            record_stage(STAT_PARSE, stats_clock_ns() - parse_start, block.size());
+        }
+
+        // Apply calibration formula to the whole block
+        {
+            StageTimer timer(STAT_CONVERT, block.size());
+            if (multi_channel) {
+                if (setup.snapshot != NULL) {
+                    setup.snapshot->check(block_channels.data(), block.size());
+                }
+
+                // The CPU takes over if the GPU fails
+                if (!setup.on_gpu || !gpu_apply_calibration(*setup.channel_table, block_channels.data(),
+                                                            block.data(), real_values.data(), block.size())) {
+                    apply_calibration(*setup.channel_table, block_channels.data(), block.data(),
+                                      real_values.data(), block.size());
+                }
+                block_channels.clear();
+            } else if (use_lookup) {
+                apply_lookup(*setup.lookup, block_codes.data(), real_values.data(), block.size());
+                block_codes.clear();
+            } else if (use_fixed_point) {
+                const FixedPointCalibration& fixed_point = *setup.fixed_point;
+                apply_fixed_point(fixed_point, block_codes.data(), fixed_values.data(), block.size());
+                for (size_t i = 0; i < block.size(); i++) {
+                    bool in_range = block_codes[i] >= fixed_point.first_code
+                        && block_codes[i] <= fixed_point.last_code;
+                    real_values[i] = in_range ? ldexp(static_cast<double>(fixed_values[i]), -fixed_point.output_bits)
+                                              : numeric_limits<double>::quiet_NaN();
+                }
+                block_codes.clear();
+            } else if (with_temperature) {
+                apply_model(*setup.model, block.data(), block_temperatures.data(), real_values.data(),
+                            block.size());
+                block_temperatures.clear();
+            } else {
+                apply_model(*setup.model, block.data(), real_values.data(), block.size());
+            }
+        }
+        if (!block.empty()) {
+            record_startup(block.size());
+        }
+
+        // Match the precision used by save_calibration_to_file()
+        {
+            StageTimer timer(STAT_FORMAT, block.size());
+            for (size_t i = 0; i < block.size(); i++) {
+                writer.write_fixed(real_values[i], 10);
+                writer.put('\n');
+            }
+        }
+        result.converted += block.size();
+        block.clear();
+        if (setup.block_done) {
+            setup.block_done();
+        }
+        parse_start = stats_enabled() ? stats_clock_ns() : 0;
+
+        if (!more) {
+            break;
+        }
+    }
+
+    writer.flush();
+
+    if (result.status != STREAM_OK) {
+        return;
+    }
+    if (reader.line_too_long()) {
+        result.status = STREAM_LINE_TOO_LONG;
+        result.error_line = line_number + 1;
+    } else if (reader.read_failed()) {
+        result.status = STREAM_READ_FAILED;
+    } else if (writer.failed()) {
+        result.status = STREAM_WRITE_FAILED;
+    }
+}
+
+void fit_stream(ChunkedLineReader& reader, FitPool& pool, bool keep_points, FitAccumulator& fit,
+                vector<double>& all_raw, vector<double>& all_reference, StreamResult& result,
+                size_t chunk_points, const function<void()>& chunk_done) {
+    AlignedBuffer<double> raw_chunk, reference_chunk;
+    raw_chunk.reserve(chunk_points);
+    reference_chunk.reserve(chunk_points);
+
+    char* line;
+    size_t length;
+    unsigned long long line_number = 0;
+    result = StreamResult();
+
+    // When the chunk being filled was started, for the parse stage stats
+    uint64_t parse_start = stats_enabled() ? stats_clock_ns() : 0;
+
+    while (true) {
+        bool more = reader.next_line(line, length);
+
+        if (!more || raw_chunk.size() == chunk_points) {
+            if (parse_start != 0) {
+                record_stage(STAT_PARSE, stats_clock_ns() - parse_start, raw_chunk.size());
+            }
+            fit.merge(pool.fit(raw_chunk.data(), reference_chunk.data(), raw_chunk.size()));
+            if (keep_points) {
+                all_raw.insert(all_raw.end(), raw_chunk.data(), raw_chunk.data() + raw_chunk.size());
+                all_reference.insert(all_reference.end(), reference_chunk.data(),
+                                     reference_chunk.data() + reference_chunk.size());
+            }
+            result.converted += raw_chunk.size();
+            raw_chunk.clear();
+            reference_chunk.clear();
+            if (chunk_done) {
+                chunk_done();
+            }
+            parse_start = stats_enabled() ? stats_clock_ns() : 0;
+        }
+        if (!more) {
+            break;
+        }
+
+        line_number++;
+
+        // Skip blank lines and comments
+        if (is_blank_or_comment(line, line + length)) {
+            continue;
+        }
+
+        double reference_value, raw_reading;
+        if (!parse_point(line, line + length, reference_value, raw_reading)) {
+            result.status = STREAM_BAD_POINT;
+            result.error_line = line_number;
+            result.error_text.assign(line, length);
+            return;
+        }
+
+        raw_chunk.push_back(raw_reading);
+        reference_chunk.push_back(reference_value);
+    }
+
+    if (reader.line_too_long()) {
+        result.status = STREAM_LINE_TOO_LONG;
+        result.error_line = line_number + 1;
+    } else if (reader.read_failed()) {
+        result.status = STREAM_READ_FAILED;
+    }
+}
@@ -0,0 +1,102 @@
+/*
+ * The batch convert and fit loops
+ *
+ * convert and fit stream text in and out block by block: lines are read
+ * through a ChunkedLineReader, parsed into fixed-size blocks, converted
+ * (or folded into the fit) a block at a time and formatted through a
+ * BufferedWriter. These are those loops, for the commands in main.cpp and
+ * for the benchmark that checks they make no heap allocation once warmed
+ * up, so both always run the same code. Opening files and printing
+ * errors stay with the caller: a StreamResult says how the stream ended
+ * and stream_error_message() words it.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <cstddef>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "adc_lookup.h"
+#include "calibration_table.h"
+#include "fit.h"
+#include "fixed_point.h"
+#include "model.h"
+#include "snapshot.h"
+#include "text_io.h"
+
+/*
+ * What convert_stream() converts with: channel_table ("channel,raw"
+ * samples), fixed_point or lookup (integer ADC codes), or else model
+ * (readings, or "raw,temperature" for a temperature-compensated model)
+ */
+struct ConvertSetup {
+    const CalibrationModel* model;
+    const AdcLookupTable* lookup;
+    const FixedPointCalibration* fixed_point;   // Codes outside its range come out as nan
+    const CalibrationTableView* channel_table;
+    const MappedSnapshot* snapshot;             // Behind channel_table: each block's channels are checked
+    bool on_gpu;                                // channel_table on the GPU (the CPU if that fails)
+    unsigned threads;                           // channel_table on a ParallelConverter unless 1
+
+    // Called after each block is written, e.g. to count allocations from the first one on
+    std::function<void()> block_done;
+
+    ConvertSetup()
+        : model(NULL), lookup(NULL), fixed_point(NULL), channel_table(NULL), snapshot(NULL),
+          on_gpu(false), threads(1) {}
+};
+
+enum StreamStatus {
+    STREAM_OK,
+    STREAM_BAD_SAMPLE,              // Not "channel,raw"
+    STREAM_BAD_TEMPERATURE_SAMPLE,  // Not "raw,temperature"
+    STREAM_BAD_READING,             // Not a number
+    STREAM_BAD_CODE,                // Not an integer ADC code
+    STREAM_BAD_POINT,               // Not "reference,raw"
+    STREAM_LINE_TOO_LONG,
+    STREAM_READ_FAILED,
+    STREAM_WRITE_FAILED
+};
+
+struct StreamResult {
+    StreamStatus status;
+    unsigned long long converted;   // Values written (convert) or points fitted (fit)
+    unsigned long long error_line;  // The line that failed, from 1
+    std::string error_text;
+    unsigned threads;               // Of the ParallelConverter, 0 if none was used
+    size_t node_count;
+
+    StreamResult() : status(STREAM_OK), converted(0), error_line(0), threads(0), node_count(0) {}
+};
+
+// "Line N: ..." for a bad line, or which file could not be read or written
+std::string stream_error_message(const StreamResult& result, const std::string& in_filename,
+                                 const std::string& out_filename);
+
+/*
+ * Convert the lines of reader into writer, one value per line with 10
+ * decimals; blank lines and comments are skipped. Stops at the first bad
+ * line. The writer is flushed, but an AsyncWriter behind it is the
+ * caller's to finish().
+ */
+void convert_stream(ChunkedLineReader& reader, BufferedWriter& writer, const ConvertSetup& setup,
+                    StreamResult& result);
+
+// Points fit_stream() buffers and reduces at a time
+const size_t FIT_CHUNK_POINTS = 16 * FIT_BLOCK_SIZE;
+
+/*
+ * Fold the "reference,raw" lines of reader into fit, a chunk of
+ * chunk_points at a time on pool, and into all_raw / all_reference as
+ * well when keep_points is set. Chunk boundaries depend only on the
+ * input, so the fit is bit-identical for any thread count.
+ */
+void fit_stream(ChunkedLineReader& reader, FitPool& pool, bool keep_points, FitAccumulator& fit,
+                std::vector<double>& all_raw, std::vector<double>& all_reference, StreamResult& result,
+                size_t chunk_points = FIT_CHUNK_POINTS,
+                const std::function<void()>& chunk_done = std::function<void()>());
+
+#endif
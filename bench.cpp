@@ -0,0 +1,1118 @@
+/*
+ * Sensor Calibration Benchmarks
+ *
+ * PURPOSE:
+ * Measures the throughput of the fit, the apply kernels, calibration file
+ * load/save and number parsing, so regressions can be tracked over time.
+ * Results go to stdout (or --json FILE) as JSON; a readable summary goes
+ * to stderr.
+ * Multi-channel text convert is also timed on the NUMA-pinned thread pool
+ * at 1, 2, 4, ... threads up to the core count, with the speedup over one
+ * thread, to show how it scales on a given machine.
+ * Cold starts are timed as open-to-first-converted-value for a table and
+ * a snapshot of the benchmark channels and of a million channels.
+ * It also runs the batch convert and fit loops (batch.h) with every heap
+ * allocation counted, and exits with 1 if either allocates anything once
+ * warmed up.
+ *
+ * COMPILATION:
+ * g++ -std=c++17 -O2 -pthread bench.cpp apply.cpp fit.cpp calibration_table.cpp text_io.cpp stats.cpp model.cpp robust.cpp channel_fit.cpp adc_lookup.cpp mapped_file.cpp sample_file.cpp async_io.cpp drift.cpp gpu_offload.cpp parallel_convert.cpp fixed_point.cpp snapshot.cpp batch.cpp -o sensor_bench
+ *
+ * RUN:
+ *   sensor_bench [--max-points N] [--channels N] [--min-time SECONDS] [--json FILE]
+ * --max-points sets the largest fit size (decades from 1e3 up to it,
+ * default 1e7; 1e9 needs about 16 GB of RAM).
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#endif
+
+#include "calibration.h"
+#include "apply.h"
+#include "aligned_buffer.h"
+#include "async_io.h"
+#include "batch.h"
+#include "fit.h"
+#include "calibration_table.h"
+#include "text_io.h"
+#include "fixed_point.h"
+#include "model.h"
+#include "robust.h"
+#include "adc_lookup.h"
+#include "drift.h"
+#include "fixed_calibration.h"
+#include "gpu_offload.h"
+#include "parallel_convert.h"
+#include "snapshot.h"
+
+using namespace std;
+
+// One measured case
+struct BenchResult {
+    string name;        // e.g. "apply_double"
+    string variant;     // e.g. kernel or format
+    size_t items;       // Points, samples, files or bytes per iteration
+    string unit;        // What items counts
+    unsigned threads;
+    double seconds;     // Mean time per iteration
+};
+
+// Benchmark settings from the command line
+struct BenchOptions {
+    size_t max_points;
+    uint32_t channels;
+    double min_time;
+    string json_filename;
+    string temp_prefix;
+
+    BenchOptions()
+        : max_points(10000000), channels(10000), min_time(0.2), temp_prefix("bench_tmp_") {}
+};
+
+// Heap allocations of one batch loop after its first block
+struct AllocationResult {
+    string path;        // "convert" or "fit"
+    string variant;     // I/O backend, apply path or thread count
+    size_t blocks;      // Blocks after the warm-up block
+    unsigned long long allocations;
+};
+
+vector<BenchResult> results;
+vector<AllocationResult> allocation_results;
+
+/*
+ * HEAP ALLOCATION COUNTING
+ * Every operator new in the program is replaced by one that counts, so
+ * bench_allocations() can see whether a loop touched the heap.
+ */
+atomic<unsigned long long> heap_allocations(0);
+
+namespace {
+
+// alignment 0 = the default new alignment
+void* counted_allocate(size_t size, size_t alignment) {
+    heap_allocations.fetch_add(1, memory_order_relaxed);
+    if (size == 0) {
+        size = 1;
+    }
+
+    void* memory;
+#ifdef _WIN32
+    memory = alignment > 0 ? _aligned_malloc(size, alignment) : malloc(size);
+#else
+    if (alignment > 0) {
+        if (posix_memalign(&memory, alignment < sizeof(void*) ? sizeof(void*) : alignment, size) != 0) {
+            memory = NULL;
+        }
+    } else {
+        memory = malloc(size);
+    }
+#endif
+    if (memory == NULL) {
+        throw bad_alloc();
+    }
+    return memory;
+}
+
+void counted_free(void* memory, size_t alignment) {
+#ifdef _WIN32
+    if (alignment > 0) {
+        _aligned_free(memory);
+        return;
+    }
+#endif
+    (void)alignment;
+    free(memory);
+}
+
+}  // namespace
+
+void* operator new(size_t size) { return counted_allocate(size, 0); }
+void* operator new[](size_t size) { return counted_allocate(size, 0); }
+void* operator new(size_t size, align_val_t alignment) {
+    return counted_allocate(size, static_cast<size_t>(alignment));
+}
+void* operator new[](size_t size, align_val_t alignment) {
+    return counted_allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* memory) noexcept { counted_free(memory, 0); }
+void operator delete[](void* memory) noexcept { counted_free(memory, 0); }
+void operator delete(void* memory, size_t) noexcept { counted_free(memory, 0); }
+void operator delete[](void* memory, size_t) noexcept { counted_free(memory, 0); }
+void operator delete(void* memory, align_val_t alignment) noexcept {
+    counted_free(memory, static_cast<size_t>(alignment));
+}
+void operator delete[](void* memory, align_val_t alignment) noexcept {
+    counted_free(memory, static_cast<size_t>(alignment));
+}
+void operator delete(void* memory, size_t, align_val_t alignment) noexcept {
+    counted_free(memory, static_cast<size_t>(alignment));
+}
+void operator delete[](void* memory, size_t, align_val_t alignment) noexcept {
+    counted_free(memory, static_cast<size_t>(alignment));
+}
+
+// Function prototypes
+bool parse_options(int argc, char* argv[], BenchOptions& options);
+template <typename Body> double time_per_iteration(double min_time, Body body);
+void record(const string& name, const string& variant, size_t items, const string& unit,
+            unsigned threads, double seconds);
+void bench_fit(const BenchOptions& options);
+void bench_apply(const BenchOptions& options);
+void bench_files(const BenchOptions& options);
+void bench_parse(const BenchOptions& options);
+void bench_scaling(const BenchOptions& options);
+bool bench_allocations(const BenchOptions& options);
+void write_json(FILE* out);
+
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+
+    if (!parse_options(argc, argv, options)) {
+        cerr << "Usage: sensor_bench [--max-points N] [--channels N] [--min-time SECONDS] [--json FILE]\n";
+        return 2;
+    }
+
+    bench_fit(options);
+    bench_apply(options);
+    bench_files(options);
+    bench_parse(options);
+    bench_scaling(options);
+    bool allocation_free = bench_allocations(options);
+
+    FILE* out = stdout;
+    if (!options.json_filename.empty()) {
+        out = fopen(options.json_filename.c_str(), "w");
+        if (out == NULL) {
+            cerr << "Error: Cannot create file '" << options.json_filename << "'\n";
+            return 1;
+        }
+    }
+
+    write_json(out);
+
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    if (!allocation_free) {
+        cerr << "Error: The allocation check failed (see \"allocations\").\n";
+        return 1;
+    }
+    return 0;
+}
+
+bool parse_options(int argc, char* argv[], BenchOptions& options) {
+    for (int i = 1; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            return false;
+        }
+
+        const char* value = argv[++i];
+        if (option == "--max-points") {
+            // strtod so that 1e9 works
+            double points = strtod(value, NULL);
+            if (!(points >= 1000)) {
+                return false;
+            }
+            options.max_points = static_cast<size_t>(points);
+        } else if (option == "--channels") {
+            long channels = strtol(value, NULL, 10);
+            if (channels < 1 || channels > static_cast<long>(CALIBRATION_TABLE_MAX_CHANNELS)) {
+                return false;
+            }
+            options.channels = static_cast<uint32_t>(channels);
+        } else if (option == "--min-time") {
+            options.min_time = strtod(value, NULL);
+            if (!(options.min_time > 0)) {
+                return false;
+            }
+        } else if (option == "--json") {
+            options.json_filename = value;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * Run body repeatedly until min_time has passed (at least once after a
+ * warm-up run) and return the mean seconds per run
+ */
+template <typename Body>
+double time_per_iteration(double min_time, Body body) {
+    typedef chrono::steady_clock Clock;
+
+    body();  // Warm-up: page faults, caches, kernel dispatch
+
+    size_t iterations = 0;
+    Clock::time_point start = Clock::now();
+    double elapsed;
+
+    do {
+        body();
+        iterations++;
+        elapsed = chrono::duration<double>(Clock::now() - start).count();
+    } while (elapsed < min_time);
+
+    return elapsed / iterations;
+}
+
+void record(const string& name, const string& variant, size_t items, const string& unit,
+            unsigned threads, double seconds) {
+    BenchResult result;
+    result.name = name;
+    result.variant = variant;
+    result.items = items;
+    result.unit = unit;
+    result.threads = threads;
+    result.seconds = seconds;
+    results.push_back(result);
+
+    fprintf(stderr, "%-16s %-16s %12zu %-10s %3u thr  %12.6f ms  %14.0f %s/s\n",
+            name.c_str(), variant.c_str(), items, unit.c_str(), threads,
+            seconds * 1e3, items / seconds, unit.c_str());
+}
+
+/*
+ * FIT
+ * fit_parallel() on 1 thread and on every core, plus the one-point-at-a-time
+ * Welford update the interactive and streaming paths use, the recursive
+ * least squares update of drift tracking, and the robust fits up to 1e5
+ * points
+ */
+void bench_fit(const BenchOptions& options) {
+    unsigned cores = thread::hardware_concurrency();
+    if (cores == 0) {
+        cores = 1;
+    }
+
+    mt19937_64 rng(42);
+    normal_distribution<double> noise(0.0, 1.0);
+
+    vector<double> raw(options.max_points), reference(options.max_points);
+    for (size_t i = 0; i < options.max_points; i++) {
+        raw[i] = 8.0e6 + 1000.0 * noise(rng);
+        reference[i] = 0.25 * raw[i] - 100.0 + 0.01 * noise(rng);
+    }
+
+    for (size_t n = 1000; n <= options.max_points; n *= 10) {
+        volatile double sink = 0.0;
+
+        double serial = time_per_iteration(options.min_time, [&]() {
+            FitAccumulator fit;
+            for (size_t i = 0; i < n; i++) {
+                fit.add(raw[i], reference[i]);
+            }
+            sink = fit.c_xy;
+        });
+        record("fit", "welford", n, "points", 1, serial);
+
+        // One recursive least squares update per point, as drift tracking does
+        double tracked = time_per_iteration(options.min_time, [&]() {
+            DriftTracker tracker(0.999);
+            for (size_t i = 0; i < n; i++) {
+                tracker.add(raw[i], reference[i]);
+            }
+            sink = tracker.effective_points();
+        });
+        record("fit", "rls", n, "points", 1, tracked);
+
+        double one = time_per_iteration(options.min_time, [&]() {
+            sink = fit_parallel(raw.data(), reference.data(), n, 1).c_xy;
+        });
+        record("fit", "blocked", n, "points", 1, one);
+
+        if (cores > 1) {
+            double all = time_per_iteration(options.min_time, [&]() {
+                sink = fit_parallel(raw.data(), reference.data(), n, cores).c_xy;
+            });
+            record("fit", "blocked", n, "points", cores, all);
+        }
+
+        // The robust fits hold every point and cost far more per point
+        if (n <= 100000) {
+            RobustFitOptions robust;
+            robust.threads = 1;
+            Calibration line;
+            size_t inliers;
+
+            double theil_sen = time_per_iteration(options.min_time, [&]() {
+                fit_theil_sen(raw.data(), reference.data(), n, robust, line);
+                sink = line.slope;
+            });
+            record("fit", "theil-sen", n, "points", 1, theil_sen);
+
+            double ransac = time_per_iteration(options.min_time, [&]() {
+                fit_ransac(raw.data(), reference.data(), n, robust, line, inliers);
+                sink = line.slope;
+            });
+            record("fit", "ransac", n, "points", 1, ransac);
+
+            double huber = time_per_iteration(options.min_time, [&]() {
+                fit_huber(raw.data(), reference.data(), n, robust, line);
+                sink = line.slope;
+            });
+            record("fit", "huber", n, "points", 1, huber);
+        }
+
+        (void)sink;
+    }
+}
+
+// Build-time coefficients for the "fixed" apply rows: cal in bench_apply()
+struct BenchFixedLine {
+    static constexpr double slope = 0.2427184466;
+    static constexpr double offset = -104.1747572816;
+};
+
+// A degree 5 polynomial over the int16 range
+struct BenchFixedPolynomial {
+    static constexpr int degree = 5;
+    static constexpr double center = 0.0;
+    static constexpr double scale = 1.0 / 32768.0;
+    static constexpr double coefficients[degree + 1] = { -104.17, 7953.4, 1.07, -0.21, 0.035, -0.0042 };
+};
+
+/*
+ * APPLY
+ * Every kernel this CPU supports for each input type, for a degree 5
+ * polynomial and for a raw degree 3 / temperature degree 2 surface, the
+ * same line and a degree 5 polynomial compiled in (variant "fixed", with
+ * float outputs too), then the best kernel split over all cores, the
+ * multi-channel gather (also on the GPU if there is one), a 64-segment
+ * piecewise model and a 1024-segment one fitted to skewed readings, a
+ * 16-bit ADC lookup table and the integer-only form of the line
+ * (fixed_point.h)
+ */
+void bench_apply(const BenchOptions& options) {
+    const size_t n = 1 << 20;  // 8 MB of doubles: beyond L2, within L3 on most servers
+    Calibration cal;
+    cal.slope = 0.2427184466;
+    cal.offset = -104.1747572816;
+    cal.is_valid = true;
+
+    vector<double> in_double(n), out(n);
+    vector<float> in_float(n);
+    vector<int16_t> in_int16(n);
+    vector<int32_t> in_int32(n);
+
+    for (size_t i = 0; i < n; i++) {
+        in_int16[i] = static_cast<int16_t>(i * 2654435761u);
+        in_int32[i] = static_cast<int32_t>(i * 2654435761u) >> 8;
+        in_float[i] = static_cast<float>(in_int16[i]);
+        in_double[i] = static_cast<double>(in_int32[i]);
+    }
+
+    // Smooth curve through the test readings for the nonlinear models
+    vector<double> curve(n);
+    for (size_t i = 0; i < n; i++) {
+        curve[i] = cal.slope * in_double[i] + 1e-9 * in_double[i] * in_double[i];
+    }
+    CalibrationModel polynomial, piecewise;
+    fit_polynomial(in_double.data(), curve.data(), n, MAX_POLYNOMIAL_DEGREE, polynomial);
+    fit_piecewise(in_double.data(), curve.data(), n, 64, piecewise);
+
+    // The same curve drifting with a temperature sweep from -40 to 85
+    vector<double> temperature(n), drifted(n);
+    for (size_t i = 0; i < n; i++) {
+        temperature[i] = -40.0 + 125.0 * static_cast<double>((i * 40503u) % 65536) / 65535.0;
+        drifted[i] = curve[i] * (1.0 + 2e-4 * temperature[i]) + 0.01 * temperature[i];
+    }
+    CalibrationModel surface;
+    fit_temperature_model(in_double.data(), temperature.data(), drifted.data(), n, 3, 2, 0, surface);
+
+    ApplyKernel best = active_apply_kernel();
+    const ApplyKernel kernels[] = { APPLY_SCALAR, APPLY_AVX2, APPLY_AVX512, APPLY_NEON };
+
+    for (ApplyKernel kernel : kernels) {
+        if (!select_apply_kernel(kernel)) {
+            continue;
+        }
+        string name = apply_kernel_name(kernel);
+
+        record("apply_double", name, n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+            apply_calibration(cal, in_double.data(), out.data(), n);
+        }));
+        record("apply_float", name, n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+            apply_calibration(cal, in_float.data(), out.data(), n);
+        }));
+        record("apply_int16", name, n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+            apply_calibration(cal, in_int16.data(), out.data(), n);
+        }));
+        record("apply_int32", name, n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+            apply_calibration(cal, in_int32.data(), out.data(), n);
+        }));
+        record("apply_poly5", name, n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+            apply_model(polynomial, in_double.data(), out.data(), n);
+        }));
+        record("apply_temperature3x2", name, n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+            apply_model(surface, in_double.data(), temperature.data(), out.data(), n);
+        }));
+    }
+
+    select_apply_kernel(best);
+
+    // Coefficients known at build time (fixed_calibration.h)
+    vector<float> out_float(n);
+    record("apply_double", "fixed", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_fixed<FixedLine<BenchFixedLine> >(in_double.data(), out.data(), n);
+    }));
+    record("apply_float", "fixed", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_fixed<FixedLine<BenchFixedLine> >(in_float.data(), out.data(), n);
+    }));
+    record("apply_int16", "fixed", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_fixed<FixedLine<BenchFixedLine> >(in_int16.data(), out.data(), n);
+    }));
+    record("apply_int16_to_float", "fixed", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_fixed<FixedLine<BenchFixedLine> >(in_int16.data(), out_float.data(), n);
+    }));
+    record("apply_int32", "fixed", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_fixed<FixedLine<BenchFixedLine> >(in_int32.data(), out.data(), n);
+    }));
+    record("apply_poly5", "fixed", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_fixed<FixedPolynomial<BenchFixedPolynomial> >(in_double.data(), out.data(), n);
+    }));
+    record("apply_poly5_int16_to_float", "fixed", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_fixed<FixedPolynomial<BenchFixedPolynomial> >(in_int16.data(), out_float.data(), n);
+    }));
+
+    // Multi-threaded: a larger buffer cut into one slice per core
+    unsigned cores = thread::hardware_concurrency();
+    if (cores > 1) {
+        size_t big = 16 * n;
+        vector<double> big_in(big, 1.0), big_out(big);
+
+        double seconds = time_per_iteration(options.min_time, [&]() {
+            vector<thread> pool;
+            size_t slice = (big + cores - 1) / cores;
+            for (unsigned t = 0; t < cores; t++) {
+                size_t begin = t * slice;
+                size_t count = begin < big ? min(slice, big - begin) : 0;
+                pool.emplace_back([&, begin, count]() {
+                    apply_calibration(cal, big_in.data() + begin, big_out.data() + begin, count);
+                });
+            }
+            for (size_t t = 0; t < pool.size(); t++) {
+                pool[t].join();
+            }
+        });
+        record("apply_double", apply_kernel_name(best), big, "samples", cores, seconds);
+    }
+
+    // Multi-channel gather over the benchmark channel count
+    CalibrationRegistry registry;
+    for (uint32_t c = 0; c < options.channels; c++) {
+        Calibration channel_cal = cal;
+        channel_cal.offset += c;
+        registry.set(c, channel_cal);
+    }
+
+    vector<uint32_t> channels(n);
+    for (size_t i = 0; i < n; i++) {
+        channels[i] = static_cast<uint32_t>(i % options.channels);
+    }
+
+    CalibrationTableView view = registry.view();
+    record("apply_multi", apply_kernel_name(best), n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_calibration(view, channels.data(), in_double.data(), out.data(), n);
+    }));
+
+    // The same on the GPU, transfers included (see gpu_offload.h)
+    if (gpu_available()) {
+        record("apply_multi", "gpu", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+            gpu_apply_calibration(view, channels.data(), in_double.data(), out.data(), n);
+        }));
+    }
+
+    record("apply_piecewise", "grid", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_model(piecewise, in_double.data(), out.data(), n);
+    }));
+
+    // Exponentially spread readings crowd the quantile knots into a few grid cells
+    vector<double> skewed(n), skewed_curve(n);
+    for (size_t i = 0; i < n; i++) {
+        skewed[i] = exp(20.0 * static_cast<double>((i * 40503u) % 65536) / 65535.0);
+        skewed_curve[i] = log(skewed[i]);
+    }
+    CalibrationModel skewed_piecewise;
+    fit_piecewise(skewed.data(), skewed_curve.data(), n, 1024, skewed_piecewise);
+    record("apply_piecewise", "skewed/1024", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_model(skewed_piecewise, skewed.data(), out.data(), n);
+    }));
+
+    // 16-bit codes through a lookup table built from the polynomial
+    AdcLookupTable lookup;
+    build_adc_lookup(polynomial, 16, true, lookup);
+    record("apply_lookup", "s16", n, "samples", 1, time_per_iteration(options.min_time, [&]() {
+        apply_lookup(lookup, in_int16.data(), out.data(), n);
+    }));
+
+    // The line in Q format for targets without an FPU, over the same codes
+    vector<int32_t> out_int32(n);
+    FixedPointCalibration fixed16, fixed32;
+    make_fixed_point(cal, INT16_MIN, INT16_MAX, -1, fixed16);
+    make_fixed_point(cal, -(1 << 23), (1 << 23) - 1, -1, fixed32);
+    record("apply_fixed_point_int16", fixed_point_kernel_name(), n, "samples", 1,
+           time_per_iteration(options.min_time, [&]() {
+        apply_fixed_point(fixed16, in_int16.data(), out_int32.data(), n);
+    }));
+    record("apply_fixed_point_int32", fixed_point_kernel_name(), n, "samples", 1,
+           time_per_iteration(options.min_time, [&]() {
+        apply_fixed_point(fixed32, in_int32.data(), out_int32.data(), n);
+    }));
+}
+
+/*
+ * FILES
+ * One text file per channel against one binary table and one snapshot
+ * for all channels, then the time from opening a table or snapshot of
+ * options.channels and of 2^20 channels to the first converted value
+ */
+void bench_files(const BenchOptions& options) {
+    uint32_t count = options.channels;
+    Calibration cal;
+    cal.slope = 0.2427184466;
+    cal.offset = -104.1747572816;
+    cal.is_valid = true;
+
+    vector<string> names(count);
+    for (uint32_t c = 0; c < count; c++) {
+        names[c] = options.temp_prefix + to_string(c) + ".txt";
+    }
+
+    double save_text = time_per_iteration(options.min_time, [&]() {
+        for (uint32_t c = 0; c < count; c++) {
+            write_calibration_file(names[c], cal);
+        }
+    });
+    record("save", "text", count, "channels", 1, save_text);
+
+    volatile double sink = 0.0;
+    double load_text = time_per_iteration(options.min_time, [&]() {
+        for (uint32_t c = 0; c < count; c++) {
+            Calibration loaded;
+            read_calibration_file(names[c], loaded);
+            sink = loaded.slope;
+        }
+    });
+    record("load", "text", count, "channels", 1, load_text);
+
+    for (uint32_t c = 0; c < count; c++) {
+        remove(names[c].c_str());
+    }
+
+    CalibrationRegistry registry;
+    for (uint32_t c = 0; c < count; c++) {
+        registry.set(c, cal);
+    }
+    string table_name = options.temp_prefix + "table.caltab";
+
+    double save_table = time_per_iteration(options.min_time, [&]() {
+        write_calibration_table(table_name, registry.view());
+    });
+    record("save", "table", count, "channels", 1, save_table);
+
+    // Open plus a lookup of every channel
+    double load_table = time_per_iteration(options.min_time, [&]() {
+        MappedCalibrationTable table;
+        table.open(table_name);
+        for (uint32_t c = 0; c < count; c++) {
+            Calibration loaded;
+            table.view().lookup(c, loaded);
+            sink = loaded.slope;
+        }
+    });
+    record("load", "table", count, "channels", 1, load_table);
+
+    // The same with every record checked
+    string snapshot_name = options.temp_prefix + "snapshot.calsnap";
+    map<uint32_t, FitAccumulator> no_fits;
+    double save_snapshot = time_per_iteration(options.min_time, [&]() {
+        write_snapshot(snapshot_name, registry.view(), no_fits);
+    });
+    record("save", "snapshot", count, "channels", 1, save_snapshot);
+
+    double load_snapshot = time_per_iteration(options.min_time, [&]() {
+        MappedSnapshot snapshot;
+        snapshot.open(snapshot_name);
+        for (uint32_t c = 0; c < count; c++) {
+            Calibration loaded;
+            snapshot.lookup(c, loaded);
+            sink = loaded.slope;
+        }
+    });
+    record("load", "snapshot", count, "channels", 1, load_snapshot);
+
+    // Open, then convert one sample of the last channel: a latency, one conversion per
+    // iteration, with the table size in the variant
+    const uint32_t sizes[2] = { count, 1u << 20 };
+    for (uint32_t size : sizes) {
+        if (size != count) {
+            registry.set(size - 1, cal);
+            write_calibration_table(table_name, registry.view());
+            write_snapshot(snapshot_name, registry.view(), no_fits);
+        }
+        uint32_t channel = size - 1;
+        double raw = 1000.0, real;
+        string channels = "/" + to_string(size);
+
+        record("first_conversion", "table" + channels, 1, "conversion", 1, time_per_iteration(options.min_time, [&]() {
+            MappedCalibrationTable table;
+            table.open(table_name);
+            apply_calibration(table.view(), &channel, &raw, &real, 1);
+            sink = real;
+        }));
+        record("first_conversion", "snapshot" + channels, 1, "conversion", 1, time_per_iteration(options.min_time, [&]() {
+            MappedSnapshot snapshot;
+            snapshot.open(snapshot_name);
+            snapshot.check(&channel, 1);
+            apply_calibration(snapshot.view(), &channel, &raw, &real, 1);
+            sink = real;
+        }));
+    }
+
+    remove(table_name.c_str());
+    remove(snapshot_name.c_str());
+    (void)sink;
+}
+
+/*
+ * PARSE
+ * from_chars parsing of a reading per line and to_chars formatting,
+ * both measured in bytes of text
+ */
+void bench_parse(const BenchOptions& options) {
+    const size_t lines = 1 << 20;
+    mt19937_64 rng(7);
+    uniform_real_distribution<double> value(0.0, 65535.0);
+
+    string text;
+    vector<size_t> starts(lines + 1);
+    char number[64];
+    for (size_t i = 0; i < lines; i++) {
+        starts[i] = text.size();
+        snprintf(number, sizeof(number), "%.4f", value(rng));
+        text += number;
+    }
+    starts[lines] = text.size();
+
+    volatile double sink = 0.0;
+    double parse = time_per_iteration(options.min_time, [&]() {
+        double sum = 0.0;
+        for (size_t i = 0; i < lines; i++) {
+            double raw;
+            parse_reading(text.data() + starts[i], text.data() + starts[i + 1], raw);
+            sum += raw;
+        }
+        sink = sum;
+    });
+    record("parse", "from_chars", text.size(), "bytes", 1, parse);
+    (void)sink;
+
+    FILE* scratch = tmpfile();
+    if (scratch == NULL) {
+        return;
+    }
+
+    vector<double> values(lines);
+    for (size_t i = 0; i < lines; i++) {
+        values[i] = value(rng);
+    }
+
+    size_t written = 0;
+    double format = time_per_iteration(options.min_time, [&]() {
+        rewind(scratch);
+        BufferedWriter writer(scratch);
+        for (size_t i = 0; i < lines; i++) {
+            writer.write_fixed(values[i], 10);
+            writer.put('\n');
+        }
+        writer.flush();
+        written = static_cast<size_t>(ftell(scratch));
+    });
+    record("format", "to_chars", written, "bytes", 1, format);
+
+    fclose(scratch);
+}
+
+/*
+ * SCALING
+ * ParallelConverter on "channel,raw" text in memory, from one thread up
+ * to one per core, against the benchmark channel count. Items are lines,
+ * so the rates compare with the serial convert loop's.
+ */
+void bench_scaling(const BenchOptions& options) {
+    const size_t lines = 1 << 20;
+    mt19937_64 rng(11);
+    uniform_real_distribution<double> value(0.0, 65535.0);
+
+    CalibrationRegistry registry;
+    for (uint32_t c = 0; c < options.channels; c++) {
+        Calibration cal;
+        cal.slope = 0.25 + 1e-6 * c;
+        cal.offset = -100.0 + c;
+        cal.is_valid = true;
+        registry.set(c, cal);
+    }
+
+    string text;
+    char line[64];
+    for (size_t i = 0; i < lines; i++) {
+        snprintf(line, sizeof(line), "%u,%.4f\n", static_cast<unsigned>(rng() % options.channels),
+                 value(rng));
+        text += line;
+    }
+
+    unsigned cores = thread::hardware_concurrency();
+    if (cores == 0) {
+        cores = 1;
+    }
+    vector<unsigned> counts;
+    for (unsigned threads = 1; threads < cores; threads *= 2) {
+        counts.push_back(threads);
+    }
+    counts.push_back(cores);
+
+    string output;
+    output.reserve(2 * text.size());
+    double single = 0.0;
+
+    for (size_t c = 0; c < counts.size(); c++) {
+        // The pool starts once per count, outside the timing
+        ParallelConverter converter(registry.view(), counts[c]);
+
+        double seconds = time_per_iteration(options.min_time, [&]() {
+            output.clear();
+            ChunkedLineReader reader(text.data(), text.size(), 1 << 20);
+            BufferedWriter writer(&output, 1 << 20);
+            char* next;
+            size_t length;
+            while (reader.next_line(next, length)) {
+                converter.add_line(next, length, writer);
+            }
+            converter.finish(writer);
+            writer.flush();
+        });
+        record("convert_multi", "numa", lines, "lines", counts[c], seconds);
+
+        if (c == 0) {
+            single = seconds;
+        }
+        fprintf(stderr, "%-16s %-16s %3u thr on %zu node(s): %5.2fx one thread, %3.0f%% of linear\n",
+                "scaling", "numa", counts[c], converter.node_count(), single / seconds,
+                100.0 * single / seconds / counts[c]);
+    }
+}
+
+/*
+ * STEADY-STATE ALLOCATIONS
+ * Runs the batch convert loop (convert_stream(), text in, text out) on
+ * each I/O backend and then on every other apply path, and the batch fit
+ * loop (fit_stream()) on one thread and on a pool, over files big enough
+ * for several read chunks. Allocations are counted from the end of the
+ * first block, once the buffers exist, to the end of the input; every
+ * count should be 0. The GPU path is left out: its blocks are a million
+ * samples, and what OpenCL allocates is the driver's.
+ */
+
+// What the convert runs apply
+struct ConvertModels {
+    CalibrationModel linear;
+    CalibrationModel polynomial;
+    CalibrationModel surface;
+    AdcLookupTable lookup;
+    FixedPointCalibration fixed_point;
+    CalibrationRegistry registry;
+    CalibrationTableView table;
+    MappedSnapshot snapshot;
+};
+
+// One convert_stream() run; returns false if the files could not be used or the run failed
+bool convert_allocations(const string& in_filename, const string& out_filename, IoBackend io,
+                         const ConvertSetup& setup, const string& variant, AllocationResult& result) {
+    FILE* in = fopen(in_filename.c_str(), "r");
+    if (in == NULL) {
+        return false;
+    }
+    FILE* out = fopen(out_filename.c_str(), "w");
+    if (out == NULL) {
+        fclose(in);
+        return false;
+    }
+
+    unique_ptr<AsyncReader> async_in;
+    unique_ptr<AsyncWriter> async_out;
+    if (io != IO_SYNC) {
+        async_in.reset(new AsyncReader(fileno(in), io));
+        async_out.reset(new AsyncWriter(fileno(out), io));
+    }
+    ChunkedLineReader reader = async_in ? ChunkedLineReader(async_in.get()) : ChunkedLineReader(in);
+    BufferedWriter writer = async_out ? BufferedWriter(async_out.get()) : BufferedWriter(out);
+
+    size_t blocks = 0;
+    unsigned long long warm = 0;
+    ConvertSetup counted = setup;
+    counted.block_done = [&]() {
+        if (blocks++ == 0) {
+            warm = heap_allocations.load();
+        }
+    };
+
+    StreamResult stream;
+    convert_stream(reader, writer, counted, stream);
+    unsigned long long allocations = heap_allocations.load() - warm;
+    bool ok = stream.status == STREAM_OK && blocks > 1 && !(async_out && !async_out->finish());
+
+    result.path = "convert";
+    result.variant = variant.empty() ? io_backend_name(async_in ? async_in->backend() : IO_SYNC) : variant;
+    result.blocks = blocks - 1;
+    result.allocations = allocations;
+
+    fclose(in);
+    fclose(out);
+    return ok;
+}
+
+// One fit_stream() run, with smaller chunks so the file stays small
+bool fit_allocations(const string& in_filename, unsigned threads, AllocationResult& result) {
+    FILE* in = fopen(in_filename.c_str(), "r");
+    if (in == NULL) {
+        return false;
+    }
+
+    ChunkedLineReader reader(in);
+    FitPool pool(threads);
+    FitAccumulator fit;
+    vector<double> no_raw, no_reference;
+    size_t chunks = 0;
+    unsigned long long warm = 0;
+
+    StreamResult stream;
+    fit_stream(reader, pool, false, fit, no_raw, no_reference, stream, 2 * FIT_BLOCK_SIZE, [&]() {
+        if (chunks++ == 0) {
+            warm = heap_allocations.load();
+        }
+    });
+
+    result.path = "fit";
+    result.variant = to_string(pool.threads()) + (pool.threads() == 1 ? " thread" : " threads");
+    result.blocks = chunks - 1;
+    result.allocations = heap_allocations.load() - warm;
+
+    bool ok = stream.status == STREAM_OK && fit.count > 0;
+    fclose(in);
+    return ok;
+}
+
+bool bench_allocations(const BenchOptions& options) {
+    const size_t lines = 1 << 20;
+    const uint32_t CHANNELS = 64;
+    string codes_name = options.temp_prefix + "convert_in.txt";
+    string temperature_name = options.temp_prefix + "convert_temperature.txt";
+    string samples_name = options.temp_prefix + "convert_samples.txt";
+    string out_name = options.temp_prefix + "convert_out.txt";
+    string fit_name = options.temp_prefix + "fit_in.txt";
+    string snapshot_name = options.temp_prefix + "alloc.calsnap";
+
+    // 12-bit ADC codes, alone, with a slow temperature sweep and round robin
+    // over the channels, and points on a line through them
+    FILE* files[4] = { fopen(codes_name.c_str(), "w"), fopen(temperature_name.c_str(), "w"),
+                       fopen(samples_name.c_str(), "w"), fopen(fit_name.c_str(), "w") };
+    bool created = files[0] != NULL && files[1] != NULL && files[2] != NULL && files[3] != NULL;
+    for (size_t i = 0; created && i < lines; i++) {
+        unsigned code = static_cast<unsigned>((i * 2654435761u) >> 20) & 4095;
+        fprintf(files[0], "%u\n", code);
+        fprintf(files[1], "%u,%.3f\n", code, -40.0 + 125.0 * static_cast<double>(i % 4096) / 4096);
+        fprintf(files[2], "%u,%u\n", static_cast<unsigned>(i % CHANNELS), code);
+        if (i < lines / 2) {
+            fprintf(files[3], "%.4f,%u\n", 0.25 * code - 100.0, code);
+        }
+    }
+    for (size_t f = 0; f < 4; f++) {
+        if (files[f] != NULL) {
+            fclose(files[f]);
+        }
+    }
+    if (!created) {
+        cerr << "Error: Cannot create the allocation test files.\n";
+        return false;
+    }
+
+    Calibration cal;
+    cal.slope = 0.2427184466;
+    cal.offset = -104.1747572816;
+    cal.is_valid = true;
+
+    ConvertModels models;
+    models.linear = linear_model(cal);
+    vector<double> codes(4096), curve(4096), temperature(4096), drifted(4096);
+    for (size_t i = 0; i < codes.size(); i++) {
+        codes[i] = static_cast<double>(i);
+        curve[i] = cal.slope * codes[i] + 1e-6 * codes[i] * codes[i];
+        temperature[i] = -40.0 + 125.0 * static_cast<double>((i * 40503u) % 4096) / 4095.0;
+        drifted[i] = curve[i] * (1.0 + 2e-4 * temperature[i]) + 0.01 * temperature[i];
+    }
+    fit_polynomial(codes.data(), curve.data(), codes.size(), 3, models.polynomial);
+    fit_temperature_model(codes.data(), temperature.data(), drifted.data(), codes.size(), 3, 2, 1,
+                          models.surface);
+    build_adc_lookup(models.polynomial, 12, false, models.lookup);
+    make_fixed_point(cal, 0, 4095, -1, models.fixed_point);
+    for (uint32_t c = 0; c < CHANNELS; c++) {
+        Calibration channel_cal = cal;
+        channel_cal.offset += c;
+        models.registry.set(c, channel_cal);
+    }
+    models.table = models.registry.view();
+    bool ok = write_snapshot(snapshot_name, models.table, map<uint32_t, FitAccumulator>())
+        && models.snapshot.open(snapshot_name) == SNAPSHOT_OK;
+    if (!ok) {
+        cerr << "Error: Cannot create the allocation test snapshot.\n";
+    }
+    CalibrationTableView snapshot_table = models.snapshot.view();
+
+    // A linear calibration on each backend, then the other apply paths
+    ConvertSetup linear;
+    linear.model = &models.linear;
+    const IoBackend backends[] = { IO_SYNC, IO_THREAD, IO_URING };
+    for (IoBackend io : backends) {
+        AllocationResult result;
+        if (!convert_allocations(codes_name, out_name, io, linear, "", result)) {
+            cerr << "Error: The " << io_backend_name(io) << " convert run failed.\n";
+            ok = false;
+            continue;
+        }
+        // io_uring falls back to a thread when the kernel does not offer it
+        if (io == IO_URING && result.variant != io_backend_name(IO_URING)) {
+            continue;
+        }
+        allocation_results.push_back(result);
+    }
+
+    struct PathRun {
+        const char* variant;
+        const string* in_name;
+        ConvertSetup setup;
+    };
+    vector<PathRun> runs(7);
+    runs[0].variant = "polynomial";
+    runs[0].in_name = &codes_name;
+    runs[0].setup.model = &models.polynomial;
+    runs[1].variant = "temperature";
+    runs[1].in_name = &temperature_name;
+    runs[1].setup.model = &models.surface;
+    runs[2].variant = "lookup";
+    runs[2].in_name = &codes_name;
+    runs[2].setup.model = &models.polynomial;
+    runs[2].setup.lookup = &models.lookup;
+    runs[3].variant = "fixed_point";
+    runs[3].in_name = &codes_name;
+    runs[3].setup.fixed_point = &models.fixed_point;
+    runs[4].variant = "table";
+    runs[4].in_name = &samples_name;
+    runs[4].setup.channel_table = &models.table;
+    runs[5].variant = "snapshot";
+    runs[5].in_name = &samples_name;
+    runs[5].setup.channel_table = &snapshot_table;
+    runs[5].setup.snapshot = &models.snapshot;
+    runs[6].variant = "pool";
+    runs[6].in_name = &samples_name;
+    runs[6].setup.channel_table = &models.table;
+    runs[6].setup.threads = 2;
+
+    for (size_t r = 0; r < runs.size(); r++) {
+        if (runs[r].setup.snapshot != NULL && !models.snapshot.is_open()) {
+            continue;
+        }
+        AllocationResult result;
+        if (!convert_allocations(*runs[r].in_name, out_name, IO_SYNC, runs[r].setup, runs[r].variant, result)) {
+            cerr << "Error: The " << runs[r].variant << " convert run failed.\n";
+            ok = false;
+            continue;
+        }
+        allocation_results.push_back(result);
+    }
+
+    // The default fit uses every core; 4 threads cover the pool on any machine
+    const unsigned fit_threads[] = { 1, 4 };
+    for (unsigned threads : fit_threads) {
+        AllocationResult fit_result;
+        if (fit_allocations(fit_name, threads, fit_result)) {
+            allocation_results.push_back(fit_result);
+        } else {
+            cerr << "Error: The fit run on " << threads << " threads failed.\n";
+            ok = false;
+        }
+    }
+
+    for (size_t i = 0; i < allocation_results.size(); i++) {
+        const AllocationResult& r = allocation_results[i];
+        fprintf(stderr, "%-16s %-16s %12zu %-10s %llu heap allocations after warm-up\n",
+                ("alloc_" + r.path).c_str(), r.variant.c_str(), r.blocks, "blocks", r.allocations);
+        ok = ok && r.allocations == 0;
+    }
+
+    models.snapshot.close();
+    remove(codes_name.c_str());
+    remove(temperature_name.c_str());
+    remove(samples_name.c_str());
+    remove(out_name.c_str());
+    remove(fit_name.c_str());
+    remove(snapshot_name.c_str());
+    return ok;
+}
+
+/*
+ * Write all results as one JSON document
+ * Names and units are plain identifiers, so no string escaping is needed
+ */
+void write_json(FILE* out) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"benchmark\": \"sensor_calibration\",\n");
+    fprintf(out, "  \"apply_kernel\": \"%s\",\n", apply_kernel_name(active_apply_kernel()));
+    fprintf(out, "  \"hardware_threads\": %u,\n", thread::hardware_concurrency());
+    fprintf(out, "  \"numa_nodes\": %zu,\n", numa_nodes().size());
+    fprintf(out, "  \"results\": [\n");
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"variant\": \"%s\", \"items\": %zu, \"unit\": \"%s\", "
+                     "\"threads\": %u, \"seconds\": %.9g, \"items_per_second\": %.9g}%s\n",
+                r.name.c_str(), r.variant.c_str(), r.items, r.unit.c_str(), r.threads,
+                r.seconds, r.items / r.seconds, i + 1 < results.size() ? "," : "");
+    }
+
+    fprintf(out, "  ],\n");
+    fprintf(out, "  \"allocations\": [\n");
+
+    for (size_t i = 0; i < allocation_results.size(); i++) {
+        const AllocationResult& r = allocation_results[i];
+        fprintf(out, "    {\"path\": \"%s\", \"variant\": \"%s\", \"blocks\": %zu, "
+                     "\"allocations\": %llu}%s\n",
+                r.path.c_str(), r.variant.c_str(), r.blocks, r.allocations,
+                i + 1 < allocation_results.size() ? "," : "");
+    }
+
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
@@ -0,0 +1,17 @@
+/*
+ * Calibration coefficients shared by the menu, batch mode and kernels
+ */
+
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+// Structure to hold calibration coefficients
+struct Calibration {
+    double slope;
+    double offset;
+    bool is_valid;  // Track whether calibration has been set
+
+    Calibration() : slope(0.0), offset(0.0), is_valid(false) {}
+};
+
+#endif
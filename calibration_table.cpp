@@ -0,0 +1,265 @@
+/*
+ * Binary calibration table files: writing, mapping and validation
+ */
+
+#include "calibration_table.h"
+
+#include <atomic>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "stats.h"
+
+using namespace std;
+
+namespace {
+
+const uint64_t TABLE_ALIGNMENT = 64;
+
+uint64_t align_up(uint64_t value) {
+    return (value + TABLE_ALIGNMENT - 1) / TABLE_ALIGNMENT * TABLE_ALIGNMENT;
+}
+
+size_t valid_words(uint32_t channel_count) {
+    return (static_cast<size_t>(channel_count) + 63) / 64;
+}
+
+// Lay out the arrays that follow the header
+void fill_layout(CalibrationTableHeader& header, uint32_t first_channel, uint32_t channel_count) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, CALIBRATION_TABLE_MAGIC, sizeof(header.magic));
+    header.version = CALIBRATION_TABLE_VERSION;
+    header.header_size = sizeof(CalibrationTableHeader);
+    header.first_channel = first_channel;
+    header.channel_count = channel_count;
+    header.slopes_offset = align_up(sizeof(CalibrationTableHeader));
+    header.offsets_offset = align_up(header.slopes_offset + channel_count * sizeof(double));
+    header.valid_offset = align_up(header.offsets_offset + channel_count * sizeof(double));
+    header.file_size = header.valid_offset + valid_words(channel_count) * sizeof(uint64_t);
+}
+
+/*
+ * Check a mapped file and point the view at its arrays
+ * Every array must lie inside the file at the position the writer puts it
+ */
+TableStatus parse_table(const unsigned char* data, size_t size, CalibrationTableView& table) {
+    CalibrationTableHeader header;
+
+    if (size < sizeof(header)) {
+        return TABLE_BAD_FORMAT;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, CALIBRATION_TABLE_MAGIC, sizeof(header.magic)) != 0) {
+        return TABLE_BAD_FORMAT;
+    }
+    if (header.version != CALIBRATION_TABLE_VERSION) {
+        return TABLE_BAD_VERSION;
+    }
+    if (header.channel_count > CALIBRATION_TABLE_MAX_CHANNELS) {
+        return TABLE_BAD_FORMAT;
+    }
+
+    CalibrationTableHeader expected;
+    fill_layout(expected, header.first_channel, header.channel_count);
+
+    if (header.header_size != expected.header_size
+        || header.slopes_offset != expected.slopes_offset
+        || header.offsets_offset != expected.offsets_offset
+        || header.valid_offset != expected.valid_offset
+        || header.file_size != expected.file_size) {
+        return TABLE_BAD_FORMAT;
+    }
+    if (size < header.file_size) {
+        return TABLE_TRUNCATED;
+    }
+
+    table.first_channel = header.first_channel;
+    table.channel_count = header.channel_count;
+    table.slopes = reinterpret_cast<const double*>(data + header.slopes_offset);
+    table.offsets = reinterpret_cast<const double*>(data + header.offsets_offset);
+    table.valid = reinterpret_cast<const uint64_t*>(data + header.valid_offset);
+
+    return TABLE_OK;
+}
+
+}  // namespace
+
+string table_status_message(TableStatus status, const string& filename) {
+    switch (status) {
+        case TABLE_OK:
+            return "Calibration table loaded from '" + filename + "'";
+        case TABLE_CANNOT_OPEN:
+            return "Cannot open file '" + filename + "'";
+        case TABLE_BAD_FORMAT:
+            return "'" + filename + "' is not a calibration table.";
+        case TABLE_BAD_VERSION:
+            return "'" + filename + "' uses an unsupported table version.";
+        case TABLE_TRUNCATED:
+            return "'" + filename + "' is truncated.";
+    }
+    return "Unknown error.";
+}
+
+uint64_t next_table_generation() {
+    static atomic<uint64_t> last(0);
+    return last.fetch_add(1, memory_order_relaxed) + 1;
+}
+
+MappedCalibrationTable::MappedCalibrationTable() {}
+
+MappedCalibrationTable::~MappedCalibrationTable() {
+    close();
+}
+
+/*
+ * Map filename read-only and validate its header
+ * The page cache backs the arrays directly; nothing is copied or parsed
+ */
+TableStatus MappedCalibrationTable::open(const string& filename) {
+    StageTimer timer(STAT_LOAD, 1);
+    close();
+
+    MapStatus mapped = file.open(filename);
+    if (mapped != MAP_OK) {
+        return mapped == MAP_EMPTY ? TABLE_BAD_FORMAT : TABLE_CANNOT_OPEN;
+    }
+
+    TableStatus status = parse_table(file.bytes(), file.size(), table);
+    if (status != TABLE_OK) {
+        close();
+    } else {
+        table.generation = next_table_generation();
+    }
+    return status;
+}
+
+void MappedCalibrationTable::close() {
+    file.close();
+    table = CalibrationTableView();
+}
+
+bool write_calibration_table(const string& filename, const CalibrationTableView& table) {
+    StageTimer timer(STAT_SAVE, 1);
+
+    if (table.channel_count > CALIBRATION_TABLE_MAX_CHANNELS) {
+        return false;
+    }
+
+    CalibrationTableHeader header;
+    fill_layout(header, table.first_channel, table.channel_count);
+
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    const char padding[TABLE_ALIGNMENT] = {};
+    size_t slope_bytes = table.channel_count * sizeof(double);
+    size_t valid_bytes = valid_words(table.channel_count) * sizeof(uint64_t);
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(padding, header.slopes_offset - sizeof(header));
+    file.write(reinterpret_cast<const char*>(table.slopes), slope_bytes);
+    file.write(padding, header.offsets_offset - (header.slopes_offset + slope_bytes));
+    file.write(reinterpret_cast<const char*>(table.offsets), slope_bytes);
+    file.write(padding, header.valid_offset - (header.offsets_offset + slope_bytes));
+    file.write(reinterpret_cast<const char*>(table.valid), valid_bytes);
+
+    file.close();
+    return !file.fail();
+}
+
+CalibrationRegistry::CalibrationRegistry()
+    : first_channel(0), valid_count(0), generation(next_table_generation()) {}
+
+bool CalibrationRegistry::set(uint32_t channel, const Calibration& cal) {
+    generation = next_table_generation();
+    uint32_t count = static_cast<uint32_t>(slopes.size());
+
+    if (count == 0) {
+        first_channel = channel;
+    }
+
+    uint32_t new_first = channel < first_channel ? channel : first_channel;
+    uint32_t last = count == 0 ? channel : first_channel + (count - 1);
+    uint32_t new_last = channel > last ? channel : last;
+
+    if (new_last - new_first >= CALIBRATION_TABLE_MAX_CHANNELS) {
+        return false;
+    }
+
+    uint32_t new_count = new_last - new_first + 1;
+
+    if (new_first != first_channel || new_count != count) {
+        // Re-lay the arrays over the wider ID range
+        uint32_t shift = first_channel - new_first;
+        vector<double> new_slopes(new_count, 0.0);
+        vector<double> new_offsets(new_count, 0.0);
+        vector<uint64_t> new_valid(valid_words(new_count), 0);
+
+        for (uint32_t i = 0; i < count; i++) {
+            if ((valid[i >> 6] >> (i & 63)) & 1) {
+                uint32_t j = i + shift;
+                new_slopes[j] = slopes[i];
+                new_offsets[j] = offsets[i];
+                new_valid[j >> 6] |= uint64_t(1) << (j & 63);
+            }
+        }
+
+        first_channel = new_first;
+        slopes.swap(new_slopes);
+        offsets.swap(new_offsets);
+        valid.swap(new_valid);
+    }
+
+    uint32_t index = channel - first_channel;
+    uint64_t bit = uint64_t(1) << (index & 63);
+
+    if (!(valid[index >> 6] & bit)) {
+        valid[index >> 6] |= bit;
+        valid_count++;
+    }
+    slopes[index] = cal.slope;
+    offsets[index] = cal.offset;
+    return true;
+}
+
+void CalibrationRegistry::remove(uint32_t channel) {
+    uint32_t index = channel - first_channel;
+    if (index >= slopes.size()) {
+        return;
+    }
+
+    uint64_t bit = uint64_t(1) << (index & 63);
+    if (valid[index >> 6] & bit) {
+        valid[index >> 6] &= ~bit;
+        valid_count--;
+        generation = next_table_generation();
+    }
+}
+
+void CalibrationRegistry::assign(const CalibrationTableView& table) {
+    generation = next_table_generation();
+    first_channel = table.first_channel;
+    slopes.assign(table.slopes, table.slopes + table.channel_count);
+    offsets.assign(table.offsets, table.offsets + table.channel_count);
+    valid.assign(table.valid, table.valid + valid_words(table.channel_count));
+
+    valid_count = 0;
+    for (uint32_t i = 0; i < table.channel_count; i++) {
+        valid_count += (valid[i >> 6] >> (i & 63)) & 1;
+    }
+}
+
+CalibrationTableView CalibrationRegistry::view() const {
+    CalibrationTableView table;
+    table.first_channel = first_channel;
+    table.channel_count = static_cast<uint32_t>(slopes.size());
+    table.slopes = slopes.data();
+    table.offsets = offsets.data();
+    table.valid = valid.data();
+    table.generation = generation;
+    return table;
+}
@@ -0,0 +1,162 @@
+/*
+ * Binary calibration tables for many channels
+ *
+ * A table holds slope/offset pairs for a contiguous range of channel IDs
+ * as plain arrays, so a memory-mapped file can be used in place: opening
+ * a table costs one mmap and a header check, and looking up a channel is
+ * one index computation.
+ *
+ * FILE LAYOUT (little-endian, arrays 64-byte aligned):
+ *   CalibrationTableHeader
+ *   double   slopes[channel_count]
+ *   double   offsets[channel_count]
+ *   uint64_t valid[(channel_count + 63) / 64]   one bit per channel
+ * Entry i belongs to channel first_channel + i.
+ */
+
+#ifndef CALIBRATION_TABLE_H
+#define CALIBRATION_TABLE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "calibration.h"
+#include "mapped_file.h"
+
+const char CALIBRATION_TABLE_MAGIC[8] = { 'S', 'C', 'A', 'L', 'T', 'B', 'L', '\0' };
+const uint32_t CALIBRATION_TABLE_VERSION = 1;
+
+// Upper bound on the channel ID range of one table (keeps sparse IDs from exploding the file)
+const uint32_t CALIBRATION_TABLE_MAX_CHANNELS = 1u << 24;
+
+struct CalibrationTableHeader {
+    char magic[8];             // CALIBRATION_TABLE_MAGIC
+    uint32_t version;          // CALIBRATION_TABLE_VERSION
+    uint32_t header_size;      // sizeof(CalibrationTableHeader)
+    uint32_t first_channel;    // Channel ID of entry 0
+    uint32_t channel_count;    // Number of entries
+    uint64_t slopes_offset;    // Byte offsets of the arrays from the start of the file
+    uint64_t offsets_offset;
+    uint64_t valid_offset;
+    uint64_t file_size;        // Total size written
+    uint32_t reserved[2];
+};
+
+/*
+ * Read-only view of a channel table: the arrays of a mapped file or of an
+ * in-memory registry. The view does not own the arrays.
+ * generation tells copies of the contents apart (the GPU keeps one): the
+ * owner of the arrays takes a new one from next_table_generation()
+ * whenever it changes them, even in place. 0 means untracked, so such a
+ * view is never taken to be unchanged.
+ */
+struct CalibrationTableView {
+    uint32_t first_channel;
+    uint32_t channel_count;
+    const double* slopes;
+    const double* offsets;
+    const uint64_t* valid;
+    uint64_t generation;
+
+    CalibrationTableView()
+        : first_channel(0), channel_count(0), slopes(NULL), offsets(NULL), valid(NULL), generation(0) {}
+
+    // True if the table holds a calibration for channel
+    bool has_channel(uint32_t channel) const {
+        uint32_t index = channel - first_channel;  // Wraps past channel_count below first_channel
+        return index < channel_count && ((valid[index >> 6] >> (index & 63)) & 1);
+    }
+
+    // O(1) lookup; returns false if the channel has no calibration
+    bool lookup(uint32_t channel, Calibration& cal) const {
+        if (!has_channel(channel)) {
+            return false;
+        }
+        uint32_t index = channel - first_channel;
+        cal.slope = slopes[index];
+        cal.offset = offsets[index];
+        cal.is_valid = true;
+        return true;
+    }
+};
+
+// A generation no view has had yet; never 0
+uint64_t next_table_generation();
+
+// Result of opening a calibration table
+enum TableStatus {
+    TABLE_OK,
+    TABLE_CANNOT_OPEN,
+    TABLE_BAD_FORMAT,
+    TABLE_BAD_VERSION,
+    TABLE_TRUNCATED
+};
+
+std::string table_status_message(TableStatus status, const std::string& filename);
+
+/*
+ * A calibration table file mapped read-only into memory
+ * The mapping lives until close() or destruction; views taken from it
+ * must not outlive it.
+ */
+class MappedCalibrationTable {
+public:
+    MappedCalibrationTable();
+    ~MappedCalibrationTable();
+
+    TableStatus open(const std::string& filename);
+    void close();
+
+    bool is_open() const { return file.is_open(); }
+    const CalibrationTableView& view() const { return table; }
+
+private:
+    MappedCalibrationTable(const MappedCalibrationTable&);             // Not copyable
+    MappedCalibrationTable& operator=(const MappedCalibrationTable&);
+
+    MappedFile file;
+    CalibrationTableView table;
+};
+
+/*
+ * In-memory registry of calibrations indexed by channel ID
+ *
+ * Same structure-of-arrays layout as a table file: contiguous slopes[],
+ * offsets[] and a valid bitset over the channel ID range in use, so a
+ * batch of interleaved samples can gather coefficients by index.
+ * Views taken with view() are invalidated by set(), remove() and assign().
+ */
+class CalibrationRegistry {
+public:
+    CalibrationRegistry();
+
+    // Store cal for channel, growing the ID range as needed.
+    // Returns false if the range would exceed CALIBRATION_TABLE_MAX_CHANNELS.
+    bool set(uint32_t channel, const Calibration& cal);
+
+    void remove(uint32_t channel);
+    bool get(uint32_t channel, Calibration& cal) const { return view().lookup(channel, cal); }
+
+    // Replace the registry contents with a copy of table
+    void assign(const CalibrationTableView& table);
+
+    // Number of channels holding a calibration
+    size_t size() const { return valid_count; }
+
+    CalibrationTableView view() const;
+
+private:
+    uint32_t first_channel;
+    std::vector<double> slopes;
+    std::vector<double> offsets;
+    std::vector<uint64_t> valid;
+    size_t valid_count;
+    uint64_t generation;    // Moves on with every set(), remove() and assign()
+};
+
+// Write a table to filename. Returns false if the file cannot be written.
+bool write_calibration_table(const std::string& filename, const CalibrationTableView& table);
+
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Grouping long-format rows by channel and fitting every channel
+ */
+
+#include "channel_fit.h"
+
+#include <algorithm>
+
+#include "calibration_table.h"
+#include "fit.h"
+#include "work_stealing.h"
+
+using namespace std;
+
+namespace {
+
+// The rows of every channel present, stored contiguously channel by channel
+struct ChannelGroups {
+    vector<uint32_t> channel;       // Ascending IDs of the channels present
+    vector<size_t> first_row;       // Per channel, plus the row count at the end
+    vector<double> raw;
+    vector<double> reference;
+};
+
+bool group_by_channel(const uint32_t* channel, const double* raw, const double* reference, size_t n,
+                      ChannelGroups& groups) {
+    uint32_t min_channel = channel[0];
+    uint32_t max_channel = channel[0];
+    for (size_t i = 1; i < n; i++) {
+        min_channel = min(min_channel, channel[i]);
+        max_channel = max(max_channel, channel[i]);
+    }
+    if (max_channel - min_channel >= CALIBRATION_TABLE_MAX_CHANNELS) {
+        return false;
+    }
+
+    // Counting sort by channel: count the rows per ID, then turn the
+    // counts into each channel's first row in the grouped arrays
+    size_t span = static_cast<size_t>(max_channel - min_channel) + 1;
+    vector<size_t> start(span + 1, 0);
+    for (size_t i = 0; i < n; i++) {
+        start[channel[i] - min_channel + 1]++;
+    }
+    for (size_t c = 0; c < span; c++) {
+        start[c + 1] += start[c];
+    }
+
+    // Rows keep their input order within a channel (the sort is stable)
+    groups.raw.resize(n);
+    groups.reference.resize(n);
+    vector<size_t> next(start.begin(), start.end() - 1);
+    for (size_t i = 0; i < n; i++) {
+        size_t slot = next[channel[i] - min_channel]++;
+        groups.raw[slot] = raw[i];
+        groups.reference[slot] = reference[i];
+    }
+
+    groups.channel.clear();
+    groups.first_row.clear();
+    for (size_t c = 0; c < span; c++) {
+        if (start[c + 1] != start[c]) {
+            groups.channel.push_back(min_channel + static_cast<uint32_t>(c));
+            groups.first_row.push_back(start[c]);
+        }
+    }
+    groups.first_row.push_back(n);
+    return true;
+}
+
+}  // namespace
+
+bool fit_channels(const uint32_t* channel, const double* raw, const double* reference, size_t n,
+                  FitMethod method, const RobustFitOptions& options, vector<ChannelFit>& fits,
+                  ComputeDevice device) {
+    fits.clear();
+    if (n == 0) {
+        return true;
+    }
+
+    ChannelGroups groups;
+    if (!group_by_channel(channel, raw, reference, n, groups)) {
+        return false;
+    }
+
+    size_t present = groups.channel.size();
+    fits.resize(present);
+    for (size_t t = 0; t < present; t++) {
+        fits[t].channel = groups.channel[t];
+        fits[t].points = groups.first_row[t + 1] - groups.first_row[t];
+    }
+
+    // Every channel's moments in one pass over the grouped points
+    if (method == FIT_LEAST_SQUARES && resolve_compute_device(device) == DEVICE_GPU) {
+        vector<FitAccumulator> moments(present);
+        if (gpu_fit_moments(groups.raw.data(), groups.reference.data(), groups.first_row.data(),
+                            present, moments.data())) {
+            for (size_t t = 0; t < present; t++) {
+                fits[t].fitted = compute_calibration(moments[t], fits[t].cal);
+            }
+            return true;
+        }
+    }
+
+    RobustFitOptions channel_options = options;
+    channel_options.threads = 1;
+
+    parallel_for_stealing(present, options.threads, [&](size_t t) {
+        ChannelFit& fit = fits[t];
+        const double* channel_raw = groups.raw.data() + groups.first_row[t];
+        const double* channel_reference = groups.reference.data() + groups.first_row[t];
+
+        fit.fitted = fit_line(method, channel_raw, channel_reference, fit.points,
+                              channel_options, fit.cal);
+    });
+
+    return true;
+}
+
+bool channel_moments(const uint32_t* channel, const double* raw, const double* reference, size_t n,
+                     unsigned threads, ComputeDevice device, vector<ChannelMoments>& moments) {
+    moments.clear();
+    if (n == 0) {
+        return true;
+    }
+
+    ChannelGroups groups;
+    if (!group_by_channel(channel, raw, reference, n, groups)) {
+        return false;
+    }
+
+    size_t present = groups.channel.size();
+    vector<FitAccumulator> fits(present);
+    if (resolve_compute_device(device) != DEVICE_GPU
+        || !gpu_fit_moments(groups.raw.data(), groups.reference.data(), groups.first_row.data(),
+                            present, fits.data())) {
+        // Summed exactly as fit_line() sums a least squares fit
+        parallel_for_stealing(present, threads, [&](size_t t) {
+            size_t first = groups.first_row[t];
+            fits[t] = fit_parallel(groups.raw.data() + first, groups.reference.data() + first,
+                                   groups.first_row[t + 1] - first, 1);
+        });
+    }
+
+    moments.resize(present);
+    for (size_t t = 0; t < present; t++) {
+        moments[t].channel = groups.channel[t];
+        moments[t].fit = fits[t];
+    }
+    return true;
+}
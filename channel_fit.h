@@ -0,0 +1,72 @@
+/*
+ * Fitting many channels at once
+ *
+ * A production run calibrates thousands of sensors from one long-format
+ * file of "channel,reference,raw" rows. The rows are grouped by channel
+ * with a counting sort over the channel IDs, then every channel is fitted
+ * on its own. Channels hold anything from a handful of points to
+ * millions, so they are spread over the threads by work stealing
+ * (work_stealing.h) rather than in fixed shares.
+ *
+ * Each channel is fitted on a single thread, exactly as fit would fit it
+ * alone, so the results do not depend on the thread count. Least squares
+ * fits can instead take their moments from the GPU (gpu_offload.h).
+ */
+
+#ifndef CHANNEL_FIT_H
+#define CHANNEL_FIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "calibration.h"
+#include "fit.h"
+#include "gpu_offload.h"
+#include "robust.h"
+
+// The fit of one channel
+struct ChannelFit {
+    uint32_t channel;
+    size_t points;
+    Calibration cal;
+    bool fitted;    // False with fewer than 2 distinct raw readings
+
+    ChannelFit() : channel(0), points(0), fitted(false) {}
+};
+
+// The least squares moments of one channel's points
+struct ChannelMoments {
+    uint32_t channel;
+    FitAccumulator fit;
+
+    ChannelMoments() : channel(0) {}
+};
+
+/*
+ * Fit every channel present in the n rows (channel[i], raw[i],
+ * reference[i]) with the given method; options.threads is the number of
+ * channels fitted at once. fits gets one entry per channel, in ascending
+ * channel order. The IDs must span fewer than
+ * CALIBRATION_TABLE_MAX_CHANNELS (calibration_table.h); returns false
+ * otherwise.
+ * With device DEVICE_GPU a least squares fit reduces every channel's
+ * points on the GPU, falling back to the CPU if that fails; other methods
+ * always run on the CPU.
+ */
+bool fit_channels(const uint32_t* channel, const double* raw, const double* reference, size_t n,
+                  FitMethod method, const RobustFitOptions& options, std::vector<ChannelFit>& fits,
+                  ComputeDevice device = DEVICE_CPU);
+
+/*
+ * The least squares moments of every channel present in the n rows, in
+ * ascending channel order: what fit_channels() would fit by least
+ * squares, before the lines are solved. Each channel is summed as
+ * fit_line() sums it, on one thread, so compute_calibration() on its
+ * moments gives the line fit_channels() gives. threads and device as for
+ * fit_channels(); returns false in the same case.
+ */
+bool channel_moments(const uint32_t* channel, const double* raw, const double* reference, size_t n,
+                     unsigned threads, ComputeDevice device, std::vector<ChannelMoments>& moments);
+
+#endif
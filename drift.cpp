@@ -0,0 +1,38 @@
+/*
+ * Recursive least squares drift tracker
+ */
+
+#include "drift.h"
+
+#include <algorithm>
+
+using namespace std;
+
+DriftTracker::DriftTracker(double forgetting)
+    : forgetting(forgetting), weight(0.0), mean_x(0.0), mean_y(0.0),
+      m2_x(0.0), c_xy(0.0), points(0), seed_points(0) {}
+
+void DriftTracker::seed(const FitAccumulator& fit) {
+    double count = static_cast<double>(fit.count);
+    double window = forgetting < 1.0 ? 1.0 / (1.0 - forgetting) : count;
+    double scale = count > window ? window / count : 1.0;
+
+    // Scaling every weight by the same factor leaves the means unchanged
+    weight = min(count, window);
+    mean_x = fit.mean_x;
+    mean_y = fit.mean_y;
+    m2_x = fit.m2_x * scale;
+    c_xy = fit.c_xy * scale;
+    seed_points = fit.count;
+}
+
+bool DriftTracker::calibration(Calibration& cal) const {
+    if (points + seed_points < 2 || !(m2_x > 0.0)) {
+        return false;
+    }
+
+    cal.slope = c_xy / m2_x;
+    cal.offset = mean_y - cal.slope * mean_x;
+    cal.is_valid = true;
+    return true;
+}
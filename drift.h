@@ -0,0 +1,82 @@
+/*
+ * Online drift tracking: recursive least squares with a forgetting factor
+ *
+ * A sensor's slope and offset wander over weeks. DriftTracker follows
+ * them from a trickle of reference points ("reference,raw" pairs from a
+ * reference instrument) without ever refitting: each point is folded in
+ * in O(1), and older points count for less and less, by a factor of
+ * `forgetting` per new point. With forgetting = 0.999 the estimate
+ * effectively rests on the last 1 / (1 - 0.999) = 1000 points.
+ *
+ * The state is the exponentially weighted version of FitAccumulator's
+ * centered moments, so the estimate is exactly the weighted least squares
+ * line that covariance-form RLS converges to, with the same precision for
+ * readings with a large DC offset. Unlike the covariance form it has no
+ * gain matrix to blow up while the raw readings stop varying (the moments
+ * just fade together and keep their ratio), and no initial covariance to
+ * guess.
+ */
+
+#ifndef DRIFT_H
+#define DRIFT_H
+
+#include "calibration.h"
+#include "fit.h"
+
+class DriftTracker {
+public:
+    // forgetting in (0, 1]; 1 never forgets (a plain running fit)
+    explicit DriftTracker(double forgetting = 0.999);
+
+    /*
+     * Start from a saved fit state instead of from nothing. Its points are
+     * taken as the most recent ones, with their weight capped at the
+     * tracker's window so new points are not drowned out.
+     */
+    void seed(const FitAccumulator& fit);
+
+    // Fold in one reference point
+    void add(double raw, double reference) {
+        points++;
+
+        // Age what came before, then add the point with weight 1
+        weight = forgetting * weight + 1.0;
+        m2_x *= forgetting;
+        c_xy *= forgetting;
+
+        // Weighted Welford update: one old and one new deviation
+        double dx = raw - mean_x;
+        double dy = reference - mean_y;
+        mean_x += dx / weight;
+        mean_y += dy / weight;
+        m2_x += dx * (raw - mean_x);
+        c_xy += dx * (reference - mean_y);
+    }
+
+    /*
+     * Current estimate. Returns false (cal untouched) until the points
+     * seen so far pin down a line: at least 2 of them, not all at the
+     * same raw reading.
+     */
+    bool calibration(Calibration& cal) const;
+
+    double forgetting_factor() const { return forgetting; }
+
+    // Sum of the point weights, at most 1 / (1 - forgetting)
+    double effective_points() const { return weight; }
+
+    // Points added since construction
+    unsigned long long points_added() const { return points; }
+
+private:
+    double forgetting;
+    double weight;
+    double mean_x;
+    double mean_y;
+    double m2_x;            // Weighted sum of (raw - mean_x)
+    double c_xy;            // Weighted sum of (raw - mean_x)  (reference - mean_y)
+    unsigned long long points;
+    unsigned long long seed_points;     // Points behind the seed, if any
+};
+
+#endif
@@ -0,0 +1,483 @@
+/*
+ * Least squares fit and its parallel reduction
+ */
+
+#include "fit.h"
+
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "stats.h"
+
+using namespace std;
+
+/*
+ * Combine two sets of centered moments (Chan et al.)
+ * The means move by their weighted difference and each co-moment gains a
+ * correction for the distance between the two means
+ */
+void FitAccumulator::merge(const FitAccumulator& other) {
+    if (other.count == 0) {
+        return;
+    }
+    if (count == 0) {
+        *this = other;
+        return;
+    }
+
+    double na = static_cast<double>(count);
+    double nb = static_cast<double>(other.count);
+    double n = na + nb;
+    double dx = other.mean_x - mean_x;
+    double dy = other.mean_y - mean_y;
+    double weight = na * nb / n;
+
+    mean_x += dx * (nb / n);
+    mean_y += dy * (nb / n);
+    m2_x += other.m2_x + dx * dx * weight;
+    m2_y += other.m2_y + dy * dy * weight;
+    c_xy += other.c_xy + dx * dy * weight;
+    count += other.count;
+}
+
+/*
+ * merge() run backwards: with this = A + B and other = B, recover A.
+ * A's means follow from the weighted totals, and the mean-distance
+ * correction is computed from A's means instead of this one's.
+ */
+void FitAccumulator::subtract(const FitAccumulator& other) {
+    if (other.count == 0) {
+        return;
+    }
+    if (other.count >= count) {
+        *this = FitAccumulator();
+        return;
+    }
+
+    double n = static_cast<double>(count);
+    double nb = static_cast<double>(other.count);
+    double na = n - nb;
+
+    double mean_ax = mean_x + (mean_x - other.mean_x) * (nb / na);
+    double mean_ay = mean_y + (mean_y - other.mean_y) * (nb / na);
+    double dx = other.mean_x - mean_ax;
+    double dy = other.mean_y - mean_ay;
+    double weight = na * nb / n;
+
+    mean_x = mean_ax;
+    mean_y = mean_ay;
+    m2_x -= other.m2_x + dx * dx * weight;
+    m2_y -= other.m2_y + dy * dy * weight;
+    c_xy -= other.c_xy + dx * dy * weight;
+    count -= other.count;
+
+    // Rounding must not leave a negative sum of squares behind
+    if (m2_x < 0.0) {
+        m2_x = 0.0;
+    }
+    if (m2_y < 0.0) {
+        m2_y = 0.0;
+    }
+}
+
+/*
+ * LINEAR REGRESSION CALCULATION (Least Squares Method)
+ *
+ * We want to fit: y = slope * x + offset
+ * where x = raw reading, y = reference value
+ *
+ * In centered form:
+ * slope = Sum((x - mean_x)(y - mean_y)) / Sum((x - mean_x)) = c_xy / m2_x
+ * offset = mean_y - slope * mean_x
+ *
+ * This minimizes the sum of squared errors between actual and predicted
+ * values. It is algebraically the same as the textbook
+ * (n * sum_xy - sum_x * sum_y) / (n * sum_x - (sum_x)) but does not
+ * subtract two huge, nearly equal numbers.
+ */
+bool compute_calibration(const FitAccumulator& fit, Calibration& cal) {
+    if (fit.count < 2) {
+        return false;
+    }
+
+    // All raw readings identical: every deviation is exactly zero
+    if (!(fit.m2_x > 0.0)) {
+        return false;
+    }
+
+    cal.slope = fit.c_xy / fit.m2_x;
+    cal.offset = fit.mean_y - cal.slope * fit.mean_x;
+    cal.is_valid = true;
+
+    return true;
+}
+
+/*
+ * FIT DIAGNOSTICS
+ *
+ * For the least squares line SSE = m2_y - c_xy / m2_x exactly, which
+ * avoids the cancellation in the general formula. Standard errors:
+ *   se(slope)  = s / sqrt(m2_x)
+ *   se(offset) = s  sqrt(1/n + mean_x / m2_x),   s = sqrt(SSE / (n - 2))
+ */
+bool compute_diagnostics(const FitAccumulator& fit, const Calibration& cal, bool least_squares,
+                         FitDiagnostics& diagnostics) {
+    if (fit.count < 2) {
+        return false;
+    }
+
+    double n = static_cast<double>(fit.count);
+    double sse;
+    if (least_squares && fit.m2_x > 0.0) {
+        sse = fit.m2_y - fit.c_xy * (fit.c_xy / fit.m2_x);
+    } else {
+        double bias = fit.mean_y - cal.slope * fit.mean_x - cal.offset;
+        sse = fit.m2_y - 2.0 * cal.slope * fit.c_xy + cal.slope * cal.slope * fit.m2_x
+            + n * bias * bias;
+    }
+    if (sse < 0.0) {
+        sse = 0.0;
+    }
+
+    FitDiagnostics result;
+    result.count = fit.count;
+    result.r_squared = fit.m2_y > 0.0 ? 1.0 - sse / fit.m2_y : (sse == 0.0 ? 1.0 : 0.0);
+    result.residual_rms = sqrt(sse / n);
+
+    if (least_squares && fit.count > 2 && fit.m2_x > 0.0) {
+        double dof = n - 2.0;
+        double s = sqrt(sse / dof);
+        double t = student_t_critical(0.95, dof);
+
+        result.residual_std_error = s;
+        result.slope_std_error = s / sqrt(fit.m2_x);
+        result.offset_std_error = s * sqrt(1.0 / n + fit.mean_x * fit.mean_x / fit.m2_x);
+        result.slope_ci95 = t * result.slope_std_error;
+        result.offset_ci95 = t * result.offset_std_error;
+        result.has_standard_errors = true;
+    }
+
+    diagnostics = result;
+    return true;
+}
+
+namespace {
+
+/*
+ * Regularized incomplete beta function I_x(a, b), by its continued
+ * fraction (modified Lentz), using the symmetry I_x(a, b) = 1 - I_1-x(b, a)
+ * where the fraction converges slowly
+ */
+double incomplete_beta(double a, double b, double x) {
+    if (x <= 0.0) {
+        return 0.0;
+    }
+    if (x >= 1.0) {
+        return 1.0;
+    }
+    if (x > (a + 1.0) / (a + b + 2.0)) {
+        return 1.0 - incomplete_beta(b, a, 1.0 - x);
+    }
+
+    const double TINY = 1e-300;
+    double front = exp(lgamma(a + b) - lgamma(a) - lgamma(b) + a * log(x) + b * log(1.0 - x)) / a;
+
+    double c = 1.0, d = 1.0 - (a + b) * x / (a + 1.0);
+    d = fabs(d) < TINY ? 1.0 / TINY : 1.0 / d;
+    double f = d;
+
+    for (int m = 1; m <= 300; m++) {
+        // Even step
+        double numerator = m * (b - m) * x / ((a + 2.0 * m - 1.0) * (a + 2.0 * m));
+        d = 1.0 + numerator * d;
+        d = fabs(d) < TINY ? 1.0 / TINY : 1.0 / d;
+        c = 1.0 + numerator / c;
+        c = fabs(c) < TINY ? TINY : c;
+        f *= c * d;
+
+        // Odd step
+        numerator = -(a + m) * (a + b + m) * x / ((a + 2.0 * m) * (a + 2.0 * m + 1.0));
+        d = 1.0 + numerator * d;
+        d = fabs(d) < TINY ? 1.0 / TINY : 1.0 / d;
+        c = 1.0 + numerator / c;
+        c = fabs(c) < TINY ? TINY : c;
+        double step = c * d;
+        f *= step;
+
+        if (fabs(step - 1.0) < 1e-15) {
+            break;
+        }
+    }
+
+    return front * f;
+}
+
+// P(|T| <= t) for Student's t with dof degrees of freedom
+double student_t_central(double t, double dof) {
+    return 1.0 - incomplete_beta(0.5 * dof, 0.5, dof / (dof + t * t));
+}
+
+}  // namespace
+
+// Bisection on the central probability, which rises monotonically in t
+double student_t_critical(double confidence, double degrees_of_freedom) {
+    double low = 0.0, high = 1.0;
+    while (student_t_central(high, degrees_of_freedom) < confidence && high < 1e12) {
+        high *= 2.0;
+    }
+    for (int i = 0; i < 200 && high - low > 1e-12 * high; i++) {
+        double mid = 0.5 * (low + high);
+        if (student_t_central(mid, degrees_of_freedom) < confidence) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    return 0.5 * (low + high);
+}
+
+FitAccumulator fit_block(const double* raw, const double* reference, size_t n) {
+    FitAccumulator block;
+    if (n == 0) {
+        return block;
+    }
+
+    double sum_x = 0.0, sum_y = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        sum_x += raw[i];
+        sum_y += reference[i];
+    }
+
+    block.count = n;
+    block.mean_x = sum_x / n;
+    block.mean_y = sum_y / n;
+
+    double m2_x = 0.0, m2_y = 0.0, c_xy = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double dx = raw[i] - block.mean_x;
+        double dy = reference[i] - block.mean_y;
+        m2_x += dx * dx;
+        m2_y += dy * dy;
+        c_xy += dx * dy;
+    }
+
+    block.m2_x = m2_x;
+    block.m2_y = m2_y;
+    block.c_xy = c_xy;
+    return block;
+}
+
+/*
+ * PARALLEL REDUCTION
+ *
+ * Worker threads take blocks from a shared counter, so uneven progress
+ * balances itself, and each writes its block's moments to its own slot.
+ * The slots are then merged as a binary tree in block order:
+ * (0+1) (2+3) ... then ((0+1)+(2+3)) ... which keeps the rounding of the
+ * merge independent of how blocks were spread over threads.
+ * The slots of a chunk of up to FIT_STACK_BLOCKS blocks (what batch fit
+ * passes in) live on the stack, so a single-threaded call allocates nothing.
+ */
+namespace {
+
+// Fit blocks taken from next_block until none are left
+void fit_blocks(const double* raw, const double* reference, size_t n, size_t num_blocks,
+                atomic<size_t>& next_block, FitAccumulator* partial) {
+    while (true) {
+        size_t block = next_block.fetch_add(1, memory_order_relaxed);
+        if (block >= num_blocks) {
+            break;
+        }
+
+        size_t begin = block * FIT_BLOCK_SIZE;
+        size_t end = begin + FIT_BLOCK_SIZE < n ? begin + FIT_BLOCK_SIZE : n;
+
+        partial[block] = fit_block(raw + begin, reference + begin, end - begin);
+    }
+}
+
+FitAccumulator merge_blocks(FitAccumulator* partial, size_t num_blocks) {
+    for (size_t stride = 1; stride < num_blocks; stride *= 2) {
+        for (size_t i = 0; i + stride < num_blocks; i += 2 * stride) {
+            partial[i].merge(partial[i + stride]);
+        }
+    }
+    return num_blocks > 0 ? partial[0] : FitAccumulator();
+}
+
+unsigned resolve_threads(unsigned threads) {
+    if (threads == 0) {
+        threads = thread::hardware_concurrency();
+    }
+    return threads == 0 ? 1 : threads;
+}
+
+}  // namespace
+
+FitAccumulator fit_parallel(const double* raw, const double* reference, size_t n,
+                            unsigned threads) {
+    const size_t FIT_STACK_BLOCKS = 64;
+
+    StageTimer timer(STAT_FIT, n);
+    size_t num_blocks = (n + FIT_BLOCK_SIZE - 1) / FIT_BLOCK_SIZE;
+    FitAccumulator stack_partial[FIT_STACK_BLOCKS];
+    vector<FitAccumulator> heap_partial(num_blocks > FIT_STACK_BLOCKS ? num_blocks : 0);
+    FitAccumulator* partial = num_blocks > FIT_STACK_BLOCKS ? heap_partial.data() : stack_partial;
+
+    threads = resolve_threads(threads);
+    if (threads > num_blocks) {
+        threads = static_cast<unsigned>(num_blocks);
+    }
+
+    atomic<size_t> next_block(0);
+
+    auto worker = [&]() {
+        fit_blocks(raw, reference, n, num_blocks, next_block, partial);
+    };
+
+    if (threads <= 1) {
+        worker();
+    } else {
+        // The calling thread works too
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; t++) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (size_t t = 0; t < pool.size(); t++) {
+            pool[t].join();
+        }
+    }
+
+    return merge_blocks(partial, num_blocks);
+}
+
+/*
+ * The workers of a FitPool sleep until a chunk is posted (generation
+ * moves on), fit blocks of it alongside the caller and report back. The
+ * block slots are kept, grown to the largest chunk seen.
+ */
+class FitEngine {
+public:
+    explicit FitEngine(unsigned threads);
+    ~FitEngine();
+
+    FitAccumulator fit(const double* raw, const double* reference, size_t n);
+
+    unsigned thread_count;
+
+private:
+    void work();
+
+    vector<thread> pool;
+    vector<FitAccumulator> partial;
+
+    mutex lock;
+    condition_variable work_ready;  // A chunk was posted, or stopping
+    condition_variable work_done;   // A worker is through with the chunk
+    unsigned long long generation;  // Chunks posted
+    unsigned busy;                  // Workers not through with the current chunk
+    bool stopping;
+
+    // The chunk being fitted; set under lock before generation moves on
+    const double* chunk_raw;
+    const double* chunk_reference;
+    size_t chunk_size;
+    size_t num_blocks;
+    atomic<size_t> next_block;
+};
+
+FitEngine::FitEngine(unsigned threads)
+    : thread_count(resolve_threads(threads)), generation(0), busy(0), stopping(false),
+      chunk_raw(NULL), chunk_reference(NULL), chunk_size(0), num_blocks(0), next_block(0) {
+    // The calling thread works too
+    for (unsigned t = 1; t < thread_count; t++) {
+        pool.emplace_back(&FitEngine::work, this);
+    }
+}
+
+FitEngine::~FitEngine() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (size_t t = 0; t < pool.size(); t++) {
+        pool[t].join();
+    }
+}
+
+void FitEngine::work() {
+    unsigned long long seen = 0;
+
+    while (true) {
+        {
+            unique_lock<mutex> guard(lock);
+            work_ready.wait(guard, [&]() { return stopping || generation != seen; });
+            if (stopping) {
+                return;
+            }
+            seen = generation;
+        }
+
+        fit_blocks(chunk_raw, chunk_reference, chunk_size, num_blocks, next_block, partial.data());
+
+        {
+            lock_guard<mutex> guard(lock);
+            busy--;
+        }
+        work_done.notify_all();
+    }
+}
+
+FitAccumulator FitEngine::fit(const double* raw, const double* reference, size_t n) {
+    StageTimer timer(STAT_FIT, n);
+    size_t blocks = (n + FIT_BLOCK_SIZE - 1) / FIT_BLOCK_SIZE;
+    if (partial.size() < blocks) {
+        partial.resize(blocks);
+    }
+
+    // Small chunks are not worth a wake-up
+    bool shared = blocks > 1 && !pool.empty();
+    {
+        lock_guard<mutex> guard(lock);
+        chunk_raw = raw;
+        chunk_reference = reference;
+        chunk_size = n;
+        num_blocks = blocks;
+        next_block.store(0, memory_order_relaxed);
+        if (shared) {
+            busy = static_cast<unsigned>(pool.size());
+            generation++;
+        }
+    }
+
+    if (shared) {
+        work_ready.notify_all();
+    }
+    fit_blocks(raw, reference, n, blocks, next_block, partial.data());
+    if (shared) {
+        unique_lock<mutex> guard(lock);
+        work_done.wait(guard, [&]() { return busy == 0; });
+    }
+
+    return merge_blocks(partial.data(), blocks);
+}
+
+FitPool::FitPool(unsigned threads) : engine(new FitEngine(threads)) {}
+
+FitPool::~FitPool() {
+    delete engine;
+}
+
+FitAccumulator FitPool::fit(const double* raw, const double* reference, size_t n) {
+    return engine->fit(raw, reference, n);
+}
+
+unsigned FitPool::threads() const {
+    return engine->thread_count;
+}
@@ -0,0 +1,178 @@
+/*
+ * Least squares fit of Real Value = Slope  Raw + Offset
+ *
+ * FitAccumulator keeps centered moments (means and co-moments) behind the
+ * fit, so points can be folded in one at a time in constant memory, and
+ * accumulators built on different chunks or threads can be merged. Saved
+ * with the coefficients (see text_io.h), they let a calibration gain or
+ * lose points later in O(1) per point without the original data.
+ * fit_parallel() splits a buffer of points over several threads; a
+ * FitPool does the same on threads kept from one buffer to the next.
+ * The same moments give the fit's quality (compute_diagnostics()) without
+ * another pass over the points.
+ */
+
+#ifndef FIT_H
+#define FIT_H
+
+#include <cstddef>
+
+#include "calibration.h"
+
+/*
+ * Running centered moments for the least squares fit
+ *
+ * Raw sums such as sum_x lose every significant digit when the readings
+ * carry a large DC offset (e.g. 24-bit ADC counts around 8 million).
+ * Deviations from the running mean stay small, so the co-moments below
+ * keep full precision whatever the offset (Welford's update).
+ */
+struct FitAccumulator {
+    unsigned long long count;
+    double mean_x;     // Mean of raw readings
+    double mean_y;     // Mean of reference values
+    double m2_x;       // Sum of (raw - mean_x)
+    double m2_y;       // Sum of (reference - mean_y)
+    double c_xy;       // Sum of (raw - mean_x)  (reference - mean_y)
+
+    FitAccumulator()
+        : count(0), mean_x(0.0), mean_y(0.0), m2_x(0.0), m2_y(0.0), c_xy(0.0) {}
+
+    void add(double x, double y) {
+        count++;
+        double n = static_cast<double>(count);
+        double dx = x - mean_x;
+        double dy = y - mean_y;
+
+        mean_x += dx / n;
+        mean_y += dy / n;
+
+        // One old and one new deviation: exact Welford update
+        m2_x += dx * (x - mean_x);
+        m2_y += dy * (y - mean_y);
+        c_xy += dx * (y - mean_y);
+    }
+
+    /*
+     * Take back a point that was added before (the Welford update run
+     * backwards). Retracting a point that was never added gives
+     * meaningless moments.
+     */
+    void remove(double x, double y) {
+        if (count <= 1) {
+            *this = FitAccumulator();
+            return;
+        }
+        double n = static_cast<double>(count);
+        count--;
+        double dx = x - mean_x;
+        double dy = y - mean_y;
+
+        mean_x -= dx / (n - 1.0);
+        mean_y -= dy / (n - 1.0);
+
+        m2_x -= dx * (x - mean_x);
+        m2_y -= dy * (y - mean_y);
+        c_xy -= dx * (y - mean_y);
+
+        // Rounding must not leave a negative sum of squares behind
+        if (m2_x < 0.0) {
+            m2_x = 0.0;
+        }
+        if (m2_y < 0.0) {
+            m2_y = 0.0;
+        }
+    }
+
+    // Fold all points of other into this accumulator
+    void merge(const FitAccumulator& other);
+
+    // Undo merge(other): take back points that were all added before
+    void subtract(const FitAccumulator& other);
+};
+
+/*
+ * Compute slope/offset from the accumulated moments
+ * Returns false (and leaves cal untouched) with fewer than 2 points or
+ * when all raw readings are identical
+ */
+bool compute_calibration(const FitAccumulator& fit, Calibration& cal);
+
+/*
+ * How well a line fits the accumulated points
+ * The sum of squared residuals of any line follows from the moments:
+ *   SSE = m2_y - 2 slope c_xy + slope m2_x + n (mean_y - slope mean_x - offset)
+ * Standard errors and confidence intervals assume independent normal errors
+ * and are only given for the least squares line.
+ */
+struct FitDiagnostics {
+    unsigned long long count;
+    double r_squared;           // 1 - SSE / m2_y
+    double residual_rms;        // sqrt(SSE / n)
+    double residual_std_error;  // sqrt(SSE / (n - 2))
+    double slope_std_error;
+    double offset_std_error;
+    double slope_ci95;          // Half-widths of the 95% confidence intervals
+    double offset_ci95;
+    bool has_standard_errors;   // Least squares with at least 3 points
+
+    FitDiagnostics()
+        : count(0), r_squared(0.0), residual_rms(0.0), residual_std_error(0.0),
+          slope_std_error(0.0), offset_std_error(0.0), slope_ci95(0.0), offset_ci95(0.0),
+          has_standard_errors(false) {}
+};
+
+/*
+ * Quality of the line cal over the points in fit; least_squares says cal
+ * came from compute_calibration(fit). Returns false with fewer than 2 points.
+ */
+bool compute_diagnostics(const FitAccumulator& fit, const Calibration& cal, bool least_squares,
+                         FitDiagnostics& diagnostics);
+
+// Two-sided critical value of Student's t: P(|T| <= t) = confidence
+double student_t_critical(double confidence, double degrees_of_freedom);
+
+/*
+ * Accumulate n points held in memory. Uses two passes over the (cache
+ * resident) buffer: one for the means, one for the centered sums.
+ */
+FitAccumulator fit_block(const double* raw, const double* reference, size_t n);
+
+// Points per reduction block. Fixed, so results do not depend on the thread count.
+const size_t FIT_BLOCK_SIZE = 65536;
+
+/*
+ * Accumulate n points (raw[i], reference[i]) using up to threads threads
+ * (0 = one per hardware thread). The buffer is cut into FIT_BLOCK_SIZE
+ * blocks and the block moments are merged in a fixed pairwise order, so
+ * the result is bit-identical for every thread count.
+ */
+FitAccumulator fit_parallel(const double* raw, const double* reference, size_t n,
+                            unsigned threads = 0);
+
+class FitEngine;
+
+/*
+ * fit_parallel() for a stream of chunks: the threads (0 = one per
+ * hardware thread) start once and wait between calls, so each chunk costs
+ * a wake-up rather than thread creation, and no heap allocation once the
+ * largest chunk has been seen. Results are those of fit_parallel(). One
+ * caller at a time.
+ */
+class FitPool {
+public:
+    explicit FitPool(unsigned threads = 0);
+    ~FitPool();
+
+    FitAccumulator fit(const double* raw, const double* reference, size_t n);
+
+    unsigned threads() const;
+
+private:
+    FitPool(const FitPool&);                // Not copyable
+    FitPool& operator=(const FitPool&);
+
+    FitEngine* engine;
+};
+
+#endif
@@ -0,0 +1,142 @@
+/*
+ * Calibrations fixed at build time: out[i] = f(in[i]) with f compiled in
+ *
+ * PURPOSE:
+ * Factory-trimmed sensors ship with coefficients that never change, so a
+ * program built for one can bake them in. The apply loops here are
+ * templates over the coefficients and the sample types: the compiler
+ * sees every coefficient as a constant, folds it into the loop, unrolls
+ * Horner's rule and vectorizes the loop for the one in/out type pair,
+ * with no runtime dispatch on model kind, degree or type.
+ *
+ * The coefficients come in a struct with static constexpr members (C++17
+ * takes no double as a template argument):
+ *
+ *   struct BridgeA {
+ *       static constexpr double slope = 0.0625;
+ *       static constexpr double offset = -12.5;
+ *   };
+ *   apply_fixed<FixedLine<BridgeA> >(raw, real, n);        (int16_t*, double*)
+ *
+ *   struct ThermistorB {       t = (Raw - center)  scale, as in a model file
+ *       static constexpr int degree = 3;
+ *       static constexpr double center = 2048.0;
+ *       static constexpr double scale = 1.0 / 2048.0;
+ *       static constexpr double coefficients[degree + 1] = { 25.0, -41.2, 3.9, -0.8 };
+ *   };
+ *   apply_fixed<FixedPolynomial<ThermistorB> >(raw, real, n);
+ *
+ * In is int16_t, int32_t, float or double; Out is float or double. The
+ * arithmetic is done in Out, so float outputs run twice as many lanes per
+ * vector as double ones (the coefficients are rounded to float). Double
+ * results match the scalar apply kernel and evaluate_model() exactly.
+ *
+ * fixed_model<Fixed>() gives the matching CalibrationModel, to save the
+ * baked-in calibration or check it against a calibration file.
+ */
+
+#ifndef FIXED_CALIBRATION_H
+#define FIXED_CALIBRATION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+#include "calibration.h"
+#include "model.h"
+
+// Real = slope  Raw + offset
+template <typename Coefficients>
+struct FixedLine {
+    template <typename T>
+    static constexpr T value(T raw) {
+        return static_cast<T>(Coefficients::slope) * raw + static_cast<T>(Coefficients::offset);
+    }
+
+    static CalibrationModel model() {
+        Calibration cal;
+        cal.slope = Coefficients::slope;
+        cal.offset = Coefficients::offset;
+        cal.is_valid = true;
+        return linear_model(cal);
+    }
+};
+
+// Real = c[0] + c[1]t + ... + c[degree]t^degree, t = (Raw - center)  scale
+template <typename Coefficients>
+struct FixedPolynomial {
+    static_assert(Coefficients::degree >= 1 && Coefficients::degree <= MAX_POLYNOMIAL_DEGREE,
+                  "polynomial degree out of range");
+
+    template <typename T>
+    static constexpr T value(T raw) {
+        return horner<0>((raw - static_cast<T>(Coefficients::center)) * static_cast<T>(Coefficients::scale));
+    }
+
+    static CalibrationModel model() {
+        CalibrationModel fixed;
+        fixed.kind = MODEL_POLYNOMIAL;
+        fixed.degree = Coefficients::degree;
+        fixed.center = Coefficients::center;
+        fixed.scale = Coefficients::scale;
+        for (int k = 0; k <= Coefficients::degree; k++) {
+            fixed.coefficients[k] = Coefficients::coefficients[k];
+        }
+        fixed.is_valid = true;
+        return fixed;
+    }
+
+private:
+    // Highest power first, the same order of operations as evaluate_model()
+    template <int K, typename T>
+    static constexpr T horner(T t) {
+        if constexpr (K == Coefficients::degree) {
+            return static_cast<T>(Coefficients::coefficients[K]);
+        } else {
+            return horner<K + 1>(t) * t + static_cast<T>(Coefficients::coefficients[K]);
+        }
+    }
+};
+
+/*
+ * One reading, usable in constant expressions, e.g. to turn an alarm
+ * threshold into raw counts' real value at compile time
+ */
+template <typename Fixed, typename Out = double, typename In>
+constexpr Out fixed_value(In raw) {
+    return Fixed::template value<Out>(static_cast<Out>(raw));
+}
+
+// Convert n raw readings from in[] into real values in out[]
+template <typename Fixed, typename In, typename Out>
+void apply_fixed(const In* in, Out* out, size_t n) {
+    static_assert(std::is_same<In, int16_t>::value || std::is_same<In, int32_t>::value
+                  || std::is_same<In, float>::value || std::is_same<In, double>::value,
+                  "raw readings are int16_t, int32_t, float or double");
+    static_assert(std::is_same<Out, float>::value || std::is_same<Out, double>::value,
+                  "real values are float or double");
+
+    // Whole blocks are read before they are written, so the compiler can
+    // vectorize each one without proving in[] and out[] apart
+    const size_t BLOCK = 16;
+    size_t i = 0;
+    for (; i + BLOCK <= n; i += BLOCK) {
+        Out block[BLOCK];
+        for (size_t j = 0; j < BLOCK; j++) {
+            block[j] = Fixed::template value<Out>(static_cast<Out>(in[i + j]));
+        }
+        for (size_t j = 0; j < BLOCK; j++) {
+            out[i + j] = block[j];
+        }
+    }
+    for (; i < n; i++) {
+        out[i] = Fixed::template value<Out>(static_cast<Out>(in[i]));
+    }
+}
+
+template <typename Fixed>
+CalibrationModel fixed_model() {
+    return Fixed::model();
+}
+
+#endif
@@ -0,0 +1,247 @@
+/*
+ * Q-format calibrations: choosing the formats, error bounds, apply loops
+ * and the "fixed" line of calibration files
+ */
+
+#include "fixed_point.h"
+
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define SENSORCAL_NEON 1
+#include <arm_neon.h>
+#endif
+
+using namespace std;
+
+namespace {
+
+const int MAX_SLOPE_BITS = 62;
+const double OFFSET_LIMIT = 2305843009213693952.0;     // 2^61, so sums stay within int64_t
+
+// The exact 64-bit sum for code before the narrowing to int32_t
+int64_t fixed_point_sum(const FixedPointCalibration& fixed, int32_t code) {
+    int shift = fixed.slope_bits - fixed.output_bits;
+    int64_t sum = static_cast<int64_t>(fixed.slope) * code + fixed.offset;
+    if (shift > 0) {
+        sum += int64_t(1) << (shift - 1);
+    }
+    return sum >> shift;
+}
+
+// The outputs are monotonic in the code, so the end codes bound them all
+bool outputs_fit(const FixedPointCalibration& fixed) {
+    int64_t first = fixed_point_sum(fixed, fixed.first_code);
+    int64_t last = fixed_point_sum(fixed, fixed.last_code);
+    return first >= INT32_MIN && first <= INT32_MAX && last >= INT32_MIN && last <= INT32_MAX;
+}
+
+#ifdef SENSORCAL_NEON
+// Four codes at once; vshlq_s64 by a negative count is an arithmetic shift right
+inline int32x4_t neon_convert(int32x4_t code, int32x2_t slope, int64x2_t bias, int64x2_t shift) {
+    int64x2_t low = vaddq_s64(vmull_s32(vget_low_s32(code), slope), bias);
+    int64x2_t high = vaddq_s64(vmull_s32(vget_high_s32(code), slope), bias);
+    return vcombine_s32(vmovn_s64(vshlq_s64(low, shift)), vmovn_s64(vshlq_s64(high, shift)));
+}
+
+inline int64x2_t neon_bias(const FixedPointCalibration& fixed) {
+    int shift = fixed.slope_bits - fixed.output_bits;
+    return vdupq_n_s64(fixed.offset + (shift > 0 ? int64_t(1) << (shift - 1) : 0));
+}
+#endif
+
+// Advance over blanks (and a comma) between fields
+const char* skip_separator(const char* text, const char* end) {
+    while (text < end && (*text == ' ' || *text == '\t')) {
+        text++;
+    }
+    if (text < end && *text == ',') {
+        text++;
+        while (text < end && (*text == ' ' || *text == '\t')) {
+            text++;
+        }
+    }
+    return text;
+}
+
+bool parse_integer(const char*& text, const char* end, int64_t& value) {
+    from_chars_result result = from_chars(text, end, value);
+    if (result.ec != errc() || result.ptr == text) {
+        return false;
+    }
+    text = result.ptr;
+    return true;
+}
+
+void put_integer(int64_t value, string& text) {
+    char digits[24];
+    to_chars_result result = to_chars(digits, digits + sizeof(digits), value);
+    text.append(digits, result.ptr);
+}
+
+}  // namespace
+
+bool make_fixed_point(const Calibration& cal, int32_t first_code, int32_t last_code, int output_bits,
+                      FixedPointCalibration& fixed) {
+    if (!cal.is_valid || !isfinite(cal.slope) || !isfinite(cal.offset) || first_code > last_code
+        || output_bits > MAX_SLOPE_BITS) {
+        return false;
+    }
+
+    // Most slope fraction bits that keep slope in int32_t and offset below 2^61
+    int slope_bits = MAX_SLOPE_BITS;
+    while (slope_bits >= 0
+           && (fabs(round(ldexp(cal.slope, slope_bits))) > 2147483647.0
+               || fabs(round(ldexp(cal.offset, slope_bits))) >= OFFSET_LIMIT)) {
+        slope_bits--;
+    }
+    if (slope_bits < 0 || output_bits > slope_bits) {
+        return false;
+    }
+
+    // Then the most output fraction bits that keep every output in int32_t
+    int first_bits = output_bits >= 0 ? output_bits : slope_bits;
+    int last_bits = output_bits >= 0 ? output_bits : 0;
+
+    FixedPointCalibration candidate;
+    candidate.slope = static_cast<int32_t>(llround(ldexp(cal.slope, slope_bits)));
+    candidate.offset = static_cast<int64_t>(llround(ldexp(cal.offset, slope_bits)));
+    candidate.slope_bits = slope_bits;
+    candidate.first_code = first_code;
+    candidate.last_code = last_code;
+
+    for (int bits = first_bits; bits >= last_bits; bits--) {
+        candidate.output_bits = bits;
+        if (outputs_fit(candidate)) {
+            fixed = candidate;
+            return true;
+        }
+    }
+    return false;
+}
+
+void fixed_point_error(const Calibration& cal, const FixedPointCalibration& fixed, FixedPointError& error) {
+    int shift = fixed.slope_bits - fixed.output_bits;
+    double largest_code = max(fabs(static_cast<double>(fixed.first_code)),
+                              fabs(static_cast<double>(fixed.last_code)));
+
+    // Each of slope and offset is off by at most half a step; the output
+    // shift rounds to the nearest step
+    error.lsb = ldexp(1.0, -fixed.output_bits);
+    error.bound = ldexp(0.5 * largest_code + 0.5, -fixed.slope_bits) + (shift > 0 ? 0.5 * error.lsb : 0.0);
+
+    // Every code, or 2^20 evenly spaced ones including both ends
+    const int64_t MAX_SAMPLES = int64_t(1) << 20;
+    int64_t span = static_cast<int64_t>(fixed.last_code) - fixed.first_code;
+    int64_t samples = min(span + 1, MAX_SAMPLES);
+
+    error.max_error = 0.0;
+    error.worst_code = fixed.first_code;
+    for (int64_t i = 0; i < samples; i++) {
+        int64_t step = samples > 1 ? i * span / (samples - 1) : 0;
+        int32_t code = static_cast<int32_t>(fixed.first_code + step);
+        double exact = cal.slope * code + cal.offset;
+        double deviation = fabs(ldexp(static_cast<double>(fixed_point_value(fixed, code)),
+                                      -fixed.output_bits) - exact);
+        if (deviation > error.max_error) {
+            error.max_error = deviation;
+            error.worst_code = code;
+        }
+    }
+}
+
+void apply_fixed_point(const FixedPointCalibration& fixed, const int16_t* in, int32_t* out, size_t n) {
+    size_t i = 0;
+#ifdef SENSORCAL_NEON
+    int32x2_t slope = vdup_n_s32(fixed.slope);
+    int64x2_t bias = neon_bias(fixed);
+    int64x2_t shift = vdupq_n_s64(-(fixed.slope_bits - fixed.output_bits));
+    for (; i + 4 <= n; i += 4) {
+        vst1q_s32(out + i, neon_convert(vmovl_s16(vld1_s16(in + i)), slope, bias, shift));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = fixed_point_value(fixed, in[i]);
+    }
+}
+
+void apply_fixed_point(const FixedPointCalibration& fixed, const int32_t* in, int32_t* out, size_t n) {
+    size_t i = 0;
+#ifdef SENSORCAL_NEON
+    int32x2_t slope = vdup_n_s32(fixed.slope);
+    int64x2_t bias = neon_bias(fixed);
+    int64x2_t shift = vdupq_n_s64(-(fixed.slope_bits - fixed.output_bits));
+    for (; i + 4 <= n; i += 4) {
+        vst1q_s32(out + i, neon_convert(vld1q_s32(in + i), slope, bias, shift));
+    }
+#endif
+    for (; i < n; i++) {
+        out[i] = fixed_point_value(fixed, in[i]);
+    }
+}
+
+const char* fixed_point_kernel_name() {
+#ifdef SENSORCAL_NEON
+    return "neon";
+#else
+    return "scalar";
+#endif
+}
+
+bool parse_fixed_point(const char* text, const char* end, FixedPointCalibration& fixed) {
+    text = skip_separator(text, end);
+    if (end - text < 5 || strncmp(text, "fixed", 5) != 0) {
+        return false;
+    }
+    text += 5;
+
+    int64_t values[6];
+    for (int i = 0; i < 6; i++) {
+        const char* field = skip_separator(text, end);
+        if (field == text || !parse_integer(field, end, values[i])) {
+            return false;
+        }
+        text = field;
+    }
+    while (text < end && (*text == ' ' || *text == '\t' || *text == '\r')) {
+        text++;
+    }
+    if (text != end) {
+        return false;
+    }
+
+    const int64_t offset_limit = int64_t(1) << 61;
+    if (values[0] < INT32_MIN || values[0] > INT32_MAX
+        || values[1] <= -offset_limit || values[1] >= offset_limit
+        || values[2] < 0 || values[2] > MAX_SLOPE_BITS || values[3] < 0 || values[3] > values[2]
+        || values[4] < INT32_MIN || values[5] > INT32_MAX || values[4] > values[5]) {
+        return false;
+    }
+
+    FixedPointCalibration parsed;
+    parsed.slope = static_cast<int32_t>(values[0]);
+    parsed.offset = values[1];
+    parsed.slope_bits = static_cast<int>(values[2]);
+    parsed.output_bits = static_cast<int>(values[3]);
+    parsed.first_code = static_cast<int32_t>(values[4]);
+    parsed.last_code = static_cast<int32_t>(values[5]);
+    if (!outputs_fit(parsed)) {
+        return false;
+    }
+    fixed = parsed;
+    return true;
+}
+
+void format_fixed_point(const FixedPointCalibration& fixed, string& text) {
+    const int64_t values[6] = {fixed.slope, fixed.offset, fixed.slope_bits, fixed.output_bits,
+                               fixed.first_code, fixed.last_code};
+    text += "fixed";
+    for (int i = 0; i < 6; i++) {
+        text += ' ';
+        put_integer(values[i], text);
+    }
+    text += '\n';
+}
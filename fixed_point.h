@@ -0,0 +1,108 @@
+/*
+ * Integer-only calibration for targets without a (fast) FPU
+ *
+ * PURPOSE:
+ * Edge gateways built around microcontrollers convert ADC codes with no
+ * floating point unit, or a slow one. A fitted line is turned into Q
+ * format there once: the slope and offset become integers scaled by
+ * 2^slope_bits, and every conversion is one 32 x 32 -> 64 bit multiply,
+ * an add and a rounding shift down to an output with output_bits
+ * fraction bits,
+ *
+ *   out = (slope * code + offset + 2^(shift - 1)) >> shift,   shift = slope_bits - output_bits
+ *
+ * so out / 2^output_bits is the real value. (Not to be confused with
+ * fixed_calibration.h, whose coefficients are fixed at build time.)
+ *
+ * FORMATS:
+ * make_fixed_point() picks the formats for the codes of one ADC: as many
+ * output fraction bits as keep every converted code within int32_t, and
+ * as many slope fraction bits as keep slope within int32_t and offset
+ * below 2^61, so no step can overflow. fixed_point_error() bounds the
+ * error against the double line and measures it over every code.
+ *
+ * FILES:
+ * The integer form is written into the text calibration file after the
+ * fit state (see text_io.h), by the same code that saves any calibration:
+ *   fixed SLOPE OFFSET SLOPE_BITS OUTPUT_BITS FIRST_CODE LAST_CODE
+ *   # fixed_error: lsb L bound B max_error E
+ * Readers of the double line skip both lines, so one file deploys to the
+ * server and to the edge. read_fixed_point_file() reads the integer form
+ * with integer arithmetic only.
+ *
+ * SIMD:
+ * With NEON (ARMv7 with NEON, AArch64) the apply loops convert four codes
+ * per step with vmull_s32 and a rounding shift; elsewhere they are plain
+ * integer loops. Both give the same results.
+ */
+
+#ifndef FIXED_POINT_H
+#define FIXED_POINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "calibration.h"
+
+struct FixedPointCalibration {
+    int32_t slope;          // round(slope * 2^slope_bits)
+    int64_t offset;         // round(offset * 2^slope_bits)
+    int slope_bits;         // Fraction bits of slope and offset, 0..62
+    int output_bits;        // Fraction bits of the output, 0..slope_bits
+    int32_t first_code;     // Codes the formats were chosen for
+    int32_t last_code;
+
+    FixedPointCalibration()
+        : slope(0), offset(0), slope_bits(0), output_bits(0), first_code(0), last_code(0) {}
+};
+
+// How far the integer form is from the double line, in real units
+struct FixedPointError {
+    double lsb;             // One output step, 2^-output_bits
+    double bound;           // Worst case from the roundings of slope, offset and output
+    double max_error;       // Worst case measured over the codes
+    int32_t worst_code;     // Where it occurred
+};
+
+/*
+ * Derive the integer form of cal for codes first_code..last_code.
+ * output_bits < 0 takes as many output fraction bits as fit; otherwise it
+ * is used if it fits. Returns false if the converted codes cannot be held
+ * in int32_t with that many bits (or cal is not valid).
+ */
+bool make_fixed_point(const Calibration& cal, int32_t first_code, int32_t last_code, int output_bits,
+                      FixedPointCalibration& fixed);
+
+// Bound the error of fixed against cal and measure it (over at most 2^20 evenly spaced codes)
+void fixed_point_error(const Calibration& cal, const FixedPointCalibration& fixed, FixedPointError& error);
+
+// One code (first_code..last_code) in Q output_bits
+inline int32_t fixed_point_value(const FixedPointCalibration& fixed, int32_t code) {
+    int shift = fixed.slope_bits - fixed.output_bits;
+    int64_t sum = static_cast<int64_t>(fixed.slope) * code + fixed.offset;
+    if (shift > 0) {
+        sum += int64_t(1) << (shift - 1);
+    }
+    // Arithmetic shift: rounds half up for negative sums too
+    return static_cast<int32_t>(sum >> shift);
+}
+
+// out[i] = fixed_point_value(fixed, in[i]); in may not alias out for int16_t
+void apply_fixed_point(const FixedPointCalibration& fixed, const int16_t* in, int32_t* out, size_t n);
+void apply_fixed_point(const FixedPointCalibration& fixed, const int32_t* in, int32_t* out, size_t n);
+
+// Name of the apply loop in use: "neon" or "scalar"
+const char* fixed_point_kernel_name();
+
+/*
+ * Parse a "fixed SLOPE OFFSET SLOPE_BITS OUTPUT_BITS FIRST_CODE LAST_CODE"
+ * line [text, end) with integer arithmetic only. Returns false (fixed
+ * untouched) unless the whole line is a consistent integer form.
+ */
+bool parse_fixed_point(const char* text, const char* end, FixedPointCalibration& fixed);
+
+// Append the "fixed ..." line, with its newline, to text
+void format_fixed_point(const FixedPointCalibration& fixed, std::string& text);
+
+#endif
@@ -0,0 +1,782 @@
+/*
+ * OpenCL backend for the multi-channel apply and the per-channel moments
+ */
+
+#include "gpu_offload.h"
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+#if !defined(SENSORCAL_NO_GPU)
+#ifdef _WIN32
+#define NOMINMAX     // Keep std::min and std::max usable
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+#endif
+
+using namespace std;
+
+bool parse_compute_device(const string& text, ComputeDevice& device) {
+    if (text == "cpu") {
+        device = DEVICE_CPU;
+    } else if (text == "gpu") {
+        device = DEVICE_GPU;
+    } else if (text == "auto") {
+        device = DEVICE_AUTO;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* compute_device_name(ComputeDevice device) {
+    switch (device) {
+        case DEVICE_CPU: return "cpu";
+        case DEVICE_GPU: return "gpu";
+        case DEVICE_AUTO: return "auto";
+    }
+    return "unknown";
+}
+
+ComputeDevice resolve_compute_device(ComputeDevice device) {
+    if (device == DEVICE_AUTO) {
+        return gpu_available() ? DEVICE_GPU : DEVICE_CPU;
+    }
+    return device;
+}
+
+#ifdef SENSORCAL_NO_GPU
+
+bool gpu_available(string* reason) {
+    if (reason != NULL) {
+        *reason = "built without GPU support (SENSORCAL_NO_GPU)";
+    }
+    return false;
+}
+
+string gpu_device_name() {
+    return string();
+}
+
+bool gpu_apply_calibration(const CalibrationTableView&, const uint32_t*, const double*, double*, size_t) {
+    return false;
+}
+
+bool gpu_fit_moments(const double*, const double*, const size_t*, size_t, FitAccumulator*) {
+    return false;
+}
+
+#else
+
+namespace {
+
+/*
+ * The slice of the OpenCL 1.2 C API used here, declared locally (the ABI
+ * is fixed by the Khronos headers) and resolved from the ICD loader at
+ * run time
+ */
+typedef int32_t cl_int;
+typedef uint32_t cl_uint;
+typedef uint64_t cl_ulong;
+typedef cl_ulong cl_bitfield;
+typedef cl_uint cl_bool;
+typedef intptr_t cl_context_properties;
+typedef struct _cl_platform_id* cl_platform_id;
+typedef struct _cl_device_id* cl_device_id;
+typedef struct _cl_context* cl_context;
+typedef struct _cl_command_queue* cl_command_queue;
+typedef struct _cl_mem* cl_mem;
+typedef struct _cl_program* cl_program;
+typedef struct _cl_kernel* cl_kernel;
+typedef struct _cl_event* cl_event;
+
+const cl_int CL_SUCCESS = 0;
+const cl_bool CL_FALSE = 0;
+const cl_bool CL_TRUE = 1;
+const cl_bitfield CL_DEVICE_TYPE_GPU = 1 << 2;
+const cl_uint CL_DEVICE_MAX_WORK_GROUP_SIZE = 0x1004;
+const cl_uint CL_DEVICE_NAME = 0x102B;
+const cl_uint CL_DEVICE_DOUBLE_FP_CONFIG = 0x1032;
+const cl_context_properties CL_CONTEXT_PLATFORM = 0x1084;
+const cl_uint CL_PROGRAM_BUILD_LOG = 0x1183;
+const cl_uint CL_KERNEL_WORK_GROUP_SIZE = 0x11B0;
+const cl_bitfield CL_MEM_READ_WRITE = 1 << 0;
+const cl_bitfield CL_MEM_WRITE_ONLY = 1 << 1;
+const cl_bitfield CL_MEM_READ_ONLY = 1 << 2;
+const cl_bitfield CL_MEM_ALLOC_HOST_PTR = 1 << 4;
+const cl_bitfield CL_MAP_READ = 1 << 0;
+const cl_bitfield CL_MAP_WRITE = 1 << 1;
+
+#if defined(_WIN32) && !defined(_WIN64)
+#define CL_CALL __stdcall
+#else
+#define CL_CALL
+#endif
+
+struct OpenCl {
+    cl_int (CL_CALL* GetPlatformIDs)(cl_uint, cl_platform_id*, cl_uint*);
+    cl_int (CL_CALL* GetDeviceIDs)(cl_platform_id, cl_bitfield, cl_uint, cl_device_id*, cl_uint*);
+    cl_int (CL_CALL* GetDeviceInfo)(cl_device_id, cl_uint, size_t, void*, size_t*);
+    cl_context (CL_CALL* CreateContext)(const cl_context_properties*, cl_uint, const cl_device_id*,
+                                        void (CL_CALL*)(const char*, const void*, size_t, void*),
+                                        void*, cl_int*);
+    cl_command_queue (CL_CALL* CreateCommandQueue)(cl_context, cl_device_id, cl_bitfield, cl_int*);
+    cl_program (CL_CALL* CreateProgramWithSource)(cl_context, cl_uint, const char**, const size_t*, cl_int*);
+    cl_int (CL_CALL* BuildProgram)(cl_program, cl_uint, const cl_device_id*, const char*,
+                                   void (CL_CALL*)(cl_program, void*), void*);
+    cl_int (CL_CALL* GetProgramBuildInfo)(cl_program, cl_device_id, cl_uint, size_t, void*, size_t*);
+    cl_kernel (CL_CALL* CreateKernel)(cl_program, const char*, cl_int*);
+    cl_int (CL_CALL* GetKernelWorkGroupInfo)(cl_kernel, cl_device_id, cl_uint, size_t, void*, size_t*);
+    cl_mem (CL_CALL* CreateBuffer)(cl_context, cl_bitfield, size_t, void*, cl_int*);
+    cl_int (CL_CALL* ReleaseMemObject)(cl_mem);
+    void* (CL_CALL* EnqueueMapBuffer)(cl_command_queue, cl_mem, cl_bool, cl_bitfield, size_t, size_t,
+                                      cl_uint, const cl_event*, cl_event*, cl_int*);
+    cl_int (CL_CALL* EnqueueWriteBuffer)(cl_command_queue, cl_mem, cl_bool, size_t, size_t, const void*,
+                                         cl_uint, const cl_event*, cl_event*);
+    cl_int (CL_CALL* EnqueueReadBuffer)(cl_command_queue, cl_mem, cl_bool, size_t, size_t, void*,
+                                        cl_uint, const cl_event*, cl_event*);
+    cl_int (CL_CALL* EnqueueNDRangeKernel)(cl_command_queue, cl_kernel, cl_uint, const size_t*,
+                                           const size_t*, const size_t*, cl_uint, const cl_event*,
+                                           cl_event*);
+    cl_int (CL_CALL* SetKernelArg)(cl_kernel, cl_uint, size_t, const void*);
+    cl_int (CL_CALL* Flush)(cl_command_queue);
+    cl_int (CL_CALL* Finish)(cl_command_queue);
+    cl_int (CL_CALL* WaitForEvents)(cl_uint, const cl_event*);
+    cl_int (CL_CALL* ReleaseEvent)(cl_event);
+};
+
+#ifdef _WIN32
+void* open_library() {
+    return LoadLibraryA("OpenCL.dll");
+}
+
+void* library_symbol(void* library, const char* name) {
+    return reinterpret_cast<void*>(GetProcAddress(static_cast<HMODULE>(library), name));
+}
+#else
+void* open_library() {
+    const char* names[] = {
+        "libOpenCL.so.1", "libOpenCL.so", "/System/Library/Frameworks/OpenCL.framework/OpenCL"
+    };
+    for (const char* name : names) {
+        void* library = dlopen(name, RTLD_NOW | RTLD_LOCAL);
+        if (library != NULL) {
+            return library;
+        }
+    }
+    return NULL;
+}
+
+void* library_symbol(void* library, const char* name) {
+    return dlsym(library, name);
+}
+#endif
+
+template <typename Function>
+bool resolve(void* library, const char* name, Function& function) {
+    void* symbol = library_symbol(library, name);
+    function = reinterpret_cast<Function>(symbol);
+    return symbol != NULL;
+}
+
+bool load_opencl(OpenCl& cl, string& reason) {
+    void* library = open_library();
+    if (library == NULL) {
+        reason = "no OpenCL library (GPU driver) installed";
+        return false;
+    }
+
+    // The library stays loaded for the rest of the run
+    bool ok = resolve(library, "clGetPlatformIDs", cl.GetPlatformIDs)
+        && resolve(library, "clGetDeviceIDs", cl.GetDeviceIDs)
+        && resolve(library, "clGetDeviceInfo", cl.GetDeviceInfo)
+        && resolve(library, "clCreateContext", cl.CreateContext)
+        && resolve(library, "clCreateCommandQueue", cl.CreateCommandQueue)
+        && resolve(library, "clCreateProgramWithSource", cl.CreateProgramWithSource)
+        && resolve(library, "clBuildProgram", cl.BuildProgram)
+        && resolve(library, "clGetProgramBuildInfo", cl.GetProgramBuildInfo)
+        && resolve(library, "clCreateKernel", cl.CreateKernel)
+        && resolve(library, "clGetKernelWorkGroupInfo", cl.GetKernelWorkGroupInfo)
+        && resolve(library, "clCreateBuffer", cl.CreateBuffer)
+        && resolve(library, "clReleaseMemObject", cl.ReleaseMemObject)
+        && resolve(library, "clEnqueueMapBuffer", cl.EnqueueMapBuffer)
+        && resolve(library, "clEnqueueWriteBuffer", cl.EnqueueWriteBuffer)
+        && resolve(library, "clEnqueueReadBuffer", cl.EnqueueReadBuffer)
+        && resolve(library, "clEnqueueNDRangeKernel", cl.EnqueueNDRangeKernel)
+        && resolve(library, "clSetKernelArg", cl.SetKernelArg)
+        && resolve(library, "clFlush", cl.Flush)
+        && resolve(library, "clFinish", cl.Finish)
+        && resolve(library, "clWaitForEvents", cl.WaitForEvents)
+        && resolve(library, "clReleaseEvent", cl.ReleaseEvent);
+    if (!ok) {
+        reason = "the OpenCL library lacks OpenCL 1.2 functions";
+    }
+    return ok;
+}
+
+/*
+ * DEVICE CODE
+ * apply_multi matches apply_multi_avx2(): one fused multiply-add per
+ * sample, NaN where the channel is out of range or not valid.
+ * tile_moments reduces one tile of a segment per work group: every work
+ * item runs the Welford update over a strided share of the tile, then the
+ * shares are merged pairwise in local memory as FitAccumulator::merge()
+ * does. scratch holds 6 doubles per work item: count, mean_x, mean_y,
+ * m2_x, m2_y, c_xy.
+ */
+const char* const KERNEL_SOURCE =
+    "#pragma OPENCL EXTENSION cl_khr_fp64 : enable\n"
+    "\n"
+    "__kernel void apply_multi(__global const double* slopes, __global const double* offsets,\n"
+    "                          __global const ulong* valid, uint first_channel, uint channel_count,\n"
+    "                          __global const uint* channels, __global const double* in,\n"
+    "                          __global double* out, uint n) {\n"
+    "    uint i = get_global_id(0);\n"
+    "    if (i >= n) {\n"
+    "        return;\n"
+    "    }\n"
+    "    uint index = channels[i] - first_channel;\n"
+    "    if (index < channel_count && ((valid[index >> 6] >> (index & 63)) & 1) != 0) {\n"
+    "        out[i] = fma(slopes[index], in[i], offsets[index]);\n"
+    "    } else {\n"
+    "        out[i] = (double)NAN;\n"
+    "    }\n"
+    "}\n"
+    "\n"
+    "__kernel void tile_moments(__global const double* raw, __global const double* reference,\n"
+    "                           __global const uint* tile_first, __global double* moments,\n"
+    "                           __local double* scratch) {\n"
+    "    uint tile = get_group_id(0);\n"
+    "    uint item = get_local_id(0);\n"
+    "    uint items = get_local_size(0);\n"
+    "    uint end = tile_first[tile + 1];\n"
+    "\n"
+    "    double n = 0.0, mean_x = 0.0, mean_y = 0.0, m2_x = 0.0, m2_y = 0.0, c_xy = 0.0;\n"
+    "    for (uint i = tile_first[tile] + item; i < end; i += items) {\n"
+    "        double x = raw[i];\n"
+    "        double y = reference[i];\n"
+    "        n += 1.0;\n"
+    "        double dx = x - mean_x;\n"
+    "        double dy = y - mean_y;\n"
+    "        mean_x += dx / n;\n"
+    "        mean_y += dy / n;\n"
+    "        m2_x += dx * (x - mean_x);\n"
+    "        m2_y += dy * (y - mean_y);\n"
+    "        c_xy += dx * (y - mean_y);\n"
+    "    }\n"
+    "\n"
+    "    __local double* mine = scratch + 6 * item;\n"
+    "    mine[0] = n;\n"
+    "    mine[1] = mean_x;\n"
+    "    mine[2] = mean_y;\n"
+    "    mine[3] = m2_x;\n"
+    "    mine[4] = m2_y;\n"
+    "    mine[5] = c_xy;\n"
+    "    barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "\n"
+    "    for (uint half = items / 2; half > 0; half /= 2) {\n"
+    "        if (item < half) {\n"
+    "            __local double* other = scratch + 6 * (item + half);\n"
+    "            double nb = other[0];\n"
+    "            if (nb > 0.0) {\n"
+    "                double total = mine[0] + nb;\n"
+    "                double dx = other[1] - mine[1];\n"
+    "                double dy = other[2] - mine[2];\n"
+    "                double weight = mine[0] * nb / total;\n"
+    "                mine[1] += dx * (nb / total);\n"
+    "                mine[2] += dy * (nb / total);\n"
+    "                mine[3] += other[3] + dx * dx * weight;\n"
+    "                mine[4] += other[4] + dy * dy * weight;\n"
+    "                mine[5] += other[5] + dx * dy * weight;\n"
+    "                mine[0] = total;\n"
+    "            }\n"
+    "        }\n"
+    "        barrier(CLK_LOCAL_MEM_FENCE);\n"
+    "    }\n"
+    "\n"
+    "    if (item < 6) {\n"
+    "        moments[6 * tile + item] = scratch[item];\n"
+    "    }\n"
+    "}\n";
+
+// Values per transfer; the tile counts bound the moments kernel's chunks
+const size_t CHUNK_VALUES = 1 << 20;
+const size_t TILE_POINTS = 1 << 14;     // Points one work group reduces
+const size_t CHUNK_TILES = 4096;
+const size_t MOMENTS_PER_TILE = 6;
+const size_t MAX_WORK_GROUP = 256;
+const unsigned SLOT_COUNT = 2;
+
+// Staging buffers of a slot, each with a device buffer of the same size
+enum SlotBuffer {
+    BUFFER_A,       // Channels (apply) or raw readings (moments)
+    BUFFER_B,       // Raw readings (apply) or reference values (moments)
+    BUFFER_TILES,   // Tile bounds (moments)
+    BUFFER_OUT,     // Real values (apply) or tile moments (moments)
+    BUFFER_COUNT
+};
+
+const size_t SLOT_BUFFER_SIZES[BUFFER_COUNT] = {
+    CHUNK_VALUES * sizeof(double),
+    CHUNK_VALUES * sizeof(double),
+    (CHUNK_TILES + 1) * sizeof(uint32_t),
+    CHUNK_VALUES * sizeof(double)
+};
+
+struct Slot {
+    cl_command_queue queue;
+    cl_mem staging[BUFFER_COUNT];   // Driver-allocated (pinned), mapped for the whole run
+    void* host[BUFFER_COUNT];
+    cl_mem device[BUFFER_COUNT];
+    cl_event done;                  // Result copy of the chunk in flight, or NULL
+    size_t chunk;                   // Which chunk that is
+};
+
+/*
+ * The one GPU of the run. Set up on first use and never destroyed: some
+ * OpenCL drivers shut down at exit before static destructors would run.
+ */
+class GpuContext {
+public:
+    GpuContext() : ready(false), context(NULL), apply_kernel(NULL), moments_kernel(NULL),
+                   work_group(MAX_WORK_GROUP), table_slopes(NULL), table_offsets(NULL),
+                   table_valid(NULL), table_capacity(0) {
+        ready = load_opencl(cl, reason) && open_device() && build_kernels() && create_slots();
+    }
+
+    bool usable(string* why) {
+        lock_guard<mutex> lock(busy);
+        if (!ready && why != NULL) {
+            *why = reason;
+        }
+        return ready;
+    }
+
+    string device() {
+        lock_guard<mutex> lock(busy);
+        return ready ? name : string();
+    }
+
+    bool apply(const CalibrationTableView& table, const uint32_t* channels, const double* in,
+               double* out, size_t n);
+    bool fit_moments(const double* raw, const double* reference, const size_t* first,
+                     size_t segments, FitAccumulator* moments);
+
+private:
+    bool open_device();
+    bool build_kernels();
+    bool create_slots();
+    bool upload_table(const CalibrationTableView& table);
+
+    void release(cl_mem buffer) {
+        if (buffer != NULL) {
+            cl.ReleaseMemObject(buffer);
+        }
+    }
+
+    // Give up the GPU after a failed call; returns false for the caller to pass on
+    bool fail(const char* what) {
+        for (Slot& slot : slots) {
+            cl.Finish(slot.queue);
+            if (slot.done != NULL) {
+                cl.ReleaseEvent(slot.done);
+                slot.done = NULL;
+            }
+        }
+        ready = false;
+        reason = string(what) + " failed on the GPU";
+        return false;
+    }
+
+    template <typename Fill, typename Collect>
+    bool stream(size_t chunks, Fill fill, Collect collect);
+
+    OpenCl cl;
+    bool ready;
+    string reason;
+    string name;
+    mutex busy;
+
+    cl_device_id device_id;
+    cl_context context;
+    cl_kernel apply_kernel;
+    cl_kernel moments_kernel;
+    size_t work_group;
+    vector<Slot> slots;
+
+    // The table last uploaded, kept on the device while the caller's view keeps its generation
+    CalibrationTableView table_view;
+    cl_mem table_slopes;
+    cl_mem table_offsets;
+    cl_mem table_valid;
+    uint32_t table_capacity;
+};
+
+bool GpuContext::open_device() {
+    cl_uint platform_count = 0;
+    if (cl.GetPlatformIDs(0, NULL, &platform_count) != CL_SUCCESS || platform_count == 0) {
+        reason = "no OpenCL platform found";
+        return false;
+    }
+    vector<cl_platform_id> platforms(platform_count);
+    cl.GetPlatformIDs(platform_count, platforms.data(), NULL);
+
+    // The first GPU that does double precision
+    for (cl_platform_id platform : platforms) {
+        cl_uint device_count = 0;
+        if (cl.GetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, 0, NULL, &device_count) != CL_SUCCESS
+            || device_count == 0) {
+            continue;
+        }
+        vector<cl_device_id> devices(device_count);
+        cl.GetDeviceIDs(platform, CL_DEVICE_TYPE_GPU, device_count, devices.data(), NULL);
+
+        for (cl_device_id candidate : devices) {
+            cl_bitfield double_config = 0;
+            if (cl.GetDeviceInfo(candidate, CL_DEVICE_DOUBLE_FP_CONFIG, sizeof(double_config),
+                                 &double_config, NULL) != CL_SUCCESS || double_config == 0) {
+                continue;
+            }
+
+            cl_context_properties properties[] = {
+                CL_CONTEXT_PLATFORM, reinterpret_cast<cl_context_properties>(platform), 0
+            };
+            cl_int status;
+            context = cl.CreateContext(properties, 1, &candidate, NULL, NULL, &status);
+            if (status != CL_SUCCESS) {
+                continue;
+            }
+            device_id = candidate;
+
+            char text[256] = "";
+            cl.GetDeviceInfo(candidate, CL_DEVICE_NAME, sizeof(text) - 1, text, NULL);
+            name = text;
+
+            size_t max_group = 0;
+            cl.GetDeviceInfo(candidate, CL_DEVICE_MAX_WORK_GROUP_SIZE, sizeof(max_group), &max_group, NULL);
+            // The moments kernel halves its work group on each merge step
+            while (work_group > 1 && work_group > max_group) {
+                work_group /= 2;
+            }
+            return true;
+        }
+    }
+
+    reason = "no OpenCL GPU with double precision found";
+    return false;
+}
+
+bool GpuContext::build_kernels() {
+    cl_int status;
+    const char* source = KERNEL_SOURCE;
+    cl_program program = cl.CreateProgramWithSource(context, 1, &source, NULL, &status);
+    if (status != CL_SUCCESS) {
+        reason = "cannot create the GPU program";
+        return false;
+    }
+
+    if (cl.BuildProgram(program, 1, &device_id, "", NULL, NULL) != CL_SUCCESS) {
+        char log[512] = "";
+        cl.GetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, sizeof(log) - 1, log, NULL);
+        reason = string("the GPU kernels do not build: ") + log;
+        return false;
+    }
+
+    cl_int apply_status, moments_status;
+    apply_kernel = cl.CreateKernel(program, "apply_multi", &apply_status);
+    moments_kernel = cl.CreateKernel(program, "tile_moments", &moments_status);
+    if (apply_status != CL_SUCCESS || moments_status != CL_SUCCESS) {
+        reason = "cannot create the GPU kernels";
+        return false;
+    }
+
+    // A kernel's registers and local memory can hold it below the device's limit
+    const cl_kernel kernels[] = { apply_kernel, moments_kernel };
+    for (cl_kernel kernel : kernels) {
+        size_t kernel_group = 0;
+        if (cl.GetKernelWorkGroupInfo(kernel, device_id, CL_KERNEL_WORK_GROUP_SIZE, sizeof(kernel_group),
+                                      &kernel_group, NULL) != CL_SUCCESS) {
+            reason = "cannot query the GPU kernels";
+            return false;
+        }
+        while (work_group > 1 && work_group > kernel_group) {
+            work_group /= 2;
+        }
+    }
+    return true;
+}
+
+bool GpuContext::create_slots() {
+    slots.resize(SLOT_COUNT);
+
+    for (Slot& slot : slots) {
+        cl_int status;
+        slot.done = NULL;
+        slot.chunk = 0;
+        slot.queue = cl.CreateCommandQueue(context, device_id, 0, &status);
+        if (status != CL_SUCCESS) {
+            reason = "cannot create a GPU command queue";
+            return false;
+        }
+
+        for (int b = 0; b < BUFFER_COUNT; b++) {
+            size_t size = SLOT_BUFFER_SIZES[b];
+            cl_bitfield device_flags = b == BUFFER_OUT ? CL_MEM_WRITE_ONLY : CL_MEM_READ_ONLY;
+            cl_int staging_status, map_status, device_status;
+
+            slot.staging[b] = cl.CreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size,
+                                              NULL, &staging_status);
+            slot.host[b] = staging_status != CL_SUCCESS ? NULL
+                : cl.EnqueueMapBuffer(slot.queue, slot.staging[b], CL_TRUE, CL_MAP_READ | CL_MAP_WRITE,
+                                      0, size, 0, NULL, NULL, &map_status);
+            slot.device[b] = cl.CreateBuffer(context, device_flags, size, NULL, &device_status);
+
+            if (slot.host[b] == NULL || map_status != CL_SUCCESS || device_status != CL_SUCCESS) {
+                reason = "cannot allocate GPU buffers";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool GpuContext::upload_table(const CalibrationTableView& table) {
+    // Same generation, same contents; untracked views (0) go over every time
+    if (table.generation != 0 && table.generation == table_view.generation
+        && table.slopes == table_view.slopes && table.offsets == table_view.offsets
+        && table.valid == table_view.valid && table.first_channel == table_view.first_channel
+        && table.channel_count == table_view.channel_count) {
+        return true;
+    }
+    table_view = CalibrationTableView();
+
+    // Device arrays only grow; a smaller table reuses them
+    size_t count = max<size_t>(table.channel_count, 1);
+    size_t words = (count + 63) / 64;
+    if (count > table_capacity) {
+        cl_int slopes_status, offsets_status, valid_status;
+        cl_mem slopes = cl.CreateBuffer(context, CL_MEM_READ_ONLY, count * sizeof(double), NULL, &slopes_status);
+        cl_mem offsets = cl.CreateBuffer(context, CL_MEM_READ_ONLY, count * sizeof(double), NULL, &offsets_status);
+        cl_mem valid = cl.CreateBuffer(context, CL_MEM_READ_ONLY, words * sizeof(uint64_t), NULL, &valid_status);
+        if (slopes_status != CL_SUCCESS || offsets_status != CL_SUCCESS || valid_status != CL_SUCCESS) {
+            release(slopes_status == CL_SUCCESS ? slopes : NULL);
+            release(offsets_status == CL_SUCCESS ? offsets : NULL);
+            release(valid_status == CL_SUCCESS ? valid : NULL);
+            return false;
+        }
+        release(table_slopes);
+        release(table_offsets);
+        release(table_valid);
+        table_slopes = slopes;
+        table_offsets = offsets;
+        table_valid = valid;
+        table_capacity = static_cast<uint32_t>(count);
+    }
+
+    cl_command_queue queue = slots[0].queue;
+    if (table.channel_count > 0) {
+        size_t bytes = table.channel_count * sizeof(double);
+        size_t valid_bytes = ((table.channel_count + 63) / 64) * sizeof(uint64_t);
+        if (cl.EnqueueWriteBuffer(queue, table_slopes, CL_TRUE, 0, bytes, table.slopes, 0, NULL, NULL) != CL_SUCCESS
+            || cl.EnqueueWriteBuffer(queue, table_offsets, CL_TRUE, 0, bytes, table.offsets, 0, NULL, NULL) != CL_SUCCESS
+            || cl.EnqueueWriteBuffer(queue, table_valid, CL_TRUE, 0, valid_bytes, table.valid, 0, NULL, NULL) != CL_SUCCESS) {
+            return false;
+        }
+    }
+    table_view = table;
+    return true;
+}
+
+/*
+ * Run chunks 0 .. chunks - 1 through the slots in turn. fill(slot, chunk)
+ * copies a chunk into the slot's staging buffers and queues its
+ * transfers and kernel; its last command must set slot.done. Once that
+ * has completed, collect(slot, chunk) takes the results out of the
+ * staging buffers. Chunks are collected in order.
+ */
+template <typename Fill, typename Collect>
+bool GpuContext::stream(size_t chunks, Fill fill, Collect collect) {
+    for (size_t chunk = 0; chunk < chunks + SLOT_COUNT; chunk++) {
+        Slot& slot = slots[chunk % SLOT_COUNT];
+
+        // The slot's previous chunk must be back before its staging buffers are reused
+        if (slot.done != NULL) {
+            cl_int status = cl.WaitForEvents(1, &slot.done);
+            cl.ReleaseEvent(slot.done);
+            slot.done = NULL;
+            if (status != CL_SUCCESS) {
+                return fail("a transfer");
+            }
+            collect(slot, slot.chunk);
+        }
+
+        if (chunk < chunks) {
+            slot.chunk = chunk;
+            if (!fill(slot, chunk) || cl.Flush(slot.queue) != CL_SUCCESS) {
+                return fail("queueing work");
+            }
+        }
+    }
+    return true;
+}
+
+bool GpuContext::apply(const CalibrationTableView& table, const uint32_t* channels, const double* in,
+                       double* out, size_t n) {
+    lock_guard<mutex> lock(busy);
+    if (!ready) {
+        return false;
+    }
+    if (n == 0) {
+        return true;
+    }
+    if (!upload_table(table)) {
+        return fail("uploading the calibration table");
+    }
+
+    cl_uint first_channel = table.first_channel;
+    cl_uint channel_count = table.channel_count;
+    size_t chunks = (n + CHUNK_VALUES - 1) / CHUNK_VALUES;
+
+    return stream(chunks, [&](Slot& slot, size_t chunk) {
+        size_t begin = chunk * CHUNK_VALUES;
+        cl_uint count = static_cast<cl_uint>(min(CHUNK_VALUES, n - begin));
+        memcpy(slot.host[BUFFER_A], channels + begin, count * sizeof(uint32_t));
+        memcpy(slot.host[BUFFER_B], in + begin, count * sizeof(double));
+
+        size_t local = work_group;
+        size_t global = (count + local - 1) / local * local;
+        return cl.EnqueueWriteBuffer(slot.queue, slot.device[BUFFER_A], CL_FALSE, 0, count * sizeof(uint32_t),
+                                     slot.host[BUFFER_A], 0, NULL, NULL) == CL_SUCCESS
+            && cl.EnqueueWriteBuffer(slot.queue, slot.device[BUFFER_B], CL_FALSE, 0, count * sizeof(double),
+                                     slot.host[BUFFER_B], 0, NULL, NULL) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 0, sizeof(cl_mem), &table_slopes) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 1, sizeof(cl_mem), &table_offsets) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 2, sizeof(cl_mem), &table_valid) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 3, sizeof(cl_uint), &first_channel) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 4, sizeof(cl_uint), &channel_count) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 5, sizeof(cl_mem), &slot.device[BUFFER_A]) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 6, sizeof(cl_mem), &slot.device[BUFFER_B]) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 7, sizeof(cl_mem), &slot.device[BUFFER_OUT]) == CL_SUCCESS
+            && cl.SetKernelArg(apply_kernel, 8, sizeof(cl_uint), &count) == CL_SUCCESS
+            && cl.EnqueueNDRangeKernel(slot.queue, apply_kernel, 1, NULL, &global, &local,
+                                       0, NULL, NULL) == CL_SUCCESS
+            && cl.EnqueueReadBuffer(slot.queue, slot.device[BUFFER_OUT], CL_FALSE, 0, count * sizeof(double),
+                                    slot.host[BUFFER_OUT], 0, NULL, &slot.done) == CL_SUCCESS;
+    }, [&](Slot& slot, size_t chunk) {
+        size_t begin = chunk * CHUNK_VALUES;
+        size_t count = min(CHUNK_VALUES, n - begin);
+        memcpy(out + begin, slot.host[BUFFER_OUT], count * sizeof(double));
+    });
+}
+
+bool GpuContext::fit_moments(const double* raw, const double* reference, const size_t* first,
+                             size_t segments, FitAccumulator* moments) {
+    lock_guard<mutex> lock(busy);
+    if (!ready) {
+        return false;
+    }
+
+    // Cut the segments into tiles of at most TILE_POINTS points
+    vector<size_t> tile_begin, tile_segment;
+    for (size_t s = 0; s < segments; s++) {
+        moments[s] = FitAccumulator();
+        for (size_t begin = first[s]; begin < first[s + 1]; begin += TILE_POINTS) {
+            tile_begin.push_back(begin);
+            tile_segment.push_back(s);
+        }
+    }
+    size_t tiles = tile_begin.size();
+    if (tiles == 0) {
+        return true;
+    }
+    tile_begin.push_back(first[segments]);
+
+    // Consecutive tiles make a chunk while they fit in the staging buffers
+    vector<size_t> chunk_tile(1, 0);
+    for (size_t t = 0; t < tiles; t++) {
+        size_t chunk_first = chunk_tile.back();
+        if (t - chunk_first == CHUNK_TILES || tile_begin[t + 1] - tile_begin[chunk_first] > CHUNK_VALUES) {
+            chunk_tile.push_back(t);
+        }
+    }
+    chunk_tile.push_back(tiles);
+    size_t chunks = chunk_tile.size() - 1;
+
+    return stream(chunks, [&](Slot& slot, size_t chunk) {
+        size_t t0 = chunk_tile[chunk];
+        size_t t1 = chunk_tile[chunk + 1];
+        size_t begin = tile_begin[t0];
+        size_t count = tile_begin[t1] - begin;
+
+        uint32_t* bounds = static_cast<uint32_t*>(slot.host[BUFFER_TILES]);
+        for (size_t t = t0; t <= t1; t++) {
+            bounds[t - t0] = static_cast<uint32_t>(tile_begin[t] - begin);
+        }
+        memcpy(slot.host[BUFFER_A], raw + begin, count * sizeof(double));
+        memcpy(slot.host[BUFFER_B], reference + begin, count * sizeof(double));
+
+        size_t local = work_group;
+        size_t global = (t1 - t0) * local;
+        size_t result_bytes = (t1 - t0) * MOMENTS_PER_TILE * sizeof(double);
+        return cl.EnqueueWriteBuffer(slot.queue, slot.device[BUFFER_A], CL_FALSE, 0, count * sizeof(double),
+                                     slot.host[BUFFER_A], 0, NULL, NULL) == CL_SUCCESS
+            && cl.EnqueueWriteBuffer(slot.queue, slot.device[BUFFER_B], CL_FALSE, 0, count * sizeof(double),
+                                     slot.host[BUFFER_B], 0, NULL, NULL) == CL_SUCCESS
+            && cl.EnqueueWriteBuffer(slot.queue, slot.device[BUFFER_TILES], CL_FALSE, 0,
+                                     (t1 - t0 + 1) * sizeof(uint32_t), bounds, 0, NULL, NULL) == CL_SUCCESS
+            && cl.SetKernelArg(moments_kernel, 0, sizeof(cl_mem), &slot.device[BUFFER_A]) == CL_SUCCESS
+            && cl.SetKernelArg(moments_kernel, 1, sizeof(cl_mem), &slot.device[BUFFER_B]) == CL_SUCCESS
+            && cl.SetKernelArg(moments_kernel, 2, sizeof(cl_mem), &slot.device[BUFFER_TILES]) == CL_SUCCESS
+            && cl.SetKernelArg(moments_kernel, 3, sizeof(cl_mem), &slot.device[BUFFER_OUT]) == CL_SUCCESS
+            && cl.SetKernelArg(moments_kernel, 4, MOMENTS_PER_TILE * local * sizeof(double), NULL) == CL_SUCCESS
+            && cl.EnqueueNDRangeKernel(slot.queue, moments_kernel, 1, NULL, &global, &local,
+                                       0, NULL, NULL) == CL_SUCCESS
+            && cl.EnqueueReadBuffer(slot.queue, slot.device[BUFFER_OUT], CL_FALSE, 0, result_bytes,
+                                    slot.host[BUFFER_OUT], 0, NULL, &slot.done) == CL_SUCCESS;
+    }, [&](Slot& slot, size_t chunk) {
+        // Tiles of a segment are merged in order, so the result does not depend on the chunking
+        const double* tile_moments = static_cast<const double*>(slot.host[BUFFER_OUT]);
+        for (size_t t = chunk_tile[chunk]; t < chunk_tile[chunk + 1]; t++) {
+            const double* m = tile_moments + (t - chunk_tile[chunk]) * MOMENTS_PER_TILE;
+            FitAccumulator tile;
+            tile.count = static_cast<unsigned long long>(m[0]);
+            tile.mean_x = m[1];
+            tile.mean_y = m[2];
+            tile.m2_x = m[3];
+            tile.m2_y = m[4];
+            tile.c_xy = m[5];
+            moments[tile_segment[t]].merge(tile);
+        }
+    });
+}
+
+GpuContext& gpu() {
+    static GpuContext* context = new GpuContext;
+    return *context;
+}
+
+}  // namespace
+
+bool gpu_available(string* reason) {
+    return gpu().usable(reason);
+}
+
+string gpu_device_name() {
+    return gpu().device();
+}
+
+bool gpu_apply_calibration(const CalibrationTableView& table, const uint32_t* channels,
+                           const double* in, double* out, size_t n) {
+    return gpu().apply(table, channels, in, out, n);
+}
+
+bool gpu_fit_moments(const double* raw, const double* reference, const size_t* first,
+                     size_t segments, FitAccumulator* moments) {
+    return gpu().fit_moments(raw, reference, first, segments, moments);
+}
+
+#endif  // SENSORCAL_NO_GPU
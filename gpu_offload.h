@@ -0,0 +1,91 @@
+/*
+ * Optional GPU offload for reprocessing archived campaigns
+ *
+ * Billions of samples over thousands of channels keep the CPU busy for
+ * hours; a GPU does the same multi-channel apply and the per-channel
+ * least squares reductions many times faster. Two operations run there:
+ *
+ *   gpu_apply_calibration()  the multi-channel gather of apply.h
+ *   gpu_fit_moments()        the FitAccumulator of every channel of
+ *                            grouped points (what fit-table fits)
+ *
+ * The backend is OpenCL 1.2 with double precision (cl_khr_fp64), which
+ * covers NVIDIA, AMD and Intel GPUs alike. The OpenCL library is loaded
+ * at run time, so building needs no SDK and a machine without a GPU
+ * driver simply keeps using the CPU. Define SENSORCAL_NO_GPU to leave the
+ * backend out altogether. (glibc before 2.34 needs -ldl for dlopen().)
+ *
+ * STREAMING:
+ * Buffers go over in chunks of about a million values. Each of two slots
+ * has its own command queue and its own driver-allocated (pinned) staging
+ * buffers, so one chunk is copied to or from the device while the other
+ * one's kernel runs, and the host fills the next staging buffer in the
+ * meantime.
+ *
+ * RESULTS:
+ * The apply kernel uses fused multiply-add like the SIMD kernels. The
+ * moments come from a fixed tree of Welford updates and merges, so they
+ * are deterministic but may differ in the last bits from a fit on the CPU.
+ *
+ * Every function is safe to call from several threads; GPU work is done
+ * one call at a time. After a failed transfer or launch the GPU is given
+ * up for the rest of the run and everything returns false, so callers
+ * fall back to the CPU.
+ */
+
+#ifndef GPU_OFFLOAD_H
+#define GPU_OFFLOAD_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "calibration_table.h"
+#include "fit.h"
+
+enum ComputeDevice {
+    DEVICE_CPU,
+    DEVICE_GPU,
+    DEVICE_AUTO     // The GPU if there is a usable one, else the CPU
+};
+
+// Parse "cpu", "gpu" or "auto"
+bool parse_compute_device(const std::string& text, ComputeDevice& device);
+const char* compute_device_name(ComputeDevice device);
+
+/*
+ * True once the first OpenCL GPU with double precision has been set up.
+ * The first call loads the library, picks the device and builds the
+ * kernels; if that fails (or the GPU was given up) reason (if not NULL)
+ * says why.
+ */
+bool gpu_available(std::string* reason = NULL);
+
+// The device in use, e.g. "NVIDIA A100-SXM4-40GB"; empty without one
+std::string gpu_device_name();
+
+// DEVICE_AUTO resolved: DEVICE_GPU if gpu_available(), else DEVICE_CPU
+ComputeDevice resolve_compute_device(ComputeDevice device);
+
+/*
+ * apply_calibration(table, channels, in, out, n) on the GPU: samples
+ * whose channel has no calibration come out NaN. Returns false, with out
+ * in an unspecified state, if the GPU cannot do it.
+ * The table stays on the device while later calls pass a view of the
+ * same arrays and generation (see calibration_table.h); a view with
+ * generation 0 is uploaded again on every call.
+ */
+bool gpu_apply_calibration(const CalibrationTableView& table, const uint32_t* channels,
+                           const double* in, double* out, size_t n);
+
+/*
+ * Segmented least squares moments: the points are grouped, segment s
+ * being points first[s] .. first[s + 1] - 1, and moments[s] gets the
+ * FitAccumulator of that segment's points (count 0 for an empty one).
+ * first has segments + 1 ascending entries. Returns false if the GPU
+ * cannot do it.
+ */
+bool gpu_fit_moments(const double* raw, const double* reference, const size_t* first,
+                     size_t segments, FitAccumulator* moments);
+
+#endif
@@ -4,43 +4,193 @@
  * PURPOSE:
  * This program calibrates sensors by mapping raw readings to real-world values
  * using a linear model: Real Value = Slope  Raw Reading + Offset
+ * The menu and the batch commands are a front end to libsensorcal (see
+ * sensorcal.h), which other programs can link to do the same in-process.
  * COMPILATION:
- * Windows:   g++ sensor_calibrate.cpp -o sensor_calibrate.exe
+ * Windows:   g++ -std=c++17 -O2 -pthread main.cpp apply.cpp fit.cpp calibration_table.cpp text_io.cpp stats.cpp model.cpp robust.cpp channel_fit.cpp adc_lookup.cpp mapped_file.cpp sample_file.cpp async_io.cpp serve.cpp drift.cpp session.cpp gpu_offload.cpp moment_file.cpp parallel_convert.cpp fixed_point.cpp snapshot.cpp batch.cpp -o sensor_calibrate.exe
  * RUN:
  * Windows:   sensor_calibrate.exe
+ *
+ * BATCH MODE:
+ * Running with a command skips the interactive menu:
+ *   sensor_calibrate.exe convert --cal calibration.txt --in raw.csv --out real.csv
+ * The input holds one raw reading per line; the output gets one real value
+ * per line.
+ *   sensor_calibrate.exe fit --in points.csv --out calibration.txt
+ * The input holds one "reference,raw" point per line and is streamed in
+ * fixed-size chunks, so any number of points fits in constant memory.
+ * --model polynomial:3 or piecewise:16 fits a nonlinear calibration
+ * instead (see model.h); convert --cal accepts either kind of file.
+ * --model temperature:3,2 fits a temperature-compensated surface from
+ * "reference,raw,temperature" points; convert then takes "raw,temperature"
+ * lines and corrects for temperature in the same pass.
+ * A linear fit saves its fit state too, so
+ *   sensor_calibrate.exe fit --update calibration.txt --in new.csv --out calibration.txt
+ * adds points to it (and --retract FILE takes points out) without refitting.
+ * convert --adc u12 (or s16, ...) treats readings as integer ADC codes and
+ * converts them through a precomputed per-code lookup table.
+ *   sensor_calibrate.exe fixed-point --cal calibration.txt --adc u12 --out calibration.txt
+ * Adds the integer (Q format) form of a line for gateways without an FPU
+ * (see fixed_point.h); convert --fixed-point calibration.txt converts the
+ * codes with it exactly as the gateway would.
+ * convert and fit also take binary sample files (int16, int32, float32 or
+ * float64 columns behind a small header, see sample_file.h) as --in;
+ * they are memory-mapped and converted in place without parsing.
+ *   sensor_calibrate.exe fit-table --in run.csv --out rig.caltab
+ * Fits every sensor of a production run at once from one long-format file
+ * of "channel,reference,raw" points and writes one calibration table.
+ * fit-table and convert of interleaved "channel,raw" samples take
+ * --device gpu (or auto) to do the least squares sums and the conversion
+ * on an OpenCL GPU when reprocessing archives (see gpu_offload.h).
+ *   sensor_calibrate.exe fit-moments --in shard.csv --out node7.calmom
+ *   sensor_calibrate.exe merge-moments --in node1.calmom --in node2.calmom --out rig.caltab
+ * Fits a campaign sharded over many machines without moving its points:
+ * each node sums its shard into per-channel least squares moments, and
+ * the merged moments give the same table as fit-table of all the points
+ * (see moment_file.h).
+ *   sensor_calibrate.exe pack --list channels.txt --out rig.caltab
+ * Packs many per-channel text calibrations into one memory-mapped binary
+ * table, which convert reads with --table rig.caltab --channel ID, or
+ * without --channel for interleaved "channel,raw" samples. Those convert on
+ * many threads with --threads N (0 = one per core), pinned per NUMA node
+ * on multi-socket servers (see parallel_convert.h).
+ *   sensor_calibrate.exe pack --list channels.txt --snapshot rig.calsnap
+ * Precompiles the calibrations and fit states of every channel into a
+ * snapshot for cold starts. convert and serve take --snapshot FILE like
+ * --table FILE, and "sensor_calibrate.exe --snapshot FILE" starts the
+ * menu on one; each channel is checked only when it is first used, so
+ * the first conversion does not wait for the rest (see snapshot.h).
+ *   sensor_calibrate.exe serve --cal calibration.txt --in /run/adc.fifo --out /run/real.fifo
+ * Runs as a service on a live stream: a reader, converter and writer
+ * thread joined by lock-free rings convert each reading as it arrives.
+ * Omit --in / --out (or pass "-") to use stdin / stdout.
+ * Replacing the --cal / --table file (or sending SIGHUP) reloads it
+ * without interrupting the stream. With --track PIPE, "reference,raw"
+ * points from a reference instrument keep the line in step with the
+ * sensor's drift instead (recursive least squares, see drift.h).
+ *
+ * STATS:
+ * Set SENSORCAL_STATS=1 to print per-stage timing counters on exit (and on
+ * SIGUSR1 where available), including the time from startup to the first
+ * converted value; see stats.h.
+ *
+ * BENCHMARKS:
+ * bench.cpp builds a separate benchmark executable; see its header.
  */
 
 #include <iostream>
 #include <fstream>
+#include <map>
 #include <vector>
 #include <cmath>
 #include <limits>
 #include <iomanip>
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+#include <algorithm>
+#include <memory>
+
+#include "calibration.h"
+#include "apply.h"
+#include "aligned_buffer.h"
+#include "fit.h"
+#include "calibration_table.h"
+#include "text_io.h"
+#include "async_io.h"
+#include "batch.h"
+#include "model.h"
+#include "robust.h"
+#include "channel_fit.h"
+#include "adc_lookup.h"
+#include "fixed_point.h"
+#include "gpu_offload.h"
+#include "moment_file.h"
+#include "parallel_convert.h"
+#include "sample_file.h"
+#include "serve.h"
+#include "session.h"
+#include "snapshot.h"
+#include "stats.h"
 
 using namespace std;
 
-// Structure to hold calibration coefficients
-struct Calibration {
-    double slope;
-    double offset;
-    bool is_valid;  // Track whether calibration has been set
+// Calibrations and fit states of every channel, and the channel the menu works on
+CalibrationSession session;
+uint32_t active_channel = 0;
 
-    Calibration() : slope(0.0), offset(0.0), is_valid(false) {}
-};
+// The snapshot the session was started from; channels are copied in as they are first used
+MappedSnapshot menu_snapshot;
 
-// Global calibration object
-Calibration current_calibration;
+// Points entered for a fit, reused from one fit to the next
+AlignedBuffer<double> entered_raw, entered_reference;
 
 // Function prototypes
 void display_menu();
 void enter_calibration_data();
+void update_calibration_points();
+void read_point(double& reference_value, double& raw_reading);
+void print_diagnostics(ostream& out, const FitDiagnostics& diagnostics);
 void load_calibration_from_file();
 void convert_raw_reading();
 void save_calibration_to_file();
+void select_channel();
+void take_snapshot_channel(uint32_t channel);
 void clear_input_buffer();
 void pause_screen();
+int run_batch_command(int argc, char* argv[]);
+ComputeDevice choose_device(ComputeDevice device);
+int load_batch_calibration(const string& command, const string& cal_filename,
+                           const string& table_filename, const string& snapshot_filename,
+                           const string& channel_text, CalibrationModel& model,
+                           MappedCalibrationTable& table, MappedSnapshot& snapshot);
+int batch_convert(int argc, char* argv[]);
+int convert_sample_file(const string& in_filename, const string& out_filename, IoBackend io,
+                        const CalibrationModel& model, const AdcLookupTable* lookup);
+void convert_sample_block(const CalibrationModel& model, const AdcLookupTable* lookup,
+                          const SampleColumn& raw, size_t first, size_t n,
+                          double* scratch, double* real_values);
+void warn_uring_fallback(IoBackend io, const string& reason, const string& name);
+string io_summary(const AsyncReader* in, const AsyncWriter* out);
+int batch_fit(int argc, char* argv[]);
+int read_fit_points(const string& in_filename, unsigned threads, bool keep_points,
+                    FitAccumulator& fit, vector<double>& all_raw, vector<double>& all_reference);
+int read_sample_fit_points(const string& in_filename, size_t chunk_points, FitPool& pool,
+                           bool keep_points, FitAccumulator& fit,
+                           vector<double>& all_raw, vector<double>& all_reference);
+int fit_temperature_points(const string& in_filename, const string& out_filename,
+                           unsigned threads, int raw_degree, int temperature_degree);
+int read_temperature_points(const string& in_filename, vector<double>& raw,
+                            vector<double>& temperature, vector<double>& reference);
+int batch_fit_table(int argc, char* argv[]);
+int write_fitted_table(const vector<ChannelFit>& fits, const string& out_filename,
+                       const string& source, size_t& fitted);
+int batch_fit_moments(int argc, char* argv[]);
+int batch_merge_moments(int argc, char* argv[]);
+int batch_fixed_point(int argc, char* argv[]);
+int batch_pack(int argc, char* argv[]);
+int batch_serve(int argc, char* argv[]);
+void print_usage();
+
+int main(int argc, char* argv[]) {
+    init_stats();
+
+    // Any command-line arguments but a snapshot to start from select non-interactive batch mode
+    bool menu_on_snapshot = argc == 3 && strcmp(argv[1], "--snapshot") == 0;
+    if (argc > 1 && !menu_on_snapshot) {
+        return run_batch_command(argc, argv);
+    }
+    if (menu_on_snapshot) {
+        SnapshotStatus status = menu_snapshot.open(argv[2]);
+        if (status != SNAPSHOT_OK) {
+            cerr << "Error: " << snapshot_status_message(status, argv[2]) << "\n";
+            return 1;
+        }
+        take_snapshot_channel(active_channel);
+    }
 
-int main() {
     int choice;
 
     cout << "\n========================================\n";
@@ -52,7 +202,7 @@ int main() {
 
         // Get user choice with validation
         if (!(cin >> choice)) {
-            cout << "\nInvalid input. Enter a number between 1 and 5.\n";
+            cout << "\nInvalid input. Enter a number between 1 and 7.\n";
             clear_input_buffer();
             pause_screen();
             continue;
@@ -74,10 +224,16 @@ int main() {
                 save_calibration_to_file();
                 break;
             case 5:
+                select_channel();
+                break;
+            case 6:
+                update_calibration_points();
+                break;
+            case 7:
                 cout << "\nExiting program. Goodbye!\n";
                 return 0;
             default:
-                cout << "\nInvalid option. Choose between 1 and 5.\n";
+                cout << "\nInvalid option. Choose between 1 and 7.\n";
                 pause_screen();
         }
     }
@@ -89,21 +245,25 @@ int main() {
  * Display the main menu options
  */
 void display_menu() {
-    cout << "\n--- MAIN MENU ---\n";
+    cout << "\n--- MAIN MENU (channel " << active_channel << ") ---\n";
     cout << "1. Enter new calibration data\n";
     cout << "2. Load existing calibration from file\n";
     cout << "3. Convert a raw reading\n";
     cout << "4. Save current calibration to file\n";
-    cout << "5. Exit\n";
+    cout << "5. Select channel\n";
+    cout << "6. Add or remove calibration points\n";
+    cout << "7. Exit\n";
     cout << "\nChoose an option: ";
 }
 
 /*
  * Collect calibration data points from user and compute slope/offset
- * using least squares linear regression
+ * using least squares linear regression, or one of the robust fits
+ * (see robust.h) when some reference readings may be bad
  */
 void enter_calibration_data() {
     int num_points;
+    int method_choice;
 
     cout << "\n=== ENTER CALIBRATION DATA ===\n";
 
@@ -120,93 +280,58 @@ void enter_calibration_data() {
 
     clear_input_buffer();
 
-    // Store data points
-    vector<double> reference_values(num_points);
-    vector<double> raw_readings(num_points);
-
-    // Collect each data point
-    for (int i = 0; i < num_points; i++) {
-        cout << "\nPoint " << (i + 1) << ":\n";
-
-        // Get reference value (real-world measurement)
-        while (true) {
-            cout << "  Reference value: ";
-            if (cin >> reference_values[i]) {
-                break;
-            } else {
-                cout << "  Invalid input. Enter a number.\n";
-                clear_input_buffer();
-            }
-        }
-
-        // Get raw sensor reading
-        while (true) {
-            cout << "  Raw reading: ";
-            if (cin >> raw_readings[i]) {
-                break;
-            } else {
-                cout << "  Invalid input. Enter a number.\n";
-                clear_input_buffer();
-            }
+    const FitMethod methods[] = {FIT_LEAST_SQUARES, FIT_THEIL_SEN, FIT_RANSAC, FIT_HUBER};
+    while (true) {
+        cout << "Fit method: 1 = least squares, 2 = Theil-Sen, 3 = RANSAC, 4 = Huber: ";
+        if (cin >> method_choice && method_choice >= 1 && method_choice <= 4) {
+            break;
+        } else {
+            cout << "Invalid input. Enter a number between 1 and 4.\n";
+            clear_input_buffer();
         }
-
-        clear_input_buffer();
     }
 
-    /*
-     * LINEAR REGRESSION CALCULATION (Least Squares Method)
-     *
-     * We want to fit: y = slope * x + offset
-     * where x = raw reading, y = reference value
-     *
-     * Formulas:
-     * slope = (n * sum_xy - sum_x * sum_y) / (n * sum_x - (sum_x))
-     * offset = (sum_y - slope * sum_x) / n
-     *
-     * This minimizes the sum of squared errors between actual and predicted values
-     */
-
-    double sum_x = 0.0;      // Sum of raw readings
-    double sum_y = 0.0;      // Sum of reference values
-    double sum_xy = 0.0;     // Sum of (raw  reference)
-    double sum_x2 = 0.0;     // Sum of (raw)
+    clear_input_buffer();
+    FitMethod method = methods[method_choice - 1];
+
+    entered_raw.clear();
+    entered_reference.clear();
 
+    // Collect each data point
     for (int i = 0; i < num_points; i++) {
-        double x = raw_readings[i];
-        double y = reference_values[i];
-
-        sum_x += x;
-        sum_y += y;
-        sum_xy += x * y;
-        sum_x2 += x * x;
-    }
+        double reference_value, raw_reading;
 
-    double n = static_cast<double>(num_points);
+        cout << "\nPoint " << (i + 1) << ":\n";
+        read_point(reference_value, raw_reading);
 
-    // Calculate slope
-    double numerator = n * sum_xy - sum_x * sum_y;
-    double denominator = n * sum_x2 - sum_x * sum_x;
+        entered_raw.push_back(raw_reading);
+        entered_reference.push_back(reference_value);
+    }
 
-    // Check for division by zero (all raw readings identical)
-    if (fabs(denominator) < 1e-10) {
-        cout << "\nError: All raw readings are identical. Cannot compute calibration.\n";
+    FitDiagnostics diagnostics;
+    SessionStatus status = session.fit(active_channel, method, entered_raw.data(),
+                                       entered_reference.data(), entered_raw.size(), &diagnostics);
+    if (status != SESSION_OK) {
+        cout << "\nError: " << session_status_message(status, active_channel) << "\n";
         pause_screen();
         return;
     }
 
-    double slope = numerator / denominator;
-    double offset = (sum_y - slope * sum_x) / n;
-
-    // Update current calibration
-    current_calibration.slope = slope;
-    current_calibration.offset = offset;
-    current_calibration.is_valid = true;
+    Calibration fitted;
+    session.get(active_channel, fitted);
+    double slope = fitted.slope;
+    double offset = fitted.offset;
 
     // Display results
     cout << fixed << setprecision(4);
     cout << "\n--- CALIBRATION RESULTS ---\n";
+    cout << "Method: " << fit_method_name(method) << "\n";
     cout << "Slope:  " << slope << "\n";
     cout << "Offset: " << offset << "\n";
+
+    if (diagnostics.count > 0) {
+        print_diagnostics(cout, diagnostics);
+    }
     cout << "\nCalibration updated successfully.\n";
     cout << "Formula: Real Value = " << slope << "  Raw Reading + " << offset << "\n";
 
@@ -214,8 +339,132 @@ void enter_calibration_data() {
 }
 
 /*
- * Load calibration coefficients from a text file
- * Expected format: first line = slope, second line = offset
+ * Print how well a fit matches its points (see FitDiagnostics)
+ */
+void print_diagnostics(ostream& out, const FitDiagnostics& diagnostics) {
+    ios::fmtflags flags = out.flags();
+    streamsize precision = out.precision();
+
+    out << defaultfloat;
+    out << "R squared:    " << setprecision(10) << diagnostics.r_squared << "\n";
+    out << "Residual RMS: " << setprecision(6) << diagnostics.residual_rms << "\n";
+    if (diagnostics.has_standard_errors) {
+        out << "Residual standard error: " << diagnostics.residual_std_error
+            << " (" << (diagnostics.count - 2) << " degrees of freedom)\n";
+        out << "Slope standard error:    " << diagnostics.slope_std_error
+            << " (95% confidence: +/- " << diagnostics.slope_ci95 << ")\n";
+        out << "Offset standard error:   " << diagnostics.offset_std_error
+            << " (95% confidence: +/- " << diagnostics.offset_ci95 << ")\n";
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
+
+/*
+ * Read one "reference value" / "raw reading" pair from the user
+ */
+void read_point(double& reference_value, double& raw_reading) {
+    // Get reference value (real-world measurement)
+    while (true) {
+        cout << "  Reference value: ";
+        if (cin >> reference_value) {
+            break;
+        } else {
+            cout << "  Invalid input. Enter a number.\n";
+            clear_input_buffer();
+        }
+    }
+
+    // Get raw sensor reading
+    while (true) {
+        cout << "  Raw reading: ";
+        if (cin >> raw_reading) {
+            break;
+        } else {
+            cout << "  Invalid input. Enter a number.\n";
+            clear_input_buffer();
+        }
+    }
+
+    clear_input_buffer();
+}
+
+/*
+ * Add points to, or remove points from, the active channel's fit
+ * Works from the saved moments (see FitAccumulator), so each point costs
+ * O(1) and the points entered before need not be entered again. The
+ * calibration is updated after every point.
+ */
+void update_calibration_points() {
+    cout << "\n=== ADD / REMOVE CALIBRATION POINTS ===\n";
+
+    const FitAccumulator* saved = session.fit_state(active_channel);
+    if (saved != NULL) {
+        cout << "Current fit: " << saved->count << " points.\n";
+    } else {
+        Calibration existing;
+        if (session.get(active_channel, existing)) {
+            cout << "This calibration has no fit state (e.g. it was saved by an older version).\n";
+        }
+        cout << "Starting a new fit from the points entered here.\n";
+    }
+
+    while (true) {
+        char action;
+        cout << "\n(a)dd a point, (r)emove a point or (d)one: ";
+        cin >> action;
+        clear_input_buffer();
+
+        if (action == 'd' || action == 'D') {
+            break;
+        }
+        bool adding = action == 'a' || action == 'A';
+        if (!adding && action != 'r' && action != 'R') {
+            cout << "Invalid choice. Enter a, r or d.\n";
+            continue;
+        }
+        if (!adding && session.fit_state(active_channel) == NULL) {
+            cout << "The fit has no points to remove.\n";
+            continue;
+        }
+
+        double reference_value, raw_reading;
+        read_point(reference_value, raw_reading);
+
+        FitDiagnostics diagnostics;
+        SessionStatus status = adding
+            ? session.add_point(active_channel, raw_reading, reference_value, &diagnostics)
+            : session.remove_point(active_channel, raw_reading, reference_value, &diagnostics);
+
+        if (status == SESSION_CHANNEL_TOO_FAR) {
+            cout << "\nError: " << session_status_message(status, active_channel) << "\n";
+            break;
+        }
+
+        const FitAccumulator* fit = session.fit_state(active_channel);
+        unsigned long long count = fit != NULL ? fit->count : 0;
+        Calibration fitted;
+        cout << fixed << setprecision(4);
+        if (status == SESSION_OK && session.get(active_channel, fitted)) {
+            cout << "  " << count << " points: Slope = " << fitted.slope
+                 << ", Offset = " << fitted.offset << ", R squared = "
+                 << setprecision(6) << diagnostics.r_squared << setprecision(4) << "\n";
+        } else {
+            cout << "  " << count << " points: need at least 2 distinct raw readings"
+                 << " for a calibration.\n";
+        }
+    }
+
+    pause_screen();
+}
+
+/*
+ * Load calibration coefficients from a file
+ * A binary calibration table or a snapshot replaces the calibrations of
+ * all channels (a snapshot's are copied in as they are selected); a text
+ * file (first line = slope, second line = offset) sets the active channel
+ * only
  */
 void load_calibration_from_file() {
     string filename;
@@ -224,44 +473,79 @@ void load_calibration_from_file() {
     cout << "Enter filename (e.g., calibration.txt): ";
     getline(cin, filename);
 
-    ifstream file(filename);
+    if (is_snapshot_file(filename)) {
+        SnapshotStatus snapshot_status = menu_snapshot.open(filename);
+        if (snapshot_status != SNAPSHOT_OK) {
+            cout << "\nError: " << snapshot_status_message(snapshot_status, filename) << "\n";
+            pause_screen();
+            return;
+        }
+        session = CalibrationSession();
+        take_snapshot_channel(active_channel);
+
+        cout << "\n--- LOADED CALIBRATION SNAPSHOT ---\n";
+        cout << "Channels: " << menu_snapshot.calibrated() << " (IDs " << menu_snapshot.first_channel()
+             << ".." << (menu_snapshot.first_channel() + menu_snapshot.channel_count() - 1) << ")\n";
+        cout << "\nCalibration snapshot loaded successfully from '" << filename << "'\n";
 
-    if (!file.is_open()) {
-        cout << "\nError: Cannot open file '" << filename << "'\n";
-        cout << "Make sure the file exists in the current directory.\n";
         pause_screen();
         return;
     }
 
-    double slope, offset;
+    MappedCalibrationTable table;
+    TableStatus table_status = table.open(filename);
+
+    if (table_status == TABLE_OK) {
+        session.load_table(table.view());
+        menu_snapshot.close();
+
+        cout << "\n--- LOADED CALIBRATION TABLE ---\n";
+        cout << "Channels: " << session.size() << " (IDs " << table.view().first_channel
+             << ".." << (table.view().first_channel + table.view().channel_count - 1) << ")\n";
+        cout << "\nCalibration table loaded successfully from '" << filename << "'\n";
 
-    // Read slope from first line
-    if (!(file >> slope)) {
-        cout << "\nError: Cannot read slope from file.\n";
-        file.close();
         pause_screen();
         return;
     }
-
-    // Read offset from second line
-    if (!(file >> offset)) {
-        cout << "\nError: Cannot read offset from file.\n";
-        file.close();
+    if (table_status != TABLE_BAD_FORMAT && table_status != TABLE_CANNOT_OPEN) {
+        cout << "\nError: " << table_status_message(table_status, filename) << "\n";
         pause_screen();
         return;
     }
 
-    file.close();
+    string text;
+    LoadStatus status = LOAD_CANNOT_OPEN;
+    SessionStatus loaded_status = read_text_file(filename, text)
+        ? session.load(active_channel, text.data(), text.size(), &status)
+        : SESSION_BAD_TEXT;
+
+    if (loaded_status == SESSION_BAD_TEXT) {
+        cout << "\nError: " << load_status_message(status, filename) << "\n";
+        if (status == LOAD_CANNOT_OPEN) {
+            cout << "Make sure the file exists in the current directory.\n";
+        }
+        pause_screen();
+        return;
+    }
+    if (loaded_status != SESSION_OK) {
+        cout << "\nError: " << session_status_message(loaded_status, active_channel) << "\n";
+        pause_screen();
+        return;
+    }
 
-    // Update current calibration
-    current_calibration.slope = slope;
-    current_calibration.offset = offset;
-    current_calibration.is_valid = true;
+    Calibration loaded;
+    session.get(active_channel, loaded);
+    double slope = loaded.slope;
+    double offset = loaded.offset;
+    const FitAccumulator* fit = session.fit_state(active_channel);
 
     cout << fixed << setprecision(4);
     cout << "\n--- LOADED CALIBRATION ---\n";
     cout << "Slope:  " << slope << "\n";
     cout << "Offset: " << offset << "\n";
+    if (fit != NULL) {
+        cout << "Fitted from " << fit->count << " points (option 6 adds or removes points).\n";
+    }
     cout << "\nCalibration loaded successfully from '" << filename << "'\n";
 
     pause_screen();
@@ -275,7 +559,8 @@ void convert_raw_reading() {
     cout << "\n=== CONVERT RAW READING ===\n";
 
     // Check if calibration is available
-    if (!current_calibration.is_valid) {
+    Calibration current_calibration;
+    if (!session.get(active_channel, current_calibration)) {
         cout << "\nNo calibration loaded.\n";
         cout << "Please enter calibration data (option 1) or load from file (option 2) first.\n";
         pause_screen();
@@ -305,7 +590,8 @@ void convert_raw_reading() {
         clear_input_buffer();
 
         // Apply calibration formula: Real Value = Slope  Raw + Offset
-        double real_value = current_calibration.slope * raw_reading + current_calibration.offset;
+        double real_value;
+        session.apply(active_channel, &raw_reading, &real_value, 1);
 
         cout << "\nRaw Reading: " << raw_reading << "\n";
         cout << "Real Value:  " << real_value << "\n\n";
@@ -321,13 +607,15 @@ void convert_raw_reading() {
 
 /*
  * Save current calibration coefficients to a text file
- * Format: slope on first line, offset on second line
+ * Format: slope on first line, offset on second line, then the fit state
+ * if the calibration was fitted here
  */
 void save_calibration_to_file() {
     cout << "\n=== SAVE CALIBRATION ===\n";
 
     // Check if calibration exists
-    if (!current_calibration.is_valid) {
+    Calibration current_calibration;
+    if (!session.get(active_channel, current_calibration)) {
         cout << "\nNo calibration to save.\n";
         cout << "Please enter calibration data (option 1) or load from file (option 2) first.\n";
         pause_screen();
@@ -338,21 +626,14 @@ void save_calibration_to_file() {
     cout << "Enter filename to save (e.g., calibration.txt): ";
     getline(cin, filename);
 
-    ofstream file(filename);
-
-    if (!file.is_open()) {
+    string text;
+    session.save(active_channel, text);
+    if (!write_text_file(filename, text)) {
         cout << "\nError: Cannot create file '" << filename << "'\n";
         pause_screen();
         return;
     }
 
-    // Write slope and offset to file (one per line)
-    file << fixed << setprecision(10);
-    file << current_calibration.slope << "\n";
-    file << current_calibration.offset << "\n";
-
-    file.close();
-
     cout << "\nCalibration saved successfully to '" << filename << "'\n";
     cout << "Slope:  " << current_calibration.slope << "\n";
     cout << "Offset: " << current_calibration.offset << "\n";
@@ -360,6 +641,63 @@ void save_calibration_to_file() {
     pause_screen();
 }
 
+/*
+ * Choose the channel that options 1-4 and 6 work on
+ */
+void select_channel() {
+    cout << "\n=== SELECT CHANNEL ===\n";
+    cout << "Channels with a calibration: " << session.size() << "\n";
+    if (menu_snapshot.is_open()) {
+        cout << "Channels in the snapshot: " << menu_snapshot.calibrated() << "\n";
+    }
+
+    uint32_t channel;
+    string text;
+
+    while (true) {
+        cout << "Enter channel ID: ";
+        getline(cin, text);
+        if (parse_channel(text.c_str(), channel)) {
+            break;
+        }
+        cout << "Invalid input. Enter a channel ID (0 or more).\n";
+    }
+
+    active_channel = channel;
+    take_snapshot_channel(channel);
+
+    Calibration cal;
+    cout << fixed << setprecision(4);
+    if (session.get(channel, cal)) {
+        cout << "\nChannel " << channel << ": Slope = " << cal.slope << ", Offset = " << cal.offset << "\n";
+    } else {
+        cout << "\nChannel " << channel << " has no calibration yet.\n";
+    }
+
+    pause_screen();
+}
+
+/*
+ * Copy channel's calibration and fit state from the menu's snapshot the
+ * first time the channel is used, so starting on a snapshot costs the
+ * same for any number of channels. A channel worked on since (or with
+ * points but no line yet) keeps what it has; a damaged record is reported.
+ */
+void take_snapshot_channel(uint32_t channel) {
+    Calibration cal;
+    if (!menu_snapshot.is_open() || session.get(channel, cal) || session.fit_state(channel) != NULL) {
+        return;
+    }
+
+    FitAccumulator fit;
+    SnapshotStatus status = menu_snapshot.lookup(channel, cal, &fit);
+    if (status == SNAPSHOT_OK) {
+        session.set(channel, cal, fit);
+    } else if (status == SNAPSHOT_DAMAGED) {
+        cout << "\nWarning: Channel " << channel << ": the snapshot's record is damaged and was skipped.\n";
+    }
+}
+
 /*
  * Clear the input buffer after invalid input or after using >>
  * Prevents leftover characters from causing problems
@@ -377,3 +715,2033 @@ void pause_screen() {
     cout << "\nPress Enter to continue...";
     cin.get();
 }
+
+/*
+ * Print command-line usage for batch mode
+ */
+void print_usage() {
+    cerr << "Usage:\n";
+    cerr << "  SensorCalibration                  Start the interactive menu\n";
+    cerr << "  SensorCalibration --snapshot FILE  Start the menu on the channels of a snapshot\n";
+    cerr << "  SensorCalibration convert --cal FILE [--adc FORMAT] [--io BACKEND] [--in FILE] [--out FILE]\n";
+    cerr << "  SensorCalibration convert (--table FILE | --snapshot FILE) [--channel ID [--adc FORMAT]]\n";
+    cerr << "                            [--io BACKEND]\n";
+    cerr << "                            [--device DEVICE] [--threads N] [--in FILE] [--out FILE]\n";
+    cerr << "  SensorCalibration convert --fixed-point FILE [--io BACKEND] [--in FILE] [--out FILE]\n";
+    cerr << "      Convert raw readings (one per line) to real values.\n";
+    cerr << "      With --table or --snapshot and no --channel, lines are \"channel,raw\"\n";
+    cerr << "      samples.\n";
+    cerr << "      With a temperature-compensated --cal, lines are \"raw,temperature\".\n";
+    cerr << "      --adc u12 / s16 / ... converts integer ADC codes by table lookup.\n";
+    cerr << "      --fixed-point converts integer ADC codes with the integer form saved by\n";
+    cerr << "      the fixed-point command, as a target without an FPU would.\n";
+    cerr << "      --io auto (default), uring, thread or sync: how file reads and writes\n";
+    cerr << "      overlap the conversion. uring warns and uses a thread for streams it\n";
+    cerr << "      cannot take (pipes, terminals, appends).\n";
+    cerr << "      --device cpu (default), gpu or auto: where \"channel,raw\" samples are\n";
+    cerr << "      converted; gpu needs an OpenCL GPU with double precision.\n";
+    cerr << "      --threads N converts \"channel,raw\" samples on N threads (default 1,\n";
+    cerr << "      0 = one per core), spread over the NUMA nodes; the output is the same.\n";
+    cerr << "  SensorCalibration fit [--in FILE] [--out FILE] [--threads N] [--model MODEL]\n";
+    cerr << "                        [--method METHOD [--threshold DISTANCE]]\n";
+    cerr << "  SensorCalibration fit --update FILE [--in FILE] [--retract FILE] [--out FILE]\n";
+    cerr << "      Fit a calibration from \"reference,raw\" points (one per line).\n";
+    cerr << "      MODEL is linear (default), polynomial:DEGREE (2-5), piecewise:SEGMENTS\n";
+    cerr << "      or temperature:RAW,TEMP (degrees 1-5 and 1-3) for a temperature-\n";
+    cerr << "      compensated surface fitted from \"reference,raw,temperature\" points.\n";
+    cerr << "      METHOD (linear only) is least-squares (default), theil-sen, ransac or\n";
+    cerr << "      huber; --threshold sets the RANSAC inlier distance.\n";
+    cerr << "      Without --out the calibration is written to stdout.\n";
+    cerr << "      --update adds points to (and --retract takes points out of) the fit\n";
+    cerr << "      saved in a linear calibration file.\n";
+    cerr << "      --threads defaults to one per core; results do not depend on it.\n";
+    cerr << "  SensorCalibration fit-table --in FILE --out FILE [--threads N] [--device DEVICE]\n";
+    cerr << "                              [--method METHOD [--threshold DISTANCE]]\n";
+    cerr << "      Fit every channel of a \"channel,reference,raw\" file (one point per\n";
+    cerr << "      line) and write the lines into one binary calibration table.\n";
+    cerr << "      --device gpu or auto sums least squares fits on the GPU.\n";
+    cerr << "  SensorCalibration fit-moments --in FILE --out FILE [--threads N] [--device DEVICE]\n";
+    cerr << "      Sum every channel of a \"channel,reference,raw\" file into least squares\n";
+    cerr << "      moments and write them to a moment file, for merge-moments.\n";
+    cerr << "  SensorCalibration merge-moments --in FILE [--in FILE ...] [--out FILE]\n";
+    cerr << "                                  [--moments-out FILE]\n";
+    cerr << "      Merge the moment files of several shards and write the fitted lines\n";
+    cerr << "      into a calibration table (--out), the merged moments (--moments-out)\n";
+    cerr << "      or both.\n";
+    cerr << "  SensorCalibration fixed-point --cal FILE --adc FORMAT [--output-bits N] [--out FILE]\n";
+    cerr << "      Add the integer form of a linear calibration for the codes of an ADC\n";
+    cerr << "      (u12, s16, ...) and report its error. --output-bits sets the fraction\n";
+    cerr << "      bits of the output (default: as many as fit in 32 bits).\n";
+    cerr << "      Without --out the calibration is written to stdout.\n";
+    cerr << "  SensorCalibration pack --list FILE [--out FILE] [--snapshot FILE]\n";
+    cerr << "      Pack the text calibrations named in a \"channel filename\" list\n";
+    cerr << "      into one binary calibration table (--out), or into a snapshot that\n";
+    cerr << "      also keeps their fit states and is checked channel by channel as\n";
+    cerr << "      it is used, for fast starts (--snapshot), or both.\n";
+    cerr << "  SensorCalibration serve (--cal FILE | --table FILE [--channel ID] | --snapshot FILE [--channel ID])\n";
+    cerr << "                          [--in PIPE] [--out PIPE]\n";
+    cerr << "      Convert a live stream (e.g. a named pipe) until its writer closes it,\n";
+    cerr << "      writing each value as soon as it is converted.\n";
+    cerr << "      The calibration is reloaded when its file changes or on SIGHUP.\n";
+    cerr << "  SensorCalibration serve --cal FILE --track PIPE [--forgetting F] [--publish-every N]\n";
+    cerr << "                          [--save FILE] [--in PIPE] [--out PIPE]\n";
+    cerr << "      As above, but follow the sensor's drift: each \"reference,raw\" point\n";
+    cerr << "      read from --track updates the line by recursive least squares\n";
+    cerr << "      (forgetting factor F, default 0.999) and the new line is used at once.\n";
+    cerr << "  --in / --out default to stdin / stdout; \"-\" means the same.\n";
+    cerr << "  convert and fit also read binary sample files (see sample_file.h) as --in.\n";
+}
+
+/*
+ * The device a batch command's GPU work runs on: auto takes the GPU if
+ * there is a usable one, and gpu without one warns and uses the CPU
+ */
+ComputeDevice choose_device(ComputeDevice device) {
+    if (device == DEVICE_GPU) {
+        string reason;
+        if (!gpu_available(&reason)) {
+            cerr << "Warning: No GPU to use (" << reason << "); using the CPU.\n";
+            return DEVICE_CPU;
+        }
+    }
+    return resolve_compute_device(device);
+}
+
+/*
+ * Run a non-interactive command given on the command line
+ * Returns the process exit code (0 = success, 1 = error, 2 = bad usage)
+ */
+int run_batch_command(int argc, char* argv[]) {
+    string command = argv[1];
+
+    if (command == "convert") {
+        return batch_convert(argc, argv);
+    }
+    if (command == "fit") {
+        return batch_fit(argc, argv);
+    }
+    if (command == "fit-table") {
+        return batch_fit_table(argc, argv);
+    }
+    if (command == "fit-moments") {
+        return batch_fit_moments(argc, argv);
+    }
+    if (command == "merge-moments") {
+        return batch_merge_moments(argc, argv);
+    }
+    if (command == "fixed-point") {
+        return batch_fixed_point(argc, argv);
+    }
+    if (command == "pack") {
+        return batch_pack(argc, argv);
+    }
+    if (command == "serve") {
+        return batch_serve(argc, argv);
+    }
+    if (command == "help" || command == "--help" || command == "-h") {
+        print_usage();
+        return 0;
+    }
+
+    cerr << "Error: Unknown command '" << command << "'\n";
+    print_usage();
+    return 2;
+}
+
+/*
+ * Load the calibration chosen by --cal FILE, --table FILE [--channel ID]
+ * or --snapshot FILE [--channel ID] for convert and serve. A --cal file
+ * or a single channel ends up in model; without --channel the table or
+ * snapshot stays open for "channel,raw" samples. Only the snapshot's
+ * header (and the one channel's record) is checked here.
+ * Returns 0, or the exit code after printing the error.
+ */
+int load_batch_calibration(const string& command, const string& cal_filename,
+                           const string& table_filename, const string& snapshot_filename,
+                           const string& channel_text, CalibrationModel& model,
+                           MappedCalibrationTable& table, MappedSnapshot& snapshot) {
+    int sources = !cal_filename.empty() + !table_filename.empty() + !snapshot_filename.empty();
+    if (sources != 1 || (!cal_filename.empty() && !channel_text.empty())) {
+        cerr << "Error: " << command << " needs either --cal FILE, --table FILE [--channel ID]"
+             << " or --snapshot FILE [--channel ID].\n";
+        print_usage();
+        return 2;
+    }
+
+    if (!snapshot_filename.empty()) {
+        SnapshotStatus status = snapshot.open(snapshot_filename);
+        if (status != SNAPSHOT_OK) {
+            cerr << "Error: " << snapshot_status_message(status, snapshot_filename) << "\n";
+            return 1;
+        }
+    } else if (!cal_filename.empty()) {
+        LoadStatus status = read_model_file(cal_filename, model);
+        if (status != LOAD_OK) {
+            cerr << "Error: " << load_status_message(status, cal_filename) << "\n";
+            return 1;
+        }
+    } else {
+        TableStatus status = table.open(table_filename);
+        if (status != TABLE_OK) {
+            cerr << "Error: " << table_status_message(status, table_filename) << "\n";
+            return 1;
+        }
+    }
+
+    if (!channel_text.empty()) {
+        uint32_t channel;
+        if (!parse_channel(channel_text.c_str(), channel)) {
+            cerr << "Error: Invalid channel ID '" << channel_text << "'\n";
+            return 2;
+        }
+        Calibration cal;
+        if (snapshot.is_open()) {
+            SnapshotStatus status = snapshot.lookup(channel, cal);
+            if (status != SNAPSHOT_OK) {
+                cerr << "Error: Channel " << channel << ": " << snapshot_status_message(status, snapshot_filename)
+                     << "\n";
+                return 1;
+            }
+            snapshot.close();
+        } else if (!table.view().lookup(channel, cal)) {
+            cerr << "Error: Channel " << channel << " has no calibration in '" << table_filename << "'\n";
+            return 1;
+        }
+        model = linear_model(cal);
+    }
+
+    return 0;
+}
+
+/*
+ * BATCH CONVERSION
+ *
+ * Streams every raw reading in the input through
+ * Real Value = Slope  Raw + Offset without any prompts.
+ * Readings are parsed with from_chars straight out of large read chunks,
+ * converted a block at a time and formatted with to_chars into a large
+ * write buffer, so throughput is limited by the disk rather than by the user.
+ * With --table and no --channel every line is a "channel,raw" sample and
+ * each block is converted by one gather pass over the table; samples for
+ * channels missing from the table come out as nan.
+ * With --adc u12 / s16 (etc.) readings must be integer ADC codes; the
+ * calibration is evaluated once per possible code up front and every
+ * reading is converted by a table lookup. Codes outside the ADC range
+ * come out as nan.
+ * A temperature-compensated model takes "raw,temperature" lines; each
+ * block of pairs is converted by one pass of the fused surface kernel.
+ * Reads run ahead and writes run behind the conversion on their own
+ * buffers (see async_io.h), so the disk and the CPU work at the same
+ * time; --io picks io_uring, a helper thread, or plain stdio (sync).
+ * The summary names the backends used: an explicit --io uring that has
+ * to fall back to a thread for a stream warns with the reason.
+ * With --device gpu, "channel,raw" samples are converted on the GPU a
+ * million at a time (see gpu_offload.h).
+ * --snapshot FILE works like --table FILE, but each channel's record is
+ * only checked when its first sample arrives (see snapshot.h); the thread
+ * pool and the GPU take the table whole, so they check all of it first.
+ * With --fixed-point FILE readings are integer ADC codes converted by the
+ * integer form in FILE (see fixed_point.h), bit for bit as on the target;
+ * codes outside the range it was made for come out as nan.
+ * Blank lines and lines starting with '#' are skipped.
+ */
+int batch_convert(int argc, char* argv[]) {
+    string cal_filename, table_filename, snapshot_filename, in_filename = "-", out_filename = "-";
+    string channel_text, adc_text, fixed_point_filename;
+    IoBackend io = IO_AUTO;
+    ComputeDevice device = DEVICE_CPU;
+    unsigned threads = 1;
+
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Error: Option '" << option << "' needs a value.\n";
+            print_usage();
+            return 2;
+        }
+
+        if (option == "--cal") {
+            cal_filename = argv[++i];
+        } else if (option == "--table") {
+            table_filename = argv[++i];
+        } else if (option == "--snapshot") {
+            snapshot_filename = argv[++i];
+        } else if (option == "--channel") {
+            channel_text = argv[++i];
+        } else if (option == "--adc") {
+            adc_text = argv[++i];
+        } else if (option == "--fixed-point") {
+            fixed_point_filename = argv[++i];
+        } else if (option == "--io") {
+            if (!parse_io_backend(argv[++i], io)) {
+                cerr << "Error: --io needs auto, uring, thread or sync.\n";
+                return 2;
+            }
+        } else if (option == "--device") {
+            if (!parse_compute_device(argv[++i], device)) {
+                cerr << "Error: --device needs cpu, gpu or auto.\n";
+                return 2;
+            }
+        } else if (option == "--threads") {
+            char* end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 0) {
+                cerr << "Error: --threads needs a count >= 0.\n";
+                return 2;
+            }
+            threads = static_cast<unsigned>(value);
+        } else if (option == "--in") {
+            in_filename = argv[++i];
+        } else if (option == "--out") {
+            out_filename = argv[++i];
+        } else {
+            cerr << "Error: Unknown option '" << option << "'\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    CalibrationModel model;
+    MappedCalibrationTable table;
+    MappedSnapshot snapshot;
+    FixedPointCalibration fixed_point;
+    bool use_fixed_point = !fixed_point_filename.empty();
+    if (use_fixed_point) {
+        if (!cal_filename.empty() || !table_filename.empty() || !snapshot_filename.empty()
+            || !channel_text.empty() || !adc_text.empty()) {
+            cerr << "Error: --fixed-point FILE takes the place of --cal, --table, --snapshot and --adc.\n";
+            return 2;
+        }
+        LoadStatus status = read_fixed_point_file(fixed_point_filename, fixed_point);
+        if (status != LOAD_OK) {
+            cerr << "Error: " << load_status_message(status, fixed_point_filename) << "\n";
+            return 1;
+        }
+    } else {
+        int load_result = load_batch_calibration("convert", cal_filename, table_filename, snapshot_filename,
+                                                 channel_text, model, table, snapshot);
+        if (load_result != 0) {
+            return load_result;
+        }
+    }
+    bool multi_channel = (!table_filename.empty() || !snapshot_filename.empty()) && channel_text.empty();
+
+    if (device == DEVICE_GPU && !multi_channel) {
+        cerr << "Error: --device gpu converts \"channel,raw\" samples only (--table FILE without --channel).\n";
+        return 2;
+    }
+    if (threads != 1 && !multi_channel) {
+        cerr << "Error: --threads converts \"channel,raw\" samples only (--table FILE without --channel).\n";
+        return 2;
+    }
+    bool on_gpu = multi_channel && choose_device(device) == DEVICE_GPU;
+
+    // The view of a snapshot gains each channel as it is checked
+    if (snapshot.is_open() && (on_gpu || threads != 1)) {
+        snapshot.check_all();
+    }
+    CalibrationTableView channel_table = snapshot.is_open() ? snapshot.view() : table.view();
+
+    int adc_bits = 0;
+    bool adc_signed = false;
+    if (!adc_text.empty()) {
+        if (!parse_adc_format(adc_text, adc_bits, adc_signed)) {
+            cerr << "Error: --adc needs u1..u" << MAX_ADC_BITS << " or s1..s" << MAX_ADC_BITS
+                 << " (e.g. u12 for a 12-bit unsigned ADC).\n";
+            return 2;
+        }
+        if (multi_channel) {
+            cerr << "Error: --adc needs --cal FILE or --table FILE --channel ID.\n";
+            return 2;
+        }
+        if (model_needs_temperature(model)) {
+            cerr << "Error: --adc does not work with temperature-compensated models.\n";
+            return 2;
+        }
+    }
+
+    AdcLookupTable lookup;
+    bool use_lookup = adc_bits > 0;
+    if (use_lookup) {
+        build_adc_lookup(model, adc_bits, adc_signed, lookup);
+    }
+
+    if (in_filename != "-" && is_sample_file(in_filename)) {
+        if (use_fixed_point) {
+            cerr << "Error: --fixed-point converts text ADC codes only.\n";
+            return 2;
+        }
+        if (multi_channel) {
+            cerr << "Error: Sample files hold no channel column; convert them with --cal FILE"
+                 << " or --table FILE --channel ID.\n";
+            return 2;
+        }
+        return convert_sample_file(in_filename, out_filename, io, model, use_lookup ? &lookup : NULL);
+    }
+
+    FILE* in = stdin;
+    FILE* out = stdout;
+
+    if (in_filename != "-") {
+        in = fopen(in_filename.c_str(), "r");
+        if (in == NULL) {
+            cerr << "Error: Cannot open file '" << in_filename << "'\n";
+            return 1;
+        }
+    }
+
+    if (out_filename != "-") {
+        out = fopen(out_filename.c_str(), "w");
+        if (out == NULL) {
+            cerr << "Error: Cannot create file '" << out_filename << "'\n";
+            if (in != stdin) {
+                fclose(in);
+            }
+            return 1;
+        }
+    }
+
+    // Reads ahead and writes behind on other buffers while a block is converted
+    unique_ptr<AsyncReader> async_in;
+    unique_ptr<AsyncWriter> async_out;
+    if (io != IO_SYNC) {
+        async_in.reset(new AsyncReader(fileno(in), io));
+        async_out.reset(new AsyncWriter(fileno(out), io));
+        warn_uring_fallback(io, async_in->fallback_reason(), in_filename == "-" ? "stdin" : in_filename);
+        warn_uring_fallback(io, async_out->fallback_reason(), out_filename == "-" ? "stdout" : out_filename);
+    }
+
+    ChunkedLineReader reader = async_in ? ChunkedLineReader(async_in.get()) : ChunkedLineReader(in);
+    BufferedWriter writer = async_out ? BufferedWriter(async_out.get()) : BufferedWriter(out);
+
+    ConvertSetup setup;
+    if (multi_channel) {
+        setup.channel_table = &channel_table;
+        setup.snapshot = snapshot.is_open() ? &snapshot : NULL;
+        setup.on_gpu = on_gpu;
+        setup.threads = threads;
+    } else if (use_fixed_point) {
+        setup.fixed_point = &fixed_point;
+    } else {
+        setup.model = &model;
+        setup.lookup = use_lookup ? &lookup : NULL;
+    }
+
+    StreamResult result;
+    convert_stream(reader, writer, setup, result);
+    if (result.status == STREAM_OK && async_out && !async_out->finish()) {
+        result.status = STREAM_WRITE_FAILED;
+    }
+
+    if (in != stdin) {
+        fclose(in);
+    }
+    if (out != stdout && fclose(out) != 0 && result.status == STREAM_OK) {
+        result.status = STREAM_WRITE_FAILED;
+    }
+
+    if (result.status != STREAM_OK) {
+        cerr << "Error: " << stream_error_message(result, in_filename, out_filename) << "\n";
+        return 1;
+    }
+
+    if (snapshot.damaged() > 0) {
+        cerr << "Warning: Damaged channel records in '" << snapshot_filename << "' were skipped: "
+             << snapshot.damaged() << "; their samples came out as nan.\n";
+    }
+
+    cerr << "Converted " << result.converted << " readings";
+    if (result.threads > 0) {
+        cerr << " on " << result.threads << (result.threads == 1 ? " thread" : " threads")
+             << " over " << result.node_count
+             << (result.node_count == 1 ? " NUMA node" : " NUMA nodes") << ",";
+    }
+    cerr << " with " << io_summary(async_in.get(), async_out.get()) << ".\n";
+    return 0;
+}
+
+/*
+ * Convert a binary sample file (see sample_file.h) for batch_convert()
+ * The raw column is mapped and fed to the apply kernels in place, a block
+ * at a time; only the formatted output is buffered. Temperature-
+ * compensated models read the temperature column alongside it.
+ * Returns 0, or the exit code after printing the error.
+ */
+int convert_sample_file(const string& in_filename, const string& out_filename, IoBackend io,
+                        const CalibrationModel& model, const AdcLookupTable* lookup) {
+    MappedSampleFile samples;
+    SampleStatus status = samples.open(in_filename);
+    if (status != SAMPLE_OK) {
+        cerr << "Error: " << sample_status_message(status, in_filename) << "\n";
+        return 1;
+    }
+
+    const SampleColumn& raw = samples.column(COLUMN_RAW);
+    if (raw.data == NULL) {
+        cerr << "Error: '" << in_filename << "' has no raw column.\n";
+        return 1;
+    }
+    if (lookup != NULL && raw.type != SAMPLE_INT16 && raw.type != SAMPLE_INT32) {
+        cerr << "Error: --adc needs an int16 or int32 raw column, but '" << in_filename
+             << "' holds " << sample_type_name(raw.type) << ".\n";
+        return 1;
+    }
+    const SampleColumn& temperature = samples.column(COLUMN_TEMPERATURE);
+    bool with_temperature = model_needs_temperature(model);
+    if (with_temperature && temperature.data == NULL) {
+        cerr << "Error: '" << in_filename << "' has no temperature column for a"
+             << " temperature-compensated model.\n";
+        return 1;
+    }
+
+    FILE* out = stdout;
+    if (out_filename != "-") {
+        out = fopen(out_filename.c_str(), "w");
+        if (out == NULL) {
+            cerr << "Error: Cannot create file '" << out_filename << "'\n";
+            return 1;
+        }
+    }
+
+    unique_ptr<AsyncWriter> async_out;
+    if (io != IO_SYNC) {
+        async_out.reset(new AsyncWriter(fileno(out), io));
+        warn_uring_fallback(io, async_out->fallback_reason(), out_filename == "-" ? "stdout" : out_filename);
+    }
+
+    const size_t BLOCK_SIZE = 4096;
+    AlignedBuffer<double> scratch(raw.type == SAMPLE_FLOAT64 ? 0 : BLOCK_SIZE);
+    AlignedBuffer<double> temperature_scratch(with_temperature && temperature.type != SAMPLE_FLOAT64
+                                              ? BLOCK_SIZE : 0);
+    AlignedBuffer<double> real_values(BLOCK_SIZE);
+    BufferedWriter writer = async_out ? BufferedWriter(async_out.get()) : BufferedWriter(out);
+    size_t rows = static_cast<size_t>(samples.row_count());
+
+    for (size_t first = 0; first < rows; first += BLOCK_SIZE) {
+        size_t n = min(BLOCK_SIZE, rows - first);
+
+        {
+            StageTimer timer(STAT_CONVERT, n);
+            if (with_temperature) {
+                apply_model(model, sample_values(raw, first, n, scratch.data()),
+                            sample_values(temperature, first, n, temperature_scratch.data()),
+                            real_values.data(), n);
+            } else {
+                convert_sample_block(model, lookup, raw, first, n, scratch.data(), real_values.data());
+            }
+        }
+        record_startup(n);
+
+        // Same format as the text path
+        {
+            StageTimer timer(STAT_FORMAT, n);
+            for (size_t i = 0; i < n; i++) {
+                writer.write_fixed(real_values[i], 10);
+                writer.put('\n');
+            }
+        }
+    }
+
+    writer.flush();
+
+    bool write_failed = writer.failed() || (async_out && !async_out->finish());
+    if (out != stdout && fclose(out) != 0) {
+        write_failed = true;
+    }
+    if (write_failed) {
+        cerr << "Error: Writing to '" << out_filename << "' failed.\n";
+        return 1;
+    }
+
+    cerr << "Converted " << rows << " readings with mapped reads and "
+         << io_backend_name(async_out ? async_out->backend() : IO_SYNC) << " writes.\n";
+    return 0;
+}
+
+/*
+ * --io uring falls back to the thread backend for a stream io_uring cannot
+ * take; say so, or a benchmark of "uring" would quietly measure the thread
+ * engine. IO_AUTO falls back silently.
+ */
+void warn_uring_fallback(IoBackend io, const string& reason, const string& name) {
+    if (io == IO_URING && !reason.empty()) {
+        cerr << "Warning: Cannot use io_uring for '" << name << "' (" << reason
+             << "); using the thread backend.\n";
+    }
+}
+
+// The backends a convert read and wrote with, for its summary
+string io_summary(const AsyncReader* in, const AsyncWriter* out) {
+    IoBackend read = in != NULL ? in->backend() : IO_SYNC;
+    IoBackend write = out != NULL ? out->backend() : IO_SYNC;
+    if (read == write) {
+        return string(io_backend_name(read)) + " I/O";
+    }
+    return string(io_backend_name(read)) + " reads and " + io_backend_name(write) + " writes";
+}
+
+/*
+ * Convert raw values first .. first + n - 1 of a mapped column
+ * Linear models and ADC lookups read the column in its own type; the
+ * nonlinear kernels take doubles, so other columns are widened into
+ * scratch first.
+ */
+void convert_sample_block(const CalibrationModel& model, const AdcLookupTable* lookup,
+                          const SampleColumn& raw, size_t first, size_t n,
+                          double* scratch, double* real_values) {
+    if (lookup != NULL) {
+        if (raw.type == SAMPLE_INT16) {
+            apply_lookup(*lookup, static_cast<const int16_t*>(raw.data) + first, real_values, n);
+        } else {
+            apply_lookup(*lookup, static_cast<const int32_t*>(raw.data) + first, real_values, n);
+        }
+        return;
+    }
+
+    if (raw.type == SAMPLE_FLOAT64) {
+        apply_model(model, static_cast<const double*>(raw.data) + first, real_values, n);
+        return;
+    }
+
+    if (model.kind != MODEL_LINEAR) {
+        widen_samples(raw, first, n, scratch);
+        apply_model(model, scratch, real_values, n);
+        return;
+    }
+
+    switch (raw.type) {
+        case SAMPLE_INT16:
+            apply_calibration(model.linear, static_cast<const int16_t*>(raw.data) + first, real_values, n);
+            break;
+        case SAMPLE_INT32:
+            apply_calibration(model.linear, static_cast<const int32_t*>(raw.data) + first, real_values, n);
+            break;
+        case SAMPLE_FLOAT32:
+            apply_calibration(model.linear, static_cast<const float*>(raw.data) + first, real_values, n);
+            break;
+        case SAMPLE_FLOAT64:
+            break;
+    }
+}
+
+/*
+ * Stream the "reference,raw" points in in_filename ("-" = stdin) into fit,
+ * and into all_raw / all_reference as well when keep_points is set.
+ * Returns 0, or the exit code after printing the error.
+ */
+int read_fit_points(const string& in_filename, unsigned threads, bool keep_points,
+                    FitAccumulator& fit, vector<double>& all_raw, vector<double>& all_reference) {
+    // The workers start once for the whole input
+    FitPool pool(threads);
+
+    if (in_filename != "-" && is_sample_file(in_filename)) {
+        return read_sample_fit_points(in_filename, FIT_CHUNK_POINTS, pool, keep_points,
+                                      fit, all_raw, all_reference);
+    }
+
+    FILE* in = stdin;
+    if (in_filename != "-") {
+        in = fopen(in_filename.c_str(), "r");
+        if (in == NULL) {
+            cerr << "Error: Cannot open file '" << in_filename << "'\n";
+            return 1;
+        }
+    }
+
+    ChunkedLineReader reader(in);
+    StreamResult result;
+    fit_stream(reader, pool, keep_points, fit, all_raw, all_reference, result);
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (result.status != STREAM_OK) {
+        cerr << "Error: " << stream_error_message(result, in_filename, "") << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * Read the points of a binary sample file (see sample_file.h) for
+ * read_fit_points(), in the same chunks as the text path so both give
+ * bit-identical fits. float64 columns are reduced in place; other types
+ * are widened a chunk at a time.
+ * Returns 0, or the exit code after printing the error.
+ */
+int read_sample_fit_points(const string& in_filename, size_t chunk_points, FitPool& pool,
+                           bool keep_points, FitAccumulator& fit,
+                           vector<double>& all_raw, vector<double>& all_reference) {
+    MappedSampleFile samples;
+    SampleStatus status = samples.open(in_filename);
+    if (status != SAMPLE_OK) {
+        cerr << "Error: " << sample_status_message(status, in_filename) << "\n";
+        return 1;
+    }
+
+    const SampleColumn& raw = samples.column(COLUMN_RAW);
+    const SampleColumn& reference = samples.column(COLUMN_REFERENCE);
+    if (raw.data == NULL || reference.data == NULL) {
+        cerr << "Error: '" << in_filename << "' needs a reference and a raw column to fit.\n";
+        return 1;
+    }
+
+    bool in_place = raw.type == SAMPLE_FLOAT64 && reference.type == SAMPLE_FLOAT64;
+    AlignedBuffer<double> raw_chunk(in_place ? 0 : chunk_points);
+    AlignedBuffer<double> reference_chunk(in_place ? 0 : chunk_points);
+    size_t rows = static_cast<size_t>(samples.row_count());
+
+    for (size_t first = 0; first < rows; first += chunk_points) {
+        size_t n = min(chunk_points, rows - first);
+        const double* chunk_raw;
+        const double* chunk_reference;
+
+        if (in_place) {
+            chunk_raw = static_cast<const double*>(raw.data) + first;
+            chunk_reference = static_cast<const double*>(reference.data) + first;
+        } else {
+            widen_samples(raw, first, n, raw_chunk.data());
+            widen_samples(reference, first, n, reference_chunk.data());
+            chunk_raw = raw_chunk.data();
+            chunk_reference = reference_chunk.data();
+        }
+
+        fit.merge(pool.fit(chunk_raw, chunk_reference, n));
+        if (keep_points) {
+            all_raw.insert(all_raw.end(), chunk_raw, chunk_raw + n);
+            all_reference.insert(all_reference.end(), chunk_reference, chunk_reference + n);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * BATCH FIT
+ *
+ * Streams (reference, raw) points from a file or stdin and folds them
+ * into a FitAccumulator a chunk at a time, summing each chunk on all
+ * cores. The input is read in fixed-size chunks and only one chunk of
+ * points is kept, so memory use stays constant however large the
+ * dataset is.
+ * --model polynomial:N or piecewise:N fits a nonlinear model instead;
+ * those fits keep every point in memory.
+ * --model temperature:R,T fits a temperature-compensated surface of raw
+ * degree R and temperature degree T from "reference,raw,temperature"
+ * points (see fit_temperature_points()).
+ * --method theil-sen, ransac or huber fits the line robustly, so bad
+ * reference readings do not pull it off (see robust.h); these keep every
+ * point in memory too.
+ * A least squares line is saved with its fit state (the moments behind it).
+ * The fit's R squared, residual RMS and (for least squares) standard errors
+ * and 95% confidence intervals come from the same moments; they are
+ * printed and saved as comments in the calibration file.
+ * --update FILE starts from the fit state saved in FILE, so new points
+ * are added without the old ones; --retract FILE takes back points that
+ * were fitted before. With --update, --in is optional.
+ * Blank lines and lines starting with '#' are skipped.
+ */
+int batch_fit(int argc, char* argv[]) {
+    string in_filename, out_filename = "-";
+    string update_filename, retract_filename;
+    unsigned threads = 0;
+    ModelKind model_kind = MODEL_LINEAR;
+    long model_size = 0;   // Degree or segment count
+    long temperature_degree = 0;
+    FitMethod method = FIT_LEAST_SQUARES;
+    RobustFitOptions robust_options;
+
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Error: Option '" << option << "' needs a value.\n";
+            print_usage();
+            return 2;
+        }
+
+        if (option == "--in") {
+            in_filename = argv[++i];
+        } else if (option == "--out") {
+            out_filename = argv[++i];
+        } else if (option == "--method") {
+            if (!parse_fit_method(argv[++i], method)) {
+                cerr << "Error: --method needs least-squares, theil-sen, ransac or huber.\n";
+                return 2;
+            }
+        } else if (option == "--threshold") {
+            char* end;
+            robust_options.threshold = strtod(argv[++i], &end);
+            if (*end != '\0' || !(robust_options.threshold > 0.0)) {
+                cerr << "Error: --threshold needs a distance > 0.\n";
+                return 2;
+            }
+        } else if (option == "--update") {
+            update_filename = argv[++i];
+        } else if (option == "--retract") {
+            retract_filename = argv[++i];
+        } else if (option == "--threads") {
+            char* end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 0) {
+                cerr << "Error: --threads needs a count >= 0.\n";
+                return 2;
+            }
+            threads = static_cast<unsigned>(value);
+        } else if (option == "--model") {
+            string model_text = argv[++i];
+            size_t colon = model_text.find(':');
+            string name = model_text.substr(0, colon);
+            char* end = NULL;
+            if (colon != string::npos) {
+                model_size = strtol(model_text.c_str() + colon + 1, &end, 10);
+            }
+
+            if (name == "linear" && colon == string::npos) {
+                model_kind = MODEL_LINEAR;
+            } else if (name == "polynomial" && end != NULL && *end == '\0'
+                       && model_size >= 2 && model_size <= MAX_POLYNOMIAL_DEGREE) {
+                model_kind = MODEL_POLYNOMIAL;
+            } else if (name == "piecewise" && end != NULL && *end == '\0'
+                       && model_size >= 1 && model_size <= static_cast<long>(MAX_PIECEWISE_SEGMENTS)) {
+                model_kind = MODEL_PIECEWISE;
+            } else if (name == "temperature" && end != NULL && *end == ','
+                       && model_size >= 1 && model_size <= MAX_POLYNOMIAL_DEGREE
+                       && (temperature_degree = strtol(end + 1, &end, 10)) >= 1
+                       && temperature_degree <= MAX_TEMPERATURE_DEGREE && *end == '\0') {
+                model_kind = MODEL_TEMPERATURE;
+            } else {
+                cerr << "Error: --model needs linear, polynomial:2.." << MAX_POLYNOMIAL_DEGREE
+                     << ", piecewise:1.." << MAX_PIECEWISE_SEGMENTS << " or temperature:1.."
+                     << MAX_POLYNOMIAL_DEGREE << ",1.." << MAX_TEMPERATURE_DEGREE << ".\n";
+                return 2;
+            }
+        } else {
+            cerr << "Error: Unknown option '" << option << "'\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (model_kind != MODEL_LINEAR && method != FIT_LEAST_SQUARES) {
+        cerr << "Error: --method applies to linear fits only.\n";
+        return 2;
+    }
+    if ((model_kind != MODEL_LINEAR || method != FIT_LEAST_SQUARES)
+        && !(update_filename.empty() && retract_filename.empty())) {
+        cerr << "Error: --update and --retract work with least squares linear fits only.\n";
+        return 2;
+    }
+    robust_options.threads = threads;
+    if (!retract_filename.empty() && update_filename.empty()) {
+        cerr << "Error: --retract needs --update FILE with the fit to take the points from.\n";
+        return 2;
+    }
+    if (model_kind == MODEL_TEMPERATURE) {
+        return fit_temperature_points(in_filename.empty() ? "-" : in_filename, out_filename, threads,
+                                      static_cast<int>(model_size), static_cast<int>(temperature_degree));
+    }
+
+    FitAccumulator fit;
+    if (!update_filename.empty()) {
+        Calibration saved;
+        LoadStatus status = read_calibration_file(update_filename, saved, fit);
+        if (status != LOAD_OK) {
+            cerr << "Error: " << load_status_message(status, update_filename) << "\n";
+            return 1;
+        }
+        if (fit.count == 0) {
+            cerr << "Error: '" << update_filename << "' has no fit state to update.\n";
+            return 1;
+        }
+    } else if (in_filename.empty()) {
+        in_filename = "-";
+    }
+
+    // Every point, for the nonlinear models
+    vector<double> all_raw, all_reference;
+    if (!in_filename.empty()) {
+        FitAccumulator added;
+        bool keep_points = model_kind != MODEL_LINEAR || method != FIT_LEAST_SQUARES;
+        int read_result = read_fit_points(in_filename, threads, keep_points,
+                                          added, all_raw, all_reference);
+        if (read_result != 0) {
+            return read_result;
+        }
+        fit.merge(added);
+    }
+
+    if (!retract_filename.empty()) {
+        FitAccumulator retracted;
+        int read_result = read_fit_points(retract_filename, threads, false,
+                                          retracted, all_raw, all_reference);
+        if (read_result != 0) {
+            return read_result;
+        }
+        if (retracted.count > fit.count) {
+            cerr << "Error: Cannot retract " << retracted.count << " points from a fit of "
+                 << fit.count << ".\n";
+            return 1;
+        }
+        fit.subtract(retracted);
+    }
+
+    Calibration cal;
+    if (fit.count < 2) {
+        cerr << "Error: Need at least 2 points, got " << fit.count << ".\n";
+        return 1;
+    }
+    if (!compute_calibration(fit, cal)) {
+        cerr << "Error: All raw readings are identical. Cannot compute calibration.\n";
+        return 1;
+    }
+
+    if (model_kind != MODEL_LINEAR) {
+        CalibrationModel model;
+        bool fitted;
+        {
+            StageTimer timer(STAT_FIT, all_raw.size());
+            if (model_kind == MODEL_POLYNOMIAL) {
+                fitted = fit_polynomial(all_raw.data(), all_reference.data(), all_raw.size(),
+                                        static_cast<int>(model_size), model);
+            } else {
+                fitted = fit_piecewise(all_raw.data(), all_reference.data(), all_raw.size(),
+                                       static_cast<size_t>(model_size), model);
+            }
+        }
+
+        if (!fitted) {
+            cerr << "Error: Too few distinct raw readings for this model.\n";
+            return 1;
+        }
+
+        bool written = out_filename == "-" ? write_model(stdout, model)
+                                           : write_model_file(out_filename, model);
+        if (!written) {
+            cerr << "Error: Cannot create file '" << out_filename << "'\n";
+            return 1;
+        }
+
+        cerr << "Fitted " << fit.count << " points: " << model_description(model) << "\n";
+        return 0;
+    }
+
+    // A robust line does not follow from the moments, so it has no fit state
+    FitAccumulator state = fit;
+    if (method != FIT_LEAST_SQUARES) {
+        if (!fit_line(method, all_raw.data(), all_reference.data(), all_raw.size(),
+                      robust_options, cal)) {
+            cerr << "Error: All raw readings are identical. Cannot compute calibration.\n";
+            return 1;
+        }
+        state = FitAccumulator();
+    }
+
+    // Quality of the final line over every point, from the same moments
+    FitDiagnostics diagnostics;
+    compute_diagnostics(fit, cal, method == FIT_LEAST_SQUARES, diagnostics);
+
+    bool written = out_filename == "-" ? write_calibration(stdout, cal, state, &diagnostics)
+                                       : write_calibration_file(out_filename, cal, state, &diagnostics);
+    if (!written) {
+        cerr << "Error: Cannot create file '" << out_filename << "'\n";
+        return 1;
+    }
+
+    cerr << fixed << setprecision(10);
+    cerr << "Fitted " << fit.count << " points";
+    if (method != FIT_LEAST_SQUARES) {
+        cerr << " (" << fit_method_name(method) << ")";
+    }
+    cerr << ": Slope = " << cal.slope << ", Offset = " << cal.offset << "\n";
+    print_diagnostics(cerr, diagnostics);
+    return 0;
+}
+
+/*
+ * Fit a temperature-compensated model for batch_fit() and write it out
+ * The surface needs every point at once, so all of them are held in
+ * memory; the normal equations are then summed on all cores.
+ * Returns 0, or the exit code after printing the error.
+ */
+int fit_temperature_points(const string& in_filename, const string& out_filename,
+                           unsigned threads, int raw_degree, int temperature_degree) {
+    vector<double> raw, temperature, reference;
+    int read_result = read_temperature_points(in_filename, raw, temperature, reference);
+    if (read_result != 0) {
+        return read_result;
+    }
+
+    CalibrationModel model;
+    bool fitted;
+    {
+        StageTimer timer(STAT_FIT, raw.size());
+        fitted = fit_temperature_model(raw.data(), temperature.data(), reference.data(), raw.size(),
+                                       raw_degree, temperature_degree, threads, model);
+    }
+    if (!fitted) {
+        cerr << "Error: Too few distinct raw readings and temperatures for this model ("
+             << raw.size() << " points).\n";
+        return 1;
+    }
+
+    bool written = out_filename == "-" ? write_model(stdout, model)
+                                       : write_model_file(out_filename, model);
+    if (!written) {
+        cerr << "Error: Cannot create file '" << out_filename << "'\n";
+        return 1;
+    }
+
+    cerr << "Fitted " << raw.size() << " points: " << model_description(model) << "\n";
+    return 0;
+}
+
+/*
+ * Read every "reference,raw,temperature" point in in_filename ("-" =
+ * stdin), or the reference, raw and temperature columns of a sample file
+ * Returns 0, or the exit code after printing the error.
+ */
+int read_temperature_points(const string& in_filename, vector<double>& raw,
+                            vector<double>& temperature, vector<double>& reference) {
+    if (in_filename != "-" && is_sample_file(in_filename)) {
+        MappedSampleFile samples;
+        SampleStatus status = samples.open(in_filename);
+        if (status != SAMPLE_OK) {
+            cerr << "Error: " << sample_status_message(status, in_filename) << "\n";
+            return 1;
+        }
+
+        const SampleColumn& raw_column = samples.column(COLUMN_RAW);
+        const SampleColumn& temperature_column = samples.column(COLUMN_TEMPERATURE);
+        const SampleColumn& reference_column = samples.column(COLUMN_REFERENCE);
+        if (raw_column.data == NULL || temperature_column.data == NULL
+            || reference_column.data == NULL) {
+            cerr << "Error: '" << in_filename
+                 << "' needs a reference, a raw and a temperature column to fit.\n";
+            return 1;
+        }
+
+        size_t rows = static_cast<size_t>(samples.row_count());
+        raw.resize(rows);
+        temperature.resize(rows);
+        reference.resize(rows);
+        widen_samples(raw_column, 0, rows, raw.data());
+        widen_samples(temperature_column, 0, rows, temperature.data());
+        widen_samples(reference_column, 0, rows, reference.data());
+        return 0;
+    }
+
+    FILE* in = stdin;
+    if (in_filename != "-") {
+        in = fopen(in_filename.c_str(), "r");
+        if (in == NULL) {
+            cerr << "Error: Cannot open file '" << in_filename << "'\n";
+            return 1;
+        }
+    }
+
+    ChunkedLineReader reader(in);
+    char* line;
+    size_t length;
+    unsigned long long line_number = 0;
+    bool parse_error = false;
+
+    {
+        StageTimer timer(STAT_PARSE);
+        while (reader.next_line(line, length)) {
+            line_number++;
+
+            // Skip blank lines and comments
+            if (is_blank_or_comment(line, line + length)) {
+                continue;
+            }
+
+            double reference_value, raw_reading, temperature_value;
+            if (!parse_temperature_point(line, line + length, reference_value, raw_reading,
+                                         temperature_value)) {
+                cerr << "Error: Line " << line_number
+                     << ": expected \"reference,raw,temperature\" but got '" << line << "'\n";
+                parse_error = true;
+                break;
+            }
+
+            raw.push_back(raw_reading);
+            temperature.push_back(temperature_value);
+            reference.push_back(reference_value);
+        }
+        timer.add_items(raw.size());
+    }
+
+    bool too_long = reader.line_too_long();
+    bool read_failed = reader.read_failed();
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (parse_error) {
+        return 1;
+    }
+    if (too_long) {
+        cerr << "Error: Line " << (line_number + 1) << " is too long.\n";
+        return 1;
+    }
+    if (read_failed) {
+        cerr << "Error: Reading '" << in_filename << "' failed.\n";
+        return 1;
+    }
+    return 0;
+}
+
+/*
+ * BATCH FIT TABLE
+ *
+ * Fits every channel of a production run in one go. The input holds one
+ * "channel,reference,raw" point per line, in any order; the points are
+ * grouped by channel and the channels are fitted in parallel (see
+ * channel_fit.h). Every fitted line goes into one binary calibration
+ * table, as pack would write it. Channels with fewer than 2 distinct raw
+ * readings are left out of the table and listed on stderr.
+ * With --device gpu (least squares only) the channels' sums are done on
+ * the GPU; the lines may then differ from a CPU fit in the last digits.
+ * All points are held in memory. Blank lines and lines starting with '#'
+ * are skipped.
+ */
+int batch_fit_table(int argc, char* argv[]) {
+    string in_filename, out_filename;
+    FitMethod method = FIT_LEAST_SQUARES;
+    RobustFitOptions robust_options;
+    ComputeDevice device = DEVICE_CPU;
+
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Error: Option '" << option << "' needs a value.\n";
+            print_usage();
+            return 2;
+        }
+
+        if (option == "--in") {
+            in_filename = argv[++i];
+        } else if (option == "--out") {
+            out_filename = argv[++i];
+        } else if (option == "--method") {
+            if (!parse_fit_method(argv[++i], method)) {
+                cerr << "Error: --method needs least-squares, theil-sen, ransac or huber.\n";
+                return 2;
+            }
+        } else if (option == "--threshold") {
+            char* end;
+            robust_options.threshold = strtod(argv[++i], &end);
+            if (*end != '\0' || !(robust_options.threshold > 0.0)) {
+                cerr << "Error: --threshold needs a distance > 0.\n";
+                return 2;
+            }
+        } else if (option == "--threads") {
+            char* end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 0) {
+                cerr << "Error: --threads needs a count >= 0.\n";
+                return 2;
+            }
+            robust_options.threads = static_cast<unsigned>(value);
+        } else if (option == "--device") {
+            if (!parse_compute_device(argv[++i], device)) {
+                cerr << "Error: --device needs cpu, gpu or auto.\n";
+                return 2;
+            }
+        } else {
+            cerr << "Error: Unknown option '" << option << "'\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (in_filename.empty() || out_filename.empty()) {
+        cerr << "Error: fit-table needs --in FILE and --out FILE.\n";
+        print_usage();
+        return 2;
+    }
+    if (device == DEVICE_GPU && method != FIT_LEAST_SQUARES) {
+        cerr << "Error: --device gpu fits least-squares lines only.\n";
+        return 2;
+    }
+    FILE* in = stdin;
+    if (in_filename != "-") {
+        in = fopen(in_filename.c_str(), "r");
+        if (in == NULL) {
+            cerr << "Error: Cannot open file '" << in_filename << "'\n";
+            return 1;
+        }
+    }
+
+    vector<uint32_t> channels;
+    vector<double> raw_readings, reference_values;
+
+    ChunkedLineReader reader(in);
+    char* line;
+    size_t length;
+    unsigned long long line_number = 0;
+    bool parse_error = false;
+
+    {
+        StageTimer timer(STAT_PARSE);
+
+        while (reader.next_line(line, length)) {
+            line_number++;
+
+            if (is_blank_or_comment(line, line + length)) {
+                continue;
+            }
+
+            uint32_t channel;
+            double reference_value, raw_reading;
+            if (!parse_channel_point(line, line + length, channel, reference_value, raw_reading)) {
+                cerr << "Error: Line " << line_number << ": expected \"channel,reference,raw\" but got '"
+                     << line << "'\n";
+                parse_error = true;
+                break;
+            }
+
+            channels.push_back(channel);
+            reference_values.push_back(reference_value);
+            raw_readings.push_back(raw_reading);
+        }
+        timer.add_items(channels.size());
+    }
+
+    bool too_long = reader.line_too_long();
+    bool read_failed = reader.read_failed();
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (parse_error) {
+        return 1;
+    }
+    if (too_long) {
+        cerr << "Error: Line " << (line_number + 1) << " is too long.\n";
+        return 1;
+    }
+    if (read_failed) {
+        cerr << "Error: Reading '" << in_filename << "' failed.\n";
+        return 1;
+    }
+    if (channels.empty()) {
+        cerr << "Error: '" << in_filename << "' holds no points.\n";
+        return 1;
+    }
+
+    device = method == FIT_LEAST_SQUARES ? choose_device(device) : DEVICE_CPU;
+
+    vector<ChannelFit> fits;
+    if (!fit_channels(channels.data(), raw_readings.data(), reference_values.data(), channels.size(),
+                      method, robust_options, fits, device)) {
+        uint32_t min_channel = *min_element(channels.begin(), channels.end());
+        uint32_t max_channel = *max_element(channels.begin(), channels.end());
+        cerr << "Error: Channel IDs " << min_channel << ".." << max_channel
+             << " span more than " << CALIBRATION_TABLE_MAX_CHANNELS << " channels.\n";
+        return 1;
+    }
+
+    size_t fitted;
+    int status = write_fitted_table(fits, out_filename, "'" + in_filename + "'", fitted);
+    if (status != 0) {
+        return status;
+    }
+
+    cerr << "Fitted " << fitted << " channels (" << (fits.size() - fitted) << " skipped) from "
+         << channels.size() << " points";
+    if (method != FIT_LEAST_SQUARES) {
+        cerr << " (" << fit_method_name(method) << ")";
+    }
+    // A GPU that failed during the fit was given up and the CPU took over
+    if (device == DEVICE_GPU && gpu_available()) {
+        cerr << " on " << gpu_device_name();
+    }
+    cerr << " into '" << out_filename << "'\n";
+    return 0;
+}
+
+/*
+ * Write the fitted channels of fits (in ascending channel order) into a
+ * calibration table, listing the ones that could not be fitted on stderr.
+ * fitted gets the number of channels written; source names where the
+ * points came from in the error message. Returns 0, or the exit code
+ * after printing the error.
+ */
+int write_fitted_table(const vector<ChannelFit>& fits, const string& out_filename,
+                       const string& source, size_t& fitted) {
+    // Lay the fitted channels out by ID; fits are in ascending channel order
+    uint32_t min_channel = fits.front().channel;
+    uint32_t max_channel = fits.back().channel;
+    uint32_t channel_count = max_channel - min_channel + 1;
+    vector<double> slopes(channel_count, 0.0);
+    vector<double> offsets(channel_count, 0.0);
+    vector<uint64_t> valid((channel_count + 63) / 64, 0);
+    fitted = 0;
+
+    for (size_t i = 0; i < fits.size(); i++) {
+        if (!fits[i].fitted) {
+            cerr << "Warning: Channel " << fits[i].channel << ": cannot fit " << fits[i].points
+                 << (fits[i].points == 1 ? " point" : " points")
+                 << " (need 2 distinct raw readings); left out of the table.\n";
+            continue;
+        }
+
+        uint32_t index = fits[i].channel - min_channel;
+        slopes[index] = fits[i].cal.slope;
+        offsets[index] = fits[i].cal.offset;
+        valid[index >> 6] |= uint64_t(1) << (index & 63);
+        fitted++;
+    }
+
+    if (fitted == 0) {
+        cerr << "Error: No channel in " << source << " could be fitted.\n";
+        return 1;
+    }
+
+    CalibrationTableView table;
+    table.first_channel = min_channel;
+    table.channel_count = channel_count;
+    table.slopes = slopes.data();
+    table.offsets = offsets.data();
+    table.valid = valid.data();
+
+    if (!write_calibration_table(out_filename, table)) {
+        cerr << "Error: Cannot create file '" << out_filename << "'\n";
+        return 1;
+    }
+
+    return 0;
+}
+
+/*
+ * BATCH FIT MOMENTS
+ *
+ * The node side of a sharded fit. The input holds one
+ * "channel,reference,raw" point per line, as for fit-table, and is
+ * streamed in fixed-size chunks: each chunk is grouped by channel and
+ * summed into the channels' least squares moments, so the memory used
+ * depends on the number of channels only. The moments go into a moment
+ * file for merge-moments (see moment_file.h). Chunk boundaries depend
+ * only on the input, so the file is the same for any --threads value.
+ */
+int batch_fit_moments(int argc, char* argv[]) {
+    const size_t MOMENT_CHUNK_POINTS = 16 * FIT_BLOCK_SIZE;
+
+    string in_filename, out_filename;
+    unsigned threads = 0;
+    ComputeDevice device = DEVICE_CPU;
+
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Error: Option '" << option << "' needs a value.\n";
+            print_usage();
+            return 2;
+        }
+
+        if (option == "--in") {
+            in_filename = argv[++i];
+        } else if (option == "--out") {
+            out_filename = argv[++i];
+        } else if (option == "--threads") {
+            char* end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 0) {
+                cerr << "Error: --threads needs a count >= 0.\n";
+                return 2;
+            }
+            threads = static_cast<unsigned>(value);
+        } else if (option == "--device") {
+            if (!parse_compute_device(argv[++i], device)) {
+                cerr << "Error: --device needs cpu, gpu or auto.\n";
+                return 2;
+            }
+        } else {
+            cerr << "Error: Unknown option '" << option << "'\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (in_filename.empty() || out_filename.empty()) {
+        cerr << "Error: fit-moments needs --in FILE and --out FILE.\n";
+        print_usage();
+        return 2;
+    }
+    FILE* in = stdin;
+    if (in_filename != "-") {
+        in = fopen(in_filename.c_str(), "r");
+        if (in == NULL) {
+            cerr << "Error: Cannot open file '" << in_filename << "'\n";
+            return 1;
+        }
+    }
+
+    device = choose_device(device);
+
+    AlignedBuffer<uint32_t> channel_chunk;
+    AlignedBuffer<double> raw_chunk, reference_chunk;
+    channel_chunk.reserve(MOMENT_CHUNK_POINTS);
+    raw_chunk.reserve(MOMENT_CHUNK_POINTS);
+    reference_chunk.reserve(MOMENT_CHUNK_POINTS);
+
+    MomentSet moments;
+    ChunkedLineReader reader(in);
+    char* line;
+    size_t length;
+    unsigned long long line_number = 0;
+    bool parse_error = false;
+    bool span_error = false;
+
+    // When the chunk being filled was started, for the parse stage stats
+    uint64_t parse_start = stats_enabled() ? stats_clock_ns() : 0;
+
+    while (true) {
+        bool more = reader.next_line(line, length);
+
+        if (!more || channel_chunk.size() == MOMENT_CHUNK_POINTS) {
+            if (parse_start != 0) {
+                record_stage(STAT_PARSE, stats_clock_ns() - parse_start, channel_chunk.size());
+            }
+            if (!moments.add(channel_chunk.data(), raw_chunk.data(), reference_chunk.data(),
+                             channel_chunk.size(), threads, device)) {
+                span_error = true;
+                break;
+            }
+            channel_chunk.clear();
+            raw_chunk.clear();
+            reference_chunk.clear();
+            parse_start = stats_enabled() ? stats_clock_ns() : 0;
+        }
+        if (!more) {
+            break;
+        }
+
+        line_number++;
+
+        if (is_blank_or_comment(line, line + length)) {
+            continue;
+        }
+
+        uint32_t channel;
+        double reference_value, raw_reading;
+        if (!parse_channel_point(line, line + length, channel, reference_value, raw_reading)) {
+            cerr << "Error: Line " << line_number << ": expected \"channel,reference,raw\" but got '"
+                 << line << "'\n";
+            parse_error = true;
+            break;
+        }
+
+        channel_chunk.push_back(channel);
+        reference_chunk.push_back(reference_value);
+        raw_chunk.push_back(raw_reading);
+    }
+
+    bool too_long = reader.line_too_long();
+    bool read_failed = reader.read_failed();
+
+    if (in != stdin) {
+        fclose(in);
+    }
+
+    if (parse_error) {
+        return 1;
+    }
+    if (span_error) {
+        uint32_t min_channel = *min_element(channel_chunk.data(), channel_chunk.data() + channel_chunk.size());
+        uint32_t max_channel = *max_element(channel_chunk.data(), channel_chunk.data() + channel_chunk.size());
+        cerr << "Error: Channel IDs " << min_channel << ".." << max_channel
+             << " span more than " << CALIBRATION_TABLE_MAX_CHANNELS << " channels.\n";
+        return 1;
+    }
+    if (too_long) {
+        cerr << "Error: Line " << (line_number + 1) << " is too long.\n";
+        return 1;
+    }
+    if (read_failed) {
+        cerr << "Error: Reading '" << in_filename << "' failed.\n";
+        return 1;
+    }
+    if (moments.size() == 0) {
+        cerr << "Error: '" << in_filename << "' holds no points.\n";
+        return 1;
+    }
+
+    if (!write_moment_file(out_filename, moments)) {
+        cerr << "Error: Cannot create file '" << out_filename << "'\n";
+        return 1;
+    }
+
+    cerr << "Summed " << moments.points() << " points of " << moments.size() << " channels";
+    if (device == DEVICE_GPU && gpu_available()) {
+        cerr << " on " << gpu_device_name();
+    }
+    cerr << " into '" << out_filename << "'\n";
+    return 0;
+}
+
+/*
+ * BATCH MERGE MOMENTS
+ *
+ * The coordinator side of a sharded fit: merges the moment files written
+ * by fit-moments (or by earlier merges) in the order given, then fits
+ * every channel's line from the merged moments into a calibration table
+ * (--out) and/or writes the merged moments to a new moment file
+ * (--moments-out) for a further stage of merging. A channel whose shards
+ * are spread over several files gets the same line as if fit-table had
+ * seen all its points, to rounding. Every file is checked before any
+ * output is written.
+ */
+int batch_merge_moments(int argc, char* argv[]) {
+    vector<string> in_filenames;
+    string out_filename, moments_filename;
+
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Error: Option '" << option << "' needs a value.\n";
+            print_usage();
+            return 2;
+        }
+
+        if (option == "--in") {
+            in_filenames.push_back(argv[++i]);
+        } else if (option == "--out") {
+            out_filename = argv[++i];
+        } else if (option == "--moments-out") {
+            moments_filename = argv[++i];
+        } else {
+            cerr << "Error: Unknown option '" << option << "'\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (in_filenames.empty() || (out_filename.empty() && moments_filename.empty())) {
+        cerr << "Error: merge-moments needs --in FILE and --out FILE or --moments-out FILE.\n";
+        print_usage();
+        return 2;
+    }
+
+    MomentSet merged;
+    for (size_t i = 0; i < in_filenames.size(); i++) {
+        MomentSet shard;
+        MomentStatus status = read_moment_file(in_filenames[i], shard);
+        if (status != MOMENTS_OK) {
+            cerr << "Error: " << moment_status_message(status, in_filenames[i]) << "\n";
+            return 1;
+        }
+        merged.merge(shard);
+    }
+
+    if (merged.size() == 0) {
+        cerr << "Error: The moment files hold no points.\n";
+        return 1;
+    }
+
+    cerr << "Merged " << merged.points() << " points of " << merged.size() << " channels from "
+         << in_filenames.size() << (in_filenames.size() == 1 ? " file\n" : " files\n");
+
+    if (!out_filename.empty()) {
+        uint32_t min_channel = merged.channels().begin()->first;
+        uint32_t max_channel = merged.channels().rbegin()->first;
+        if (max_channel - min_channel >= CALIBRATION_TABLE_MAX_CHANNELS) {
+            cerr << "Error: Channel IDs " << min_channel << ".." << max_channel
+                 << " span more than " << CALIBRATION_TABLE_MAX_CHANNELS << " channels.\n";
+            return 1;
+        }
+
+        vector<ChannelFit> fits;
+        merged.fit(fits);
+
+        size_t fitted;
+        int status = write_fitted_table(fits, out_filename, "the moment files", fitted);
+        if (status != 0) {
+            return status;
+        }
+        cerr << "Fitted " << fitted << " channels (" << (fits.size() - fitted) << " skipped) into '"
+             << out_filename << "'\n";
+    }
+
+    if (!moments_filename.empty()) {
+        if (!write_moment_file(moments_filename, merged)) {
+            cerr << "Error: Cannot create file '" << moments_filename << "'\n";
+            return 1;
+        }
+        cerr << "Wrote the merged moments to '" << moments_filename << "'\n";
+    }
+    return 0;
+}
+
+/*
+ * BATCH FIXED POINT
+ *
+ * Derives the integer form of a linear calibration for every code of one
+ * ADC (see fixed_point.h) and writes the calibration back with it, keeping
+ * the fit state, so the same file deploys to gateways without an FPU.
+ * The formats and the error against the double line are reported; the
+ * error is measured over every code of the ADC.
+ */
+int batch_fixed_point(int argc, char* argv[]) {
+    string cal_filename, adc_text, out_filename = "-";
+    int output_bits = -1;
+
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Error: Option '" << option << "' needs a value.\n";
+            print_usage();
+            return 2;
+        }
+
+        if (option == "--cal") {
+            cal_filename = argv[++i];
+        } else if (option == "--adc") {
+            adc_text = argv[++i];
+        } else if (option == "--output-bits") {
+            char* end;
+            long value = strtol(argv[++i], &end, 10);
+            if (*end != '\0' || value < 0 || value > 31) {
+                cerr << "Error: --output-bits needs a count from 0 to 31.\n";
+                return 2;
+            }
+            output_bits = static_cast<int>(value);
+        } else if (option == "--out") {
+            out_filename = argv[++i];
+        } else {
+            cerr << "Error: Unknown option '" << option << "'\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (cal_filename.empty() || adc_text.empty()) {
+        cerr << "Error: fixed-point needs --cal FILE and --adc FORMAT.\n";
+        print_usage();
+        return 2;
+    }
+
+    int adc_bits;
+    bool adc_signed;
+    if (!parse_adc_format(adc_text, adc_bits, adc_signed)) {
+        cerr << "Error: --adc needs u1..u" << MAX_ADC_BITS << " or s1..s" << MAX_ADC_BITS
+             << " (e.g. u12 for a 12-bit unsigned ADC).\n";
+        return 2;
+    }
+
+    Calibration cal;
+    FitAccumulator fit;
+    LoadStatus status = read_calibration_file(cal_filename, cal, fit);
+    if (status != LOAD_OK) {
+        cerr << "Error: " << load_status_message(status, cal_filename) << "\n";
+        return 1;
+    }
+
+    int32_t first_code = adc_signed ? -(int32_t(1) << (adc_bits - 1)) : 0;
+    int32_t last_code = adc_signed ? (int32_t(1) << (adc_bits - 1)) - 1 : (int32_t(1) << adc_bits) - 1;
+
+    FixedPointCalibration fixed;
+    if (!make_fixed_point(cal, first_code, last_code, output_bits, fixed)) {
+        cerr << "Error: The real values of codes " << first_code << " to " << last_code;
+        if (output_bits >= 0) {
+            cerr << " with " << output_bits << " fraction bits";
+        }
+        cerr << " do not fit in 32 bits.\n";
+        return 1;
+    }
+
+    FixedPointError error;
+    fixed_point_error(cal, fixed, error);
+
+    // The quality comments follow from the fit state; without one they are dropped
+    FitDiagnostics diagnostics;
+    bool has_diagnostics = fit.count > 0 && compute_diagnostics(fit, cal, true, diagnostics);
+    const FitDiagnostics* quality = has_diagnostics ? &diagnostics : NULL;
+
+    bool written = out_filename == "-" ? write_calibration(stdout, cal, fit, quality, &fixed)
+                                       : write_calibration_file(out_filename, cal, fit, quality, &fixed);
+    if (!written) {
+        cerr << "Error: Cannot create file '" << out_filename << "'\n";
+        return 1;
+    }
+
+    cerr << "Codes " << first_code << " to " << last_code << ": Slope = " << fixed.slope
+         << " and Offset = " << fixed.offset << " in Q" << fixed.slope_bits
+         << ", output in Q" << fixed.output_bits << "\n";
+    cerr << scientific << setprecision(3);
+    cerr << "  LSB " << error.lsb << ", error bound " << error.bound << ", largest error "
+         << error.max_error << " (code " << error.worst_code << ")\n";
+    return 0;
+}
+
+/*
+ * BATCH PACK
+ *
+ * Converts per-sensor text calibrations (the two-line files written by
+ * save_calibration_to_file()) into one binary calibration table, or a
+ * snapshot (see snapshot.h) that keeps their fit states as well, or both.
+ * The list file holds one "channel filename" entry per line; blank lines
+ * and lines starting with '#' are skipped. Channels missing from the list
+ * are marked invalid in the table.
+ */
+int batch_pack(int argc, char* argv[]) {
+    string list_filename, out_filename, snapshot_filename;
+
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Error: Option '" << option << "' needs a value.\n";
+            print_usage();
+            return 2;
+        }
+
+        if (option == "--list") {
+            list_filename = argv[++i];
+        } else if (option == "--out") {
+            out_filename = argv[++i];
+        } else if (option == "--snapshot") {
+            snapshot_filename = argv[++i];
+        } else {
+            cerr << "Error: Unknown option '" << option << "'\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    if (list_filename.empty() || (out_filename.empty() && snapshot_filename.empty())) {
+        cerr << "Error: pack needs --list FILE and --out FILE, --snapshot FILE or both.\n";
+        print_usage();
+        return 2;
+    }
+
+    ifstream list(list_filename);
+    if (!list.is_open()) {
+        cerr << "Error: Cannot open file '" << list_filename << "'\n";
+        return 1;
+    }
+
+    vector<uint32_t> channels;
+    vector<Calibration> calibrations;
+    map<uint32_t, FitAccumulator> fits;
+    uint32_t min_channel = numeric_limits<uint32_t>::max();
+    uint32_t max_channel = 0;
+
+    string line;
+    unsigned long long line_number = 0;
+
+    while (getline(list, line)) {
+        line_number++;
+
+        size_t start = line.find_first_not_of(" \t\r");
+        if (start == string::npos || line[start] == '#') {
+            continue;
+        }
+
+        size_t channel_end = line.find_first_of(" \t", start);
+        size_t name_start = channel_end == string::npos ? string::npos
+                                                        : line.find_first_not_of(" \t", channel_end);
+        size_t name_end = line.find_last_not_of(" \t\r");
+        uint32_t channel;
+
+        if (name_start == string::npos
+            || !parse_channel(line.substr(start, channel_end - start).c_str(), channel)) {
+            cerr << "Error: Line " << line_number << ": expected \"channel filename\" but got '" << line << "'\n";
+            return 1;
+        }
+
+        string cal_filename = line.substr(name_start, name_end - name_start + 1);
+        Calibration cal;
+        FitAccumulator fit;
+        LoadStatus status = read_calibration_file(cal_filename, cal, fit);
+        if (status != LOAD_OK) {
+            cerr << "Error: Channel " << channel << ": " << load_status_message(status, cal_filename) << "\n";
+            return 1;
+        }
+        if (fit.count > 0) {
+            fits[channel] = fit;
+        }
+
+        channels.push_back(channel);
+        calibrations.push_back(cal);
+        min_channel = min(min_channel, channel);
+        max_channel = max(max_channel, channel);
+    }
+
+    if (channels.empty()) {
+        cerr << "Error: '" << list_filename << "' lists no channels.\n";
+        return 1;
+    }
+    if (max_channel - min_channel >= CALIBRATION_TABLE_MAX_CHANNELS) {
+        cerr << "Error: Channel IDs " << min_channel << ".." << max_channel
+             << " span more than " << CALIBRATION_TABLE_MAX_CHANNELS << " channels.\n";
+        return 1;
+    }
+
+    // Lay the channels out by ID
+    uint32_t channel_count = max_channel - min_channel + 1;
+    vector<double> slopes(channel_count, 0.0);
+    vector<double> offsets(channel_count, 0.0);
+    vector<uint64_t> valid((channel_count + 63) / 64, 0);
+
+    for (size_t i = 0; i < channels.size(); i++) {
+        uint32_t index = channels[i] - min_channel;
+
+        if ((valid[index >> 6] >> (index & 63)) & 1) {
+            cerr << "Error: Channel " << channels[i] << " is listed twice.\n";
+            return 1;
+        }
+
+        slopes[index] = calibrations[i].slope;
+        offsets[index] = calibrations[i].offset;
+        valid[index >> 6] |= uint64_t(1) << (index & 63);
+    }
+
+    CalibrationTableView table;
+    table.first_channel = min_channel;
+    table.channel_count = channel_count;
+    table.slopes = slopes.data();
+    table.offsets = offsets.data();
+    table.valid = valid.data();
+
+    if (!out_filename.empty() && !write_calibration_table(out_filename, table)) {
+        cerr << "Error: Cannot create file '" << out_filename << "'\n";
+        return 1;
+    }
+    if (!snapshot_filename.empty() && !write_snapshot(snapshot_filename, table, fits)) {
+        cerr << "Error: Cannot create file '" << snapshot_filename << "'\n";
+        return 1;
+    }
+
+    cerr << "Packed " << channels.size() << " channels (IDs " << min_channel << ".."
+         << max_channel << ") into '" << (out_filename.empty() ? snapshot_filename : out_filename) << "'";
+    if (!out_filename.empty() && !snapshot_filename.empty()) {
+        cerr << " and '" << snapshot_filename << "'";
+    }
+    if (!snapshot_filename.empty()) {
+        cerr << ", " << fits.size() << " with fit state";
+    }
+    cerr << "\n";
+    return 0;
+}
+
+/*
+ * SERVICE MODE
+ *
+ * Like convert, but for a live stream: reads raw readings (or
+ * "channel,raw" samples with --table or --snapshot and no --channel) from a named pipe
+ * or stdin until the writer closes it, and writes each real value as
+ * soon as it has been converted. Bad lines are counted and skipped
+ * rather than stopping the service. On exit the read-to-write latency
+ * percentiles are reported on stderr.
+ * The --cal / --table / --snapshot file is reloaded when it changes or on SIGHUP,
+ * without pausing the stream; if it no longer loads, the previous
+ * calibration stays in use.
+ * --track PIPE follows the drift of a linear --cal instead: every
+ * "reference,raw" point read from PIPE updates a recursive least squares
+ * estimate (drift.h), seeded from the fit state in the --cal file, and
+ * every --publish-every points the new line replaces the one in use
+ * without pausing the stream. --forgetting sets how fast old points fade;
+ * --save FILE writes the final line when the service stops. The --cal
+ * file is not reloaded while tracking.
+ */
+int batch_serve(int argc, char* argv[]) {
+    string cal_filename, table_filename, snapshot_filename, in_filename = "-", out_filename = "-";
+    string channel_text, track_filename, save_filename;
+    TrackOptions track;
+    bool track_tuned = false;   // --forgetting or --publish-every given
+
+    for (int i = 2; i < argc; i++) {
+        string option = argv[i];
+
+        if (i + 1 >= argc) {
+            cerr << "Error: Option '" << option << "' needs a value.\n";
+            print_usage();
+            return 2;
+        }
+
+        if (option == "--cal") {
+            cal_filename = argv[++i];
+        } else if (option == "--table") {
+            table_filename = argv[++i];
+        } else if (option == "--snapshot") {
+            snapshot_filename = argv[++i];
+        } else if (option == "--channel") {
+            channel_text = argv[++i];
+        } else if (option == "--in") {
+            in_filename = argv[++i];
+        } else if (option == "--out") {
+            out_filename = argv[++i];
+        } else if (option == "--track") {
+            track_filename = argv[++i];
+        } else if (option == "--forgetting") {
+            char* end;
+            track.forgetting = strtod(argv[++i], &end);
+            if (*end != '\0' || !(track.forgetting > 0.0 && track.forgetting <= 1.0)) {
+                cerr << "Error: --forgetting needs a factor > 0 and <= 1 (e.g. 0.999).\n";
+                return 2;
+            }
+            track_tuned = true;
+        } else if (option == "--publish-every") {
+            char* end;
+            long long value = strtoll(argv[++i], &end, 10);
+            if (*end != '\0' || value < 1) {
+                cerr << "Error: --publish-every needs a count >= 1.\n";
+                return 2;
+            }
+            track.publish_every = static_cast<unsigned long long>(value);
+            track_tuned = true;
+        } else if (option == "--save") {
+            save_filename = argv[++i];
+        } else {
+            cerr << "Error: Unknown option '" << option << "'\n";
+            print_usage();
+            return 2;
+        }
+    }
+
+    bool tracking = !track_filename.empty();
+    if (!tracking && (track_tuned || !save_filename.empty())) {
+        cerr << "Error: --forgetting, --publish-every and --save need --track PIPE.\n";
+        return 2;
+    }
+    if (tracking && cal_filename.empty()) {
+        cerr << "Error: --track needs --cal FILE with a linear calibration.\n";
+        return 2;
+    }
+    if (tracking && track_filename == "-" && in_filename == "-") {
+        cerr << "Error: --in and --track cannot both read stdin.\n";
+        return 2;
+    }
+
+    // Every reload repeats exactly the startup load
+    bool multi_channel = (!table_filename.empty() || !snapshot_filename.empty()) && channel_text.empty();
+    int load_result = 0;
+    ReloadOptions reload;
+    reload.load = [&]() -> StreamCalibration* {
+        StreamCalibration* calibration = new StreamCalibration;
+        load_result = load_batch_calibration("serve", cal_filename, table_filename, snapshot_filename,
+                                             channel_text, calibration->model, calibration->table,
+                                             calibration->snapshot);
+        if (load_result == 0 && model_needs_temperature(calibration->model)) {
+            cerr << "Error: serve takes one raw reading per line and cannot run a"
+                 << " temperature-compensated model; use convert.\n";
+            load_result = 1;
+        }
+        if (load_result != 0) {
+            delete calibration;
+            return NULL;
+        }
+        calibration->multi_channel = multi_channel;
+        return calibration;
+    };
+    reload.watch_files.push_back(!cal_filename.empty() ? cal_filename
+                                 : (!table_filename.empty() ? table_filename : snapshot_filename));
+
+    StreamCalibration* calibration = reload.load();
+    if (calibration == NULL) {
+        return load_result;
+    }
+
+    // The tracker owns the calibration from here on
+    if (tracking) {
+        if (calibration->model.kind != MODEL_LINEAR) {
+            cerr << "Error: --track needs --cal FILE with a linear calibration.\n";
+            delete calibration;
+            return 2;
+        }
+        Calibration saved;
+        if (read_calibration_file(cal_filename, saved, track.seed) != LOAD_OK) {
+            track.seed = FitAccumulator();
+        }
+        reload = ReloadOptions();
+    }
+
+    int in = open_stream(in_filename, false);
+    if (in < 0) {
+        cerr << "Error: Cannot open '" << in_filename << "'\n";
+        delete calibration;
+        return 1;
+    }
+    int out = open_stream(out_filename, true);
+    if (out < 0) {
+        cerr << "Error: Cannot create '" << out_filename << "'\n";
+        close_stream(in);
+        delete calibration;
+        return 1;
+    }
+
+    if (tracking) {
+        track.fd = open_stream(track_filename, false);
+        if (track.fd < 0) {
+            cerr << "Error: Cannot open '" << track_filename << "'\n";
+            close_stream(in);
+            close_stream(out);
+            delete calibration;
+            return 1;
+        }
+    }
+
+    ServeReport report;
+    serve_stream(calibration, reload, track, in, out, report);
+
+    close_stream(in);
+    close_stream(out);
+    if (tracking) {
+        close_stream(track.fd);
+    }
+
+    cerr << fixed << setprecision(0);
+    cerr << "Served " << report.samples << " readings (" << report.bad_lines << " bad lines skipped). "
+         << "Latency p50 " << report.p50_us << " us, p99 " << report.p99_us
+         << " us, max " << report.max_us << " us.\n";
+    if (report.reloads > 0 || report.failed_reloads > 0) {
+        cerr << "Calibration reloaded " << report.reloads << " times ("
+             << report.failed_reloads << " failed).\n";
+    }
+    if (tracking) {
+        cerr << "Tracked " << report.tracked_points << " reference points ("
+             << report.bad_track_lines << " bad lines skipped), " << report.track_updates
+             << " updates published.\n";
+        if (report.tracked.is_valid) {
+            cerr << setprecision(10) << "Tracked calibration: Slope = " << report.tracked.slope
+                 << ", Offset = " << report.tracked.offset << "\n";
+        }
+    }
+
+    if (report.track_read_failed) {
+        cerr << "Error: Reading '" << track_filename << "' failed.\n";
+        return 1;
+    }
+    if (!save_filename.empty()) {
+        if (!report.tracked.is_valid) {
+            cerr << "Error: No tracked calibration to save; the reference points did not"
+                 << " pin down a line.\n";
+            return 1;
+        }
+        if (!write_calibration_file(save_filename, report.tracked)) {
+            cerr << "Error: Cannot create file '" << save_filename << "'\n";
+            return 1;
+        }
+    }
+
+    if (report.read_failed) {
+        cerr << "Error: Reading '" << in_filename << "' failed.\n";
+        return 1;
+    }
+    if (report.write_failed) {
+        cerr << "Error: Writing to '" << out_filename << "' failed.\n";
+        return 1;
+    }
+    return 0;
+}
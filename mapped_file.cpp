@@ -0,0 +1,114 @@
+/*
+ * Read-only file mapping for POSIX and Windows
+ */
+
+#include "mapped_file.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+MappedFile::MappedFile()
+    : data(NULL), length(0)
+#ifdef _WIN32
+    , file_handle(NULL), mapping_handle(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+MapStatus MappedFile::open(const string& filename) {
+    close();
+
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return MAP_CANNOT_OPEN;
+    }
+
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        return file_size.QuadPart == 0 ? MAP_EMPTY : MAP_CANNOT_OPEN;
+    }
+
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping == NULL) {
+        CloseHandle(file);
+        return MAP_CANNOT_OPEN;
+    }
+
+    void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    if (view == NULL) {
+        CloseHandle(mapping);
+        CloseHandle(file);
+        return MAP_CANNOT_OPEN;
+    }
+
+    file_handle = file;
+    mapping_handle = mapping;
+    data = static_cast<const unsigned char*>(view);
+    length = static_cast<size_t>(file_size.QuadPart);
+#else
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return MAP_CANNOT_OPEN;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        ::close(fd);
+        return MAP_CANNOT_OPEN;
+    }
+    if (info.st_size == 0) {
+        ::close(fd);
+        return MAP_EMPTY;
+    }
+
+    void* view = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);  // The mapping keeps the file alive
+    if (view == MAP_FAILED) {
+        return MAP_CANNOT_OPEN;
+    }
+
+    data = static_cast<const unsigned char*>(view);
+    length = static_cast<size_t>(info.st_size);
+#endif
+
+    return MAP_OK;
+}
+
+void MappedFile::advise_sequential() {
+#ifndef _WIN32
+    if (data != NULL) {
+        madvise(const_cast<unsigned char*>(data), length, MADV_SEQUENTIAL);
+    }
+#endif
+}
+
+void MappedFile::close() {
+    if (data != NULL) {
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+        CloseHandle(mapping_handle);
+        CloseHandle(file_handle);
+        mapping_handle = NULL;
+        file_handle = NULL;
+#else
+        munmap(const_cast<unsigned char*>(data), length);
+#endif
+    }
+    data = NULL;
+    length = 0;
+}
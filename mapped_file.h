@@ -0,0 +1,53 @@
+/*
+ * Read-only memory-mapped files
+ *
+ * The binary formats (calibration tables, sample files) are laid out so
+ * their arrays can be used straight from the page cache: opening one is
+ * an mmap and a header check, with nothing copied or parsed.
+ */
+
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <string>
+
+enum MapStatus {
+    MAP_OK,
+    MAP_CANNOT_OPEN,
+    MAP_EMPTY           // Exists but holds no bytes (cannot be mapped)
+};
+
+/*
+ * A whole file mapped read-only
+ * The mapping lives until close() or destruction; pointers into it must
+ * not outlive it.
+ */
+class MappedFile {
+public:
+    MappedFile();
+    ~MappedFile();
+
+    MapStatus open(const std::string& filename);
+    void close();
+
+    // Tell the OS the file will be read front to back, so it reads ahead
+    void advise_sequential();
+
+    bool is_open() const { return data != NULL; }
+    const unsigned char* bytes() const { return data; }
+    size_t size() const { return length; }
+
+private:
+    MappedFile(const MappedFile&);             // Not copyable
+    MappedFile& operator=(const MappedFile&);
+
+    const unsigned char* data;
+    size_t length;
+#ifdef _WIN32
+    void* file_handle;
+    void* mapping_handle;
+#endif
+};
+
+#endif
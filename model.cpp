@@ -0,0 +1,700 @@
+/*
+ * Polynomial, piecewise-linear and temperature-compensated fits,
+ * evaluation and model files
+ */
+
+#include "model.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <limits>
+
+#include "fit.h"
+#include "stats.h"
+#include "work_stealing.h"
+
+using namespace std;
+
+namespace {
+
+/*
+ * Solve the size  size system ax = b in place by Gaussian elimination
+ * with partial pivoting. Returns false if the matrix is singular.
+ */
+bool solve_dense(double* a, double* b, int size) {
+    for (int column = 0; column < size; column++) {
+        int pivot = column;
+        for (int row = column + 1; row < size; row++) {
+            if (fabs(a[row * size + column]) > fabs(a[pivot * size + column])) {
+                pivot = row;
+            }
+        }
+
+        // Relative to the diagonal scale of the normal equations
+        if (!(fabs(a[pivot * size + column]) > 1e-12 * fabs(a[0]))) {
+            return false;
+        }
+
+        if (pivot != column) {
+            for (int k = 0; k < size; k++) {
+                swap(a[pivot * size + k], a[column * size + k]);
+            }
+            swap(b[pivot], b[column]);
+        }
+
+        for (int row = column + 1; row < size; row++) {
+            double factor = a[row * size + column] / a[column * size + column];
+            for (int k = column; k < size; k++) {
+                a[row * size + k] -= factor * a[column * size + k];
+            }
+            b[row] -= factor * b[column];
+        }
+    }
+
+    for (int row = size - 1; row >= 0; row--) {
+        double sum = b[row];
+        for (int k = row + 1; k < size; k++) {
+            sum -= a[row * size + k] * b[k];
+        }
+        b[row] = sum / a[row * size + row];
+    }
+    return true;
+}
+
+const int MAX_SURFACE_TERMS = (MAX_POLYNOMIAL_DEGREE + 1) * (MAX_TEMPERATURE_DEGREE + 1);
+
+// basis[j * (temperature_degree + 1) + k] = t^j  u^k
+void surface_basis(double t, double u, int raw_degree, int temperature_degree, double* basis) {
+    int stride = temperature_degree + 1;
+    double t_power = 1.0;
+    for (int j = 0; j <= raw_degree; j++) {
+        double power = t_power;
+        for (int k = 0; k <= temperature_degree; k++) {
+            basis[j * stride + k] = power;
+            power *= u;
+        }
+        t_power *= t;
+    }
+}
+
+/*
+ * Model files are read as a stream of whitespace-separated tokens that
+ * may be spread over lines in any way, like the linear format
+ */
+class TokenReader {
+public:
+    explicit TokenReader(ChunkedLineReader& reader) : reader(reader), text(NULL), end(NULL) {}
+
+    // Next keyword made of letters; false at end of file or on a number
+    bool next_word(string& word) {
+        if (!find_token() || !isalpha(static_cast<unsigned char>(*text))) {
+            return false;
+        }
+        word.clear();
+        while (text < end && isalpha(static_cast<unsigned char>(*text))) {
+            word += static_cast<char>(tolower(static_cast<unsigned char>(*text)));
+            text++;
+        }
+        return true;
+    }
+
+    bool next_double(double& value) {
+        return find_token() && parse_double(text, end, value);
+    }
+
+    // At end of file, ignoring blank lines and comments
+    bool at_end() {
+        return !find_token();
+    }
+
+private:
+    ChunkedLineReader& reader;
+    const char* text;
+    const char* end;
+
+    bool find_token() {
+        while (true) {
+            while (text != NULL && text < end && (*text == ' ' || *text == '\t' || *text == '\r')) {
+                text++;
+            }
+            if (text != NULL && !is_blank_or_comment(text, end)) {
+                return true;
+            }
+
+            char* line;
+            size_t length;
+            if (!reader.next_line(line, length)) {
+                return false;
+            }
+            text = line;
+            end = line + length;
+        }
+    }
+};
+
+}  // namespace
+
+CalibrationModel linear_model(const Calibration& cal) {
+    CalibrationModel model;
+    model.kind = MODEL_LINEAR;
+    model.linear = cal;
+    model.is_valid = cal.is_valid;
+    return model;
+}
+
+/*
+ * Normal equations in the scaled variable t, which runs from -1 to 1:
+ * sum t^(j+k)  c[k] = sum Real  t^j
+ */
+bool fit_polynomial(const double* raw, const double* reference, size_t n, int degree,
+                    CalibrationModel& model) {
+    if (degree < 1 || degree > MAX_POLYNOMIAL_DEGREE || n <= static_cast<size_t>(degree)) {
+        return false;
+    }
+
+    double low = raw[0], high = raw[0];
+    for (size_t i = 1; i < n; i++) {
+        low = min(low, raw[i]);
+        high = max(high, raw[i]);
+    }
+    if (!(high > low)) {
+        return false;
+    }
+
+    double center = 0.5 * (low + high);
+    double scale = 2.0 / (high - low);
+    int size = degree + 1;
+
+    double power_sums[2 * MAX_POLYNOMIAL_DEGREE + 1] = { 0.0 };
+    double b[MAX_POLYNOMIAL_DEGREE + 1] = { 0.0 };
+
+    for (size_t i = 0; i < n; i++) {
+        double t = (raw[i] - center) * scale;
+        double power = 1.0;
+        for (int k = 0; k <= 2 * degree; k++) {
+            power_sums[k] += power;
+            if (k < size) {
+                b[k] += reference[i] * power;
+            }
+            power *= t;
+        }
+    }
+
+    double a[(MAX_POLYNOMIAL_DEGREE + 1) * (MAX_POLYNOMIAL_DEGREE + 1)];
+    for (int j = 0; j < size; j++) {
+        for (int k = 0; k < size; k++) {
+            a[j * size + k] = power_sums[j + k];
+        }
+    }
+
+    // Singular when there are no more distinct raw readings than the degree
+    if (!solve_dense(a, b, size)) {
+        return false;
+    }
+
+    CalibrationModel fitted;
+    fitted.kind = MODEL_POLYNOMIAL;
+    fitted.degree = degree;
+    fitted.center = center;
+    fitted.scale = scale;
+    for (int k = 0; k < size; k++) {
+        fitted.coefficients[k] = b[k];
+    }
+    fitted.is_valid = true;
+
+    model = fitted;
+    return true;
+}
+
+/*
+ * Same normal equations as fit_polynomial() with the (raw degree + 1) 
+ * (temperature degree + 1) products t^j  u^k as basis. Each block sums
+ * its own upper triangle; the blocks are added in order afterwards.
+ */
+bool fit_temperature_model(const double* raw, const double* temperature, const double* reference,
+                           size_t n, int raw_degree, int temperature_degree, unsigned threads,
+                           CalibrationModel& model) {
+    if (raw_degree < 1 || raw_degree > MAX_POLYNOMIAL_DEGREE
+        || temperature_degree < 1 || temperature_degree > MAX_TEMPERATURE_DEGREE) {
+        return false;
+    }
+    int size = (raw_degree + 1) * (temperature_degree + 1);
+    if (n < static_cast<size_t>(size)) {
+        return false;
+    }
+
+    double low = raw[0], high = raw[0];
+    double temperature_low = temperature[0], temperature_high = temperature[0];
+    for (size_t i = 1; i < n; i++) {
+        low = min(low, raw[i]);
+        high = max(high, raw[i]);
+        temperature_low = min(temperature_low, temperature[i]);
+        temperature_high = max(temperature_high, temperature[i]);
+    }
+    if (!(high > low) || !(temperature_high > temperature_low)) {
+        return false;
+    }
+
+    double center = 0.5 * (low + high);
+    double scale = 2.0 / (high - low);
+    double temperature_center = 0.5 * (temperature_low + temperature_high);
+    double temperature_scale = 2.0 / (temperature_high - temperature_low);
+
+    // Per block: size  size matrix (upper triangle used), then size sums
+    size_t num_blocks = (n + FIT_BLOCK_SIZE - 1) / FIT_BLOCK_SIZE;
+    size_t block_terms = static_cast<size_t>(size) * size + size;
+    vector<double> sums(num_blocks * block_terms, 0.0);
+
+    parallel_for_stealing(num_blocks, threads, [&](size_t block) {
+        double* a = &sums[block * block_terms];
+        double* b = a + size * size;
+        size_t begin = block * FIT_BLOCK_SIZE;
+        size_t end = min(n, begin + FIT_BLOCK_SIZE);
+        double basis[MAX_SURFACE_TERMS];
+
+        for (size_t i = begin; i < end; i++) {
+            surface_basis((raw[i] - center) * scale,
+                          (temperature[i] - temperature_center) * temperature_scale,
+                          raw_degree, temperature_degree, basis);
+            for (int j = 0; j < size; j++) {
+                b[j] += reference[i] * basis[j];
+                for (int k = j; k < size; k++) {
+                    a[j * size + k] += basis[j] * basis[k];
+                }
+            }
+        }
+    });
+
+    double a[MAX_SURFACE_TERMS * MAX_SURFACE_TERMS] = { 0.0 };
+    double b[MAX_SURFACE_TERMS] = { 0.0 };
+    for (size_t block = 0; block < num_blocks; block++) {
+        const double* block_sums = &sums[block * block_terms];
+        for (int j = 0; j < size; j++) {
+            for (int k = j; k < size; k++) {
+                a[j * size + k] += block_sums[j * size + k];
+            }
+            b[j] += block_sums[size * size + j];
+        }
+    }
+    for (int j = 0; j < size; j++) {
+        for (int k = 0; k < j; k++) {
+            a[j * size + k] = a[k * size + j];
+        }
+    }
+
+    // Singular when the raw readings or temperatures take too few values
+    if (!solve_dense(a, b, size)) {
+        return false;
+    }
+
+    CalibrationModel fitted;
+    fitted.kind = MODEL_TEMPERATURE;
+    fitted.degree = raw_degree;
+    fitted.center = center;
+    fitted.scale = scale;
+    fitted.temperature_degree = temperature_degree;
+    fitted.temperature_center = temperature_center;
+    fitted.temperature_scale = temperature_scale;
+    for (int k = 0; k < size; k++) {
+        fitted.surface[k] = b[k];
+    }
+    fitted.is_valid = true;
+
+    model = fitted;
+    return true;
+}
+
+/*
+ * With hat functions on the knots as basis, a piecewise-linear curve is
+ * sum real_k  hat_k(raw), and the normal equations are tridiagonal:
+ * each point only touches the two knots around it. They are solved with
+ * the Thomas algorithm in O(knots).
+ */
+bool fit_piecewise(const double* raw, const double* reference, size_t n, size_t segments,
+                   CalibrationModel& model) {
+    if (n < 2 || segments < 1) {
+        return false;
+    }
+    segments = min(segments, MAX_PIECEWISE_SEGMENTS);
+
+    vector<size_t> order(n);
+    for (size_t i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [raw](size_t a, size_t b) { return raw[a] < raw[b]; });
+
+    // Knots at quantiles of the raw readings, without duplicates
+    vector<double> knots;
+    for (size_t k = 0; k <= segments; k++) {
+        double knot = raw[order[min(n - 1, k * (n - 1) / segments)]];
+        if (knots.empty() || knot > knots.back()) {
+            knots.push_back(knot);
+        }
+    }
+    if (knots.size() < 2) {
+        return false;
+    }
+
+    size_t count = knots.size();
+    vector<double> diagonal(count, 0.0), upper(count, 0.0), rhs(count, 0.0);
+
+    size_t segment = 0;
+    for (size_t i = 0; i < n; i++) {
+        double x = raw[order[i]];
+        double y = reference[order[i]];
+
+        while (segment + 2 < count && x >= knots[segment + 1]) {
+            segment++;
+        }
+
+        double w = (x - knots[segment]) / (knots[segment + 1] - knots[segment]);
+        double v = 1.0 - w;
+
+        diagonal[segment] += v * v;
+        upper[segment] += v * w;
+        diagonal[segment + 1] += w * w;
+        rhs[segment] += v * y;
+        rhs[segment + 1] += w * y;
+    }
+
+    // Forward sweep; every knot is a data point, so the pivots stay positive
+    for (size_t k = 1; k < count; k++) {
+        if (!(diagonal[k - 1] > 0.0)) {
+            return false;
+        }
+        double factor = upper[k - 1] / diagonal[k - 1];
+        diagonal[k] -= factor * upper[k - 1];
+        rhs[k] -= factor * rhs[k - 1];
+    }
+    if (!(diagonal[count - 1] > 0.0)) {
+        return false;
+    }
+
+    vector<double> values(count);
+    values[count - 1] = rhs[count - 1] / diagonal[count - 1];
+    for (size_t k = count - 1; k-- > 0;) {
+        values[k] = (rhs[k] - upper[k] * values[k + 1]) / diagonal[k];
+    }
+
+    CalibrationModel fitted;
+    fitted.kind = MODEL_PIECEWISE;
+    fitted.knot_raw = knots;
+    fitted.knot_real = values;
+    prepare_piecewise(fitted);
+
+    model = fitted;
+    return true;
+}
+
+/*
+ * Four equal-width grid cells per segment over the knot range; each cell
+ * remembers the segment its start falls in, and the next cell's entry
+ * bounds the segments it spans. Knots at the quantiles of skewed data can
+ * crowd into a few cells, so a lookup binary searches that span rather
+ * than stepping through it.
+ */
+void prepare_piecewise(CalibrationModel& model) {
+    size_t segments = model.knot_raw.size() - 1;
+
+    model.segment_slope.resize(segments);
+    model.segment_offset.resize(segments);
+    for (size_t s = 0; s < segments; s++) {
+        double slope = (model.knot_real[s + 1] - model.knot_real[s])
+                       / (model.knot_raw[s + 1] - model.knot_raw[s]);
+        model.segment_slope[s] = slope;
+        model.segment_offset[s] = model.knot_real[s] - slope * model.knot_raw[s];
+    }
+
+    size_t cells = 4 * segments;
+    double start = model.knot_raw[0];
+    double width = (model.knot_raw[segments] - start) / cells;
+
+    model.grid.resize(cells + 1);
+    model.grid_start = start;
+    model.grid_scale = 1.0 / width;
+
+    size_t segment = 0;
+    for (size_t c = 0; c < cells; c++) {
+        double cell_start = start + c * width;
+        while (segment + 1 < segments && cell_start >= model.knot_raw[segment + 1]) {
+            segment++;
+        }
+        model.grid[c] = static_cast<uint32_t>(segment);
+    }
+    model.grid[cells] = static_cast<uint32_t>(segments - 1);
+
+    model.is_valid = true;
+}
+
+double evaluate_model(const CalibrationModel& model, double raw) {
+    switch (model.kind) {
+        case MODEL_POLYNOMIAL: {
+            double t = (raw - model.center) * model.scale;
+            double value = model.coefficients[model.degree];
+            for (int k = model.degree - 1; k >= 0; k--) {
+                value = value * t + model.coefficients[k];
+            }
+            return value;
+        }
+        case MODEL_PIECEWISE: {
+            size_t segment = piecewise_segment(model, raw);
+            return model.segment_slope[segment] * raw + model.segment_offset[segment];
+        }
+        case MODEL_TEMPERATURE:
+            return numeric_limits<double>::quiet_NaN();
+        case MODEL_LINEAR:
+            break;
+    }
+    return model.linear.slope * raw + model.linear.offset;
+}
+
+/*
+ * Horner's rule in u for each power of t, then in t over those rows;
+ * the order of operations matches the apply kernels
+ */
+double evaluate_model(const CalibrationModel& model, double raw, double temperature) {
+    if (model.kind != MODEL_TEMPERATURE) {
+        return evaluate_model(model, raw);
+    }
+
+    int stride = model.temperature_degree + 1;
+    double t = (raw - model.center) * model.scale;
+    double u = (temperature - model.temperature_center) * model.temperature_scale;
+    double value = 0.0;
+
+    for (int j = model.degree; j >= 0; j--) {
+        const double* row = model.surface + j * stride;
+        double row_value = row[model.temperature_degree];
+        for (int k = model.temperature_degree - 1; k >= 0; k--) {
+            row_value = row_value * u + row[k];
+        }
+        value = j == model.degree ? row_value : value * t + row_value;
+    }
+    return value;
+}
+
+string model_description(const CalibrationModel& model) {
+    switch (model.kind) {
+        case MODEL_POLYNOMIAL:
+            return "polynomial (degree " + to_string(model.degree) + ")";
+        case MODEL_PIECEWISE:
+            return "piecewise linear (" + to_string(model.knot_raw.size() - 1) + " segments)";
+        case MODEL_TEMPERATURE:
+            return "temperature-compensated (raw degree " + to_string(model.degree)
+                   + ", temperature degree " + to_string(model.temperature_degree) + ")";
+        case MODEL_LINEAR:
+            break;
+    }
+    return "linear";
+}
+
+namespace {
+
+/*
+ * Read a model from the lines of a model file. A file that does not start
+ * with a model keyword is a plain slope / offset file: linear is set and
+ * the caller reads it as one.
+ */
+LoadStatus read_nonlinear_model(ChunkedLineReader& lines, CalibrationModel& model, bool& linear) {
+    TokenReader reader(lines);
+    string keyword;
+
+    linear = !reader.next_word(keyword);
+    if (linear) {
+        return LOAD_OK;
+    }
+
+    StageTimer timer(STAT_LOAD, 1);
+    CalibrationModel loaded;
+    double count;
+    bool ok = reader.next_double(count) && count == floor(count);
+
+    if (ok && keyword == "polynomial" && count >= 1 && count <= MAX_POLYNOMIAL_DEGREE) {
+        loaded.kind = MODEL_POLYNOMIAL;
+        loaded.degree = static_cast<int>(count);
+
+        double low, high;
+        ok = reader.next_double(low) && reader.next_double(high) && high > low;
+        loaded.center = 0.5 * (low + high);
+        loaded.scale = 2.0 / (high - low);
+
+        for (int k = 0; ok && k <= loaded.degree; k++) {
+            ok = reader.next_double(loaded.coefficients[k]);
+        }
+        loaded.is_valid = ok;
+    } else if (ok && keyword == "piecewise" && count >= 2 && count <= MAX_PIECEWISE_SEGMENTS + 1) {
+        loaded.kind = MODEL_PIECEWISE;
+        size_t knots = static_cast<size_t>(count);
+        loaded.knot_raw.resize(knots);
+        loaded.knot_real.resize(knots);
+
+        for (size_t k = 0; ok && k < knots; k++) {
+            ok = reader.next_double(loaded.knot_raw[k]) && reader.next_double(loaded.knot_real[k])
+                 && (k == 0 || loaded.knot_raw[k] > loaded.knot_raw[k - 1]);
+        }
+        if (ok) {
+            prepare_piecewise(loaded);
+        }
+    } else if (ok && keyword == "temperature" && count >= 1 && count <= MAX_POLYNOMIAL_DEGREE) {
+        loaded.kind = MODEL_TEMPERATURE;
+        loaded.degree = static_cast<int>(count);
+
+        double temperature_degree = 0.0;
+        ok = reader.next_double(temperature_degree) && temperature_degree == floor(temperature_degree)
+             && temperature_degree >= 1 && temperature_degree <= MAX_TEMPERATURE_DEGREE;
+        loaded.temperature_degree = static_cast<int>(temperature_degree);
+
+        double low = 0.0, high = 0.0, temperature_low = 0.0, temperature_high = 0.0;
+        ok = ok && reader.next_double(low) && reader.next_double(high) && high > low
+             && reader.next_double(temperature_low) && reader.next_double(temperature_high)
+             && temperature_high > temperature_low;
+        loaded.center = 0.5 * (low + high);
+        loaded.scale = 2.0 / (high - low);
+        loaded.temperature_center = 0.5 * (temperature_low + temperature_high);
+        loaded.temperature_scale = 2.0 / (temperature_high - temperature_low);
+
+        int terms = (loaded.degree + 1) * (loaded.temperature_degree + 1);
+        for (int k = 0; ok && k < terms; k++) {
+            ok = reader.next_double(loaded.surface[k]);
+        }
+        loaded.is_valid = ok;
+    } else {
+        ok = false;
+    }
+
+    ok = ok && reader.at_end();
+
+    if (!ok) {
+        return LOAD_BAD_MODEL;
+    }
+    model = loaded;
+    return LOAD_OK;
+}
+
+}  // namespace
+
+LoadStatus read_model_file(const string& filename, CalibrationModel& model) {
+    FILE* file = fopen(filename.c_str(), "r");
+    if (file == NULL) {
+        return LOAD_CANNOT_OPEN;
+    }
+
+    ChunkedLineReader lines(file, 4096);
+    bool linear;
+    LoadStatus status = read_nonlinear_model(lines, model, linear);
+    fclose(file);
+
+    if (linear) {
+        Calibration cal;
+        status = read_calibration_file(filename, cal);
+        if (status == LOAD_OK) {
+            model = linear_model(cal);
+        }
+    }
+    return status;
+}
+
+LoadStatus parse_model(const char* text, size_t size, CalibrationModel& model) {
+    ChunkedLineReader lines(text, size);
+    bool linear;
+    LoadStatus status = read_nonlinear_model(lines, model, linear);
+
+    if (linear) {
+        Calibration cal;
+        FitAccumulator fit;
+        status = parse_calibration(text, size, cal, fit);
+        if (status == LOAD_OK) {
+            model = linear_model(cal);
+        }
+    }
+    return status;
+}
+
+namespace {
+
+// Everything write_model() writes
+void put_model(BufferedWriter& writer, const CalibrationModel& model) {
+
+    switch (model.kind) {
+        case MODEL_POLYNOMIAL:
+            writer.put("polynomial ");
+            writer.write_fixed(model.degree, 0);
+            writer.put('\n');
+            writer.write_fixed(model.center - 1.0 / model.scale, 10);
+            writer.put(' ');
+            writer.write_fixed(model.center + 1.0 / model.scale, 10);
+            writer.put('\n');
+            for (int k = 0; k <= model.degree; k++) {
+                writer.write_fixed(model.coefficients[k], 10);
+                writer.put('\n');
+            }
+            break;
+        case MODEL_PIECEWISE:
+            writer.put("piecewise ");
+            writer.write_fixed(static_cast<double>(model.knot_raw.size()), 0);
+            writer.put('\n');
+            for (size_t k = 0; k < model.knot_raw.size(); k++) {
+                writer.write_fixed(model.knot_raw[k], 10);
+                writer.put(' ');
+                writer.write_fixed(model.knot_real[k], 10);
+                writer.put('\n');
+            }
+            break;
+        case MODEL_TEMPERATURE: {
+            writer.put("temperature ");
+            writer.write_fixed(model.degree, 0);
+            writer.put(' ');
+            writer.write_fixed(model.temperature_degree, 0);
+            writer.put('\n');
+            writer.write_fixed(model.center - 1.0 / model.scale, 10);
+            writer.put(' ');
+            writer.write_fixed(model.center + 1.0 / model.scale, 10);
+            writer.put('\n');
+            writer.write_fixed(model.temperature_center - 1.0 / model.temperature_scale, 10);
+            writer.put(' ');
+            writer.write_fixed(model.temperature_center + 1.0 / model.temperature_scale, 10);
+            writer.put('\n');
+            int terms = (model.degree + 1) * (model.temperature_degree + 1);
+            for (int k = 0; k < terms; k++) {
+                writer.write_fixed(model.surface[k], 10);
+                writer.put('\n');
+            }
+            break;
+        }
+        case MODEL_LINEAR:
+            // Same as write_calibration_file()
+            writer.write_fixed(model.linear.slope, 10);
+            writer.put('\n');
+            writer.write_fixed(model.linear.offset, 10);
+            writer.put('\n');
+            break;
+    }
+
+}
+
+}  // namespace
+
+bool write_model(FILE* file, const CalibrationModel& model) {
+    BufferedWriter writer(file, 4096);
+    put_model(writer, model);
+    writer.flush();
+    return !writer.failed();
+}
+
+void format_model(const CalibrationModel& model, string& text) {
+    BufferedWriter writer(&text);
+    put_model(writer, model);
+    writer.flush();
+}
+
+bool write_model_file(const string& filename, const CalibrationModel& model) {
+    StageTimer timer(STAT_SAVE, 1);
+    FILE* file = fopen(filename.c_str(), "w");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool written = write_model(file, model);
+    return fclose(file) == 0 && written;
+}
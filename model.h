@@ -0,0 +1,206 @@
+/*
+ * Nonlinear calibration models
+ *
+ * Besides the linear Real Value = Slope  Raw + Offset, a calibration can
+ * be a polynomial of degree 2 to 5 (thermocouples, load cells) or a
+ * piecewise-linear curve through a set of knots. Both are least squares
+ * fits of the same "reference,raw" points the linear fit uses.
+ *
+ * Polynomials are kept in a scaled variable t = (Raw - center)  scale
+ * that maps the fitted raw range onto [-1, 1], which keeps the fit well
+ * conditioned even for ADC counts in the millions.
+ * Piecewise curves keep a per-segment slope and intercept plus a uniform
+ * lookup grid, so evaluating one costs a grid lookup and one multiply-add.
+ *
+ * TEMPERATURE-COMPENSATED MODELS
+ * Sensors that drift with temperature are calibrated as a surface over
+ * raw reading and temperature, fitted from "reference,raw,temperature"
+ * points:
+ *   Real = sum c[j][k]  t^j  u^k     j = 0 .. raw degree, k = 0 .. temperature degree
+ * with t the scaled raw reading as above and u the temperature scaled the
+ * same way over its fitted range. Converting then takes paired raw and
+ * temperature streams, so the correction happens in the same pass as the
+ * calibration.
+ */
+
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "calibration.h"
+#include "text_io.h"
+
+const int MAX_POLYNOMIAL_DEGREE = 5;
+const size_t MAX_PIECEWISE_SEGMENTS = 65536;
+const int MAX_TEMPERATURE_DEGREE = 3;
+
+enum ModelKind {
+    MODEL_LINEAR,
+    MODEL_POLYNOMIAL,
+    MODEL_PIECEWISE,
+    MODEL_TEMPERATURE
+};
+
+struct CalibrationModel {
+    ModelKind kind;
+
+    // MODEL_LINEAR
+    Calibration linear;
+
+    // MODEL_POLYNOMIAL: Real = c[0] + c[1]t + ... + c[degree]t^degree
+    // (MODEL_TEMPERATURE uses degree, center and scale for the raw reading)
+    int degree;
+    double center;
+    double scale;
+    double coefficients[MAX_POLYNOMIAL_DEGREE + 1];
+
+    // MODEL_PIECEWISE: straight lines between knots sorted by raw value;
+    // the end segments are extended beyond the first and last knot
+    std::vector<double> knot_raw;
+    std::vector<double> knot_real;
+
+    // Derived from the knots by prepare_piecewise()
+    std::vector<double> segment_slope;
+    std::vector<double> segment_offset;
+    std::vector<uint32_t> grid;     // Segment at the start of each grid cell, then the last segment
+    double grid_start;
+    double grid_scale;              // Grid cells per raw unit
+
+    // MODEL_TEMPERATURE: u = (Temperature - temperature_center)  temperature_scale;
+    // c[j][k] is surface[j * (temperature_degree + 1) + k]
+    int temperature_degree;
+    double temperature_center;
+    double temperature_scale;
+    double surface[(MAX_POLYNOMIAL_DEGREE + 1) * (MAX_TEMPERATURE_DEGREE + 1)];
+
+    bool is_valid;
+
+    CalibrationModel()
+        : kind(MODEL_LINEAR), degree(0), center(0.0), scale(1.0),
+          grid_start(0.0), grid_scale(0.0), temperature_degree(0),
+          temperature_center(0.0), temperature_scale(1.0), is_valid(false) {
+        for (int i = 0; i <= MAX_POLYNOMIAL_DEGREE; i++) {
+            coefficients[i] = 0.0;
+        }
+        for (double& c : surface) {
+            c = 0.0;
+        }
+    }
+};
+
+// Wrap a linear calibration
+CalibrationModel linear_model(const Calibration& cal);
+
+/*
+ * Least squares polynomial of the given degree through n points.
+ * Returns false if there are too few distinct raw readings for the degree.
+ */
+bool fit_polynomial(const double* raw, const double* reference, size_t n, int degree,
+                    CalibrationModel& model);
+
+/*
+ * Least squares continuous piecewise-linear curve with up to `segments`
+ * segments. Knots sit at quantiles of the raw readings, so every segment
+ * holds about the same number of points.
+ * Returns false if fewer than 2 distinct raw readings are given.
+ */
+bool fit_piecewise(const double* raw, const double* reference, size_t n, size_t segments,
+                   CalibrationModel& model);
+
+/*
+ * Least squares temperature-compensated surface through n points
+ * (raw[i], temperature[i], reference[i]), with raw_degree 1 .. MAX_POLYNOMIAL_DEGREE
+ * and temperature_degree 1 .. MAX_TEMPERATURE_DEGREE. The normal equations
+ * are summed per FIT_BLOCK_SIZE block on up to threads threads
+ * (0 = one per hardware thread) and added up in block order, so the result
+ * does not depend on the thread count.
+ * Returns false if the points do not pin down the surface (too few
+ * distinct raw readings or temperatures for the degrees).
+ */
+bool fit_temperature_model(const double* raw, const double* temperature, const double* reference,
+                           size_t n, int raw_degree, int temperature_degree, unsigned threads,
+                           CalibrationModel& model);
+
+// Build the per-segment lines and lookup grid from knot_raw / knot_real
+void prepare_piecewise(CalibrationModel& model);
+
+// Segment of a piecewise model that holds raw (end segments beyond the knots)
+inline size_t piecewise_segment(const CalibrationModel& model, double raw) {
+    size_t segments = model.segment_slope.size();
+    size_t cells = model.grid.size() - 1;
+    double cell = (raw - model.grid_start) * model.grid_scale;
+
+    if (!(cell >= 0.0)) {
+        return 0;                   // Below the grid, or NaN
+    }
+    if (cell >= static_cast<double>(cells)) {
+        return segments - 1;
+    }
+
+    // Binary search the knots inside the cell, however many there are
+    size_t c = static_cast<size_t>(cell);
+    size_t first = model.grid[c];
+    size_t last = model.grid[c + 1];
+    const double* knots = model.knot_raw.data();
+    size_t segment = std::upper_bound(knots + first + 1, knots + last + 1, raw) - (knots + 1);
+
+    // Rounding in cell can put raw one knot outside the cell
+    while (segment + 1 < segments && raw >= knots[segment + 1]) {
+        segment++;
+    }
+    while (segment > 0 && raw < knots[segment]) {
+        segment--;
+    }
+    return segment;
+}
+
+// Evaluate a model at one raw reading (NaN for a temperature model)
+double evaluate_model(const CalibrationModel& model, double raw);
+
+// Evaluate a temperature model at a raw reading and temperature
+double evaluate_model(const CalibrationModel& model, double raw, double temperature);
+
+// True if converting with the model needs a temperature for every reading
+inline bool model_needs_temperature(const CalibrationModel& model) {
+    return model.kind == MODEL_TEMPERATURE;
+}
+
+// Short description for messages, e.g. "polynomial (degree 3)"
+std::string model_description(const CalibrationModel& model);
+
+/*
+ * TEXT MODEL FILES
+ * Linear models use the two-line slope / offset format. Other models start
+ * with a keyword line:
+ *   polynomial DEGREE       then the fitted raw range "low high" and
+ *                           DEGREE + 1 coefficients in t (constant term
+ *                           first), one per line
+ *   piecewise KNOTS         then one "raw real" pair per line
+ *   temperature RAW TEMP    then the fitted raw range "low high", the
+ *                           fitted temperature range "low high" and
+ *                           (RAW + 1)  (TEMP + 1) coefficients c[j][k],
+ *                           k running fastest, one per line
+ */
+
+// Read filename into model; model is only modified on success
+LoadStatus read_model_file(const std::string& filename, CalibrationModel& model);
+
+// The same for the contents of a model file already in memory
+LoadStatus parse_model(const char* text, size_t size, CalibrationModel& model);
+
+// Write model to an open file. Returns false if writing fails.
+bool write_model(FILE* file, const CalibrationModel& model);
+
+// Append the text write_model() would write to text
+void format_model(const CalibrationModel& model, std::string& text);
+
+// Write model to filename. Returns false if the file cannot be written.
+bool write_model_file(const std::string& filename, const CalibrationModel& model);
+
+#endif
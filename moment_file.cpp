@@ -0,0 +1,196 @@
+/*
+ * Moment files: building, merging, writing and validating them
+ */
+
+#include "moment_file.h"
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+
+#include "mapped_file.h"
+#include "stats.h"
+
+using namespace std;
+
+namespace {
+
+void fill_header(MomentFileHeader& header, uint32_t channel_count, uint64_t points) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MOMENT_FILE_MAGIC, sizeof(header.magic));
+    header.version = MOMENT_FILE_VERSION;
+    header.header_size = sizeof(MomentFileHeader);
+    header.record_size = sizeof(MomentRecord);
+    header.channel_count = channel_count;
+    header.points = points;
+    header.file_size = sizeof(MomentFileHeader) + static_cast<uint64_t>(channel_count) * sizeof(MomentRecord);
+}
+
+// Moments a FitAccumulator can hold: finite, with non-negative sums of squares
+bool plausible(const MomentRecord& record) {
+    return record.count > 0
+        && isfinite(record.mean_x) && isfinite(record.mean_y) && isfinite(record.c_xy)
+        && isfinite(record.m2_x) && isfinite(record.m2_y)
+        && record.m2_x >= 0.0 && record.m2_y >= 0.0;
+}
+
+}  // namespace
+
+string moment_status_message(MomentStatus status, const string& filename) {
+    switch (status) {
+        case MOMENTS_OK:
+            return "Moments loaded from '" + filename + "'";
+        case MOMENTS_CANNOT_OPEN:
+            return "Cannot open file '" + filename + "'";
+        case MOMENTS_BAD_FORMAT:
+            return "'" + filename + "' is not a moment file.";
+        case MOMENTS_BAD_VERSION:
+            return "'" + filename + "' uses an unsupported moment file version.";
+        case MOMENTS_TRUNCATED:
+            return "'" + filename + "' is truncated.";
+    }
+    return "Unknown error.";
+}
+
+bool MomentSet::add(const uint32_t* channel, const double* raw, const double* reference, size_t n,
+                    unsigned threads, ComputeDevice device) {
+    vector<ChannelMoments> sums;
+    if (!channel_moments(channel, raw, reference, n, threads, device, sums)) {
+        return false;
+    }
+    for (size_t i = 0; i < sums.size(); i++) {
+        merge(sums[i].channel, sums[i].fit);
+    }
+    return true;
+}
+
+void MomentSet::merge(const MomentSet& other) {
+    for (map<uint32_t, FitAccumulator>::const_iterator it = other.moments.begin();
+         it != other.moments.end(); ++it) {
+        merge(it->first, it->second);
+    }
+}
+
+void MomentSet::merge(uint32_t channel, const FitAccumulator& fit) {
+    if (fit.count == 0) {
+        return;
+    }
+    moments[channel].merge(fit);
+    total_points += fit.count;
+}
+
+void MomentSet::fit(vector<ChannelFit>& fits) const {
+    fits.clear();
+    fits.reserve(moments.size());
+
+    for (map<uint32_t, FitAccumulator>::const_iterator it = moments.begin(); it != moments.end(); ++it) {
+        ChannelFit fit;
+        fit.channel = it->first;
+        fit.points = static_cast<size_t>(it->second.count);
+        fit.fitted = compute_calibration(it->second, fit.cal);
+        fits.push_back(fit);
+    }
+}
+
+/*
+ * Map the file and check it all before taking any of it: the header
+ * against the layout the writer uses, the records' order against each
+ * other and their counts against the header's total
+ */
+MomentStatus read_moment_file(const string& filename, MomentSet& moments) {
+    StageTimer timer(STAT_LOAD, 1);
+
+    MappedFile file;
+    MapStatus mapped = file.open(filename);
+    if (mapped != MAP_OK) {
+        return mapped == MAP_EMPTY ? MOMENTS_BAD_FORMAT : MOMENTS_CANNOT_OPEN;
+    }
+
+    MomentFileHeader header;
+    if (file.size() < sizeof(header)) {
+        return MOMENTS_BAD_FORMAT;
+    }
+    memcpy(&header, file.bytes(), sizeof(header));
+
+    if (memcmp(header.magic, MOMENT_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        return MOMENTS_BAD_FORMAT;
+    }
+    if (header.version != MOMENT_FILE_VERSION) {
+        return MOMENTS_BAD_VERSION;
+    }
+
+    MomentFileHeader expected;
+    fill_header(expected, header.channel_count, header.points);
+    if (header.header_size != expected.header_size || header.record_size != expected.record_size
+        || header.file_size != expected.file_size) {
+        return MOMENTS_BAD_FORMAT;
+    }
+    if (file.size() < header.file_size) {
+        return MOMENTS_TRUNCATED;
+    }
+
+    MomentSet loaded;
+    uint64_t points = 0;
+    const unsigned char* records = file.bytes() + sizeof(header);
+
+    for (uint32_t i = 0; i < header.channel_count; i++) {
+        MomentRecord record;
+        memcpy(&record, records + i * sizeof(MomentRecord), sizeof(record));
+
+        if (!plausible(record)) {
+            return MOMENTS_BAD_FORMAT;
+        }
+        if (i > 0 && record.channel <= loaded.moments.rbegin()->first) {
+            return MOMENTS_BAD_FORMAT;
+        }
+
+        FitAccumulator& fit = loaded.moments[record.channel];
+        fit.count = record.count;
+        fit.mean_x = record.mean_x;
+        fit.mean_y = record.mean_y;
+        fit.m2_x = record.m2_x;
+        fit.m2_y = record.m2_y;
+        fit.c_xy = record.c_xy;
+        points += record.count;
+    }
+
+    if (points != header.points) {
+        return MOMENTS_BAD_FORMAT;
+    }
+    loaded.total_points = points;
+    moments.moments.swap(loaded.moments);
+    moments.total_points = loaded.total_points;
+    return MOMENTS_OK;
+}
+
+bool write_moment_file(const string& filename, const MomentSet& moments) {
+    StageTimer timer(STAT_SAVE, 1);
+
+    MomentFileHeader header;
+    fill_header(header, static_cast<uint32_t>(moments.size()), moments.points());
+
+    vector<MomentRecord> records;
+    records.reserve(moments.size());
+    for (map<uint32_t, FitAccumulator>::const_iterator it = moments.channels().begin();
+         it != moments.channels().end(); ++it) {
+        MomentRecord record;
+        memset(&record, 0, sizeof(record));
+        record.channel = it->first;
+        record.count = it->second.count;
+        record.mean_x = it->second.mean_x;
+        record.mean_y = it->second.mean_y;
+        record.m2_x = it->second.m2_x;
+        record.m2_y = it->second.m2_y;
+        record.c_xy = it->second.c_xy;
+        records.push_back(record);
+    }
+
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(MomentRecord));
+    file.close();
+    return !file.fail();
+}
@@ -0,0 +1,116 @@
+/*
+ * Per-channel fit moments that merge across machines
+ *
+ * A campaign sharded over many storage nodes is fitted where the data
+ * lives: each node sums its own share into the least squares moments of
+ * every channel (count, means and co-moments, see FitAccumulator) and
+ * writes them to a small moment file, 56 bytes per channel whatever the
+ * number of points. A coordinator merges the nodes' files and solves each
+ * channel's line from the merged moments, so no raw data crosses the
+ * network. Merged moments make a moment file again, so merging can be
+ * done in stages (rack, then site).
+ *
+ * The merge is exact up to rounding: a channel's line from merged shards
+ * matches a fit of all its points on one machine to about 1e-14 of the
+ * readings' scale, whatever the order the shards are merged in.
+ *
+ * FILE LAYOUT (little-endian):
+ *   MomentFileHeader
+ *   MomentRecord records[channel_count]   ascending channel IDs, no repeats
+ */
+
+#ifndef MOMENT_FILE_H
+#define MOMENT_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "channel_fit.h"
+#include "fit.h"
+#include "gpu_offload.h"
+
+const char MOMENT_FILE_MAGIC[8] = { 'S', 'C', 'A', 'L', 'M', 'O', 'M', '\0' };
+const uint32_t MOMENT_FILE_VERSION = 1;
+
+struct MomentFileHeader {
+    char magic[8];              // MOMENT_FILE_MAGIC
+    uint32_t version;           // MOMENT_FILE_VERSION
+    uint32_t header_size;       // sizeof(MomentFileHeader)
+    uint32_t record_size;       // sizeof(MomentRecord)
+    uint32_t channel_count;     // Number of records
+    uint64_t points;            // Sum of the records' counts
+    uint64_t file_size;         // Total size written
+    uint32_t reserved[2];
+};
+
+// One channel's FitAccumulator
+struct MomentRecord {
+    uint32_t channel;
+    uint32_t reserved;
+    uint64_t count;
+    double mean_x;
+    double mean_y;
+    double m2_x;
+    double m2_y;
+    double c_xy;
+};
+
+enum MomentStatus {
+    MOMENTS_OK,
+    MOMENTS_CANNOT_OPEN,
+    MOMENTS_BAD_FORMAT,
+    MOMENTS_BAD_VERSION,
+    MOMENTS_TRUNCATED
+};
+
+std::string moment_status_message(MomentStatus status, const std::string& filename);
+
+/*
+ * The moments of any number of channels, built from points or merged
+ * from other sets
+ */
+class MomentSet {
+public:
+    MomentSet() : total_points(0) {}
+
+    /*
+     * Fold n "channel, raw, reference" rows in (see channel_moments()).
+     * Returns false, leaving the set unchanged, if the rows' channel IDs
+     * span CALIBRATION_TABLE_MAX_CHANNELS or more.
+     */
+    bool add(const uint32_t* channel, const double* raw, const double* reference, size_t n,
+             unsigned threads = 0, ComputeDevice device = DEVICE_CPU);
+
+    // Fold in every channel of other
+    void merge(const MomentSet& other);
+    void merge(uint32_t channel, const FitAccumulator& fit);
+
+    // Number of channels, and of points over all of them
+    size_t size() const { return moments.size(); }
+    uint64_t points() const { return total_points; }
+
+    // Ascending channel IDs with their moments
+    const std::map<uint32_t, FitAccumulator>& channels() const { return moments; }
+
+    /*
+     * Solve every channel's least squares line, in ascending channel
+     * order; channels whose points fix no line have fitted = false
+     */
+    void fit(std::vector<ChannelFit>& fits) const;
+
+private:
+    friend MomentStatus read_moment_file(const std::string& filename, MomentSet& moments);
+
+    std::map<uint32_t, FitAccumulator> moments;
+    uint64_t total_points;
+};
+
+// Replace moments with the contents of a moment file
+MomentStatus read_moment_file(const std::string& filename, MomentSet& moments);
+
+bool write_moment_file(const std::string& filename, const MomentSet& moments);
+
+#endif
@@ -0,0 +1,559 @@
+/*
+ * NUMA layout, thread pinning and the ParallelConverter pipeline
+ */
+
+#include "parallel_convert.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#include "aligned_buffer.h"
+#include "apply.h"
+#include "stats.h"
+
+using namespace std;
+
+namespace {
+
+const size_t CHUNK_BYTES = 1 << 18;        // Input text per chunk
+const size_t BLOCK_SIZE = 4096;            // Samples per apply, as in batch_convert()
+const unsigned SLOTS_PER_WORKER = 2;       // One converted while the next is filled
+
+enum SlotState {
+    SLOT_FREE,      // The caller's: being filled, or collected
+    SLOT_QUEUED,    // The worker's
+    SLOT_DONE       // Converted, waiting to be collected
+};
+
+// One chunk of lines on its way through a worker
+struct Slot {
+    vector<char> text;                  // '\n'-terminated lines
+    size_t used;
+    unsigned long long first_line;      // Number of the first line in text
+    string output;
+    unique_ptr<BufferedWriter> writer;  // Appends to output
+    unsigned long long converted;
+    bool failed;
+    unsigned long long error_line;
+    string error_text;
+    SlotState state;
+
+    Slot() : used(0), first_line(0), converted(0), failed(false), error_line(0), state(SLOT_FREE) {}
+};
+
+// A node's own copy of the calibration table
+struct NodeTable {
+    AlignedBuffer<double> slopes;
+    AlignedBuffer<double> offsets;
+    AlignedBuffer<uint64_t> valid;
+    CalibrationTableView view;
+};
+
+// A worker's sample block
+struct Scratch {
+    AlignedBuffer<uint32_t> channels;
+    AlignedBuffer<double> raw;
+    AlignedBuffer<double> real;
+};
+
+#ifdef _WIN32
+const unsigned GROUP_BITS = sizeof(KAFFINITY) * 8;
+#endif
+
+// "0-3,8-11" -> 0 1 2 3 8 9 10 11
+void parse_cpu_list(const char* text, vector<unsigned>& cpus) {
+    while (*text != '\0') {
+        char* end;
+        unsigned long first = strtoul(text, &end, 10);
+        if (end == text) {
+            return;
+        }
+        unsigned long last = first;
+        text = end;
+        if (*text == '-') {
+            last = strtoul(text + 1, &end, 10);
+            text = end;
+        }
+        for (unsigned long cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(static_cast<unsigned>(cpu));
+        }
+        if (*text != ',') {
+            return;
+        }
+        text++;
+    }
+}
+
+// Keep the calling thread on node's CPUs; does nothing without a CPU list
+void pin_to_node(const NumaNode& node) {
+    if (node.cpus.empty()) {
+        return;
+    }
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (size_t i = 0; i < node.cpus.size(); i++) {
+        if (node.cpus[i] < CPU_SETSIZE) {
+            CPU_SET(node.cpus[i], &set);
+        }
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#elif defined(_WIN32)
+    // A node's CPUs are all in one processor group
+    GROUP_AFFINITY affinity;
+    memset(&affinity, 0, sizeof(affinity));
+    affinity.Group = static_cast<WORD>(node.cpus[0] / GROUP_BITS);
+    for (size_t i = 0; i < node.cpus.size(); i++) {
+        if (node.cpus[i] / GROUP_BITS == affinity.Group) {
+            affinity.Mask |= KAFFINITY(1) << (node.cpus[i] % GROUP_BITS);
+        }
+    }
+    SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+#endif
+}
+
+}  // namespace
+
+vector<NumaNode> numa_nodes() {
+    vector<NumaNode> nodes;
+    vector<unsigned> usable;
+
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    bool have_mask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+    if (have_mask) {
+        for (unsigned cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed)) {
+                usable.push_back(cpu);
+            }
+        }
+    }
+
+    DIR* dir = opendir("/sys/devices/system/node");
+    if (dir != NULL) {
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            const char* name = entry->d_name;
+            if (strncmp(name, "node", 4) != 0 || name[4] < '0' || name[4] > '9') {
+                continue;
+            }
+
+            string list;
+            if (!read_text_file(string("/sys/devices/system/node/") + name + "/cpulist", list)) {
+                continue;
+            }
+            NumaNode node;
+            node.id = static_cast<unsigned>(strtoul(name + 4, NULL, 10));
+            vector<unsigned> cpus;
+            parse_cpu_list(list.c_str(), cpus);
+            for (size_t i = 0; i < cpus.size(); i++) {
+                if (!have_mask || (cpus[i] < CPU_SETSIZE && CPU_ISSET(cpus[i], &allowed))) {
+                    node.cpus.push_back(cpus[i]);
+                }
+            }
+            // Memory-only nodes have no CPUs to run on
+            if (!node.cpus.empty()) {
+                nodes.push_back(node);
+            }
+        }
+        closedir(dir);
+    }
+#elif defined(_WIN32)
+    ULONG highest;
+    if (GetNumaHighestNodeNumber(&highest)) {
+        for (ULONG id = 0; id <= highest; id++) {
+            GROUP_AFFINITY affinity;
+            if (!GetNumaNodeProcessorMaskEx(static_cast<USHORT>(id), &affinity)) {
+                continue;
+            }
+            NumaNode node;
+            node.id = id;
+            for (unsigned bit = 0; bit < GROUP_BITS; bit++) {
+                if ((affinity.Mask >> bit) & 1) {
+                    node.cpus.push_back(affinity.Group * GROUP_BITS + bit);
+                }
+            }
+            if (!node.cpus.empty()) {
+                nodes.push_back(node);
+            }
+        }
+    }
+#endif
+
+    if (nodes.empty()) {
+        NumaNode node;
+        node.id = 0;
+        node.cpus = usable;
+        nodes.push_back(node);
+    }
+
+    sort(nodes.begin(), nodes.end(), [](const NumaNode& a, const NumaNode& b) { return a.id < b.id; });
+    return nodes;
+}
+
+class ConvertEngine {
+public:
+    ConvertEngine(const CalibrationTableView& table, unsigned threads);
+    ~ConvertEngine();
+
+    bool add_line(const char* line, size_t length, BufferedWriter& out);
+    bool finish(BufferedWriter& out);
+
+    unsigned long long converted;
+    unsigned long long error_line;
+    string error_text;
+    unsigned thread_count;
+    size_t nodes_used;
+
+private:
+    void work(unsigned self);
+    void convert_chunk(Slot& slot, const CalibrationTableView& table, Scratch& scratch);
+    void convert_block(const CalibrationTableView& table, Scratch& scratch, BufferedWriter& writer);
+
+    // Make the next chunk's slot free, collecting the oldest chunks as needed
+    bool open_slot(BufferedWriter& out);
+    void submit();
+    bool collect(BufferedWriter& out);
+
+    CalibrationTableView source;    // Only valid while the workers start
+    vector<NumaNode> nodes;
+    vector<unique_ptr<NodeTable> > tables;
+    vector<unique_ptr<Slot> > slots;
+    vector<thread> pool;
+
+    mutex lock;
+    condition_variable work_ready;  // A slot was queued, or stopping
+    condition_variable work_done;   // A slot was converted, or a worker started
+    unsigned ready;
+    bool stopping;
+
+    // The caller's side
+    unsigned long long lines;
+    unsigned long long submitted;   // Chunks queued; chunk k goes to slot k % slots.size()
+    unsigned long long collected;   // Chunks written out (or failed)
+    bool filling;                   // Slot submitted % slots.size() is taking lines
+    bool failed;
+};
+
+ConvertEngine::ConvertEngine(const CalibrationTableView& table, unsigned threads)
+    : converted(0), error_line(0), thread_count(threads), nodes_used(0), source(table),
+      nodes(numa_nodes()), ready(0), stopping(false), lines(0), submitted(0), collected(0),
+      filling(false), failed(false) {
+    if (thread_count == 0) {
+        size_t usable = 0;
+        for (size_t i = 0; i < nodes.size(); i++) {
+            usable += nodes[i].cpus.size();
+        }
+        thread_count = usable > 0 ? static_cast<unsigned>(usable) : thread::hardware_concurrency();
+    }
+    if (thread_count == 0) {
+        thread_count = 1;
+    }
+    nodes_used = min(nodes.size(), static_cast<size_t>(thread_count));
+
+    tables.resize(nodes_used);
+    slots.resize(SLOTS_PER_WORKER * thread_count);
+    for (size_t s = 0; s < slots.size(); s++) {
+        slots[s].reset(new Slot());
+    }
+
+    for (unsigned t = 0; t < thread_count; t++) {
+        pool.emplace_back(&ConvertEngine::work, this, t);
+    }
+
+    // The workers copy the table, so wait before the caller may drop it
+    unique_lock<mutex> guard(lock);
+    work_done.wait(guard, [&]() { return ready == thread_count; });
+}
+
+ConvertEngine::~ConvertEngine() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    work_ready.notify_all();
+    for (size_t t = 0; t < pool.size(); t++) {
+        pool[t].join();
+    }
+}
+
+/*
+ * Worker self runs on node self % nodes_used and converts the chunks of
+ * slots self, self + threads, ... in turn. Its buffers are allocated and
+ * written here, after pinning, so their pages are on its node; so is the
+ * node's copy of the table, made by the node's first worker.
+ */
+void ConvertEngine::work(unsigned self) {
+    size_t node = self % nodes_used;
+    pin_to_node(nodes[node]);
+
+    vector<Slot*> own;
+    for (size_t s = self; s < slots.size(); s += thread_count) {
+        Slot& slot = *slots[s];
+        slot.text.assign(CHUNK_BYTES, '\0');
+        slot.output.reserve(2 * CHUNK_BYTES);
+        slot.writer.reset(new BufferedWriter(&slot.output, 1 << 16));
+        own.push_back(&slot);
+    }
+
+    Scratch scratch;
+    scratch.channels.resize(BLOCK_SIZE);
+    scratch.raw.resize(BLOCK_SIZE);
+    scratch.real.resize(BLOCK_SIZE);
+    scratch.channels.clear();
+    scratch.raw.clear();
+
+    if (self == node) {
+        NodeTable* copy = new NodeTable();
+        size_t words = (static_cast<size_t>(source.channel_count) + 63) / 64;
+        copy->slopes.resize(source.channel_count);
+        copy->offsets.resize(source.channel_count);
+        copy->valid.resize(words);
+        if (source.channel_count > 0) {
+            memcpy(copy->slopes.data(), source.slopes, source.channel_count * sizeof(double));
+            memcpy(copy->offsets.data(), source.offsets, source.channel_count * sizeof(double));
+            memcpy(copy->valid.data(), source.valid, words * sizeof(uint64_t));
+        }
+        copy->view.first_channel = source.first_channel;
+        copy->view.channel_count = source.channel_count;
+        copy->view.slopes = copy->slopes.data();
+        copy->view.offsets = copy->offsets.data();
+        copy->view.valid = copy->valid.data();
+        tables[node].reset(copy);
+    }
+
+    {
+        lock_guard<mutex> guard(lock);
+        ready++;
+    }
+    work_done.notify_all();
+
+    for (size_t turn = 0;; turn = (turn + 1) % own.size()) {
+        Slot& slot = *own[turn];
+        {
+            unique_lock<mutex> guard(lock);
+            work_ready.wait(guard, [&]() { return stopping || slot.state == SLOT_QUEUED; });
+            if (stopping) {
+                return;
+            }
+        }
+
+        // Every worker has started, so the node's table is there
+        convert_chunk(slot, tables[node]->view, scratch);
+
+        {
+            lock_guard<mutex> guard(lock);
+            slot.state = SLOT_DONE;
+        }
+        work_done.notify_all();
+    }
+}
+
+void ConvertEngine::convert_chunk(Slot& slot, const CalibrationTableView& table, Scratch& scratch) {
+    const char* line = slot.text.data();
+    const char* end = line + slot.used;
+    unsigned long long line_number = slot.first_line;
+
+    slot.converted = 0;
+    slot.failed = false;
+
+    while (line < end) {
+        const char* newline = static_cast<const char*>(memchr(line, '\n', end - line));
+
+        if (!is_blank_or_comment(line, newline)) {
+            uint32_t channel;
+            double raw_reading;
+            if (!parse_sample(line, newline, channel, raw_reading)) {
+                slot.failed = true;
+                slot.error_line = line_number;
+                slot.error_text.assign(line, newline);
+                break;
+            }
+            scratch.channels.push_back(channel);
+            scratch.raw.push_back(raw_reading);
+
+            if (scratch.raw.size() == BLOCK_SIZE) {
+                slot.converted += BLOCK_SIZE;
+                convert_block(table, scratch, *slot.writer);
+            }
+        }
+
+        line = newline + 1;
+        line_number++;
+    }
+
+    if (!slot.failed && scratch.raw.size() > 0) {
+        slot.converted += scratch.raw.size();
+        convert_block(table, scratch, *slot.writer);
+    }
+    scratch.channels.clear();
+    scratch.raw.clear();
+    slot.writer->flush();
+}
+
+void ConvertEngine::convert_block(const CalibrationTableView& table, Scratch& scratch,
+                                  BufferedWriter& writer) {
+    size_t n = scratch.raw.size();
+    {
+        StageTimer timer(STAT_CONVERT, n);
+        apply_calibration(table, scratch.channels.data(), scratch.raw.data(), scratch.real.data(), n);
+    }
+    {
+        // As batch_convert() formats them
+        StageTimer timer(STAT_FORMAT, n);
+        for (size_t i = 0; i < n; i++) {
+            writer.write_fixed(scratch.real[i], 10);
+            writer.put('\n');
+        }
+    }
+    scratch.channels.clear();
+    scratch.raw.clear();
+}
+
+bool ConvertEngine::add_line(const char* line, size_t length, BufferedWriter& out) {
+    if (failed) {
+        return false;
+    }
+    lines++;
+
+    if (!filling && !open_slot(out)) {
+        return false;
+    }
+    Slot* slot = slots[submitted % slots.size()].get();
+
+    if (slot->used + length + 1 > slot->text.size()) {
+        if (slot->used > 0) {
+            submit();
+            if (!open_slot(out)) {
+                return false;
+            }
+            slot = slots[submitted % slots.size()].get();
+        }
+        // A line longer than a whole chunk gets a chunk of its own
+        if (length + 1 > slot->text.size()) {
+            slot->text.resize(length + 1);
+        }
+    }
+
+    if (slot->used == 0) {
+        slot->first_line = lines;
+    }
+    memcpy(slot->text.data() + slot->used, line, length);
+    slot->text[slot->used + length] = '\n';
+    slot->used += length + 1;
+    return true;
+}
+
+bool ConvertEngine::finish(BufferedWriter& out) {
+    if (failed) {
+        return false;
+    }
+    if (filling) {
+        if (slots[submitted % slots.size()]->used > 0) {
+            submit();
+        }
+        filling = false;
+    }
+    while (collected < submitted) {
+        if (!collect(out)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ConvertEngine::open_slot(BufferedWriter& out) {
+    while (submitted - collected >= slots.size()) {
+        if (!collect(out)) {
+            return false;
+        }
+    }
+    slots[submitted % slots.size()]->used = 0;
+    filling = true;
+    return true;
+}
+
+void ConvertEngine::submit() {
+    {
+        lock_guard<mutex> guard(lock);
+        slots[submitted % slots.size()]->state = SLOT_QUEUED;
+    }
+    work_ready.notify_all();
+    submitted++;
+    filling = false;
+}
+
+// Write out the oldest chunk once it is converted (chunks finish in any order)
+bool ConvertEngine::collect(BufferedWriter& out) {
+    Slot& slot = *slots[collected % slots.size()];
+    {
+        unique_lock<mutex> guard(lock);
+        work_done.wait(guard, [&]() { return slot.state == SLOT_DONE; });
+        slot.state = SLOT_FREE;
+    }
+    collected++;
+
+    if (slot.failed) {
+        failed = true;
+        error_line = slot.error_line;
+        error_text = slot.error_text;
+        return false;
+    }
+    out.write(slot.output.data(), slot.output.size());
+    slot.output.clear();
+    converted += slot.converted;
+    return true;
+}
+
+ParallelConverter::ParallelConverter(const CalibrationTableView& table, unsigned threads)
+    : engine(new ConvertEngine(table, threads)) {}
+
+ParallelConverter::~ParallelConverter() {
+    delete engine;
+}
+
+bool ParallelConverter::add_line(const char* line, size_t length, BufferedWriter& out) {
+    return engine->add_line(line, length, out);
+}
+
+bool ParallelConverter::finish(BufferedWriter& out) {
+    return engine->finish(out);
+}
+
+unsigned long long ParallelConverter::converted() const {
+    return engine->converted;
+}
+
+unsigned long long ParallelConverter::error_line() const {
+    return engine->error_line;
+}
+
+const string& ParallelConverter::error_text() const {
+    return engine->error_text;
+}
+
+unsigned ParallelConverter::threads() const {
+    return engine->thread_count;
+}
+
+size_t ParallelConverter::node_count() const {
+    return engine->nodes_used;
+}
@@ -0,0 +1,89 @@
+/*
+ * Multi-channel batch convert on a NUMA-aware thread pool
+ *
+ * Converting "channel,raw" text is bound by parsing and formatting, so a
+ * single thread gets one core's worth however fast the apply kernel is.
+ * ParallelConverter cuts the input into chunks of whole lines and deals
+ * them round robin to a pool of worker threads. Each worker parses,
+ * converts and formats its chunk into its own output text; the caller's
+ * thread only copies the lines in and writes the finished text out in
+ * input order, so the output is byte for byte that of the serial loop.
+ *
+ * NUMA:
+ * On a multi-socket machine the workers are spread round robin over the
+ * NUMA nodes (so two threads already use both memory controllers) and
+ * each one is pinned to the CPUs of its node. What a worker touches in
+ * its loop is allocated and first written on its node, so the pages come
+ * from the node's local memory: its chunk and output buffers, its sample
+ * blocks and a copy of the calibration table made for each node. Only
+ * copying the lines in and the text out crosses nodes.
+ * The layout comes from /sys/devices/system/node on Linux and from the
+ * NUMA API on Windows, within the CPUs the process may use (taskset,
+ * cgroups). Elsewhere the machine counts as one node and nothing is
+ * pinned.
+ */
+
+#ifndef PARALLEL_CONVERT_H
+#define PARALLEL_CONVERT_H
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+#include "calibration_table.h"
+#include "text_io.h"
+
+// A NUMA node and the CPUs of it this process may run on
+struct NumaNode {
+    unsigned id;
+    std::vector<unsigned> cpus;     // Logical CPU numbers (on Windows group * 64 + bit)
+};
+
+/*
+ * The nodes with usable CPUs, in ID order. Without a readable layout this
+ * is one node, whose CPU list is empty if the usable CPUs are unknown.
+ */
+std::vector<NumaNode> numa_nodes();
+
+class ConvertEngine;
+
+/*
+ * Converts "channel,raw" lines through table on threads pinned workers
+ * (0 = one per hardware thread). The table is copied, so it need not
+ * outlive the converter.
+ */
+class ParallelConverter {
+public:
+    ParallelConverter(const CalibrationTableView& table, unsigned threads = 0);
+    ~ParallelConverter();
+
+    /*
+     * Queue one input line (without its newline); blank lines and comments
+     * are skipped as by the serial loop. Finished chunks are written to out
+     * in order as their buffers are needed again. Returns false once a line
+     * has failed to parse; nothing from its chunk on is written, and
+     * error_line() and error_text() say which line it was.
+     */
+    bool add_line(const char* line, size_t length, BufferedWriter& out);
+
+    // Convert the lines left and write all pending text to out; false as for add_line()
+    bool finish(BufferedWriter& out);
+
+    // Samples written to out so far
+    unsigned long long converted() const;
+
+    // The line that failed, numbered from 1 over all lines added
+    unsigned long long error_line() const;
+    const std::string& error_text() const;
+
+    unsigned threads() const;
+    size_t node_count() const;
+
+private:
+    ParallelConverter(const ParallelConverter&);             // Not copyable
+    ParallelConverter& operator=(const ParallelConverter&);
+
+    ConvertEngine* engine;
+};
+
+#endif
@@ -0,0 +1,106 @@
+/*
+ * Read-copy-update pointer for data that is read constantly and replaced
+ * rarely (e.g. the calibration a converter thread applies)
+ *
+ * Readers take a snapshot with RcuReadGuard and use it until the guard goes
+ * away. They never lock, wait or write shared data other than their own
+ * slot. A writer publishes a complete new object with one atomic exchange,
+ * then waits until no reader can still hold the old one before deleting
+ * it, so readers can never see a half-updated object or a freed one.
+ *
+ * Each reader thread needs its own slot (0 .. MAX_READERS - 1).
+ */
+
+#ifndef RCU_H
+#define RCU_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+template <typename T, int MAX_READERS = 8>
+class RcuPointer {
+public:
+    explicit RcuPointer(T* initial) : current(initial), epoch(1) {
+        for (int i = 0; i < MAX_READERS; i++) {
+            reader_epoch[i].value.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    ~RcuPointer() { delete current.load(std::memory_order_relaxed); }
+
+    /*
+     * Writer: replace the object and delete the old one once every reader
+     * that might still see it has moved on. Blocks the writer only.
+     */
+    void publish(T* replacement) {
+        std::lock_guard<std::mutex> lock(writer_mutex);
+
+        T* old = current.exchange(replacement, std::memory_order_seq_cst);
+        uint64_t new_epoch = epoch.fetch_add(1, std::memory_order_seq_cst) + 1;
+
+        // Readers that entered before the exchange announced an older epoch
+        for (int i = 0; i < MAX_READERS; i++) {
+            while (true) {
+                uint64_t seen = reader_epoch[i].value.load(std::memory_order_seq_cst);
+                if (seen == 0 || seen >= new_epoch) {
+                    break;
+                }
+                std::this_thread::yield();
+            }
+        }
+        delete old;
+    }
+
+    // Reader: start a read section in slot and return the current object
+    const T* enter(int slot) {
+        // Announce the epoch before loading the pointer (both seq_cst)
+        reader_epoch[slot].value.store(epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+        return current.load(std::memory_order_seq_cst);
+    }
+
+    // Reader: the object returned by enter() may be deleted after this
+    void leave(int slot) {
+        reader_epoch[slot].value.store(0, std::memory_order_release);
+    }
+
+private:
+    RcuPointer(const RcuPointer&);             // Not copyable
+    RcuPointer& operator=(const RcuPointer&);
+
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> value;    // 0 while outside a read section
+    };
+
+    std::atomic<T*> current;
+    std::atomic<uint64_t> epoch;
+    ReaderSlot reader_epoch[MAX_READERS];
+    std::mutex writer_mutex;
+};
+
+/*
+ * A reader's view of an RcuPointer for the lifetime of the guard
+ * Keep read sections short (e.g. one batch) so writers are not held up.
+ */
+template <typename T, int MAX_READERS = 8>
+class RcuReadGuard {
+public:
+    RcuReadGuard(RcuPointer<T, MAX_READERS>& pointer, int slot)
+        : pointer(pointer), slot(slot), object(pointer.enter(slot)) {}
+
+    ~RcuReadGuard() { pointer.leave(slot); }
+
+    const T& operator*() const { return *object; }
+    const T* operator->() const { return object; }
+
+private:
+    RcuReadGuard(const RcuReadGuard&);             // Not copyable
+    RcuReadGuard& operator=(const RcuReadGuard&);
+
+    RcuPointer<T, MAX_READERS>& pointer;
+    int slot;
+    const T* object;
+};
+
+#endif
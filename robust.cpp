@@ -0,0 +1,722 @@
+/*
+ * Theil-Sen, RANSAC and Huber line fits
+ */
+
+#include "robust.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <random>
+#include <thread>
+#include <vector>
+
+#include "fit.h"
+#include "stats.h"
+
+using namespace std;
+
+namespace {
+
+const double INF = numeric_limits<double>::infinity();
+
+// Random draws per seeded block; blocks are spread over the threads
+const size_t DRAW_BLOCK_SIZE = 4096;
+
+// RANSAC scores its hypotheses on this many points, then refits on all
+const size_t RANSAC_SCORING_POINTS = 4096;
+const size_t RANSAC_BLOCK_SIZE = 64;
+const int RANSAC_REFITS = 2;
+
+// Huber tuning constant (95% efficiency for normal errors) and MAD scale
+const double HUBER_K = 1.345;
+const double MAD_TO_SIGMA = 1.4826;
+const int HUBER_MAX_ITERATIONS = 50;
+
+// Random streams, so different draws from the same seed stay independent
+enum DrawStream {
+    STREAM_SLOPES,
+    STREAM_SCORING_POINTS,
+    STREAM_HYPOTHESES
+};
+
+/*
+ * Seed for one block of draws, whichever thread makes them (splitmix64 of
+ * the seed, stream and block)
+ */
+uint64_t block_seed(uint64_t seed, uint64_t stream, uint64_t block) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ULL * (stream * 0x100000001B3ULL + block + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Run body(block) for every block on up to threads threads (0 = one per
+ * hardware thread), handing blocks out from a shared counter as in
+ * fit_parallel()
+ */
+template <typename Body>
+void parallel_blocks(size_t num_blocks, unsigned threads, const Body& body) {
+    if (threads == 0) {
+        threads = thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > num_blocks) {
+        threads = static_cast<unsigned>(num_blocks);
+    }
+
+    atomic<size_t> next_block(0);
+
+    auto worker = [&]() {
+        while (true) {
+            size_t block = next_block.fetch_add(1, memory_order_relaxed);
+            if (block >= num_blocks) {
+                break;
+            }
+            body(block);
+        }
+    };
+
+    if (threads <= 1) {
+        worker();
+    } else {
+        // The calling thread works too
+        vector<thread> pool;
+        for (unsigned t = 1; t < threads; t++) {
+            pool.emplace_back(worker);
+        }
+        worker();
+        for (size_t t = 0; t < pool.size(); t++) {
+            pool[t].join();
+        }
+    }
+}
+
+// Median of values (which get reordered); values must not be empty
+double median_of(vector<double>& values) {
+    size_t mid = values.size() / 2;
+    nth_element(values.begin(), values.begin() + mid, values.end());
+    double upper = values[mid];
+    if (values.size() % 2 == 1) {
+        return upper;
+    }
+    double lower = *max_element(values.begin(), values.begin() + mid);
+    return 0.5 * (lower + upper);
+}
+
+/*
+ * MEDIAN OF PAIRWISE SLOPES
+ *
+ * Order the points by u = Reference - t  Raw. For two points with
+ * different raw readings the order flips exactly when t passes the slope
+ * between them, so the pairs ordered differently at t = a and at t = b
+ * are the pairs with a slope in (a, b]. Counting them is counting the
+ * inversions between two permutations, which a merge sort does in
+ * O(n log n), and the same pass can pick out the k-th inversion it meets,
+ * so slopes can be sampled uniformly from (a, b] without listing them.
+ *
+ * select() keeps an interval (lo, hi] known to hold the slopes of the
+ * wanted ranks. Each round samples n slopes from it and narrows it to a
+ * few standard errors around those ranks, keeping about 6 / sqrt(n) of
+ * the slopes, so after one or two rounds at most a few times n slopes
+ * are left; those are listed and the wanted one picked with nth_element.
+ *
+ * Ties in u are broken by raw reading (descending) and then by index,
+ * which makes a pair whose slope equals t count as "slope <= t" and
+ * never reorders points that share a raw reading.
+ */
+class SlopeSelector {
+public:
+    SlopeSelector(const double* raw, const double* reference, size_t n,
+                  const RobustFitOptions& options)
+        : options(options), rounds(0) {
+        // Sorted by (raw, reference): the order at t = -infinity
+        vector<size_t> order(n);
+        for (size_t i = 0; i < n; i++) {
+            order[i] = i;
+        }
+        sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+            return raw[a] < raw[b] || (raw[a] == raw[b] && reference[a] < reference[b]);
+        });
+
+        x.resize(n);
+        y.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            x[i] = raw[order[i]];
+            y[i] = reference[order[i]];
+        }
+
+        // Pairs sharing a raw reading have no slope
+        uint64_t total = static_cast<uint64_t>(n) * (n - 1) / 2;
+        size_t group_start = 0;
+        for (size_t i = 1; i <= n; i++) {
+            if (i == n || x[i] != x[group_start]) {
+                uint64_t group = i - group_start;
+                total -= group * (group - 1) / 2;
+                group_start = i;
+            }
+        }
+        pairs = total;
+    }
+
+    uint64_t pair_count() const { return pairs; }
+
+    /*
+     * The slopes of ranks first and last (0 = smallest, first <= last,
+     * close together) among all pair_count() slopes
+     */
+    void select(uint64_t first, uint64_t last, double& first_slope, double& last_slope) {
+        size_t n = x.size();
+        const uint64_t list_limit = max<uint64_t>(4 * static_cast<uint64_t>(n), 1 << 16);
+        const uint64_t sample_size = max<uint64_t>(n, 1024);
+        const int MAX_ROUNDS = 64;
+
+        double lo = -INF, hi = INF;
+        uint64_t count_lo = 0, count_hi = pairs;   // Slopes <= lo and <= hi
+        vector<uint32_t> order_lo, order_hi, order_t;
+        order_at(lo, order_lo);
+        order_at(hi, order_hi);
+
+        for (int round = 0; round < MAX_ROUNDS; round++) {
+            uint64_t in_range = count_hi - count_lo;
+
+            if (in_range <= list_limit) {
+                vector<double> slopes;
+                slopes.reserve(static_cast<size_t>(in_range));
+                swaps(order_lo, order_hi, NULL, &slopes);
+                if (slopes.empty()) {
+                    first_slope = last_slope = hi;
+                    return;
+                }
+                size_t first_index = static_cast<size_t>(min<uint64_t>(first - count_lo, slopes.size() - 1));
+                size_t last_index = static_cast<size_t>(min<uint64_t>(last - count_lo, slopes.size() - 1));
+                nth_element(slopes.begin(), slopes.begin() + first_index, slopes.end());
+                first_slope = slopes[first_index];
+                if (last_index > first_index) {
+                    last_slope = *min_element(slopes.begin() + first_index + 1, slopes.end());
+                    if (last_index > first_index + 1) {
+                        nth_element(slopes.begin() + first_index + 1, slopes.begin() + last_index, slopes.end());
+                        last_slope = slopes[last_index];
+                    }
+                } else {
+                    last_slope = first_slope;
+                }
+                return;
+            }
+
+            // Sample slopes from (lo, hi] and bracket the wanted rank among them
+            vector<uint64_t> picks;
+            draw_ranks(in_range, min(sample_size, in_range), picks);
+            vector<double> sample;
+            sample.reserve(picks.size());
+            swaps(order_lo, order_hi, &picks, &sample);
+            if (sample.empty()) {
+                first_slope = last_slope = hi;
+                return;
+            }
+            sort(sample.begin(), sample.end());
+
+            double scale = static_cast<double>(sample.size()) / in_range;
+            double margin = 3.0 * sqrt(static_cast<double>(sample.size())) + 1.0;
+            bool moved = false;
+
+            double below = (first - count_lo) * scale - margin;
+            double above = ceil((last - count_lo) * scale + margin);
+            if (below >= 0.0) {
+                double t = sample[static_cast<size_t>(below)];
+                if (t > lo && t < hi) {
+                    order_at(t, order_t);
+                    uint64_t count = count_lo + swaps(order_lo, order_t, NULL, NULL);
+                    if (count <= first) {
+                        lo = t;
+                        count_lo = count;
+                        order_lo.swap(order_t);
+                        moved = true;
+                    }
+                }
+            }
+
+            if (above < sample.size()) {
+                double t = sample[static_cast<size_t>(above)];
+                if (t > lo && t < hi) {
+                    order_at(t, order_t);
+                    uint64_t count = count_hi - swaps(order_t, order_hi, NULL, NULL);
+                    if (count > last) {
+                        hi = t;
+                        count_hi = count;
+                        order_hi.swap(order_t);
+                        moved = true;
+                    }
+                }
+            }
+
+            if (!moved) {
+                // The sample bunches at one value: many slopes equal hi
+                double t = nextafter(hi, -INF);
+                if (!(t > lo)) {
+                    first_slope = last_slope = hi;
+                    return;
+                }
+                order_at(t, order_t);
+                uint64_t count = count_hi - swaps(order_t, order_hi, NULL, NULL);
+                if (count <= first) {
+                    first_slope = last_slope = hi;
+                    return;
+                }
+                if (count <= last) {
+                    // Only first is below t; last is hi itself
+                    double first_below;
+                    select(first, first, first_slope, first_below);
+                    last_slope = hi;
+                    return;
+                }
+                hi = t;
+                count_hi = count;
+                order_hi.swap(order_t);
+            }
+        }
+
+        // Only reached for pathological inputs; hi is within the last bracket
+        first_slope = last_slope = hi;
+    }
+
+    const vector<double>& sorted_raw() const { return x; }
+    const vector<double>& sorted_reference() const { return y; }
+
+private:
+    const RobustFitOptions& options;
+    vector<double> x;       // Sorted by (raw, reference)
+    vector<double> y;
+    uint64_t pairs;         // Pairs with different raw readings
+    uint64_t rounds;        // Sampling rounds so far, for the seeds
+
+    // Points in their order at t (see the ties rule above)
+    void order_at(double t, vector<uint32_t>& order) const {
+        size_t n = x.size();
+        order.resize(n);
+        for (size_t i = 0; i < n; i++) {
+            order[i] = static_cast<uint32_t>(i);
+        }
+        if (t == -INF) {
+            return;
+        }
+        if (t == INF) {
+            sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+                return x[a] > x[b] || (x[a] == x[b] && a < b);
+            });
+            return;
+        }
+
+        // Sort keys next to the indices rather than looked up through them
+        struct Key {
+            double u;
+            double x;
+            uint32_t index;
+        };
+        vector<Key> keys(n);
+        for (size_t i = 0; i < n; i++) {
+            keys[i].u = y[i] - t * x[i];
+            keys[i].x = x[i];
+            keys[i].index = static_cast<uint32_t>(i);
+        }
+        sort(keys.begin(), keys.end(), [](const Key& a, const Key& b) {
+            if (a.u != b.u) {
+                return a.u < b.u;
+            }
+            return a.x > b.x || (a.x == b.x && a.index < b.index);
+        });
+        for (size_t i = 0; i < n; i++) {
+            order[i] = keys[i].index;
+        }
+    }
+
+    // count ranks drawn uniformly from [0, range), sorted
+    void draw_ranks(uint64_t range, uint64_t count, vector<uint64_t>& picks) {
+        picks.resize(static_cast<size_t>(count));
+        size_t num_blocks = (picks.size() + DRAW_BLOCK_SIZE - 1) / DRAW_BLOCK_SIZE;
+        uint64_t round = rounds++;
+
+        parallel_blocks(num_blocks, options.threads, [&](size_t block) {
+            mt19937_64 rng(block_seed(options.seed, STREAM_SLOPES + 8 * round, block));
+            uniform_int_distribution<uint64_t> pick(0, range - 1);
+            size_t begin = block * DRAW_BLOCK_SIZE;
+            size_t end = min(begin + DRAW_BLOCK_SIZE, picks.size());
+            for (size_t i = begin; i < end; i++) {
+                picks[i] = pick(rng);
+            }
+        });
+
+        sort(picks.begin(), picks.end());
+    }
+
+    double slope(uint32_t a, uint32_t b) const {
+        return (y[b] - y[a]) / (x[b] - x[a]);
+    }
+
+    /*
+     * Count the pairs ordered differently in a and b (bottom-up merge
+     * sort of b's points by their position in a). With picks, the slopes
+     * of the inversions with those (sorted) numbers go to slopes; without,
+     * slopes (if not NULL) gets every inversion's slope.
+     */
+    uint64_t swaps(const vector<uint32_t>& a, const vector<uint32_t>& b,
+                   const vector<uint64_t>* picks, vector<double>* slopes) const {
+        size_t n = a.size();
+        vector<uint32_t> position(n), sequence(n), merged(n);
+        for (size_t i = 0; i < n; i++) {
+            position[a[i]] = static_cast<uint32_t>(i);
+        }
+        for (size_t i = 0; i < n; i++) {
+            sequence[i] = position[b[i]];
+        }
+
+        uint64_t total = 0;
+        size_t next_pick = 0;
+
+        for (size_t width = 1; width < n; width *= 2) {
+            for (size_t start = 0; start < n; start += 2 * width) {
+                size_t mid = min(start + width, n);
+                size_t end = min(start + 2 * width, n);
+                size_t i = start, j = mid, k = start;
+
+                while (i < mid && j < end) {
+                    if (sequence[i] < sequence[j]) {
+                        merged[k++] = sequence[i++];
+                        continue;
+                    }
+
+                    // sequence[j] is inverted with every sequence[i .. mid)
+                    uint64_t count = mid - i;
+                    if (picks != NULL) {
+                        while (next_pick < picks->size() && (*picks)[next_pick] < total + count) {
+                            size_t left = i + static_cast<size_t>((*picks)[next_pick] - total);
+                            slopes->push_back(slope(a[sequence[left]], a[sequence[j]]));
+                            next_pick++;
+                        }
+                    } else if (slopes != NULL) {
+                        for (size_t left = i; left < mid; left++) {
+                            slopes->push_back(slope(a[sequence[left]], a[sequence[j]]));
+                        }
+                    }
+                    total += count;
+                    merged[k++] = sequence[j++];
+                }
+                while (i < mid) {
+                    merged[k++] = sequence[i++];
+                }
+                while (j < end) {
+                    merged[k++] = sequence[j++];
+                }
+            }
+            sequence.swap(merged);
+        }
+
+        return total;
+    }
+};
+
+// Theil-Sen line; no stage timer, so other fits can use it for a first guess
+bool theil_sen_line(const double* raw, const double* reference, size_t n,
+                    const RobustFitOptions& options, Calibration& cal) {
+    if (n < 2) {
+        return false;
+    }
+
+    SlopeSelector selector(raw, reference, n, options);
+    uint64_t pairs = selector.pair_count();
+    if (pairs == 0) {
+        return false;
+    }
+
+    // The middle slope, or the mean of the middle two
+    double lower, upper;
+    selector.select((pairs - 1) / 2, pairs / 2, lower, upper);
+    double slope = 0.5 * (lower + upper);
+
+    const vector<double>& x = selector.sorted_raw();
+    const vector<double>& y = selector.sorted_reference();
+    vector<double> intercepts(n);
+    for (size_t i = 0; i < n; i++) {
+        intercepts[i] = y[i] - slope * x[i];
+    }
+
+    cal.slope = slope;
+    cal.offset = median_of(intercepts);
+    cal.is_valid = true;
+    return true;
+}
+
+/*
+ * Default RANSAC threshold: three robust standard deviations (from the
+ * median absolute residual) around a Theil-Sen line through the points.
+ * If most points lie exactly on a line, a threshold just above rounding.
+ */
+double ransac_threshold(const vector<double>& x, const vector<double>& y,
+                        const RobustFitOptions& options) {
+    double largest = 0.0;
+    for (size_t i = 0; i < y.size(); i++) {
+        largest = max(largest, fabs(y[i]));
+    }
+    double floor_threshold = 1e-12 * max(largest, 1.0);
+
+    Calibration rough;
+    if (!theil_sen_line(x.data(), y.data(), x.size(), options, rough)) {
+        return floor_threshold;
+    }
+
+    vector<double> residuals(x.size());
+    for (size_t i = 0; i < x.size(); i++) {
+        residuals[i] = fabs(y[i] - (rough.slope * x[i] + rough.offset));
+    }
+    return max(3.0 * MAD_TO_SIGMA * median_of(residuals), floor_threshold);
+}
+
+// Best hypothesis of one block: most inliers, then lowest number
+struct Hypothesis {
+    size_t score;
+    uint64_t number;
+    double slope;
+    double offset;
+
+    Hypothesis() : score(0), number(0), slope(0.0), offset(0.0) {}
+
+    bool beats(const Hypothesis& other) const {
+        return score > other.score || (score == other.score && number < other.number);
+    }
+};
+
+}  // namespace
+
+bool parse_fit_method(const string& text, FitMethod& method) {
+    if (text == "least-squares") {
+        method = FIT_LEAST_SQUARES;
+    } else if (text == "theil-sen") {
+        method = FIT_THEIL_SEN;
+    } else if (text == "ransac") {
+        method = FIT_RANSAC;
+    } else if (text == "huber") {
+        method = FIT_HUBER;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+const char* fit_method_name(FitMethod method) {
+    switch (method) {
+        case FIT_LEAST_SQUARES:
+            return "least-squares";
+        case FIT_THEIL_SEN:
+            return "theil-sen";
+        case FIT_RANSAC:
+            return "ransac";
+        case FIT_HUBER:
+            return "huber";
+    }
+    return "unknown";
+}
+
+bool fit_theil_sen(const double* raw, const double* reference, size_t n,
+                   const RobustFitOptions& options, Calibration& cal) {
+    StageTimer timer(STAT_FIT, n);
+    return theil_sen_line(raw, reference, n, options, cal);
+}
+
+/*
+ * RANSAC
+ *
+ * Hypotheses are lines through two random points, scored by how many of
+ * a fixed random subset of the points lie within the threshold. Blocks of
+ * hypotheses run in parallel, each from its own seed. The winner's
+ * inliers among all points are refitted by least squares, twice, so the
+ * final line does not depend on the two points that suggested it.
+ */
+bool fit_ransac(const double* raw, const double* reference, size_t n,
+                const RobustFitOptions& options, Calibration& cal, size_t& inliers) {
+    StageTimer timer(STAT_FIT, n);
+    if (n < 2) {
+        return false;
+    }
+    if (*min_element(raw, raw + n) == *max_element(raw, raw + n)) {
+        return false;
+    }
+
+    // The points hypotheses are scored on
+    vector<double> score_x, score_y;
+    if (n <= RANSAC_SCORING_POINTS) {
+        score_x.assign(raw, raw + n);
+        score_y.assign(reference, reference + n);
+    } else {
+        mt19937_64 rng(block_seed(options.seed, STREAM_SCORING_POINTS, 0));
+        uniform_int_distribution<size_t> pick(0, n - 1);
+        for (size_t i = 0; i < RANSAC_SCORING_POINTS; i++) {
+            size_t index = pick(rng);
+            score_x.push_back(raw[index]);
+            score_y.push_back(reference[index]);
+        }
+    }
+
+    double threshold = options.threshold > 0.0 ? options.threshold
+                                               : ransac_threshold(score_x, score_y, options);
+
+    uint64_t hypotheses = options.hypotheses > 0 ? options.hypotheses : 1;
+    size_t num_blocks = static_cast<size_t>((hypotheses + RANSAC_BLOCK_SIZE - 1) / RANSAC_BLOCK_SIZE);
+    vector<Hypothesis> block_best(num_blocks);
+
+    parallel_blocks(num_blocks, options.threads, [&](size_t block) {
+        uniform_int_distribution<size_t> pick(0, n - 1);
+        uint64_t first = static_cast<uint64_t>(block) * RANSAC_BLOCK_SIZE;
+        uint64_t last = min<uint64_t>(first + RANSAC_BLOCK_SIZE, hypotheses);
+
+        for (uint64_t h = first; h < last; h++) {
+            mt19937_64 rng(block_seed(options.seed, STREAM_HYPOTHESES, h));
+            size_t i = pick(rng), j = pick(rng);
+            for (int attempt = 0; attempt < 32 && raw[i] == raw[j]; attempt++) {
+                j = pick(rng);
+            }
+            if (raw[i] == raw[j]) {
+                continue;
+            }
+
+            Hypothesis candidate;
+            candidate.number = h;
+            candidate.slope = (reference[j] - reference[i]) / (raw[j] - raw[i]);
+            candidate.offset = reference[i] - candidate.slope * raw[i];
+            for (size_t k = 0; k < score_x.size(); k++) {
+                double residual = score_y[k] - (candidate.slope * score_x[k] + candidate.offset);
+                candidate.score += fabs(residual) <= threshold;
+            }
+
+            if (candidate.beats(block_best[block])) {
+                block_best[block] = candidate;
+            }
+        }
+    });
+
+    Hypothesis best;
+    for (size_t b = 0; b < num_blocks; b++) {
+        if (block_best[b].beats(best)) {
+            best = block_best[b];
+        }
+    }
+    if (best.score == 0) {
+        return false;
+    }
+
+    Calibration line;
+    line.slope = best.slope;
+    line.offset = best.offset;
+    line.is_valid = true;
+
+    for (int refit = 0; refit < RANSAC_REFITS; refit++) {
+        FitAccumulator fit;
+        for (size_t i = 0; i < n; i++) {
+            if (fabs(reference[i] - (line.slope * raw[i] + line.offset)) <= threshold) {
+                fit.add(raw[i], reference[i]);
+            }
+        }
+        Calibration refitted;
+        if (!compute_calibration(fit, refitted)) {
+            break;
+        }
+        line = refitted;
+    }
+
+    inliers = 0;
+    for (size_t i = 0; i < n; i++) {
+        inliers += fabs(reference[i] - (line.slope * raw[i] + line.offset)) <= threshold;
+    }
+
+    cal = line;
+    return true;
+}
+
+/*
+ * HUBER
+ *
+ * Iteratively reweighted least squares from the ordinary fit: points with
+ * residuals under HUBER_K robust standard deviations keep weight 1, the
+ * rest get HUBER_K  scale / |residual|. The scale is re-estimated from
+ * the median absolute residual each round.
+ */
+bool fit_huber(const double* raw, const double* reference, size_t n,
+               const RobustFitOptions& options, Calibration& cal) {
+    StageTimer timer(STAT_FIT, n);
+    (void)options;
+
+    Calibration line;
+    if (!compute_calibration(fit_block(raw, reference, n), line)) {
+        return false;
+    }
+
+    vector<double> residuals(n), scratch(n), weights(n);
+
+    for (int iteration = 0; iteration < HUBER_MAX_ITERATIONS; iteration++) {
+        for (size_t i = 0; i < n; i++) {
+            residuals[i] = fabs(reference[i] - (line.slope * raw[i] + line.offset));
+        }
+        scratch = residuals;
+        double scale = MAD_TO_SIGMA * median_of(scratch);
+        if (!(scale > 0.0)) {
+            // Most points lie exactly on the line already
+            break;
+        }
+        double limit = HUBER_K * scale;
+
+        double sum_w = 0.0, sum_wx = 0.0, sum_wy = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            weights[i] = residuals[i] <= limit ? 1.0 : limit / residuals[i];
+            sum_w += weights[i];
+            sum_wx += weights[i] * raw[i];
+            sum_wy += weights[i] * reference[i];
+        }
+        double mean_x = sum_wx / sum_w;
+        double mean_y = sum_wy / sum_w;
+
+        // Centered weighted sums, as in fit_block()
+        double m2_x = 0.0, c_xy = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            double dx = raw[i] - mean_x;
+            m2_x += weights[i] * dx * dx;
+            c_xy += weights[i] * dx * (reference[i] - mean_y);
+        }
+        if (!(m2_x > 0.0)) {
+            break;
+        }
+
+        Calibration next;
+        next.slope = c_xy / m2_x;
+        next.offset = mean_y - next.slope * mean_x;
+        next.is_valid = true;
+
+        bool converged = fabs(next.slope - line.slope) <= 1e-12 * fabs(next.slope)
+                      && fabs(next.offset - line.offset) <= 1e-12 * fabs(next.offset);
+        line = next;
+        if (converged) {
+            break;
+        }
+    }
+
+    cal = line;
+    return true;
+}
+
+bool fit_line(FitMethod method, const double* raw, const double* reference, size_t n,
+              const RobustFitOptions& options, Calibration& cal) {
+    size_t inliers;
+    switch (method) {
+        case FIT_LEAST_SQUARES:
+            return compute_calibration(fit_parallel(raw, reference, n, options.threads), cal);
+        case FIT_THEIL_SEN:
+            return fit_theil_sen(raw, reference, n, options, cal);
+        case FIT_RANSAC:
+            return fit_ransac(raw, reference, n, options, cal, inliers);
+        case FIT_HUBER:
+            return fit_huber(raw, reference, n, options, cal);
+    }
+    return false;
+}
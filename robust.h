@@ -0,0 +1,71 @@
+/*
+ * Robust straight-line fits
+ *
+ * Least squares lets a single bad reference reading drag the whole line.
+ * These estimators fit the same Real Value = Slope  Raw + Offset but
+ * ignore, or down-weight, points that do not follow the others:
+ *
+ *   theil-sen  Slope = median of the slopes between all pairs of points,
+ *              offset = median of the resulting intercepts. Up to about
+ *              29% of the points may be bad. The median of the n(n-1)/2
+ *              slopes is found in O(n log n) per round, without listing
+ *              them, and a few rounds suffice (see robust.cpp).
+ *   ransac     The line through two random points that the most points lie
+ *              close to, refitted by least squares on those inliers. More
+ *              than half of the points may be bad.
+ *   huber      Least squares with weights that shrink for large residuals
+ *              (iteratively reweighted). Cheap, and enough for occasional
+ *              bad reference readings.
+ *
+ * Random draws are made in parallel from fixed per-block seeds, so the
+ * results do not depend on the thread count.
+ */
+
+#ifndef ROBUST_H
+#define ROBUST_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "calibration.h"
+
+enum FitMethod {
+    FIT_LEAST_SQUARES,
+    FIT_THEIL_SEN,
+    FIT_RANSAC,
+    FIT_HUBER
+};
+
+struct RobustFitOptions {
+    unsigned threads;       // 0 = one per hardware thread
+    unsigned hypotheses;    // Lines RANSAC tries
+    double threshold;       // RANSAC inlier distance in reference units; 0 = from the data
+    uint64_t seed;
+
+    RobustFitOptions() : threads(0), hypotheses(1000), threshold(0.0), seed(1) {}
+};
+
+// Parse "least-squares", "theil-sen", "ransac" or "huber"
+bool parse_fit_method(const std::string& text, FitMethod& method);
+const char* fit_method_name(FitMethod method);
+
+/*
+ * Each fit returns false (and leaves cal untouched) with fewer than 2
+ * distinct raw readings
+ */
+bool fit_theil_sen(const double* raw, const double* reference, size_t n,
+                   const RobustFitOptions& options, Calibration& cal);
+
+// inliers is set to the number of points within the threshold of the final line
+bool fit_ransac(const double* raw, const double* reference, size_t n,
+                const RobustFitOptions& options, Calibration& cal, size_t& inliers);
+
+bool fit_huber(const double* raw, const double* reference, size_t n,
+               const RobustFitOptions& options, Calibration& cal);
+
+// Fit with the given method (FIT_LEAST_SQUARES uses fit_parallel())
+bool fit_line(FitMethod method, const double* raw, const double* reference, size_t n,
+              const RobustFitOptions& options, Calibration& cal);
+
+#endif
@@ -0,0 +1,188 @@
+/*
+ * Binary sample files: mapping and validation
+ */
+
+#include "sample_file.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "stats.h"
+
+using namespace std;
+
+namespace {
+
+/*
+ * Check a mapped file and point the columns at its arrays
+ * Every column must lie inside the file and be aligned to its element
+ * size; each role may appear once.
+ */
+SampleStatus parse_sample_file(const unsigned char* data, size_t size, uint64_t& rows,
+                               SampleColumn* columns) {
+    SampleFileHeader header;
+
+    if (size < sizeof(header)) {
+        return SAMPLE_BAD_FORMAT;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    if (memcmp(header.magic, SAMPLE_FILE_MAGIC, sizeof(header.magic)) != 0) {
+        return SAMPLE_BAD_FORMAT;
+    }
+    if (header.version != SAMPLE_FILE_VERSION) {
+        return SAMPLE_BAD_VERSION;
+    }
+    if (header.header_size != sizeof(header) || header.column_count == 0
+        || header.column_count > SAMPLE_FILE_MAX_COLUMNS || header.file_size < sizeof(header)) {
+        return SAMPLE_BAD_FORMAT;
+    }
+
+    SampleColumn found[SAMPLE_COLUMN_ROLES];
+
+    for (uint32_t c = 0; c < header.column_count; c++) {
+        const SampleColumnHeader& column = header.columns[c];
+        size_t element = sample_type_size(column.type);
+
+        if (element == 0 || column.offset < sizeof(header) || column.offset % element != 0
+            || column.offset > header.file_size
+            || header.row_count > (header.file_size - column.offset) / element) {
+            return SAMPLE_BAD_FORMAT;
+        }
+
+        if (column.role == 0 || column.role > SAMPLE_COLUMN_ROLES) {
+            return SAMPLE_BAD_FORMAT;
+        }
+        SampleColumn* target = &found[column.role - 1];
+        if (target->data != NULL) {
+            return SAMPLE_BAD_FORMAT;
+        }
+        target->type = static_cast<SampleType>(column.type);
+        target->data = data + column.offset;
+    }
+
+    if (size < header.file_size) {
+        return SAMPLE_TRUNCATED;
+    }
+
+    rows = header.row_count;
+    for (uint32_t r = 0; r < SAMPLE_COLUMN_ROLES; r++) {
+        columns[r] = found[r];
+    }
+    return SAMPLE_OK;
+}
+
+template <typename T>
+void widen(const T* in, size_t n, double* out) {
+    for (size_t i = 0; i < n; i++) {
+        out[i] = static_cast<double>(in[i]);
+    }
+}
+
+}  // namespace
+
+string sample_status_message(SampleStatus status, const string& filename) {
+    switch (status) {
+        case SAMPLE_OK:
+            return "Sample file loaded from '" + filename + "'";
+        case SAMPLE_CANNOT_OPEN:
+            return "Cannot open file '" + filename + "'";
+        case SAMPLE_BAD_FORMAT:
+            return "'" + filename + "' is not a valid sample file.";
+        case SAMPLE_BAD_VERSION:
+            return "'" + filename + "' uses an unsupported sample file version.";
+        case SAMPLE_TRUNCATED:
+            return "'" + filename + "' is truncated.";
+    }
+    return "Unknown error.";
+}
+
+size_t sample_type_size(uint32_t type) {
+    switch (type) {
+        case SAMPLE_INT16: return sizeof(int16_t);
+        case SAMPLE_INT32: return sizeof(int32_t);
+        case SAMPLE_FLOAT32: return sizeof(float);
+        case SAMPLE_FLOAT64: return sizeof(double);
+    }
+    return 0;
+}
+
+const char* sample_type_name(SampleType type) {
+    switch (type) {
+        case SAMPLE_INT16: return "int16";
+        case SAMPLE_INT32: return "int32";
+        case SAMPLE_FLOAT32: return "float32";
+        case SAMPLE_FLOAT64: return "float64";
+    }
+    return "unknown";
+}
+
+bool is_sample_file(const string& filename) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[sizeof(SAMPLE_FILE_MAGIC)];
+    bool matches = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+                   && memcmp(magic, SAMPLE_FILE_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return matches;
+}
+
+MappedSampleFile::MappedSampleFile() : rows(0) {}
+
+/*
+ * Map filename read-only and validate its header
+ * The columns are read once front to back, so the kernel is asked to
+ * read ahead
+ */
+SampleStatus MappedSampleFile::open(const string& filename) {
+    StageTimer timer(STAT_LOAD, 1);
+    close();
+
+    MapStatus mapped = file.open(filename);
+    if (mapped != MAP_OK) {
+        return mapped == MAP_EMPTY ? SAMPLE_BAD_FORMAT : SAMPLE_CANNOT_OPEN;
+    }
+
+    SampleStatus status = parse_sample_file(file.bytes(), file.size(), rows, columns);
+    if (status != SAMPLE_OK) {
+        close();
+        return status;
+    }
+    file.advise_sequential();
+    return SAMPLE_OK;
+}
+
+void MappedSampleFile::close() {
+    file.close();
+    rows = 0;
+    for (SampleColumn& column : columns) {
+        column = SampleColumn();
+    }
+}
+
+void widen_samples(const SampleColumn& column, size_t first, size_t n, double* out) {
+    switch (column.type) {
+        case SAMPLE_INT16:
+            widen(static_cast<const int16_t*>(column.data) + first, n, out);
+            break;
+        case SAMPLE_INT32:
+            widen(static_cast<const int32_t*>(column.data) + first, n, out);
+            break;
+        case SAMPLE_FLOAT32:
+            widen(static_cast<const float*>(column.data) + first, n, out);
+            break;
+        case SAMPLE_FLOAT64:
+            memcpy(out, static_cast<const double*>(column.data) + first, n * sizeof(double));
+            break;
+    }
+}
+
+const double* sample_values(const SampleColumn& column, size_t first, size_t n, double* scratch) {
+    if (column.type == SAMPLE_FLOAT64) {
+        return static_cast<const double*>(column.data) + first;
+    }
+    widen_samples(column, first, n, scratch);
+    return scratch;
+}
@@ -0,0 +1,124 @@
+/*
+ * Binary sample files
+ *
+ * DAQ dumps can be handed to convert and fit as they are, without a
+ * round trip through text: a small header followed by one plain array per
+ * column. The file is memory-mapped and the apply kernels read the raw
+ * column in place, so there is no parse step and no copy of the samples
+ * (integer and float32 columns are widened to double inside the kernel).
+ *
+ * FILE LAYOUT (little-endian, columns 64-byte aligned):
+ *   SampleFileHeader
+ *   column 0 values[row_count]
+ *   column 1 values[row_count]     ...up to SAMPLE_FILE_MAX_COLUMNS
+ * Every column has its own role and type. convert needs a raw column; fit
+ * needs a reference and a raw column. Temperature-compensated models also
+ * need a temperature column for both.
+ */
+
+#ifndef SAMPLE_FILE_H
+#define SAMPLE_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "mapped_file.h"
+
+const char SAMPLE_FILE_MAGIC[8] = { 'S', 'C', 'S', 'M', 'P', 'L', 'S', '\0' };
+const uint32_t SAMPLE_FILE_VERSION = 1;
+const uint32_t SAMPLE_FILE_MAX_COLUMNS = 4;
+
+// Element type of a column
+enum SampleType {
+    SAMPLE_INT16 = 1,
+    SAMPLE_INT32 = 2,
+    SAMPLE_FLOAT32 = 3,
+    SAMPLE_FLOAT64 = 4
+};
+
+// What a column holds
+enum SampleColumnRole {
+    COLUMN_RAW = 1,         // Raw readings
+    COLUMN_REFERENCE = 2,   // Reference values of calibration points
+    COLUMN_TEMPERATURE = 3  // Sensor temperature at each reading
+};
+const uint32_t SAMPLE_COLUMN_ROLES = 3;
+
+struct SampleColumnHeader {
+    uint32_t role;          // SampleColumnRole
+    uint32_t type;          // SampleType
+    uint64_t offset;        // Byte offset of the array from the start of the file
+};
+
+struct SampleFileHeader {
+    char magic[8];          // SAMPLE_FILE_MAGIC
+    uint32_t version;       // SAMPLE_FILE_VERSION
+    uint32_t header_size;   // sizeof(SampleFileHeader)
+    uint64_t row_count;     // Values in every column
+    uint32_t column_count;  // 1 .. SAMPLE_FILE_MAX_COLUMNS
+    uint32_t reserved;
+    SampleColumnHeader columns[SAMPLE_FILE_MAX_COLUMNS];   // Unused entries are zero
+    uint64_t file_size;     // Total size written
+};
+
+// A column of a mapped file; data is NULL if the file has no such column
+struct SampleColumn {
+    SampleType type;
+    const void* data;
+
+    SampleColumn() : type(SAMPLE_FLOAT64), data(NULL) {}
+};
+
+// Result of opening a sample file
+enum SampleStatus {
+    SAMPLE_OK,
+    SAMPLE_CANNOT_OPEN,
+    SAMPLE_BAD_FORMAT,
+    SAMPLE_BAD_VERSION,
+    SAMPLE_TRUNCATED
+};
+
+std::string sample_status_message(SampleStatus status, const std::string& filename);
+
+// Bytes per value of a column type (0 for an unknown type)
+size_t sample_type_size(uint32_t type);
+
+// Short name of a column type ("int16", "float64", ...)
+const char* sample_type_name(SampleType type);
+
+// True if filename can be read and starts with SAMPLE_FILE_MAGIC
+bool is_sample_file(const std::string& filename);
+
+/*
+ * A sample file mapped read-only into memory
+ * Columns taken from it must not outlive it.
+ */
+class MappedSampleFile {
+public:
+    MappedSampleFile();
+
+    SampleStatus open(const std::string& filename);
+    void close();
+
+    bool is_open() const { return file.is_open(); }
+    uint64_t row_count() const { return rows; }
+    const SampleColumn& column(SampleColumnRole role) const { return columns[role - 1]; }
+
+private:
+    MappedSampleFile(const MappedSampleFile&);             // Not copyable
+    MappedSampleFile& operator=(const MappedSampleFile&);
+
+    MappedFile file;
+    uint64_t rows;
+    SampleColumn columns[SAMPLE_COLUMN_ROLES];     // By role - 1
+};
+
+// Copy values first .. first + n - 1 of a column into out as doubles
+void widen_samples(const SampleColumn& column, size_t first, size_t n, double* out);
+
+// Values first .. first + n - 1 as doubles: in place for a float64 column,
+// otherwise widened into scratch
+const double* sample_values(const SampleColumn& column, size_t first, size_t n, double* scratch);
+
+#endif
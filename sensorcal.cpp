@@ -0,0 +1,284 @@
+/*
+ * C interface of libsensorcal over the fit, model, apply and text modules
+ */
+
+#include "sensorcal.h"
+
+#include <algorithm>
+#include <new>
+#include <string>
+
+#include "apply.h"
+#include "fit.h"
+#include "model.h"
+#include "robust.h"
+#include "text_io.h"
+
+using namespace std;
+
+struct sensorcal_model {
+    CalibrationModel model;
+    FitAccumulator fit;     // Moments behind a least squares line, else count 0
+};
+
+namespace {
+
+// Points widened from int16 at a time for the nonlinear kernels
+const size_t WIDEN_BLOCK = 512;
+
+bool valid_points(const double* raw, const double* reference, size_t n) {
+    return raw != NULL && reference != NULL && n > 0;
+}
+
+// Install a fitted model; fit is its least squares state if it has one
+sensorcal_status replace_model(sensorcal_model* model, const CalibrationModel& fitted,
+                               const FitAccumulator& fit) {
+    try {
+        model->model = fitted;
+    } catch (const bad_alloc&) {
+        return SENSORCAL_NO_MEMORY;
+    }
+    model->fit = fit;
+    return SENSORCAL_OK;
+}
+
+sensorcal_status check_apply(const sensorcal_model* model, const void* raw, const double* out,
+                             bool with_temperature) {
+    if (model == NULL || raw == NULL || out == NULL) {
+        return SENSORCAL_BAD_ARGUMENT;
+    }
+    if (!model->model.is_valid) {
+        return SENSORCAL_NO_MODEL;
+    }
+    if (model_needs_temperature(model->model) != with_temperature) {
+        return SENSORCAL_WRONG_INPUTS;
+    }
+    return SENSORCAL_OK;
+}
+
+}  // namespace
+
+sensorcal_model* sensorcal_model_create(void) {
+    return new (nothrow) sensorcal_model;
+}
+
+void sensorcal_model_destroy(sensorcal_model* model) {
+    delete model;
+}
+
+sensorcal_status sensorcal_fit_line(sensorcal_model* model, sensorcal_method method,
+                                    const double* raw, const double* reference, size_t n,
+                                    unsigned threads) {
+    if (model == NULL || !valid_points(raw, reference, n)
+        || method < SENSORCAL_LEAST_SQUARES || method > SENSORCAL_HUBER) {
+        return SENSORCAL_BAD_ARGUMENT;
+    }
+
+    Calibration cal;
+    FitAccumulator fit;
+    try {
+        if (method == SENSORCAL_LEAST_SQUARES) {
+            fit = fit_parallel(raw, reference, n, threads);
+            if (!compute_calibration(fit, cal)) {
+                return SENSORCAL_CANNOT_FIT;
+            }
+        } else {
+            RobustFitOptions options;
+            options.threads = threads;
+            if (!fit_line(static_cast<FitMethod>(method), raw, reference, n, options, cal)) {
+                return SENSORCAL_CANNOT_FIT;
+            }
+        }
+    } catch (const bad_alloc&) {
+        return SENSORCAL_NO_MEMORY;
+    }
+
+    return replace_model(model, linear_model(cal), fit);
+}
+
+sensorcal_status sensorcal_fit_polynomial(sensorcal_model* model, const double* raw,
+                                          const double* reference, size_t n, int degree) {
+    if (model == NULL || !valid_points(raw, reference, n) || degree < 1 || degree > MAX_POLYNOMIAL_DEGREE) {
+        return SENSORCAL_BAD_ARGUMENT;
+    }
+
+    CalibrationModel fitted;
+    try {
+        if (!fit_polynomial(raw, reference, n, degree, fitted)) {
+            return SENSORCAL_CANNOT_FIT;
+        }
+    } catch (const bad_alloc&) {
+        return SENSORCAL_NO_MEMORY;
+    }
+    return replace_model(model, fitted, FitAccumulator());
+}
+
+sensorcal_status sensorcal_fit_piecewise(sensorcal_model* model, const double* raw,
+                                         const double* reference, size_t n, size_t segments) {
+    if (model == NULL || !valid_points(raw, reference, n)
+        || segments < 1 || segments > MAX_PIECEWISE_SEGMENTS) {
+        return SENSORCAL_BAD_ARGUMENT;
+    }
+
+    CalibrationModel fitted;
+    try {
+        if (!fit_piecewise(raw, reference, n, segments, fitted)) {
+            return SENSORCAL_CANNOT_FIT;
+        }
+    } catch (const bad_alloc&) {
+        return SENSORCAL_NO_MEMORY;
+    }
+    return replace_model(model, fitted, FitAccumulator());
+}
+
+sensorcal_status sensorcal_fit_temperature(sensorcal_model* model, const double* raw,
+                                           const double* temperature, const double* reference,
+                                           size_t n, int raw_degree, int temperature_degree,
+                                           unsigned threads) {
+    if (model == NULL || !valid_points(raw, reference, n) || temperature == NULL
+        || raw_degree < 1 || raw_degree > MAX_POLYNOMIAL_DEGREE
+        || temperature_degree < 1 || temperature_degree > MAX_TEMPERATURE_DEGREE) {
+        return SENSORCAL_BAD_ARGUMENT;
+    }
+
+    CalibrationModel fitted;
+    try {
+        if (!fit_temperature_model(raw, temperature, reference, n, raw_degree, temperature_degree,
+                                   threads, fitted)) {
+            return SENSORCAL_CANNOT_FIT;
+        }
+    } catch (const bad_alloc&) {
+        return SENSORCAL_NO_MEMORY;
+    }
+    return replace_model(model, fitted, FitAccumulator());
+}
+
+sensorcal_status sensorcal_load(sensorcal_model* model, const char* text, size_t size) {
+    if (model == NULL || (text == NULL && size > 0)) {
+        return SENSORCAL_BAD_ARGUMENT;
+    }
+
+    try {
+        // A linear file may carry its fit state; anything else is a model file
+        Calibration cal;
+        FitAccumulator fit;
+        LoadStatus status = parse_calibration(text, size, cal, fit);
+        if (status == LOAD_OK) {
+            return replace_model(model, linear_model(cal), fit);
+        }
+        if (status != LOAD_NOT_LINEAR) {
+            return SENSORCAL_BAD_TEXT;
+        }
+
+        CalibrationModel loaded;
+        if (parse_model(text, size, loaded) != LOAD_OK) {
+            return SENSORCAL_BAD_TEXT;
+        }
+        return replace_model(model, loaded, FitAccumulator());
+    } catch (const bad_alloc&) {
+        return SENSORCAL_NO_MEMORY;
+    }
+}
+
+sensorcal_status sensorcal_save(const sensorcal_model* model, char* text, size_t* size) {
+    if (model == NULL || size == NULL || (text == NULL && *size > 0)) {
+        return SENSORCAL_BAD_ARGUMENT;
+    }
+    if (!model->model.is_valid) {
+        return SENSORCAL_NO_MODEL;
+    }
+
+    string formatted;
+    try {
+        if (model->model.kind == MODEL_LINEAR) {
+            // As batch fit saves a least squares line: with its state and quality
+            FitDiagnostics diagnostics;
+            bool has_diagnostics = model->fit.count > 0
+                && compute_diagnostics(model->fit, model->model.linear, true, diagnostics);
+            format_calibration(model->model.linear, model->fit,
+                               has_diagnostics ? &diagnostics : NULL, formatted);
+        } else {
+            format_model(model->model, formatted);
+        }
+    } catch (const bad_alloc&) {
+        return SENSORCAL_NO_MEMORY;
+    }
+
+    size_t capacity = *size;
+    *size = formatted.size();
+    if (formatted.size() > capacity) {
+        return SENSORCAL_BUFFER_TOO_SMALL;
+    }
+    copy(formatted.begin(), formatted.end(), text);
+    return SENSORCAL_OK;
+}
+
+sensorcal_status sensorcal_apply(const sensorcal_model* model, const double* raw, double* out, size_t n) {
+    sensorcal_status status = check_apply(model, raw, out, false);
+    if (status == SENSORCAL_OK) {
+        apply_model(model->model, raw, out, n);
+    }
+    return status;
+}
+
+sensorcal_status sensorcal_apply_int16(const sensorcal_model* model, const int16_t* raw,
+                                       double* out, size_t n) {
+    sensorcal_status status = check_apply(model, raw, out, false);
+    if (status != SENSORCAL_OK) {
+        return status;
+    }
+
+    if (model->model.kind == MODEL_LINEAR) {
+        apply_calibration(model->model.linear, raw, out, n);
+        return SENSORCAL_OK;
+    }
+
+    // The nonlinear kernels take doubles: widen on the stack a block at a time
+    double widened[WIDEN_BLOCK];
+    for (size_t first = 0; first < n; first += WIDEN_BLOCK) {
+        size_t count = min(WIDEN_BLOCK, n - first);
+        for (size_t i = 0; i < count; i++) {
+            widened[i] = raw[first + i];
+        }
+        apply_model(model->model, widened, out + first, count);
+    }
+    return SENSORCAL_OK;
+}
+
+sensorcal_status sensorcal_apply_temperature(const sensorcal_model* model, const double* raw,
+                                             const double* temperature, double* out, size_t n) {
+    if (temperature == NULL) {
+        return SENSORCAL_BAD_ARGUMENT;
+    }
+    sensorcal_status status = check_apply(model, raw, out, true);
+    if (status == SENSORCAL_OK) {
+        apply_model(model->model, raw, temperature, out, n);
+    }
+    return status;
+}
+
+int sensorcal_needs_temperature(const sensorcal_model* model) {
+    return model != NULL && model_needs_temperature(model->model) ? 1 : 0;
+}
+
+const char* sensorcal_status_message(sensorcal_status status) {
+    switch (status) {
+        case SENSORCAL_OK:
+            return "OK";
+        case SENSORCAL_BAD_ARGUMENT:
+            return "Invalid argument.";
+        case SENSORCAL_NO_MODEL:
+            return "No calibration has been fitted or loaded.";
+        case SENSORCAL_CANNOT_FIT:
+            return "The points do not determine the calibration.";
+        case SENSORCAL_BAD_TEXT:
+            return "Not a calibration file.";
+        case SENSORCAL_BUFFER_TOO_SMALL:
+            return "The buffer is too small for the calibration.";
+        case SENSORCAL_WRONG_INPUTS:
+            return "Temperature-compensated models need temperatures, and only they take them.";
+        case SENSORCAL_NO_MEMORY:
+            return "Out of memory.";
+    }
+    return "Unknown error.";
+}
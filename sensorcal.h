@@ -0,0 +1,114 @@
+/*
+ * libsensorcal: the calibration library for embedding in other programs
+ *
+ * PURPOSE:
+ * Lets an acquisition process fit, apply, load and save calibrations
+ * in-process instead of running sensor_calibrate and round-tripping text
+ * through pipes. Everything works on caller buffers: nothing here opens a
+ * file, prints or reads stdin, and sensorcal_apply() makes no heap
+ * allocations, so DAQ threads can call it on every block.
+ *
+ * This header is plain C. C++ callers can use it too, or the module
+ * headers it is built on (fit.h, apply.h, model.h, text_io.h, session.h),
+ * fixed_calibration.h to compile factory-fixed coefficients in, and
+ * fixed_point.h for integer-only targets.
+ *
+ * BUILDING THE STATIC LIBRARY:
+ * g++ -std=c++17 -O2 -pthread -c apply.cpp fit.cpp calibration_table.cpp text_io.cpp stats.cpp model.cpp robust.cpp channel_fit.cpp adc_lookup.cpp mapped_file.cpp sample_file.cpp async_io.cpp drift.cpp session.cpp gpu_offload.cpp moment_file.cpp parallel_convert.cpp fixed_point.cpp snapshot.cpp batch.cpp sensorcal.cpp
+ * ar rcs libsensorcal.a apply.o fit.o calibration_table.o text_io.o stats.o model.o robust.o channel_fit.o adc_lookup.o mapped_file.o sample_file.o async_io.o drift.o session.o gpu_offload.o moment_file.o parallel_convert.o fixed_point.o snapshot.o batch.o sensorcal.o
+ * Link with -lsensorcal -pthread (and -lstdc++ from a C program).
+ *
+ * USE:
+ *   sensorcal_model* model = sensorcal_model_create();
+ *   sensorcal_load(model, text, text_size);           (or sensorcal_fit_*)
+ *   sensorcal_apply(model, raw, real, n);              (any thread, any number of times)
+ *   sensorcal_model_destroy(model);
+ * A model may be applied from several threads at once; fitting or loading
+ * into it must not overlap with anything else on the same model.
+ */
+
+#ifndef SENSORCAL_H
+#define SENSORCAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum sensorcal_status {
+    SENSORCAL_OK = 0,
+    SENSORCAL_BAD_ARGUMENT,         /* NULL pointer or parameter out of range */
+    SENSORCAL_NO_MODEL,             /* Nothing fitted or loaded yet */
+    SENSORCAL_CANNOT_FIT,           /* The points do not determine the model */
+    SENSORCAL_BAD_TEXT,             /* Not the text of a calibration file */
+    SENSORCAL_BUFFER_TOO_SMALL,     /* See sensorcal_save() */
+    SENSORCAL_WRONG_INPUTS,         /* Temperature model without temperatures, or the reverse */
+    SENSORCAL_NO_MEMORY
+} sensorcal_status;
+
+typedef enum sensorcal_method {
+    SENSORCAL_LEAST_SQUARES = 0,
+    SENSORCAL_THEIL_SEN,
+    SENSORCAL_RANSAC,
+    SENSORCAL_HUBER
+} sensorcal_method;
+
+/* Opaque: one calibration (linear, polynomial, piecewise or temperature-compensated) */
+typedef struct sensorcal_model sensorcal_model;
+
+/* A model with nothing in it yet; NULL if out of memory */
+sensorcal_model* sensorcal_model_create(void);
+void sensorcal_model_destroy(sensorcal_model* model);
+
+/*
+ * FIT
+ * Each replaces the model with a fit of the n points (raw[i], reference[i])
+ * and leaves it untouched on failure. threads = 0 uses every core.
+ */
+sensorcal_status sensorcal_fit_line(sensorcal_model* model, sensorcal_method method,
+                                    const double* raw, const double* reference, size_t n,
+                                    unsigned threads);
+sensorcal_status sensorcal_fit_polynomial(sensorcal_model* model, const double* raw,
+                                          const double* reference, size_t n, int degree);
+sensorcal_status sensorcal_fit_piecewise(sensorcal_model* model, const double* raw,
+                                         const double* reference, size_t n, size_t segments);
+sensorcal_status sensorcal_fit_temperature(sensorcal_model* model, const double* raw,
+                                           const double* temperature, const double* reference,
+                                           size_t n, int raw_degree, int temperature_degree,
+                                           unsigned threads);
+
+/*
+ * LOAD AND SAVE
+ * The text is that of a calibration file as sensor_calibrate reads and
+ * writes it. sensorcal_save() writes at most *size bytes (no NUL) and sets
+ * *size to the length of the text; if that is more than the buffer held
+ * it returns SENSORCAL_BUFFER_TOO_SMALL, so a call with *size = 0 asks for
+ * the length.
+ */
+sensorcal_status sensorcal_load(sensorcal_model* model, const char* text, size_t size);
+sensorcal_status sensorcal_save(const sensorcal_model* model, char* text, size_t* size);
+
+/*
+ * APPLY
+ * out[i] = calibrated raw[i]. Any model but a temperature-compensated one
+ * takes sensorcal_apply(); those take sensorcal_apply_temperature().
+ */
+sensorcal_status sensorcal_apply(const sensorcal_model* model, const double* raw, double* out, size_t n);
+sensorcal_status sensorcal_apply_int16(const sensorcal_model* model, const int16_t* raw,
+                                       double* out, size_t n);
+sensorcal_status sensorcal_apply_temperature(const sensorcal_model* model, const double* raw,
+                                             const double* temperature, double* out, size_t n);
+
+/* 1 if the model converts with sensorcal_apply_temperature() */
+int sensorcal_needs_temperature(const sensorcal_model* model);
+
+/* Short English description of a status */
+const char* sensorcal_status_message(sensorcal_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
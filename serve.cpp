@@ -0,0 +1,683 @@
+/*
+ * Reader / converter / writer pipeline for the streaming service mode,
+ * with optional reload and drift tracking threads
+ */
+
+#include "serve.h"
+
+#include <atomic>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+#include "apply.h"
+#include "rcu.h"
+#include "spsc_ring.h"
+#include "stats.h"
+#include "text_io.h"
+
+using namespace std;
+
+namespace {
+
+const size_t RING_CAPACITY = 1 << 16;   // Samples in flight between two stages
+const size_t BATCH_SIZE = 256;          // Samples moved per ring operation
+const size_t READ_BUFFER_SIZE = 1 << 16;
+const size_t WRITE_BUFFER_SIZE = 1 << 16;
+
+// Latency histogram: 1 us buckets up to 100 ms, then one overflow bucket
+const size_t LATENCY_BUCKETS = 100000;
+
+// How often the reload thread checks for SIGHUP and changed files
+const int RELOAD_POLL_MS = 200;
+
+// The converter is the only RCU reader
+const int CONVERTER_SLOT = 0;
+
+// Buffer for the reference point stream, which carries little data
+const size_t TRACK_BUFFER_SIZE = 1 << 12;
+
+// Set by the SIGHUP handler, cleared by the reload thread
+volatile sig_atomic_t reload_requested = 0;
+
+#ifdef SIGHUP
+extern "C" void on_sighup(int) {
+    reload_requested = 1;
+}
+#endif
+
+struct RawSample {
+    double raw;
+    uint32_t channel;
+    uint64_t arrival_ns;    // When the read() that delivered it returned
+};
+
+struct RealSample {
+    double value;
+    uint64_t arrival_ns;
+};
+
+/*
+ * Back-off for a stage with nothing to do: spin first (lowest latency),
+ * then yield, then nap, so a quiet stream does not burn three cores
+ */
+class IdleWait {
+public:
+    IdleWait() : rounds(0) {}
+
+    void wait() {
+        rounds++;
+        if (rounds < 2000) {
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+            __builtin_ia32_pause();
+#endif
+        } else if (rounds < 20000) {
+            this_thread::yield();
+        } else {
+            this_thread::sleep_for(chrono::microseconds(20));
+        }
+    }
+
+    void reset() { rounds = 0; }
+
+private:
+    unsigned rounds;
+};
+
+// Push all n items, waiting for room as needed
+template <typename T>
+void push_all(SpscRing<T>& ring, const T* items, size_t n) {
+    IdleWait idle;
+    size_t pushed = 0;
+    while (true) {
+        pushed += ring.push(items + pushed, n - pushed);
+        if (pushed == n) {
+            return;
+        }
+        idle.wait();
+    }
+}
+
+long read_some(int fd, char* buffer, size_t size) {
+    while (true) {
+#ifdef _WIN32
+        long count = _read(fd, buffer, static_cast<unsigned>(size));
+#else
+        long count = read(fd, buffer, size);
+#endif
+        if (count >= 0 || errno != EINTR) {
+            return count;
+        }
+    }
+}
+
+/*
+ * Wait up to timeout_ms for fd to have input (or end of input)
+ * Windows has no poll() for pipes; reads there simply block.
+ */
+bool wait_readable(int fd, int timeout_ms) {
+#ifdef _WIN32
+    (void)fd;
+    (void)timeout_ms;
+    return true;
+#else
+    pollfd entry;
+    entry.fd = fd;
+    entry.events = POLLIN;
+    entry.revents = 0;
+    // An error also ends the wait; the next read() reports it
+    return poll(&entry, 1, timeout_ms) != 0;
+#endif
+}
+
+/*
+ * What a watched file looked like at one poll; a file that cannot be
+ * stat()ed (e.g. mid-rename) compares equal to nothing but itself
+ */
+struct FileStamp {
+    long long mtime;
+    long long size;
+    bool exists;
+
+    bool operator==(const FileStamp& other) const {
+        return mtime == other.mtime && size == other.size && exists == other.exists;
+    }
+    bool operator!=(const FileStamp& other) const { return !(*this == other); }
+};
+
+FileStamp stamp_file(const string& path) {
+    FileStamp stamp = {0, 0, false};
+    struct stat info;
+    if (stat(path.c_str(), &info) == 0) {
+        stamp.mtime = static_cast<long long>(info.st_mtime);
+        stamp.size = static_cast<long long>(info.st_size);
+        stamp.exists = true;
+    }
+    return stamp;
+}
+
+bool write_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+#ifdef _WIN32
+        long count = _write(fd, data, static_cast<unsigned>(size));
+#else
+        long count = write(fd, data, size);
+#endif
+        if (count < 0 && errno == EINTR) {
+            continue;
+        }
+        if (count <= 0) {
+            return false;
+        }
+        data += count;
+        size -= count;
+    }
+    return true;
+}
+
+class Pipeline {
+public:
+    Pipeline(StreamCalibration* initial, const ReloadOptions& reload, const TrackOptions& track,
+             int in_fd, int out_fd)
+        : calibration(initial), multi_channel(initial->multi_channel), reload(reload),
+          track(track), tracker(track.forgetting), in_fd(in_fd), out_fd(out_fd),
+          raw_ring(RING_CAPACITY), real_ring(RING_CAPACITY),
+          reader_done(false), converter_done(false), writer_done(false),
+          latency(LATENCY_BUCKETS + 1, 0), max_latency_ns(0),
+          reloads(0), failed_reloads(0), bad_track_lines(0), track_updates(0),
+          track_read_failed(false) {
+        if (track.seed.count > 0) {
+            tracker.seed(track.seed);
+        }
+    }
+
+    void run(ServeReport& report) {
+        thread reader([this]() { read_stage(); });
+        thread converter([this]() { convert_stage(); });
+        thread reloader;
+        if (reload.load) {
+            reloader = thread([this]() { reload_stage(); });
+        }
+        thread track_thread;
+        if (track.fd >= 0) {
+            track_thread = thread([this]() { track_stage(); });
+        }
+        write_stage();
+
+        writer_done.store(true, memory_order_release);
+        reader.join();
+        converter.join();
+        if (reloader.joinable()) {
+            reloader.join();
+        }
+        if (track_thread.joinable()) {
+            track_thread.join();
+        }
+
+        report = result;
+        report.reloads = reloads;
+        report.failed_reloads = failed_reloads;
+        report.tracked_points = tracker.points_added();
+        report.bad_track_lines = bad_track_lines;
+        report.track_updates = track_updates;
+        report.track_read_failed = track_read_failed;
+        tracker.calibration(report.tracked);
+        report.p50_us = latency_percentile(0.50);
+        report.p99_us = latency_percentile(0.99);
+        report.max_us = max_latency_ns / 1000.0;
+    }
+
+private:
+    RcuPointer<StreamCalibration> calibration;
+    bool multi_channel;     // Input format; the same for every reload
+    const ReloadOptions& reload;
+    const TrackOptions& track;
+    DriftTracker tracker;   // Used by the tracking thread only
+    int in_fd;
+    int out_fd;
+
+    SpscRing<RawSample> raw_ring;
+    SpscRing<RealSample> real_ring;
+    atomic<bool> reader_done;
+    atomic<bool> converter_done;
+    atomic<bool> writer_done;
+
+    // Written by one stage each, read after join()
+    ServeReport result;
+    vector<unsigned long long> latency;
+    uint64_t max_latency_ns;
+    unsigned reloads;
+    unsigned failed_reloads;
+    // Written by the tracking thread, read after join()
+    unsigned long long bad_track_lines;
+    unsigned long long track_updates;
+    bool track_read_failed;
+
+    /*
+     * Split what each read() from fd returns into lines: on_line(line,
+     * end, arrival) runs for every complete line (NUL-terminated at end),
+     * then after_read() once per read(). A partial line waits for the
+     * next read(); one that fills the whole buffer is skipped and counted
+     * in bad_lines. With stop given, waits for input in short polls and
+     * returns once stop is set, even if fd stays open.
+     * Returns false if a read failed.
+     */
+    template <typename OnLine, typename AfterRead>
+    bool read_lines(int fd, size_t buffer_size, const atomic<bool>* stop,
+                    unsigned long long& bad_lines, OnLine on_line, AfterRead after_read) {
+        vector<char> buffer(buffer_size + 1);
+        size_t used = 0;
+        bool skipping = false;  // Inside a line that was too long
+        bool read_ok = true;
+
+        while (true) {
+            if (stop != NULL) {
+                if (stop->load(memory_order_acquire)) {
+                    break;
+                }
+                if (!wait_readable(fd, RELOAD_POLL_MS)) {
+                    continue;
+                }
+            }
+
+            long count = read_some(fd, &buffer[used], buffer_size - used);
+            if (count < 0) {
+                read_ok = false;
+            }
+            bool at_eof = count <= 0;
+            uint64_t arrival = stats_clock_ns();
+            used += at_eof ? 0 : static_cast<size_t>(count);
+
+            // The last line may lack its newline
+            if (at_eof && used > 0 && buffer[used - 1] != '\n') {
+                buffer[used++] = '\n';
+            }
+
+            size_t start = 0;
+            while (true) {
+                char* newline = static_cast<char*>(memchr(&buffer[start], '\n', used - start));
+                if (newline == NULL) {
+                    break;
+                }
+                *newline = '\0';
+                const char* line = &buffer[start];
+                const char* end = newline;
+                start = (newline - &buffer[0]) + 1;
+
+                if (skipping) {
+                    skipping = false;
+                    continue;
+                }
+                on_line(line, end, arrival);
+            }
+            after_read();
+
+            // Keep the partial line; drop it if it fills the whole buffer
+            memmove(&buffer[0], &buffer[start], used - start);
+            used -= start;
+            if (used == buffer_size) {
+                if (!skipping) {
+                    bad_lines++;
+                }
+                skipping = true;
+                used = 0;
+            }
+
+            if (at_eof) {
+                break;
+            }
+        }
+        return read_ok;
+    }
+
+    /*
+     * READER
+     * Parses every complete line in what read() returned and hands the
+     * samples on at once; a partial line waits for the next read()
+     */
+    void read_stage() {
+        vector<RawSample> batch;
+        batch.reserve(BATCH_SIZE);
+
+        bool read_ok = read_lines(in_fd, READ_BUFFER_SIZE, NULL, result.bad_lines,
+            [&](const char* line, const char* end, uint64_t arrival) {
+                parse_line(line, end, arrival, batch);
+            },
+            [&]() {
+                if (!batch.empty()) {
+                    push_all(raw_ring, batch.data(), batch.size());
+                    batch.clear();
+                }
+            });
+        if (!read_ok) {
+            result.read_failed = true;
+        }
+
+        reader_done.store(true, memory_order_release);
+    }
+
+    void parse_line(const char* line, const char* end, uint64_t arrival, vector<RawSample>& batch) {
+        if (is_blank_or_comment(line, end)) {
+            return;
+        }
+
+        RawSample sample;
+        sample.channel = 0;
+        sample.arrival_ns = arrival;
+
+        bool parsed = multi_channel
+            ? parse_sample(line, end, sample.channel, sample.raw)
+            : parse_reading(line, end, sample.raw);
+        if (!parsed) {
+            result.bad_lines++;
+            return;
+        }
+
+        batch.push_back(sample);
+        if (batch.size() == BATCH_SIZE) {
+            push_all(raw_ring, batch.data(), batch.size());
+            batch.clear();
+        }
+    }
+
+    /*
+     * CONVERTER
+     * Takes whatever is waiting (up to one batch) and converts it with
+     * the same kernels as batch mode. Each batch is converted with one
+     * calibration snapshot, so a reload takes effect between batches.
+     */
+    void convert_stage() {
+        RawSample in[BATCH_SIZE];
+        RealSample out[BATCH_SIZE];
+        double raw[BATCH_SIZE], real[BATCH_SIZE];
+        uint32_t channels[BATCH_SIZE];
+        IdleWait idle;
+
+        while (true) {
+            size_t n = raw_ring.pop(in, BATCH_SIZE);
+            if (n == 0) {
+                // Only stop once the reader is done and nothing is left
+                if (reader_done.load(memory_order_acquire)) {
+                    n = raw_ring.pop(in, BATCH_SIZE);
+                    if (n == 0) {
+                        break;
+                    }
+                } else {
+                    idle.wait();
+                    continue;
+                }
+            }
+            idle.reset();
+
+            for (size_t i = 0; i < n; i++) {
+                raw[i] = in[i].raw;
+                channels[i] = in[i].channel;
+            }
+
+            {
+                RcuReadGuard<StreamCalibration> current(calibration, CONVERTER_SLOT);
+                if (current->multi_channel && current->snapshot.is_open()) {
+                    current->snapshot.check(channels, n);
+                    apply_calibration(current->snapshot.view(), channels, raw, real, n);
+                } else if (current->multi_channel) {
+                    apply_calibration(current->table.view(), channels, raw, real, n);
+                } else {
+                    apply_model(current->model, raw, real, n);
+                }
+            }
+            record_startup(n);
+
+            for (size_t i = 0; i < n; i++) {
+                out[i].value = real[i];
+                out[i].arrival_ns = in[i].arrival_ns;
+            }
+            push_all(real_ring, out, n);
+        }
+
+        converter_done.store(true, memory_order_release);
+    }
+
+    /*
+     * WRITER
+     * Formats values into a buffer and writes it out as soon as no more
+     * values are waiting, recording each value's latency at that point
+     */
+    void write_stage() {
+        vector<char> buffer(WRITE_BUFFER_SIZE);
+        vector<uint64_t> pending;   // Arrival times of values in the buffer
+        RealSample in[BATCH_SIZE];
+        size_t used = 0;
+        IdleWait idle;
+
+        // Fixed notation with 10 decimals needs at most 309 + 12 characters
+        const size_t MAX_LINE = 324;
+
+        while (true) {
+            size_t n = real_ring.pop(in, BATCH_SIZE);
+            if (n == 0) {
+                if (used > 0) {
+                    flush(buffer, used, pending);
+                    continue;
+                }
+                if (converter_done.load(memory_order_acquire)) {
+                    n = real_ring.pop(in, BATCH_SIZE);
+                    if (n == 0) {
+                        break;
+                    }
+                } else {
+                    idle.wait();
+                    continue;
+                }
+            }
+            idle.reset();
+
+            for (size_t i = 0; i < n; i++) {
+                if (buffer.size() - used < MAX_LINE) {
+                    flush(buffer, used, pending);
+                }
+                to_chars_result formatted = to_chars(&buffer[used], &buffer[0] + buffer.size(),
+                                                     in[i].value, chars_format::fixed, 10);
+                used = formatted.ptr - &buffer[0];
+                buffer[used++] = '\n';
+                pending.push_back(in[i].arrival_ns);
+            }
+        }
+    }
+
+    /*
+     * RELOADER
+     * Loads a fresh calibration on SIGHUP, or once a watched file has
+     * changed and then stayed the same for one poll (so a file that is
+     * still being written is not picked up), and publishes it. Loading
+     * happens entirely on this thread; the converter keeps going with the
+     * old calibration until the new one is complete.
+     */
+    void reload_stage() {
+        vector<FileStamp> loaded, previous;
+        for (size_t i = 0; i < reload.watch_files.size(); i++) {
+            loaded.push_back(stamp_file(reload.watch_files[i]));
+        }
+        previous = loaded;
+
+        while (!writer_done.load(memory_order_acquire)) {
+            this_thread::sleep_for(chrono::milliseconds(RELOAD_POLL_MS));
+
+            bool wanted = reload_requested != 0;
+            reload_requested = 0;
+
+            vector<FileStamp> now;
+            for (size_t i = 0; i < reload.watch_files.size(); i++) {
+                now.push_back(stamp_file(reload.watch_files[i]));
+                if (now[i] != loaded[i] && now[i] == previous[i]) {
+                    wanted = true;
+                }
+            }
+            previous = now;
+
+            if (!wanted) {
+                continue;
+            }
+            // Whatever the outcome, do not retry until the files change again
+            loaded = now;
+
+            StreamCalibration* fresh = reload.load();
+            if (fresh == NULL) {
+                failed_reloads++;
+                cerr << "Reload failed; still using the previous calibration.\n";
+                continue;
+            }
+            calibration.publish(fresh);
+            reloads++;
+            cerr << "Calibration reloaded.\n";
+        }
+    }
+
+    /*
+     * DRIFT TRACKER
+     * Folds every "reference,raw" point of the tracking stream into the
+     * tracker and publishes the new line every publish_every points.
+     * Publishing waits for the converter to finish the batch it may be
+     * converting with the old line; the converter itself never waits.
+     */
+    void track_stage() {
+        unsigned long long since_publish = 0;
+
+        bool read_ok = read_lines(track.fd, TRACK_BUFFER_SIZE, &writer_done,
+            bad_track_lines,
+            [&](const char* line, const char* end, uint64_t) {
+                if (is_blank_or_comment(line, end)) {
+                    return;
+                }
+                double reference_value, raw_reading;
+                if (!parse_point(line, end, reference_value, raw_reading)) {
+                    bad_track_lines++;
+                    return;
+                }
+                tracker.add(raw_reading, reference_value);
+                if (++since_publish >= track.publish_every) {
+                    publish_tracked();
+                    since_publish = 0;
+                }
+            },
+            []() {});
+
+        if (since_publish > 0) {
+            publish_tracked();
+        }
+        if (!read_ok) {
+            track_read_failed = true;
+        }
+    }
+
+    void publish_tracked() {
+        Calibration cal;
+        if (!tracker.calibration(cal)) {
+            return;     // Not enough points for a line yet; keep the current one
+        }
+        StreamCalibration* fresh = new StreamCalibration;
+        fresh->model = linear_model(cal);
+        calibration.publish(fresh);
+        track_updates++;
+    }
+
+    void flush(vector<char>& buffer, size_t& used, vector<uint64_t>& pending) {
+        // After a failure keep draining the pipeline so the other stages finish
+        if (!result.write_failed && !write_all(out_fd, &buffer[0], used)) {
+            result.write_failed = true;
+        }
+        used = 0;
+
+        uint64_t now = stats_clock_ns();
+        for (size_t i = 0; i < pending.size(); i++) {
+            uint64_t ns = now - pending[i];
+            size_t bucket = static_cast<size_t>(ns / 1000);
+            latency[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS]++;
+            if (ns > max_latency_ns) {
+                max_latency_ns = ns;
+            }
+        }
+        result.samples += pending.size();
+        pending.clear();
+    }
+
+    // Upper edge of the 1 us bucket holding the given fraction of samples
+    double latency_percentile(double fraction) const {
+        if (result.samples == 0) {
+            return 0.0;
+        }
+        unsigned long long wanted = static_cast<unsigned long long>(result.samples * fraction);
+        if (wanted == 0) {
+            wanted = 1;
+        }
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < LATENCY_BUCKETS; i++) {
+            seen += latency[i];
+            if (seen >= wanted) {
+                return static_cast<double>(i + 1);
+            }
+        }
+        return max_latency_ns / 1000.0;
+    }
+};
+
+}  // namespace
+
+int open_stream(const string& path, bool for_writing) {
+    if (path == "-") {
+        return for_writing ? 1 : 0;
+    }
+#ifdef _WIN32
+    return for_writing ? _open(path.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, 0644)
+                       : _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+    return for_writing ? open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                       : open(path.c_str(), O_RDONLY);
+#endif
+}
+
+void close_stream(int fd) {
+    if (fd > 2) {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+    }
+}
+
+void serve_stream(StreamCalibration* initial, const ReloadOptions& reload,
+                  const TrackOptions& track, int in_fd, int out_fd, ServeReport& report) {
+#ifndef _WIN32
+    // A closed downstream pipe shows up as a failed write, not a signal
+    signal(SIGPIPE, SIG_IGN);
+#endif
+#ifdef SIGHUP
+    if (reload.load) {
+        reload_requested = 0;
+        signal(SIGHUP, on_sighup);
+    }
+#endif
+
+    Pipeline pipeline(initial, reload, track, in_fd, out_fd);
+    pipeline.run(report);
+
+#ifdef SIGHUP
+    if (reload.load) {
+        signal(SIGHUP, SIG_DFL);
+    }
+#endif
+}
@@ -0,0 +1,115 @@
+/*
+ * Streaming service mode
+ *
+ * Reads raw samples from a named pipe (or stdin) for as long as the writer
+ * keeps it open, converts them and writes the real values downstream,
+ * one per line. Three threads form a pipeline joined by lock-free
+ * single-producer / single-consumer rings:
+ *
+ *   reader     read() + parse -> ring -> converter (apply kernels)
+ *              -> ring -> writer (to_chars + write())
+ *
+ * Nothing waits for a full block: whatever one read() returns is parsed,
+ * converted and written as soon as it arrives, and the writer flushes
+ * whenever it runs out of work. Idle threads spin briefly, then yield,
+ * then sleep in short naps, so latency stays low under load without
+ * burning cores on a quiet stream.
+ *
+ * The calibration can be replaced while the service runs, on SIGHUP or
+ * when a watched file changes. The converter reads it through an RCU
+ * pointer (rcu.h), so it never blocks and never sees a half-loaded
+ * calibration; a reload that fails keeps the previous one. Write new
+ * calibration files under a temporary name and rename them into place so
+ * a watch can never pick up a half-written file.
+ *
+ * Instead of reloads, a fourth thread can keep a linear calibration in
+ * step with its sensor's drift: it reads "reference,raw" points from a
+ * second stream (e.g. a reference instrument's pipe), folds each into a
+ * DriftTracker (drift.h) and publishes the updated line through the same
+ * RCU pointer, so the converter picks it up at its next batch.
+ */
+
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "calibration_table.h"
+#include "drift.h"
+#include "fit.h"
+#include "model.h"
+#include "snapshot.h"
+
+// What the converter applies to each sample; never changed once published
+struct StreamCalibration {
+    CalibrationModel model;         // Single-channel readings
+    MappedCalibrationTable table;   // "channel,raw" samples when multi_channel
+    MappedSnapshot snapshot;        // Or, if open, this; checked by the converter as channels arrive
+    bool multi_channel;
+
+    StreamCalibration() : multi_channel(false) {}
+};
+
+// Load a fresh calibration; returns NULL after reporting why it failed
+typedef std::function<StreamCalibration*()> CalibrationLoader;
+
+struct ReloadOptions {
+    CalibrationLoader load;                 // Empty: no reloading
+    std::vector<std::string> watch_files;   // Reload when one of these changes
+};
+
+struct TrackOptions {
+    int fd;                     // "reference,raw" points; -1: no tracking
+    double forgetting;          // See DriftTracker
+    unsigned long long publish_every;   // Points per published update
+    FitAccumulator seed;        // Fit state to start from (count 0: none)
+
+    TrackOptions() : fd(-1), forgetting(0.999), publish_every(1) {}
+};
+
+struct ServeReport {
+    unsigned long long samples;     // Values written
+    unsigned long long bad_lines;   // Unparseable or too long; skipped
+    double p50_us;                  // Read-to-write latency of a sample
+    double p99_us;
+    double max_us;
+    unsigned reloads;
+    unsigned failed_reloads;
+    bool read_failed;
+    bool write_failed;
+
+    // Drift tracking
+    unsigned long long tracked_points;
+    unsigned long long bad_track_lines;
+    unsigned long long track_updates;   // Calibrations published
+    Calibration tracked;                // Last estimate; invalid if none
+    bool track_read_failed;
+
+    ServeReport()
+        : samples(0), bad_lines(0), p50_us(0.0), p99_us(0.0), max_us(0.0),
+          reloads(0), failed_reloads(0), read_failed(false), write_failed(false),
+          tracked_points(0), bad_track_lines(0), track_updates(0), track_read_failed(false) {}
+};
+
+/*
+ * Open a stream for serve_stream(); "-" means stdin / stdout
+ * Returns a file descriptor, or -1 if the path cannot be opened.
+ * Opening a named pipe blocks until the other end is opened too.
+ */
+int open_stream(const std::string& path, bool for_writing);
+void close_stream(int fd);
+
+/*
+ * Run the pipeline until end of input
+ * Takes ownership of initial; reloads are triggered by SIGHUP (where
+ * available) and by changes to reload.watch_files. With track.fd set,
+ * the tracked line replaces the calibration every track.publish_every
+ * points; the tracker stops at the end of either stream (on Windows only
+ * at the end of its own).
+ */
+void serve_stream(StreamCalibration* initial, const ReloadOptions& reload,
+                  const TrackOptions& track, int in_fd, int out_fd, ServeReport& report);
+
+#endif
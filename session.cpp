@@ -0,0 +1,182 @@
+/*
+ * Calibration session: fits, point updates, load and save per channel
+ */
+
+#include "session.h"
+
+#include "apply.h"
+#include "stats.h"
+
+using namespace std;
+
+string session_status_message(SessionStatus status, uint32_t channel) {
+    switch (status) {
+        case SESSION_OK:
+            return "Channel " + to_string(channel) + " updated.";
+        case SESSION_CANNOT_FIT:
+            return "All raw readings are identical. Cannot compute calibration.";
+        case SESSION_CHANNEL_TOO_FAR:
+            return "Channel " + to_string(channel) + " is too far from the other channels.";
+        case SESSION_NO_CALIBRATION:
+            return "Channel " + to_string(channel) + " has no calibration.";
+        case SESSION_NO_POINTS:
+            return "The fit has no points to remove.";
+        case SESSION_BAD_TEXT:
+            return "Not a linear calibration file.";
+    }
+    return "Unknown error.";
+}
+
+SessionStatus CalibrationSession::fit(uint32_t channel, FitMethod method, const double* raw,
+                                      const double* reference, size_t n, FitDiagnostics* diagnostics) {
+    // Running moments for the regression and the diagnostics
+    FitAccumulator moments;
+    for (size_t i = 0; i < n; i++) {
+        moments.add(raw[i], reference[i]);
+    }
+
+    Calibration fitted;
+    bool fitted_ok;
+    if (method == FIT_LEAST_SQUARES) {
+        StageTimer timer(STAT_FIT, moments.count);
+        fitted_ok = compute_calibration(moments, fitted);
+    } else {
+        fitted_ok = fit_line(method, raw, reference, n, RobustFitOptions(), fitted);
+    }
+
+    if (!fitted_ok) {
+        return SESSION_CANNOT_FIT;
+    }
+    if (!calibrations.set(channel, fitted)) {
+        return SESSION_CHANNEL_TOO_FAR;
+    }
+
+    // Points added later go to a least squares fit, so keep no state for robust lines
+    if (method == FIT_LEAST_SQUARES) {
+        fit_states[channel] = moments;
+    } else {
+        fit_states.erase(channel);
+    }
+
+    if (diagnostics != NULL) {
+        compute_diagnostics(moments, fitted, method == FIT_LEAST_SQUARES, *diagnostics);
+    }
+    return SESSION_OK;
+}
+
+SessionStatus CalibrationSession::add_point(uint32_t channel, double raw, double reference,
+                                            FitDiagnostics* diagnostics) {
+    return update(channel, raw, reference, true, diagnostics);
+}
+
+SessionStatus CalibrationSession::remove_point(uint32_t channel, double raw, double reference,
+                                               FitDiagnostics* diagnostics) {
+    return update(channel, raw, reference, false, diagnostics);
+}
+
+SessionStatus CalibrationSession::update(uint32_t channel, double raw, double reference, bool adding,
+                                         FitDiagnostics* diagnostics) {
+    FitAccumulator updated;
+    map<uint32_t, FitAccumulator>::const_iterator saved = fit_states.find(channel);
+    if (saved != fit_states.end()) {
+        updated = saved->second;
+    }
+
+    if (adding) {
+        updated.add(raw, reference);
+    } else if (updated.count == 0) {
+        return SESSION_NO_POINTS;
+    } else {
+        updated.remove(raw, reference);
+    }
+
+    Calibration fitted;
+    bool fitted_ok;
+    {
+        StageTimer timer(STAT_FIT, 1);
+        fitted_ok = compute_calibration(updated, fitted);
+    }
+
+    SessionStatus status = SESSION_OK;
+    if (fitted_ok) {
+        if (!calibrations.set(channel, fitted)) {
+            return SESSION_CHANNEL_TOO_FAR;
+        }
+        if (diagnostics != NULL) {
+            compute_diagnostics(updated, fitted, true, *diagnostics);
+        }
+    } else {
+        // The calibration must match its points, so it goes until there are enough
+        calibrations.remove(channel);
+        status = SESSION_CANNOT_FIT;
+    }
+
+    if (updated.count > 0) {
+        fit_states[channel] = updated;
+    } else {
+        fit_states.erase(channel);
+    }
+    return status;
+}
+
+SessionStatus CalibrationSession::load(uint32_t channel, const char* text, size_t size,
+                                       LoadStatus* load_status) {
+    Calibration loaded;
+    FitAccumulator fit;
+    LoadStatus parsed = parse_calibration(text, size, loaded, fit);
+    if (load_status != NULL) {
+        *load_status = parsed;
+    }
+    if (parsed != LOAD_OK) {
+        return SESSION_BAD_TEXT;
+    }
+    return set(channel, loaded, fit);
+}
+
+SessionStatus CalibrationSession::set(uint32_t channel, const Calibration& cal, const FitAccumulator& fit) {
+    if (!calibrations.set(channel, cal)) {
+        return SESSION_CHANNEL_TOO_FAR;
+    }
+    if (fit.count > 0) {
+        fit_states[channel] = fit;
+    } else {
+        fit_states.erase(channel);
+    }
+    return SESSION_OK;
+}
+
+void CalibrationSession::load_table(const CalibrationTableView& table) {
+    calibrations.assign(table);
+    fit_states.clear();
+}
+
+SessionStatus CalibrationSession::save(uint32_t channel, string& text) const {
+    Calibration cal;
+    if (!calibrations.get(channel, cal)) {
+        return SESSION_NO_CALIBRATION;
+    }
+
+    StageTimer timer(STAT_SAVE, 1);
+    const FitAccumulator* fit = fit_state(channel);
+    FitDiagnostics diagnostics;
+    if (fit != NULL && compute_diagnostics(*fit, cal, true, diagnostics)) {
+        format_calibration(cal, *fit, &diagnostics, text);
+    } else {
+        format_calibration(cal, FitAccumulator(), NULL, text);
+    }
+    return SESSION_OK;
+}
+
+SessionStatus CalibrationSession::apply(uint32_t channel, const double* raw, double* out, size_t n) const {
+    Calibration cal;
+    if (!calibrations.get(channel, cal)) {
+        return SESSION_NO_CALIBRATION;
+    }
+    apply_calibration(cal, raw, out, n);
+    return SESSION_OK;
+}
+
+const FitAccumulator* CalibrationSession::fit_state(uint32_t channel) const {
+    map<uint32_t, FitAccumulator>::const_iterator found = fit_states.find(channel);
+    return found != fit_states.end() ? &found->second : NULL;
+}
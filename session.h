@@ -0,0 +1,98 @@
+/*
+ * Per-channel calibration state behind the interactive menu
+ *
+ * CalibrationSession holds what the menu works on: a calibration for each
+ * channel and, where it was fitted by least squares, the fit state behind
+ * it, so points can still be added or removed. Everything happens on
+ * in-memory buffers: fits take arrays of points, load() takes the text of
+ * a calibration file and save() produces it. Nothing is printed or read
+ * here; the menu only prompts, reads and writes files, and reports.
+ */
+
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "calibration.h"
+#include "calibration_table.h"
+#include "fit.h"
+#include "robust.h"
+#include "text_io.h"
+
+enum SessionStatus {
+    SESSION_OK,
+    SESSION_CANNOT_FIT,         // Fewer than 2 distinct raw readings
+    SESSION_CHANNEL_TOO_FAR,    // Outside the ID range a registry can hold (see CalibrationRegistry)
+    SESSION_NO_CALIBRATION,     // The channel has none
+    SESSION_NO_POINTS,          // The fit has no point to remove
+    SESSION_BAD_TEXT            // Not a linear calibration file
+};
+
+std::string session_status_message(SessionStatus status, uint32_t channel);
+
+class CalibrationSession {
+public:
+    CalibrationSession() {}
+
+    /*
+     * Fit channel's line to n points with method. Least squares lines keep
+     * their fit state; other methods drop the channel's. diagnostics (if
+     * not NULL) gets the fit's quality; it is left alone when there are too
+     * few points for any.
+     */
+    SessionStatus fit(uint32_t channel, FitMethod method, const double* raw, const double* reference,
+                      size_t n, FitDiagnostics* diagnostics = NULL);
+
+    /*
+     * Add a point to channel's least squares fit, or take one back, and
+     * refit. A channel without fit state starts a new fit. While the
+     * points cannot fix a line (SESSION_CANNOT_FIT) the channel has no
+     * calibration, but the points are kept. diagnostics as for fit().
+     */
+    SessionStatus add_point(uint32_t channel, double raw, double reference,
+                            FitDiagnostics* diagnostics = NULL);
+    SessionStatus remove_point(uint32_t channel, double raw, double reference,
+                               FitDiagnostics* diagnostics = NULL);
+
+    /*
+     * Set channel from the text of a calibration file. load_status (if not
+     * NULL) gets the parser's result when that fails (SESSION_BAD_TEXT).
+     */
+    SessionStatus load(uint32_t channel, const char* text, size_t size, LoadStatus* load_status = NULL);
+
+    // Set channel to cal, with fit state fit unless fit.count is 0 (e.g. from a snapshot)
+    SessionStatus set(uint32_t channel, const Calibration& cal, const FitAccumulator& fit);
+
+    // Replace every channel with the calibrations of a table (which hold no fit state)
+    void load_table(const CalibrationTableView& table);
+
+    // Append the text of channel's calibration file to text, with the fit
+    // state and quality comments when it has a fit state
+    SessionStatus save(uint32_t channel, std::string& text) const;
+
+    // Convert n raw readings of channel
+    SessionStatus apply(uint32_t channel, const double* raw, double* out, size_t n) const;
+
+    bool get(uint32_t channel, Calibration& cal) const { return calibrations.get(channel, cal); }
+
+    // Fit state behind channel's calibration, or NULL if it has none
+    const FitAccumulator* fit_state(uint32_t channel) const;
+
+    // Number of channels holding a calibration
+    size_t size() const { return calibrations.size(); }
+
+    CalibrationTableView view() const { return calibrations.view(); }
+
+private:
+    SessionStatus update(uint32_t channel, double raw, double reference, bool adding,
+                         FitDiagnostics* diagnostics);
+
+    CalibrationRegistry calibrations;
+    std::map<uint32_t, FitAccumulator> fit_states;
+};
+
+#endif
@@ -0,0 +1,366 @@
+/*
+ * Calibration snapshots: writing, mapping and checking records on first use
+ */
+
+#include "snapshot.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <vector>
+
+#include "stats.h"
+
+using namespace std;
+
+namespace {
+
+const uint64_t SNAPSHOT_ALIGNMENT = 64;
+
+uint64_t align_up(uint64_t value) {
+    return (value + SNAPSHOT_ALIGNMENT - 1) / SNAPSHOT_ALIGNMENT * SNAPSHOT_ALIGNMENT;
+}
+
+size_t bit_words(uint32_t channel_count) {
+    return (static_cast<size_t>(channel_count) + 63) / 64;
+}
+
+// FNV-1a: cheap enough to run on a record in the conversion path
+uint32_t checksum_bytes(const void* data, size_t size, uint32_t hash = 2166136261u) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 16777619u;
+    }
+    return hash;
+}
+
+uint32_t header_checksum(const SnapshotHeader& header) {
+    SnapshotHeader copy = header;
+    copy.header_checksum = 0;
+    return checksum_bytes(&copy, sizeof(copy));
+}
+
+// Moving a record to another entry changes its checksum too
+uint32_t record_checksum(double slope, double offset, const SnapshotRecord& record, uint32_t channel) {
+    SnapshotRecord copy = record;
+    copy.checksum = 0;
+    uint32_t hash = checksum_bytes(&slope, sizeof(slope));
+    hash = checksum_bytes(&offset, sizeof(offset), hash);
+    hash = checksum_bytes(&copy, sizeof(copy), hash);
+    return checksum_bytes(&channel, sizeof(channel), hash);
+}
+
+// Lay out the arrays that follow the header
+void fill_layout(SnapshotHeader& header, uint32_t first_channel, uint32_t channel_count, uint32_t calibrated) {
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(SnapshotHeader);
+    header.first_channel = first_channel;
+    header.channel_count = channel_count;
+    header.record_size = sizeof(SnapshotRecord);
+    header.calibrated = calibrated;
+    header.slopes_offset = align_up(sizeof(SnapshotHeader));
+    header.offsets_offset = align_up(header.slopes_offset + channel_count * sizeof(double));
+    header.records_offset = align_up(header.offsets_offset + channel_count * sizeof(double));
+    header.file_size = header.records_offset + static_cast<uint64_t>(channel_count) * sizeof(SnapshotRecord);
+}
+
+// A fit state a FitAccumulator can hold: finite, with non-negative sums of squares
+bool plausible_fit(const SnapshotRecord& record) {
+    return record.fit_count > 0
+        && isfinite(record.mean_x) && isfinite(record.mean_y) && isfinite(record.c_xy)
+        && isfinite(record.m2_x) && isfinite(record.m2_y)
+        && record.m2_x >= 0.0 && record.m2_y >= 0.0;
+}
+
+}  // namespace
+
+string snapshot_status_message(SnapshotStatus status, const string& filename) {
+    switch (status) {
+        case SNAPSHOT_OK:
+            return "Snapshot loaded from '" + filename + "'";
+        case SNAPSHOT_CANNOT_OPEN:
+            return "Cannot open file '" + filename + "'";
+        case SNAPSHOT_BAD_FORMAT:
+            return "'" + filename + "' is not a calibration snapshot.";
+        case SNAPSHOT_BAD_VERSION:
+            return "'" + filename + "' uses an unsupported snapshot version.";
+        case SNAPSHOT_TRUNCATED:
+            return "'" + filename + "' is truncated.";
+        case SNAPSHOT_NO_CHANNEL:
+            return "The channel has no calibration in '" + filename + "'";
+        case SNAPSHOT_DAMAGED:
+            return "The channel's record in '" + filename + "' is damaged.";
+    }
+    return "Unknown error.";
+}
+
+MappedSnapshot::MappedSnapshot()
+    : slopes(NULL), offsets(NULL), records(NULL), checked_bits(NULL), good_bits(NULL),
+      checked_count(0), damaged_count(0), generation(0) {
+    memset(&header, 0, sizeof(header));
+}
+
+MappedSnapshot::~MappedSnapshot() {
+    close();
+}
+
+/*
+ * Map filename read-only and validate its header
+ * Only the header page is read; records are checked as their channels
+ * are used
+ */
+SnapshotStatus MappedSnapshot::open(const string& filename) {
+    StageTimer timer(STAT_LOAD, 1);
+    close();
+
+    MapStatus mapped = file.open(filename);
+    if (mapped != MAP_OK) {
+        return mapped == MAP_EMPTY ? SNAPSHOT_BAD_FORMAT : SNAPSHOT_CANNOT_OPEN;
+    }
+
+    SnapshotHeader read;
+    if (file.size() < sizeof(read)) {
+        close();
+        return SNAPSHOT_BAD_FORMAT;
+    }
+    memcpy(&read, file.bytes(), sizeof(read));
+
+    SnapshotStatus status = SNAPSHOT_OK;
+    SnapshotHeader expected;
+    fill_layout(expected, read.first_channel, read.channel_count, read.calibrated);
+
+    if (memcmp(read.magic, SNAPSHOT_MAGIC, sizeof(read.magic)) != 0) {
+        status = SNAPSHOT_BAD_FORMAT;
+    } else if (read.version != SNAPSHOT_VERSION) {
+        status = SNAPSHOT_BAD_VERSION;
+    } else if (read.channel_count > CALIBRATION_TABLE_MAX_CHANNELS
+               || read.calibrated > read.channel_count
+               || read.header_size != expected.header_size
+               || read.record_size != expected.record_size
+               || read.slopes_offset != expected.slopes_offset
+               || read.offsets_offset != expected.offsets_offset
+               || read.records_offset != expected.records_offset
+               || read.file_size != expected.file_size
+               || read.header_checksum != header_checksum(read)) {
+        status = SNAPSHOT_BAD_FORMAT;
+    } else if (file.size() < read.file_size) {
+        status = SNAPSHOT_TRUNCATED;
+    }
+
+    size_t words = bit_words(read.channel_count);
+    if (status == SNAPSHOT_OK) {
+        checked_bits = static_cast<uint64_t*>(calloc(words + 1, sizeof(uint64_t)));
+        good_bits = static_cast<uint64_t*>(calloc(words + 1, sizeof(uint64_t)));
+        if (checked_bits == NULL || good_bits == NULL) {
+            status = SNAPSHOT_CANNOT_OPEN;
+        }
+    }
+    if (status != SNAPSHOT_OK) {
+        close();
+        return status;
+    }
+
+    header = read;
+    slopes = reinterpret_cast<const double*>(file.bytes() + header.slopes_offset);
+    offsets = reinterpret_cast<const double*>(file.bytes() + header.offsets_offset);
+    records = reinterpret_cast<const SnapshotRecord*>(file.bytes() + header.records_offset);
+    generation = next_table_generation();
+    return SNAPSHOT_OK;
+}
+
+void MappedSnapshot::close() {
+    file.close();
+    free(checked_bits);
+    free(good_bits);
+    memset(&header, 0, sizeof(header));
+    slopes = NULL;
+    offsets = NULL;
+    records = NULL;
+    checked_bits = NULL;
+    good_bits = NULL;
+    checked_count = 0;
+    damaged_count = 0;
+    generation = 0;
+}
+
+SnapshotStatus MappedSnapshot::validate(uint32_t index) const {
+    const SnapshotRecord& record = records[index];
+    double slope = slopes[index];
+    double offset = offsets[index];
+    uint32_t channel = header.first_channel + index;
+
+    SnapshotStatus status = SNAPSHOT_OK;
+    if (record.checksum != record_checksum(slope, offset, record, channel)
+        || (record.flags & ~(SNAPSHOT_HAS_CALIBRATION | SNAPSHOT_HAS_FIT)) != 0
+        || record.flags == SNAPSHOT_HAS_FIT) {
+        status = SNAPSHOT_DAMAGED;
+    } else if (!(record.flags & SNAPSHOT_HAS_CALIBRATION)) {
+        status = SNAPSHOT_NO_CHANNEL;
+    } else if (!isfinite(slope) || !isfinite(offset)
+               || ((record.flags & SNAPSHOT_HAS_FIT) && !plausible_fit(record))) {
+        status = SNAPSHOT_DAMAGED;
+    }
+    return status;
+}
+
+// Good records are remembered; the rare missing or damaged one is checked again to say which
+SnapshotStatus MappedSnapshot::check_index(uint32_t index) const {
+    uint64_t bit = uint64_t(1) << (index & 63);
+    if (checked_bits[index >> 6] & bit) {
+        return (good_bits[index >> 6] & bit) ? SNAPSHOT_OK : validate(index);
+    }
+
+    SnapshotStatus status = validate(index);
+    checked_bits[index >> 6] |= bit;
+    checked_count++;
+    if (status == SNAPSHOT_OK) {
+        good_bits[index >> 6] |= bit;
+        generation = next_table_generation();
+    } else if (status == SNAPSHOT_DAMAGED) {
+        damaged_count++;
+    }
+    return status;
+}
+
+SnapshotStatus MappedSnapshot::check(uint32_t channel) const {
+    uint32_t index = channel - header.first_channel;  // Wraps past channel_count below first_channel
+    if (!is_open() || index >= header.channel_count) {
+        return SNAPSHOT_NO_CHANNEL;
+    }
+    return check_index(index);
+}
+
+void MappedSnapshot::check(const uint32_t* channels, size_t n) const {
+    if (!is_open()) {
+        return;
+    }
+    for (size_t i = 0; i < n; i++) {
+        uint32_t index = channels[i] - header.first_channel;
+        if (index < header.channel_count && !((checked_bits[index >> 6] >> (index & 63)) & 1)) {
+            check_index(index);
+        }
+    }
+}
+
+void MappedSnapshot::check_all() const {
+    for (uint32_t index = 0; index < header.channel_count; index++) {
+        check_index(index);
+    }
+}
+
+SnapshotStatus MappedSnapshot::lookup(uint32_t channel, Calibration& cal, FitAccumulator* fit) const {
+    SnapshotStatus status = check(channel);
+    if (status != SNAPSHOT_OK) {
+        return status;
+    }
+
+    uint32_t index = channel - header.first_channel;
+    cal.slope = slopes[index];
+    cal.offset = offsets[index];
+    cal.is_valid = true;
+
+    if (fit != NULL) {
+        const SnapshotRecord& record = records[index];
+        *fit = FitAccumulator();
+        if (record.flags & SNAPSHOT_HAS_FIT) {
+            fit->count = record.fit_count;
+            fit->mean_x = record.mean_x;
+            fit->mean_y = record.mean_y;
+            fit->m2_x = record.m2_x;
+            fit->m2_y = record.m2_y;
+            fit->c_xy = record.c_xy;
+        }
+    }
+    return SNAPSHOT_OK;
+}
+
+CalibrationTableView MappedSnapshot::view() const {
+    CalibrationTableView table;
+    if (is_open()) {
+        table.first_channel = header.first_channel;
+        table.channel_count = header.channel_count;
+        table.slopes = slopes;
+        table.offsets = offsets;
+        table.valid = good_bits;
+        table.generation = generation;
+    }
+    return table;
+}
+
+bool write_snapshot(const string& filename, const CalibrationTableView& table,
+                    const map<uint32_t, FitAccumulator>& fits) {
+    StageTimer timer(STAT_SAVE, 1);
+
+    if (table.channel_count > CALIBRATION_TABLE_MAX_CHANNELS) {
+        return false;
+    }
+
+    vector<double> slopes(table.channel_count, 0.0);
+    vector<double> offsets(table.channel_count, 0.0);
+    vector<SnapshotRecord> records(table.channel_count);
+    uint32_t calibrated = 0;
+
+    for (uint32_t i = 0; i < table.channel_count; i++) {
+        uint32_t channel = table.first_channel + i;
+        SnapshotRecord& record = records[i];
+        memset(&record, 0, sizeof(record));
+
+        if (table.has_channel(channel)) {
+            slopes[i] = table.slopes[i];
+            offsets[i] = table.offsets[i];
+            record.flags = SNAPSHOT_HAS_CALIBRATION;
+            calibrated++;
+
+            map<uint32_t, FitAccumulator>::const_iterator fit = fits.find(channel);
+            if (fit != fits.end() && fit->second.count > 0) {
+                record.flags |= SNAPSHOT_HAS_FIT;
+                record.fit_count = fit->second.count;
+                record.mean_x = fit->second.mean_x;
+                record.mean_y = fit->second.mean_y;
+                record.m2_x = fit->second.m2_x;
+                record.m2_y = fit->second.m2_y;
+                record.c_xy = fit->second.c_xy;
+            }
+        }
+        record.checksum = record_checksum(slopes[i], offsets[i], record, channel);
+    }
+
+    SnapshotHeader header;
+    fill_layout(header, table.first_channel, table.channel_count, calibrated);
+    header.header_checksum = header_checksum(header);
+
+    ofstream file(filename, ios::binary);
+    if (!file.is_open()) {
+        return false;
+    }
+
+    const char padding[SNAPSHOT_ALIGNMENT] = {};
+    size_t array_bytes = table.channel_count * sizeof(double);
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(padding, header.slopes_offset - sizeof(header));
+    file.write(reinterpret_cast<const char*>(slopes.data()), array_bytes);
+    file.write(padding, header.offsets_offset - (header.slopes_offset + array_bytes));
+    file.write(reinterpret_cast<const char*>(offsets.data()), array_bytes);
+    file.write(padding, header.records_offset - (header.offsets_offset + array_bytes));
+    file.write(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(SnapshotRecord));
+
+    file.close();
+    return !file.fail();
+}
+
+bool is_snapshot_file(const string& filename) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[sizeof(SNAPSHOT_MAGIC)];
+    bool matches = fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+                   && memcmp(magic, SNAPSHOT_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return matches;
+}
@@ -0,0 +1,167 @@
+/*
+ * Calibration snapshots for cold starts
+ *
+ * A service that converts for thousands of channels should not have to
+ * parse a text file per channel, or even scan a whole table, before it
+ * converts its first sample. A snapshot holds the calibration and fit
+ * state of every channel of a session, precompiled by pack --snapshot,
+ * in a layout that is used straight from one read-only mapping. Opening
+ * one is an mmap and a header check, whatever the number of channels.
+ *
+ * LAZY VALIDATION:
+ * Each channel's record carries a checksum over its contents and its
+ * channel ID. Nothing but the header is read at open; a record is checked
+ * (checksum, finite coefficients, plausible fit state) the first time its
+ * channel is used, and the result is remembered in two bitsets that are
+ * zero pages until touched. So the first conversion reads one header and
+ * one record, and a corrupt record only affects its own channel: it reads
+ * as missing, and damaged() counts it.
+ *
+ * FILE LAYOUT (little-endian, arrays 64-byte aligned):
+ *   SnapshotHeader
+ *   double          slopes[channel_count]
+ *   double          offsets[channel_count]
+ *   SnapshotRecord  records[channel_count]
+ * Entry i belongs to channel first_channel + i, as in a calibration table
+ * (calibration_table.h), so the slopes and offsets feed the same gather
+ * kernels through view().
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+
+#include "calibration.h"
+#include "calibration_table.h"
+#include "fit.h"
+#include "mapped_file.h"
+
+const char SNAPSHOT_MAGIC[8] = { 'S', 'C', 'A', 'L', 'S', 'N', 'P', '\0' };
+const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];              // SNAPSHOT_MAGIC
+    uint32_t version;           // SNAPSHOT_VERSION
+    uint32_t header_size;       // sizeof(SnapshotHeader)
+    uint32_t first_channel;     // Channel ID of entry 0
+    uint32_t channel_count;     // Number of entries
+    uint32_t record_size;       // sizeof(SnapshotRecord)
+    uint32_t calibrated;        // Entries holding a calibration
+    uint64_t slopes_offset;     // Byte offsets of the arrays from the start of the file
+    uint64_t offsets_offset;
+    uint64_t records_offset;
+    uint64_t file_size;         // Total size written
+    uint32_t header_checksum;   // Over the header with this field 0
+    uint32_t reserved;
+};
+
+// Flags of a SnapshotRecord
+const uint32_t SNAPSHOT_HAS_CALIBRATION = 1;
+const uint32_t SNAPSHOT_HAS_FIT = 2;
+
+// Everything about one channel but its slope and offset
+struct SnapshotRecord {
+    uint64_t fit_count;         // The fit state (see FitAccumulator), if SNAPSHOT_HAS_FIT
+    double mean_x;
+    double mean_y;
+    double m2_x;
+    double m2_y;
+    double c_xy;
+    uint32_t flags;
+    uint32_t checksum;          // Over slope, offset, this record and the channel ID
+};
+
+enum SnapshotStatus {
+    SNAPSHOT_OK,
+    SNAPSHOT_CANNOT_OPEN,
+    SNAPSHOT_BAD_FORMAT,
+    SNAPSHOT_BAD_VERSION,
+    SNAPSHOT_TRUNCATED,
+    SNAPSHOT_NO_CHANNEL,        // The channel has no calibration
+    SNAPSHOT_DAMAGED            // The channel's record fails its checks
+};
+
+std::string snapshot_status_message(SnapshotStatus status, const std::string& filename);
+
+/*
+ * A snapshot file mapped read-only, checked one channel at a time
+ * The checks write to the validation bitsets, so the const members must
+ * not be called from two threads at once; check_all() first if they are.
+ * Views taken from it must not outlive it.
+ */
+class MappedSnapshot {
+public:
+    MappedSnapshot();
+    ~MappedSnapshot();
+
+    // Map filename and check its header; no record is read
+    SnapshotStatus open(const std::string& filename);
+    void close();
+
+    bool is_open() const { return file.is_open(); }
+
+    // Check channel's record if it has not been yet: SNAPSHOT_OK, _NO_CHANNEL or _DAMAGED
+    SnapshotStatus check(uint32_t channel) const;
+
+    // check() the channels of n samples; a bit test for channels already checked
+    void check(const uint32_t* channels, size_t n) const;
+
+    // Check every record now
+    void check_all() const;
+
+    // check() channel and read its calibration and (if fit is not NULL) its fit state,
+    // which has count 0 if it has none
+    SnapshotStatus lookup(uint32_t channel, Calibration& cal, FitAccumulator* fit = NULL) const;
+
+    /*
+     * The channels checked so far as a table: channels not checked yet
+     * read as missing, so check() the channels of a block before the
+     * block is converted through the view. A check that adds a channel
+     * gives later views a new generation.
+     */
+    CalibrationTableView view() const;
+
+    uint32_t first_channel() const { return header.first_channel; }
+    uint32_t channel_count() const { return header.channel_count; }
+    uint32_t calibrated() const { return header.calibrated; }   // As written; some may be damaged
+
+    size_t checked() const { return checked_count; }
+    size_t damaged() const { return damaged_count; }
+
+private:
+    MappedSnapshot(const MappedSnapshot&);             // Not copyable
+    MappedSnapshot& operator=(const MappedSnapshot&);
+
+    SnapshotStatus validate(uint32_t index) const;
+    SnapshotStatus check_index(uint32_t index) const;
+
+    MappedFile file;
+    SnapshotHeader header;
+    const double* slopes;
+    const double* offsets;
+    const SnapshotRecord* records;
+
+    // One bit per entry, calloc'd so untouched words cost no page faults
+    mutable uint64_t* checked_bits;
+    mutable uint64_t* good_bits;    // The view's valid bitset
+    mutable size_t checked_count;
+    mutable size_t damaged_count;
+    mutable uint64_t generation;    // Of the view; moves on as channels pass their check
+};
+
+/*
+ * Write the calibrations of table and the fit states of fits (by channel;
+ * channels without a calibration in table are ignored) as a snapshot.
+ * Returns false if the file cannot be written.
+ */
+bool write_snapshot(const std::string& filename, const CalibrationTableView& table,
+                    const std::map<uint32_t, FitAccumulator>& fits);
+
+// True if filename starts with the snapshot magic; reads 8 bytes
+bool is_snapshot_file(const std::string& filename);
+
+#endif
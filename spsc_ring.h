@@ -0,0 +1,86 @@
+/*
+ * Lock-free single-producer / single-consumer ring buffer
+ *
+ * Exactly one thread may push and exactly one other thread may pop.
+ * Head and tail live on separate cache lines, and each side keeps a cached
+ * copy of the other side's index, so a push or pop touches shared memory
+ * only when the cached view says the ring looks full or empty.
+ */
+
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+template <typename T>
+class SpscRing {
+public:
+    // Capacity is rounded up to a power of two
+    explicit SpscRing(size_t capacity)
+        : head(0), cached_tail(0), tail(0), cached_head(0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    // Producer: copy up to n items in; returns how many fit
+    size_t push(const T* items, size_t n) {
+        size_t write = head.load(std::memory_order_relaxed);
+        size_t space = slots.size() - (write - cached_tail);
+        if (space < n) {
+            cached_tail = tail.load(std::memory_order_acquire);
+            space = slots.size() - (write - cached_tail);
+        }
+
+        size_t count = n < space ? n : space;
+        for (size_t i = 0; i < count; i++) {
+            slots[(write + i) & mask] = items[i];
+        }
+        head.store(write + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer: copy up to n items out; returns how many there were
+    size_t pop(T* items, size_t n) {
+        size_t read = tail.load(std::memory_order_relaxed);
+        size_t available = cached_head - read;
+        if (available < n) {
+            cached_head = head.load(std::memory_order_acquire);
+            available = cached_head - read;
+        }
+
+        size_t count = n < available ? n : available;
+        for (size_t i = 0; i < count; i++) {
+            items[i] = slots[(read + i) & mask];
+        }
+        tail.store(read + count, std::memory_order_release);
+        return count;
+    }
+
+    // Consumer: true if nothing is waiting
+    bool empty() const {
+        return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+    }
+
+private:
+    SpscRing(const SpscRing&);             // Not copyable
+    SpscRing& operator=(const SpscRing&);
+
+    std::vector<T> slots;
+    size_t mask;
+
+    // Producer side
+    alignas(64) std::atomic<size_t> head;
+    size_t cached_tail;
+
+    // Consumer side
+    alignas(64) std::atomic<size_t> tail;
+    size_t cached_head;
+};
+
+#endif
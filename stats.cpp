@@ -0,0 +1,223 @@
+/*
+ * Per-stage counters, latency histograms and the stats dump
+ */
+
+#include "stats.h"
+
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+atomic<bool> stats_active(false);
+
+namespace {
+
+/*
+ * Latency histogram bucket i counts calls that took [2^i, 2^(i+1)) ns,
+ * so 40 buckets reach past 18 minutes
+ */
+const int HISTOGRAM_BUCKETS = 40;
+
+struct StageCounters {
+    atomic<uint64_t> calls;
+    atomic<uint64_t> items;
+    atomic<uint64_t> total_ns;
+    atomic<uint64_t> max_ns;
+    atomic<uint64_t> histogram[HISTOGRAM_BUCKETS];
+};
+
+// Zero-initialized as a static
+StageCounters stages[STAT_STAGE_COUNT];
+
+const char* const STAGE_NAMES[STAT_STAGE_COUNT] = {
+    "read", "parse", "fit", "convert", "format", "write", "load", "save", "startup"
+};
+
+// When init_stats() ran, and whether the first conversion has been recorded
+uint64_t start_ns = 0;
+atomic<bool> started(false);
+
+int histogram_bucket(uint64_t nanoseconds) {
+    int bucket = 0;
+    while (nanoseconds > 1 && bucket < HISTOGRAM_BUCKETS - 1) {
+        nanoseconds >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+/*
+ * Upper edge of the bucket holding the given fraction of calls
+ * An estimate within a factor of two, which is enough to spot outliers
+ */
+uint64_t histogram_percentile(const StageCounters& stage, uint64_t calls, double fraction) {
+    uint64_t wanted = static_cast<uint64_t>(calls * fraction);
+    if (wanted == 0) {
+        wanted = 1;
+    }
+
+    uint64_t max_ns = stage.max_ns.load(memory_order_relaxed);
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += stage.histogram[i].load(memory_order_relaxed);
+        if (seen >= wanted) {
+            uint64_t edge = uint64_t(2) << i;
+            return edge < max_ns ? edge : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+/*
+ * Fixed-size line buffer for the dump
+ * Uses no allocation, locale or stdio, so it can run in a signal handler
+ */
+class DumpLine {
+public:
+    DumpLine() : used(0) {}
+
+    void text(const char* s) {
+        while (*s != '\0' && used < sizeof(buffer)) {
+            buffer[used++] = *s++;
+        }
+    }
+
+    // Unsigned decimal right-aligned in width characters
+    void number(uint64_t value, size_t width) {
+        char digits[24];
+        size_t count = 0;
+        do {
+            digits[count++] = static_cast<char>('0' + value % 10);
+            value /= 10;
+        } while (value != 0);
+
+        for (size_t i = count; i < width; i++) {
+            text(" ");
+        }
+        while (count > 0 && used < sizeof(buffer)) {
+            buffer[used++] = digits[--count];
+        }
+    }
+
+    // Text left-aligned in width characters
+    void padded(const char* s, size_t width) {
+        size_t start = used;
+        text(s);
+        while (used - start < width) {
+            text(" ");
+        }
+    }
+
+    void write_to(int fd) {
+        text("\n");
+#ifdef _WIN32
+        _write(fd, buffer, static_cast<unsigned>(used));
+#else
+        ssize_t ignored = write(fd, buffer, used);
+        (void)ignored;
+#endif
+        used = 0;
+    }
+
+private:
+    char buffer[160];
+    size_t used;
+};
+
+void dump_stats_at_exit() {
+    dump_stats(2);
+}
+
+#ifdef SIGUSR1
+void dump_stats_on_signal(int) {
+    dump_stats(2);
+}
+#endif
+
+}  // namespace
+
+void init_stats() {
+    start_ns = stats_clock_ns();
+
+    const char* setting = getenv("SENSORCAL_STATS");
+    if (setting == NULL || *setting == '\0' || strcmp(setting, "0") == 0) {
+        return;
+    }
+
+    stats_active.store(true, memory_order_relaxed);
+    atexit(dump_stats_at_exit);
+
+#ifdef SIGUSR1
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = dump_stats_on_signal;
+    action.sa_flags = SA_RESTART;   // Dumping must not make fread() fail
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGUSR1, &action, NULL);
+#endif
+}
+
+void record_stage(StatStage stage, uint64_t nanoseconds, uint64_t items) {
+    StageCounters& counters = stages[stage];
+
+    counters.calls.fetch_add(1, memory_order_relaxed);
+    counters.items.fetch_add(items, memory_order_relaxed);
+    counters.total_ns.fetch_add(nanoseconds, memory_order_relaxed);
+    counters.histogram[histogram_bucket(nanoseconds)].fetch_add(1, memory_order_relaxed);
+
+    uint64_t max_ns = counters.max_ns.load(memory_order_relaxed);
+    while (nanoseconds > max_ns
+           && !counters.max_ns.compare_exchange_weak(max_ns, nanoseconds, memory_order_relaxed)) {
+    }
+}
+
+void record_startup(uint64_t items) {
+    if (stats_enabled() && !started.load(memory_order_relaxed) && !started.exchange(true)) {
+        record_stage(STAT_STARTUP, stats_clock_ns() - start_ns, items);
+    }
+}
+
+/*
+ * One row per stage that has been called:
+ * calls, items, total milliseconds, items per second and the p50 / p99 /
+ * max latency of a single call in microseconds
+ */
+void dump_stats(int fd) {
+    DumpLine line;
+
+    line.text("--- STATS ---");
+    line.write_to(fd);
+    line.padded("stage", 9);
+    line.text("      calls          items    total ms        items/s    p50 us    p99 us    max us");
+    line.write_to(fd);
+
+    for (int i = 0; i < STAT_STAGE_COUNT; i++) {
+        const StageCounters& stage = stages[i];
+        uint64_t calls = stage.calls.load(memory_order_relaxed);
+        if (calls == 0) {
+            continue;
+        }
+
+        uint64_t items = stage.items.load(memory_order_relaxed);
+        uint64_t total_ns = stage.total_ns.load(memory_order_relaxed);
+        uint64_t rate = total_ns > 0 ? static_cast<uint64_t>(items * 1e9 / total_ns) : 0;
+
+        line.padded(STAGE_NAMES[i], 9);
+        line.number(calls, 11);
+        line.number(items, 15);
+        line.number(total_ns / 1000000, 12);
+        line.number(rate, 15);
+        line.number(histogram_percentile(stage, calls, 0.50) / 1000, 10);
+        line.number(histogram_percentile(stage, calls, 0.99) / 1000, 10);
+        line.number(stage.max_ns.load(memory_order_relaxed) / 1000, 10);
+        line.write_to(fd);
+    }
+}
@@ -0,0 +1,592 @@
+/*
+ * Chunked line reader, buffered writer and from_chars-based parsers
+ */
+
+#include "text_io.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstring>
+
+#include "stats.h"
+
+using namespace std;
+
+/*
+ * Hand out the next line from the chunk buffer, refilling it from the
+ * file when the unread data holds no complete line
+ */
+bool ChunkedLineReader::next_line(char*& line, size_t& length) {
+    size_t chunk_size = buffer.capacity() - 1;
+    size_t scanned = begin;
+
+    while (true) {
+        char* newline = static_cast<char*>(memchr(&buffer[scanned], '\n', end - scanned));
+
+        if (newline != NULL) {
+            *newline = '\0';
+            line = &buffer[begin];
+            length = newline - line;
+            begin = (newline - &buffer[0]) + 1;
+            return true;
+        }
+
+        if (at_eof) {
+            if (begin == end) {
+                return false;
+            }
+            // Last line without a trailing newline
+            buffer[end] = '\0';
+            line = &buffer[begin];
+            length = end - begin;
+            begin = end;
+            return true;
+        }
+
+        if (begin == 0 && end == chunk_size) {
+            too_long = true;
+            return false;
+        }
+
+        // Move the partial line to the front and read the next chunk after it
+        memmove(&buffer[0], &buffer[begin], end - begin);
+        end -= begin;
+        begin = 0;
+        scanned = end;
+
+        size_t count;
+        if (file == NULL) {
+            count = read_from_source(&buffer[end], chunk_size - end);
+        } else {
+            StageTimer timer(STAT_READ);
+            count = fread(&buffer[end], 1, chunk_size - end, file);
+            timer.add_items(count);
+        }
+
+        if (count == 0) {
+            if (read_failed()) {
+                return false;
+            }
+            at_eof = true;
+        }
+        end += count;
+    }
+}
+
+/*
+ * Lines may straddle the source's chunks, so each chunk is copied in
+ * behind the partial line left in the buffer (a memcpy, far cheaper than
+ * the parsing that follows). Text in memory is one long chunk.
+ */
+size_t ChunkedLineReader::read_from_source(char* data, size_t size) {
+    if (pending_size == 0 && (source == NULL || !source->next(pending, pending_size))) {
+        pending_size = 0;
+        return 0;
+    }
+    size_t count = min(size, pending_size);
+    memcpy(data, pending, count);
+    pending += count;
+    pending_size -= count;
+    return count;
+}
+
+void BufferedWriter::write_fixed(double value, int precision) {
+    // Fixed notation of a double needs at most 309 integer digits plus sign and point
+    size_t max_length = 312 + static_cast<size_t>(precision);
+
+    if (capacity - used < max_length) {
+        flush();
+    }
+
+    to_chars_result result = to_chars(buffer + used, buffer + capacity,
+                                      value, chars_format::fixed, precision);
+    if (result.ec != errc()) {
+        write_failed = true;
+        return;
+    }
+    used = result.ptr - buffer;
+}
+
+void BufferedWriter::write_exact(double value) {
+    // Shortest round-trip form: at most 24 characters
+    if (capacity - used < 32) {
+        flush();
+    }
+
+    to_chars_result result = to_chars(buffer + used, buffer + capacity, value);
+    if (result.ec != errc()) {
+        write_failed = true;
+        return;
+    }
+    used = result.ptr - buffer;
+}
+
+void BufferedWriter::write(const char* data, size_t size) {
+    while (size > 0) {
+        if (used == capacity) {
+            flush();
+        }
+        size_t part = min(size, capacity - used);
+        memcpy(buffer + used, data, part);
+        used += part;
+        data += part;
+        size -= part;
+    }
+}
+
+void BufferedWriter::flush() {
+    if (sink != NULL) {
+        // The sink times its own writes
+        sink->submit(used);
+        buffer = sink->buffer();
+        used = 0;
+        return;
+    }
+
+    if (text != NULL) {
+        text->append(buffer, used);
+        used = 0;
+        return;
+    }
+
+    StageTimer timer(STAT_WRITE, used);
+
+    if (used > 0 && fwrite(buffer, 1, used, file) != used) {
+        write_failed = true;
+    }
+    used = 0;
+    if (fflush(file) != 0) {
+        write_failed = true;
+    }
+}
+
+namespace {
+
+inline const char* skip_blanks(const char* text, const char* end) {
+    while (text < end && (*text == ' ' || *text == '\t')) {
+        text++;
+    }
+    return text;
+}
+
+// Skip the separator between two fields: blanks, an optional comma, blanks
+inline const char* skip_separator(const char* text, const char* end) {
+    text = skip_blanks(text, end);
+    if (text < end && *text == ',') {
+        text++;
+    }
+    return text;
+}
+
+// True if only trailing whitespace is left
+inline bool at_line_end(const char* text, const char* end) {
+    while (text < end && (*text == ' ' || *text == '\t' || *text == '\r')) {
+        text++;
+    }
+    return text == end;
+}
+
+bool parse_uint32(const char*& text, const char* end, uint32_t& value) {
+    from_chars_result result = from_chars(text, end, value);
+    if (result.ec != errc()) {
+        return false;
+    }
+    text = result.ptr;
+    return true;
+}
+
+}  // namespace
+
+bool parse_double(const char*& text, const char* end, double& value) {
+    const char* p = skip_blanks(text, end);
+    if (p < end && *p == '+') {
+        p++;
+    }
+
+    from_chars_result result = from_chars(p, end, value);
+    if (result.ec != errc()) {
+        return false;
+    }
+    text = result.ptr;
+    return true;
+}
+
+bool is_blank_or_comment(const char* text, const char* end) {
+    text = skip_blanks(text, end);
+    return text == end || *text == '\r' || *text == '#';
+}
+
+bool parse_reading(const char* text, const char* end, double& raw_reading) {
+    return parse_double(text, end, raw_reading) && at_line_end(text, end);
+}
+
+bool parse_point(const char* text, const char* end, double& reference_value, double& raw_reading) {
+    if (!parse_double(text, end, reference_value)) {
+        return false;
+    }
+    text = skip_separator(text, end);
+    return parse_double(text, end, raw_reading) && at_line_end(text, end);
+}
+
+bool parse_sample(const char* text, const char* end, uint32_t& channel, double& raw_reading) {
+    text = skip_blanks(text, end);
+    if (!parse_uint32(text, end, channel)) {
+        return false;
+    }
+    text = skip_separator(text, end);
+    return parse_double(text, end, raw_reading) && at_line_end(text, end);
+}
+
+bool parse_channel_point(const char* text, const char* end, uint32_t& channel,
+                         double& reference_value, double& raw_reading) {
+    text = skip_blanks(text, end);
+    if (!parse_uint32(text, end, channel)) {
+        return false;
+    }
+    text = skip_separator(text, end);
+    return parse_point(text, end, reference_value, raw_reading);
+}
+
+bool parse_temperature_sample(const char* text, const char* end, double& raw_reading,
+                              double& temperature) {
+    if (!parse_double(text, end, raw_reading)) {
+        return false;
+    }
+    text = skip_separator(text, end);
+    return parse_double(text, end, temperature) && at_line_end(text, end);
+}
+
+bool parse_temperature_point(const char* text, const char* end, double& reference_value,
+                             double& raw_reading, double& temperature) {
+    if (!parse_double(text, end, reference_value)) {
+        return false;
+    }
+    text = skip_separator(text, end);
+    return parse_temperature_sample(text, end, raw_reading, temperature);
+}
+
+bool parse_channel(const char* text, uint32_t& channel) {
+    const char* end = text + strlen(text);
+    return text != end && parse_uint32(text, end, channel) && text == end;
+}
+
+bool read_text_file(const string& filename, string& text) {
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+
+    text.clear();
+    char chunk[4096];
+    size_t count;
+    while ((count = fread(chunk, 1, sizeof(chunk), file)) > 0) {
+        text.append(chunk, count);
+    }
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    return !failed;
+}
+
+bool write_text_file(const string& filename, const string& text) {
+    StageTimer timer(STAT_SAVE, 1);
+    FILE* file = fopen(filename.c_str(), "w");
+    if (file == NULL) {
+        return false;
+    }
+
+    bool written = fwrite(text.data(), 1, text.size(), file) == text.size();
+    return fclose(file) == 0 && written;
+}
+
+namespace {
+
+/*
+ * Parse "fit COUNT MEAN_RAW MEAN_REFERENCE M2_RAW M2_REFERENCE C_RAW_REFERENCE"
+ * Returns false (fit untouched) unless the whole line is a valid fit state
+ */
+bool parse_fit_state(const char* text, const char* end, FitAccumulator& fit) {
+    text = skip_blanks(text, end);
+    if (end - text < 3 || strncmp(text, "fit", 3) != 0) {
+        return false;
+    }
+    text += 3;
+
+    double values[6];
+    for (int i = 0; i < 6; i++) {
+        text = skip_separator(text, end);
+        if (!parse_double(text, end, values[i])) {
+            return false;
+        }
+    }
+    if (!at_line_end(text, end)) {
+        return false;
+    }
+
+    // A count of points, and sums of squares that cannot be negative
+    if (!(values[0] >= 0.0 && values[0] <= 9.0e18 && values[0] == floor(values[0]))
+        || !(values[3] >= 0.0) || !(values[4] >= 0.0)) {
+        return false;
+    }
+
+    fit.count = static_cast<unsigned long long>(values[0]);
+    fit.mean_x = values[1];
+    fit.mean_y = values[2];
+    fit.m2_x = values[3];
+    fit.m2_y = values[4];
+    fit.c_xy = values[5];
+    return true;
+}
+
+/*
+ * Read slope and offset and, if fit is not NULL, the fit state line
+ * that may follow them
+ */
+LoadStatus read_calibration(ChunkedLineReader& reader, Calibration& cal, FitAccumulator* fit) {
+    StageTimer timer(STAT_LOAD, 1);
+
+    // Slope then offset; like >> any whitespace may separate them
+    double values[2];
+    int found = 0;
+    bool bad_number = false;
+
+    char* line;
+    size_t length;
+
+    while (found < 2 && !bad_number && reader.next_line(line, length)) {
+        const char* text = line;
+        const char* end = line + length;
+
+        while (found < 2 && !is_blank_or_comment(text, end)) {
+            if (!parse_double(text, end, values[found])) {
+                // A keyword such as "polynomial" instead of a slope
+                if (found == 0 && isalpha(static_cast<unsigned char>(*skip_blanks(text, end)))) {
+                    return LOAD_NOT_LINEAR;
+                }
+                bad_number = true;
+                break;
+            }
+            found++;
+        }
+    }
+
+    // The fit state, if any, is the next line that is not blank
+    FitAccumulator state;
+    bool bad_state = false;
+    if (fit != NULL && found == 2 && !bad_number) {
+        while (reader.next_line(line, length)) {
+            if (is_blank_or_comment(line, line + length)) {
+                continue;
+            }
+            const char* text = skip_blanks(line, line + length);
+            bool is_fit_line = strncmp(text, "fit", 3) == 0
+                && (text[3] == ' ' || text[3] == '\t');
+            bad_state = is_fit_line && !parse_fit_state(line, line + length, state);
+            break;
+        }
+    }
+
+    // Read slope from first line
+    if (found < 1) {
+        return LOAD_BAD_SLOPE;
+    }
+
+    // Read offset from second line
+    if (found < 2) {
+        return LOAD_BAD_OFFSET;
+    }
+
+    if (bad_state) {
+        return LOAD_BAD_FIT_STATE;
+    }
+
+    cal.slope = values[0];
+    cal.offset = values[1];
+    cal.is_valid = true;
+    if (fit != NULL) {
+        *fit = state;
+    }
+
+    return LOAD_OK;
+}
+
+LoadStatus read_calibration(const string& filename, Calibration& cal, FitAccumulator* fit) {
+    FILE* file = fopen(filename.c_str(), "r");
+
+    if (file == NULL) {
+        return LOAD_CANNOT_OPEN;
+    }
+
+    ChunkedLineReader reader(file, 4096);
+    LoadStatus status = read_calibration(reader, cal, fit);
+    fclose(file);
+    return status;
+}
+
+// Everything write_calibration() writes
+void put_calibration(BufferedWriter& writer, const Calibration& cal, const FitAccumulator& fit,
+                     const FitDiagnostics* diagnostics, const FixedPointCalibration* fixed) {
+    // Slope and offset, one per line
+    writer.write_fixed(cal.slope, 10);
+    writer.put('\n');
+    writer.write_fixed(cal.offset, 10);
+    writer.put('\n');
+
+    if (fit.count > 0) {
+        writer.put("fit ");
+        writer.write_fixed(static_cast<double>(fit.count), 0);
+        const double moments[5] = {fit.mean_x, fit.mean_y, fit.m2_x, fit.m2_y, fit.c_xy};
+        for (int i = 0; i < 5; i++) {
+            writer.put(' ');
+            writer.write_exact(moments[i]);
+        }
+        writer.put('\n');
+    }
+
+    if (diagnostics != NULL) {
+        writer.put("# quality: points ");
+        writer.write_fixed(static_cast<double>(diagnostics->count), 0);
+        writer.put(" r_squared ");
+        writer.write_exact(diagnostics->r_squared);
+        writer.put(" residual_rms ");
+        writer.write_exact(diagnostics->residual_rms);
+        writer.put('\n');
+
+        if (diagnostics->has_standard_errors) {
+            const char* names[5] = {"# errors: residual_std_error ", " slope_se ", " slope_ci95 ",
+                                    " offset_se ", " offset_ci95 "};
+            const double values[5] = {diagnostics->residual_std_error, diagnostics->slope_std_error,
+                                      diagnostics->slope_ci95, diagnostics->offset_std_error,
+                                      diagnostics->offset_ci95};
+            for (int i = 0; i < 5; i++) {
+                writer.put(names[i]);
+                writer.write_exact(values[i]);
+            }
+            writer.put('\n');
+        }
+    }
+
+    if (fixed != NULL) {
+        string line;
+        format_fixed_point(*fixed, line);
+        writer.put(line.c_str());
+
+        FixedPointError error;
+        fixed_point_error(cal, *fixed, error);
+        writer.put("# fixed_error: lsb ");
+        writer.write_exact(error.lsb);
+        writer.put(" bound ");
+        writer.write_exact(error.bound);
+        writer.put(" max_error ");
+        writer.write_exact(error.max_error);
+        writer.put('\n');
+    }
+}
+
+}  // namespace
+
+/*
+ * Read calibration coefficients from a text file into cal
+ * Expected format: first line = slope, second line = offset
+ */
+LoadStatus read_calibration_file(const string& filename, Calibration& cal) {
+    return read_calibration(filename, cal, NULL);
+}
+
+LoadStatus read_calibration_file(const string& filename, Calibration& cal, FitAccumulator& fit) {
+    return read_calibration(filename, cal, &fit);
+}
+
+LoadStatus parse_calibration(const char* text, size_t size, Calibration& cal, FitAccumulator& fit) {
+    ChunkedLineReader reader(text, size);
+    return read_calibration(reader, cal, &fit);
+}
+
+/*
+ * Write calibration coefficients to a text file
+ * Format: slope on first line, offset on second line
+ */
+bool write_calibration_file(const string& filename, const Calibration& cal) {
+    return write_calibration_file(filename, cal, FitAccumulator());
+}
+
+bool write_calibration_file(const string& filename, const Calibration& cal,
+                            const FitAccumulator& fit, const FitDiagnostics* diagnostics,
+                            const FixedPointCalibration* fixed) {
+    StageTimer timer(STAT_SAVE, 1);
+    FILE* file = fopen(filename.c_str(), "w");
+
+    if (file == NULL) {
+        return false;
+    }
+
+    bool written = write_calibration(file, cal, fit, diagnostics, fixed);
+    return fclose(file) == 0 && written;
+}
+
+bool write_calibration(FILE* file, const Calibration& cal, const FitAccumulator& fit,
+                       const FitDiagnostics* diagnostics, const FixedPointCalibration* fixed) {
+    BufferedWriter writer(file, 4096);
+    put_calibration(writer, cal, fit, diagnostics, fixed);
+    writer.flush();
+    return !writer.failed();
+}
+
+void format_calibration(const Calibration& cal, const FitAccumulator& fit,
+                        const FitDiagnostics* diagnostics, string& text,
+                        const FixedPointCalibration* fixed) {
+    BufferedWriter writer(&text);
+    put_calibration(writer, cal, fit, diagnostics, fixed);
+    writer.flush();
+}
+
+/*
+ * The first line starting with "fixed" is the integer form; nothing else
+ * in the file is parsed, so no floating point is needed
+ */
+LoadStatus read_fixed_point_file(const string& filename, FixedPointCalibration& fixed) {
+    FILE* file = fopen(filename.c_str(), "r");
+    if (file == NULL) {
+        return LOAD_CANNOT_OPEN;
+    }
+
+    ChunkedLineReader reader(file, 4096);
+    LoadStatus status = LOAD_NO_FIXED_POINT;
+    char* line;
+    size_t length;
+
+    while (reader.next_line(line, length)) {
+        const char* text = skip_blanks(line, line + length);
+        if (strncmp(text, "fixed", 5) == 0 && (text[5] == ' ' || text[5] == '\t')) {
+            status = parse_fixed_point(line, line + length, fixed) ? LOAD_OK : LOAD_BAD_FIXED_POINT;
+            break;
+        }
+    }
+    fclose(file);
+    return status;
+}
+
+string load_status_message(LoadStatus status, const string& filename) {
+    switch (status) {
+        case LOAD_OK:
+            return "Calibration loaded from '" + filename + "'";
+        case LOAD_CANNOT_OPEN:
+            return "Cannot open file '" + filename + "'";
+        case LOAD_BAD_SLOPE:
+            return "Cannot read slope from file.";
+        case LOAD_BAD_OFFSET:
+            return "Cannot read offset from file.";
+        case LOAD_NOT_LINEAR:
+            return "'" + filename + "' holds a nonlinear model; only linear calibrations can be used here.";
+        case LOAD_BAD_MODEL:
+            return "Cannot read calibration model from '" + filename + "'";
+        case LOAD_BAD_FIT_STATE:
+            return "Cannot read the fit state in '" + filename + "'";
+        case LOAD_NO_FIXED_POINT:
+            return "'" + filename + "' holds no fixed-point form; add one with the fixed-point command.";
+        case LOAD_BAD_FIXED_POINT:
+            return "Cannot read the fixed-point form in '" + filename + "'";
+    }
+    return "Unknown error.";
+}
@@ -0,0 +1,248 @@
+/*
+ * Fast text input and output for batch files
+ *
+ * Input is read in large fixed-size chunks and numbers are parsed in place
+ * with std::from_chars; output is formatted with std::to_chars into a large
+ * buffer. Neither side goes through iostreams or the C locale, so CSV
+ * throughput is limited by the disk rather than by number formatting.
+ * Numbers are always written and read with '.' as the decimal point.
+ */
+
+#ifndef TEXT_IO_H
+#define TEXT_IO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "aligned_buffer.h"
+#include "async_io.h"
+#include "calibration.h"
+#include "fit.h"
+#include "fixed_point.h"
+
+/*
+ * Reads a text stream in fixed-size chunks and hands out one line at a time
+ * Only one chunk is held in memory, so memory use does not depend on the
+ * size of the input. Lines must fit in a single chunk.
+ * Reading from an AsyncReader instead of a FILE lets the next chunks be
+ * read while the current one is parsed. Text already in memory is read
+ * the same way, copied a chunk at a time (it need not be NUL-terminated).
+ */
+class ChunkedLineReader {
+public:
+    explicit ChunkedLineReader(FILE* file, size_t chunk_size = 1 << 20)
+        : file(file), source(NULL), pending(NULL), pending_size(0),
+          begin(0), end(0), at_eof(false), too_long(false) { buffer.reserve(chunk_size + 1); }
+
+    explicit ChunkedLineReader(AsyncReader* source, size_t chunk_size = 1 << 20)
+        : file(NULL), source(source), pending(NULL), pending_size(0),
+          begin(0), end(0), at_eof(false), too_long(false) { buffer.reserve(chunk_size + 1); }
+
+    ChunkedLineReader(const char* text, size_t size, size_t chunk_size = 4096)
+        : file(NULL), source(NULL), pending(text), pending_size(size),
+          begin(0), end(0), at_eof(false), too_long(false) { buffer.reserve(chunk_size + 1); }
+
+    // Points line at the next line (NUL-terminated, without the newline) and
+    // sets length. Returns false at end of input, on a read error or on an
+    // over-long line.
+    bool next_line(char*& line, size_t& length);
+
+    bool line_too_long() const { return too_long; }
+    bool read_failed() const {
+        return source != NULL ? source->failed() : file != NULL && ferror(file) != 0;
+    }
+
+private:
+    // Copy up to size bytes from the source's chunks (or the text) into data
+    size_t read_from_source(char* data, size_t size);
+
+    FILE* file;
+    AsyncReader* source;
+    const char* pending;       // Part of the source's current chunk (or the text) not yet copied
+    size_t pending_size;
+    // Reserved, not zeroed, so a short input touches only the pages it fills;
+    // one extra byte so the last line can be terminated
+    AlignedBuffer<char> buffer;
+    size_t begin;              // Start of unread data in buffer
+    size_t end;                // End of valid data in buffer
+    bool at_eof;
+    bool too_long;
+};
+
+/*
+ * Buffered text output with std::to_chars formatting
+ * Check failed() after flush() to see if any write went wrong.
+ * Writing through an AsyncWriter formats straight into its buffers and
+ * hands each full one over to be written while the next is filled; call
+ * finish() on the AsyncWriter after the last flush(). Writing to a string
+ * appends to it, for callers that keep the text in memory.
+ */
+class BufferedWriter {
+public:
+    explicit BufferedWriter(FILE* file, size_t buffer_size = 1 << 20)
+        : file(file), sink(NULL), text(NULL), buffer(NULL),
+          capacity(buffer_size), used(0), write_failed(false) { use_own_buffer(); }
+
+    explicit BufferedWriter(AsyncWriter* sink)
+        : file(NULL), sink(sink), text(NULL), buffer(sink->buffer()), capacity(sink->capacity()),
+          used(0), write_failed(false) {}
+
+    explicit BufferedWriter(std::string* text, size_t buffer_size = 4096)
+        : file(NULL), sink(NULL), text(text), buffer(NULL),
+          capacity(buffer_size), used(0), write_failed(false) { use_own_buffer(); }
+
+    ~BufferedWriter() { flush(); }
+
+    // Write value in fixed notation with precision digits after the point
+    void write_fixed(double value, int precision);
+    // Write the shortest text that reads back as exactly value
+    void write_exact(double value);
+    void put(char c) {
+        if (used == capacity) {
+            flush();
+        }
+        buffer[used++] = c;
+    }
+    void put(const char* text) {
+        while (*text != '\0') {
+            put(*text++);
+        }
+    }
+    // Write size bytes as they are, e.g. text formatted elsewhere
+    void write(const char* data, size_t size);
+
+    void flush();
+    bool failed() const { return write_failed || (sink != NULL && sink->failed()); }
+
+private:
+    BufferedWriter(const BufferedWriter&);             // Not copyable
+    BufferedWriter& operator=(const BufferedWriter&);
+
+    void use_own_buffer() {
+        own_buffer.reserve(capacity);
+        buffer = own_buffer.data();
+    }
+
+    FILE* file;
+    AsyncWriter* sink;
+    std::string* text;
+    AlignedBuffer<char> own_buffer; // Used when writing to file or text; reserved, not zeroed
+    char* buffer;                   // Being filled: own_buffer or the sink's
+    size_t capacity;
+    size_t used;
+    bool write_failed;
+};
+
+/*
+ * PARSERS
+ * Each takes a line [text, end) and succeeds only if the whole line is
+ * consumed (trailing spaces, tabs and '\r' are allowed). Fields may be
+ * separated by a comma, whitespace or both.
+ */
+
+// True if the line is empty, only whitespace, or a '#' comment
+bool is_blank_or_comment(const char* text, const char* end);
+
+// A single raw reading
+bool parse_reading(const char* text, const char* end, double& raw_reading);
+
+// A "reference,raw" calibration point
+bool parse_point(const char* text, const char* end, double& reference_value, double& raw_reading);
+
+// A "channel,raw" multi-channel sample
+bool parse_sample(const char* text, const char* end, uint32_t& channel, double& raw_reading);
+
+// A "channel,reference,raw" calibration point of a multi-channel run
+bool parse_channel_point(const char* text, const char* end, uint32_t& channel,
+                         double& reference_value, double& raw_reading);
+
+// A "raw,temperature" sample for a temperature-compensated model
+bool parse_temperature_sample(const char* text, const char* end, double& raw_reading,
+                              double& temperature);
+
+// A "reference,raw,temperature" calibration point
+bool parse_temperature_point(const char* text, const char* end, double& reference_value,
+                             double& raw_reading, double& temperature);
+
+// A decimal channel ID making up the whole NUL-terminated string
+bool parse_channel(const char* text, uint32_t& channel);
+
+/*
+ * Parse one number at text, skipping leading blanks and a leading '+'.
+ * On success text is moved past the number.
+ */
+bool parse_double(const char*& text, const char* end, double& value);
+
+// Read a whole file into text. Returns false if it cannot be read.
+bool read_text_file(const std::string& filename, std::string& text);
+
+// Write text to filename. Returns false if the file cannot be written.
+bool write_text_file(const std::string& filename, const std::string& text);
+
+/*
+ * TEXT CALIBRATION FILES
+ * Two lines: slope on the first, offset on the second, written with 10
+ * digits after the decimal point. A fitted calibration may carry a third
+ * line with the moments it was computed from,
+ *   fit COUNT MEAN_RAW MEAN_REFERENCE M2_RAW M2_REFERENCE C_RAW_REFERENCE
+ * written exactly, so points can be added or retracted later (see
+ * FitAccumulator). Readers that only want slope and offset stop before it.
+ * The fit's quality (see FitDiagnostics) can follow as comment lines,
+ *   # quality: points N r_squared R2 residual_rms RMS
+ *   # errors: residual_std_error S slope_se SE slope_ci95 CI offset_se SE offset_ci95 CI
+ * which readers skip like any other comment. The integer form of the line
+ * for targets without an FPU can come last (see fixed_point.h),
+ *   fixed SLOPE OFFSET SLOPE_BITS OUTPUT_BITS FIRST_CODE LAST_CODE
+ *   # fixed_error: lsb L bound B max_error E
+ * and is skipped by everything but read_fixed_point_file().
+ */
+
+// Result of reading a calibration file
+enum LoadStatus {
+    LOAD_OK,
+    LOAD_CANNOT_OPEN,
+    LOAD_BAD_SLOPE,
+    LOAD_BAD_OFFSET,
+    LOAD_NOT_LINEAR,    // A nonlinear model file (see model.h)
+    LOAD_BAD_MODEL,
+    LOAD_BAD_FIT_STATE,
+    LOAD_NO_FIXED_POINT,    // No "fixed" line
+    LOAD_BAD_FIXED_POINT
+};
+
+// Read filename into cal; cal is only modified when the whole file reads successfully
+LoadStatus read_calibration_file(const std::string& filename, Calibration& cal);
+
+// Also read the fit state; fit.count is 0 if the file has none
+LoadStatus read_calibration_file(const std::string& filename, Calibration& cal, FitAccumulator& fit);
+
+// The same for the contents of a calibration file already in memory
+LoadStatus parse_calibration(const char* text, size_t size, Calibration& cal, FitAccumulator& fit);
+
+// Write cal to filename. Returns false if the file cannot be written.
+bool write_calibration_file(const std::string& filename, const Calibration& cal);
+
+// Write cal, its fit state unless fit.count is 0, and diagnostics and
+// the integer form of cal (with its error) if given
+bool write_calibration_file(const std::string& filename, const Calibration& cal,
+                            const FitAccumulator& fit, const FitDiagnostics* diagnostics = NULL,
+                            const FixedPointCalibration* fixed = NULL);
+bool write_calibration(FILE* file, const Calibration& cal, const FitAccumulator& fit,
+                       const FitDiagnostics* diagnostics = NULL,
+                       const FixedPointCalibration* fixed = NULL);
+
+// Append the text write_calibration() would write to text
+void format_calibration(const Calibration& cal, const FitAccumulator& fit,
+                        const FitDiagnostics* diagnostics, std::string& text,
+                        const FixedPointCalibration* fixed = NULL);
+
+// Read only the integer form from a calibration file, without floating point
+LoadStatus read_fixed_point_file(const std::string& filename, FixedPointCalibration& fixed);
+
+// Describe a LoadStatus for error messages
+std::string load_status_message(LoadStatus status, const std::string& filename);
+
+#endif
@@ -0,0 +1,129 @@
+/*
+ * Work-stealing parallel loop over task indices
+ *
+ * Each thread starts with a contiguous share of the tasks and takes them
+ * from the front of its share. A thread whose share runs out steals the
+ * back half of the largest share left. Tasks of very different cost (e.g.
+ * channels with ten points and with a million) then balance themselves,
+ * and threads only touch each other's shares when one runs dry.
+ */
+
+#ifndef WORK_STEALING_H
+#define WORK_STEALING_H
+
+#include <cstddef>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace work_stealing_detail {
+
+// Tasks [front, back) still to run; stolen from the back
+struct alignas(64) Share {
+    std::mutex lock;
+    size_t front;
+    size_t back;
+};
+
+}  // namespace work_stealing_detail
+
+/*
+ * Run body(task) for task = 0 .. count - 1 on up to threads threads
+ * (0 = one per hardware thread). The calling thread works too.
+ */
+template <typename Body>
+void parallel_for_stealing(size_t count, unsigned threads, const Body& body) {
+    using work_stealing_detail::Share;
+
+    if (threads == 0) {
+        threads = std::thread::hardware_concurrency();
+    }
+    if (threads == 0) {
+        threads = 1;
+    }
+    if (threads > count) {
+        threads = static_cast<unsigned>(count);
+    }
+    if (threads <= 1) {
+        for (size_t task = 0; task < count; task++) {
+            body(task);
+        }
+        return;
+    }
+
+    std::vector<Share> shares(threads);
+    for (unsigned t = 0; t < threads; t++) {
+        shares[t].front = count * t / threads;
+        shares[t].back = count * (t + 1) / threads;
+    }
+
+    auto worker = [&](unsigned self) {
+        Share& own = shares[self];
+        while (true) {
+            size_t task = 0;
+            bool found = false;
+            {
+                std::lock_guard<std::mutex> guard(own.lock);
+                if (own.front < own.back) {
+                    task = own.front++;
+                    found = true;
+                }
+            }
+            if (found) {
+                body(task);
+                continue;
+            }
+
+            // Steal the back half of the largest share; it may shrink
+            // before the steal, which rechecks it
+            unsigned victim = self;
+            size_t largest = 0;
+            for (unsigned t = 0; t < threads; t++) {
+                if (t == self) {
+                    continue;
+                }
+                size_t left;
+                {
+                    std::lock_guard<std::mutex> guard(shares[t].lock);
+                    left = shares[t].back - shares[t].front;
+                }
+                if (left > largest) {
+                    largest = left;
+                    victim = t;
+                }
+            }
+            if (victim == self) {
+                // Shares only shrink, so every task has been started
+                return;
+            }
+
+            size_t stolen_front, stolen_back;
+            {
+                std::lock_guard<std::mutex> guard(shares[victim].lock);
+                size_t left = shares[victim].back - shares[victim].front;
+                if (left == 0) {
+                    continue;
+                }
+                stolen_back = shares[victim].back;
+                stolen_front = stolen_back - (left + 1) / 2;
+                shares[victim].back = stolen_front;
+            }
+            {
+                std::lock_guard<std::mutex> guard(own.lock);
+                own.front = stolen_front;
+                own.back = stolen_back;
+            }
+        }
+    };
+
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; t++) {
+        pool.emplace_back(worker, t);
+    }
+    worker(0);
+    for (size_t t = 0; t < pool.size(); t++) {
+        pool[t].join();
+    }
+}
+
+#endif